@@ -0,0 +1,178 @@
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "asm_cache.h"
+#include "byte_io.h"
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+/* Cache file layout (all integers little endian):
+ *
+ *      "M65C"                  magic
+ *      u32                     FORMAT_VERSION
+ *      u32                     Assembler::VERSION
+ *      u64                     source hash
+ *      u32 n, n bytes          code
+ *      u32 n, n * (u16 address, u16 len, len bytes)    labels
+ *      u32 n, n * u32          relative_addresses
+ */
+static const char MAGIC[4] = { 'M', '6', '5', 'C' };
+static const uint32_t FORMAT_VERSION = 1;
+
+bool read_file(const std::string& path, std::string& contents) {
+    std::ifstream f(path.c_str(), std::ios::in | std::ios::binary);
+    if (!f.is_open()) {
+        return false;
+    }
+    f.seekg(0, std::ios::end);
+    std::streamoff size = f.tellg();
+    f.seekg(0, std::ios::beg);
+    if (size < 0) {
+        return false;
+    }
+    contents.resize((size_t) size);
+    if (size > 0) {
+        f.read(&contents[0], size);
+    }
+    return f.good() || f.eof();
+}
+
+uint64_t AssemblyCache::hash_source(const std::string& source) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < source.size(); ++i) {
+        hash ^= (uint8_t) source[i];
+        hash *= 0x100000001b3ULL;
+    }
+    // the version is part of the key so that a new assembler never reuses
+    // code produced by an old one
+    hash ^= Assembler::VERSION;
+    hash *= 0x100000001b3ULL;
+    return hash;
+}
+
+std::string AssemblyCache::path_for(uint64_t key) const {
+    std::stringstream ss;
+    ss << this->dir << "/" << std::hex << std::setw(16) << std::setfill('0')
+       << key << ".asmc";
+    return ss.str();
+}
+
+bool AssemblyCache::lookup(const std::string& source, Entry& entry) const {
+    const uint64_t key = AssemblyCache::hash_source(source);
+    std::string buf;
+    if (!read_file(this->path_for(key), buf)) {
+        return false;
+    }
+
+    ByteReader r(buf);
+    const char* magic = r.take(sizeof(MAGIC));
+    if (!magic || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+            || r.u32() != FORMAT_VERSION
+            || r.u32() != Assembler::VERSION
+            || r.u64() != key) {
+        return false;
+    }
+
+    uint32_t n = r.u32();
+    const char* code = r.take(n);
+    if (!code) {
+        return false;
+    }
+    entry.code.assign((const uint8_t*) code, (const uint8_t*) code + n);
+
+    entry.labels.clear();
+    n = r.u32();
+    for (uint32_t i = 0; i < n && r.ok; ++i) {
+        uint16_t address = r.u16();
+        uint16_t len = r.u16();
+        const char* name = r.take(len);
+        if (name) {
+            entry.labels[std::string(name, len)] = address;
+        }
+    }
+
+    entry.relative_addresses.clear();
+    n = r.u32();
+    for (uint32_t i = 0; i < n && r.ok; ++i) {
+        uint32_t pc = r.u32();
+        if (pc + 1 >= entry.code.size()) {
+            return false;
+        }
+        entry.relative_addresses.push_back(pc);
+    }
+    return r.at_end();
+}
+
+bool AssemblyCache::store(const std::string& source, const Assembler& assembler) const {
+    const uint64_t key = AssemblyCache::hash_source(source);
+
+    std::string buf;
+    buf.reserve(64 + assembler.code.size()
+                + 4 * assembler.relative_addresses.size());
+    buf.append(MAGIC, sizeof(MAGIC));
+    put_u32(buf, FORMAT_VERSION);
+    put_u32(buf, Assembler::VERSION);
+    put_u64(buf, key);
+
+    put_u32(buf, assembler.code.size());
+    buf.append(assembler.code.begin(), assembler.code.end());
+
+    put_u32(buf, assembler.labels.size());
+    std::map<std::string, uint16_t>::const_iterator it;
+    for (it = assembler.labels.begin(); it != assembler.labels.end(); ++it) {
+        put_u16(buf, it->second);
+        put_u16(buf, it->first.size());
+        buf.append(it->first);
+    }
+
+    put_u32(buf, assembler.relative_addresses.size());
+    for (size_t i = 0; i < assembler.relative_addresses.size(); ++i) {
+        put_u32(buf, assembler.relative_addresses[i]);
+    }
+
+    // write then rename, so readers only ever see complete entries. The
+    // temporary name is unique to this store, even between threads.
+    static std::atomic<unsigned> n_stores(0);
+    const std::string path = this->path_for(key);
+    std::stringstream tmp_path;
+    tmp_path << path << ".tmp" << getpid() << "." << n_stores++;
+    {
+        std::ofstream f(tmp_path.str().c_str(),
+                        std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!f.is_open()) {
+            return false;
+        }
+        f.write(buf.data(), buf.size());
+        if (!f.good()) {
+            f.close();
+            std::remove(tmp_path.str().c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmp_path.str().c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool AssemblyCache::assemble(const std::string& source, Entry& entry) const {
+    if (this->lookup(source, entry)) {
+        return true;
+    }
+
+    std::istringstream src(source);
+    Assembler assembler(src);
+    this->store(source, assembler);
+
+    entry.code = assembler.code;
+    entry.labels = assembler.labels;
+    entry.relative_addresses = assembler.relative_addresses;
+    return false;
+}
@@ -0,0 +1,67 @@
+#ifndef ASM_CACHE_H
+#define ASM_CACHE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "assembler.h"
+
+/* An on-disk cache of assembled programs.
+ *
+ * Entries are keyed by a hash of the source text and Assembler::VERSION, so
+ * a program only needs to be assembled the first time it is seen. Each entry
+ * holds everything needed to relocate and load the program: the code, the
+ * labels and the relative_addresses (see Assembler).
+ *
+ * A cache entry that is missing, truncated or written by a different
+ * assembler version is treated as a miss. Stores write to a temporary file
+ * and rename it into place, so concurrent runs sharing a cache directory
+ * never see a partially written entry.
+ */
+class AssemblyCache {
+public:
+    struct Entry {
+        std::vector<uint8_t> code;
+        std::map<std::string, uint16_t> labels;
+        std::vector<size_t> relative_addresses;
+
+        void relocate_code(uint16_t base_addr, std::vector<uint8_t>& result) const {
+            Assembler::relocate_code(this->code, this->relative_addresses,
+                                     base_addr, result);
+        }
+
+        void link_into(uint16_t base_addr, uint8_t* mem, size_t limit) const {
+            Assembler::link_into(this->code, this->relative_addresses,
+                                 base_addr, mem, limit);
+        }
+    };
+
+    /* The directory must already exist */
+    explicit AssemblyCache(const std::string& dir) : dir(dir) { }
+
+    /* FNV-1a over the source bytes, mixed with Assembler::VERSION */
+    static uint64_t hash_source(const std::string& source);
+
+    std::string path_for(uint64_t key) const;
+
+    /* Returns true and fills in entry on a cache hit */
+    bool lookup(const std::string& source, Entry& entry) const;
+
+    /* Returns false if the entry could not be written. A cache that can't be
+     * written to is not an error; the caller just assembles next time too. */
+    bool store(const std::string& source, const Assembler& assembler) const;
+
+    /* Look up the source, assembling and storing it on a miss.
+     * Throws AssemblerError if the source needs assembling and is invalid.
+     * Returns true on a cache hit.
+     */
+    bool assemble(const std::string& source, Entry& entry) const;
+
+    const std::string dir;
+};
+
+/* Read the whole file into contents. Returns false if it can't be opened. */
+bool read_file(const std::string& path, std::string& contents);
+
+#endif // ASM_CACHE_H
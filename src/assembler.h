@@ -41,10 +41,15 @@ public:
 class Assembler {
     static std::string ignore_str;
 public:
+    /* Bump this whenever the bytes produced for a given source can change.
+     * It is part of the AssemblyCache key, so stale cache entries are never
+     * reused after the assembler changes. */
+    static const uint32_t VERSION = 2;
+
     /* Throws std::invalid_argument on failing to open the file.
      * Throw AssemblerError on syntax or other errors during assembly.
      */
-    Assembler(std::istream& stream) : src_file(stream) {
+    Assembler(std::istream& stream) : src_file(stream), line_number(1) {
         this->assemble();
         this->resolve_labels();
 
@@ -62,6 +67,16 @@ private:
     DEF_LEX_FUNCTION(read_whitespace, isspace(c) && c != '\n' && c != '\r')
     DEF_LEX_FUNCTION(read_newline, c == '\n' || c == '\r')
 
+    /* read_newline, keeping line_number up to date */
+    bool read_newlines() {
+        std::string s;
+        if (!this->read_newline(s)) {
+            return false;
+        }
+        this->line_number += std::count(s.begin(), s.end(), '\n');
+        return true;
+    }
+
     void add_label(const std::string& _label) {
         const char* label = _label.c_str();
         if (this->labels.find(label) == this->labels.end()) {
@@ -100,6 +115,19 @@ private:
     }
 
     void assemble() {
+        // Most lines assemble to fewer bytes than characters of source, so
+        // the remaining source length bounds the code size well enough to
+        // avoid regrowing the code vector.
+        std::streampos start = this->src_file.tellg();
+        if (start >= 0 && this->src_file.seekg(0, std::ios::end)) {
+            std::streamoff remaining = this->src_file.tellg() - start;
+            this->src_file.seekg(start);
+            if (remaining > 0) {
+                this->code.reserve(remaining / 2);
+            }
+        }
+        this->src_file.clear();
+
         while (this->assemble_next_line());
     }
 
@@ -120,10 +148,11 @@ private:
     }
 
     /* If s starts with "0x", parse a hex number. Otherwise, parse a decimal
-     * number. */
+     * number. Numbers over $ffff can't be operands of anything, and are an
+     * error here, before they could wrap round in an Operand. */
     uint32_t parse_number(const std::string& s) {
         std::stringstream ss;
-        uint32_t x;
+        uint64_t x = 0;
         if (s.length() > 2 && s.substr(0, 2) == "0x") {
             ss << s.substr(2);
             ss >> std::hex >> x;
@@ -131,6 +160,10 @@ private:
             ss << s;
             ss >> x;
         }
+        if (ss.fail() || x > 0xffff) {
+            throw AssemblerError("Number out of range on line "
+                                 + int_to_string(this->line_number));
+        }
         return x;
     }
 
@@ -164,9 +197,15 @@ private:
         int c;
 
         // read some text which is either an instruction or a label name
-        while (this->read_whitespace() || this->read_newline());
+        while (this->read_whitespace() || this->read_newlines()
+               || this->read_comment());
         std::string text;
         if (!this->read_alphanumeric(text)) {
+            if (this->src_file.peek() != EOF) {
+                throw AssemblerError(std::string("Unexpected character '")
+                                     + (char) this->src_file.peek() + "' on line "
+                                     + int_to_string(this->line_number));
+            }
             return false;
         }
         this->read_whitespace();
@@ -177,7 +216,8 @@ private:
             this->add_label(text);
             this->src_file.get();
             this->read_whitespace();
-            if (!this->read_newline()) {
+            this->read_comment();
+            if (!this->read_newlines() && this->src_file.peek() != EOF) {
                 throw AssemblerError(std::string("Label '") + text
                                      + "' should appear on its own line");
             }
@@ -186,86 +226,292 @@ private:
 
         // otherwise we have an instruction and need to parse its argument
         const std::string instruction = text;
-        c = this->src_file.peek();
+        SourceLine source_line = { this->code.size(), this->line_number };
+        this->source_lines.push_back(source_line);
 
-        // check for an immediate value
-        if (c == '#') {
-            this->src_file.get();
-            // read either hex or a decimal value
-            if (this->read_number(text)) {
-                uint32_t value = this->parse_number(text);
-                if (value > 0xff) {
-                    throw AssemblerError(std::string("Immediate value ") + text
-                                         + " is too large ("
-                                         + int_to_string(value)
-                                         + "). Immediate are only 8-bits");
-                } else {
-                    uint8_t argument = value & 0xff;
-                    this->push_immediate_opcodes(instruction, argument);
+        Operand operand = this->read_operand();
+        this->push_instruction(instruction, operand);
+        return true;
+    }
+
+    /* An instruction's argument, as written in the source. For a label,
+     * value is the offset from the label (e.g. 2 for "table+2"). Otherwise
+     * value is the number given. */
+    struct Operand {
+        enum Kind {
+            NONE,           // INX
+            ACCUMULATOR,    // ASL A
+            IMMEDIATE,      // LDA #$01
+            DIRECT,         // LDA $12  LDA $1234,X  LDA label,Y  BNE label
+            INDIRECT,       // JMP ($1234)
+            INDIRECT_X,     // LDA ($12,X)
+            INDIRECT_Y      // LDA ($12),Y
+        };
+
+        Operand() : kind(NONE), index(0), value(0) { }
+
+        Kind kind;
+        char index;         // 'X' or 'Y' for indexed DIRECT operands
+        std::string label;  // empty if the operand is a number
+        int32_t value;
+    };
+
+    DEF_LEX_FUNCTION(read_to_end_of_line, c != '\n' && c != '\r')
+
+    /* Comments run from a ';' to the end of the line */
+    bool read_comment() {
+        if (this->src_file.peek() != ';') {
+            return false;
+        }
+        this->read_to_end_of_line();
+        return true;
+    }
+
+    void expect(char expected, const char* context) {
+        this->read_whitespace();
+        if (toupper(this->src_file.peek()) != expected) {
+            throw AssemblerError(std::string("Expected '") + expected + "' "
+                                 + context + " on line "
+                                 + int_to_string(this->line_number));
+        }
+        this->src_file.get();
+        this->read_whitespace();
+    }
+
+    /* Read a number, or a label with an optional +/- offset */
+    void read_expression(Operand& operand) {
+        std::string text;
+        int c = this->src_file.peek();
+        if (c == '$' || isdigit(c)) {
+            this->read_number(text);
+            operand.value = this->parse_number(text);
+        } else if (isalpha(c)) {
+            this->read_alphanumeric(operand.label);
+            this->read_whitespace();
+            c = this->src_file.peek();
+            if (c == '+' || c == '-') {
+                this->src_file.get();
+                this->read_whitespace();
+                if (!this->read_number(text)) {
+                    throw AssemblerError(std::string("Expected a number after '")
+                                         + (char) c + "' following label '"
+                                         + operand.label + "'");
+                }
+                operand.value = this->parse_number(text);
+                if (c == '-') {
+                    operand.value = -operand.value;
                 }
-            } else {
-                throw AssemblerError("Expected number after '#'");
             }
+        } else {
+            throw AssemblerError("Expected a number or a label on line "
+                                 + int_to_string(this->line_number));
+        }
+        this->read_whitespace();
+    }
+
+    /* Read an optional ",X" or ",Y" and return 'X', 'Y' or 0 */
+    char read_index_register() {
+        this->read_whitespace();
+        if (this->src_file.peek() != ',') {
+            return 0;
+        }
+        this->src_file.get();
+        this->read_whitespace();
+        char c = toupper(this->src_file.get());
+        if (c != 'X' && c != 'Y') {
+            throw AssemblerError("Expected X or Y after ',' on line "
+                                 + int_to_string(this->line_number));
+        }
+        this->read_whitespace();
+        return c;
+    }
+
+    Operand read_operand() {
+        Operand operand;
+        std::string text;
+        int c = this->src_file.peek();
 
         // instruction with no arguments
-        } else if (c == '\n' || c == '\r' || c < 0) {
-            this->push_implied_opcodes(instruction);
-        // accumulator register
-        } else if (c == 'A') {  // should we allow lower case here?
+        if (c == '\n' || c == '\r' || c == ';' || c < 0) {
+            operand.kind = Operand::NONE;
+        // an immediate value
+        } else if (c == '#') {
+            this->src_file.get();
+            // read either hex or a decimal value
+            if (!this->read_number(text)) {
+                throw AssemblerError("Expected number after '#'");
+            }
+            operand.kind = Operand::IMMEDIATE;
+            operand.value = this->parse_number(text);
+        // one of the indirect modes: (zp,X) (zp),Y or (abs)
+        } else if (c == '(') {
             this->src_file.get();
-        // a hex or decimal value
-        } else if (c == '$' || isdigit(c)) {
-            if (this->read_number(text)) {
-                uint32_t value = this->parse_number(text);
-                // addressing mode is determined by the value of the argument
-                // values larger than 0xff are outside the zero page
-                if (value > 0xffff) {
-                    throw AssemblerError(std::string("Value ").append(text)
-                                         .append(" is too large."));
-                } else if (value > 0xff) {
-                    this->push_absolute_opcodes(instruction, value & 0xffff);
-                } else {
-                    this->push_zero_page_opcodes(instruction, value & 0xff);
+            this->read_whitespace();
+            this->read_expression(operand);
+            if (this->src_file.peek() == ',') {
+                if (this->read_index_register() != 'X') {
+                    throw AssemblerError("Only X may index inside the "
+                                         "parentheses, as in ($12,X)");
                 }
+                this->expect(')', "after ($12,X");
+                operand.kind = Operand::INDIRECT_X;
             } else {
-                throw AssemblerError("Expected a number");
+                this->expect(')', "to close indirect address");
+                operand.index = this->read_index_register();
+                if (operand.index == 'X') {
+                    throw AssemblerError("Only Y may index outside the "
+                                         "parentheses, as in ($12),Y");
+                }
+                operand.kind = operand.index ? Operand::INDIRECT_Y
+                                             : Operand::INDIRECT;
             }
-        // a label
-        } else if (isalpha(c)) {
-            this->read_alphanumeric(text);
-            const std::string label = text;
-//            std::cout << "saw label '" << label << "' as argument" << std::endl;
-            /* PROBLEM: Our labels are actually indices into the code vector.
-             * They are actually relative code addresses, but if we convert them
-             * immediately to opcodes, the labels' address will be incorrect unless
-             * if we load the code any where other than address zero.
-             *
-             * Solutions:
-             *      - Provide the location to load the code in advance.
-             *      - Create some an intermediate representation that distinguishes
-             *      between relative and absolute addresses.
-             *
-             */
-
-            AddressMode addr_mode = this->mode_for_instr_w_label(instruction);
-
-            // lookup the address the label represents
-            if (this->labels.find(label) != this->labels.end()) {
-//                std::cout << "found label '" << label << "'" << std::endl;
-                uint16_t address = this->labels[label];
-                if (addr_mode == ABS) {
-                    this->push_absolute_opcodes(instruction, address, true);
-                } else if (addr_mode == REL) {
-                    this->push_relative_opcodes(instruction, address);
+        // a number or a label, optionally indexed, or the accumulator
+        } else {
+            this->read_expression(operand);
+            if (OpInfo::to_lower(operand.label) == "a") {
+                operand.kind = Operand::ACCUMULATOR;
+            } else {
+                operand.kind = Operand::DIRECT;
+                operand.index = this->read_index_register();
+            }
+        }
+
+        // nothing but a comment may follow the operand
+        this->read_whitespace();
+        this->read_comment();
+        c = this->src_file.peek();
+        if (c != '\n' && c != '\r' && c >= 0) {
+            throw AssemblerError(std::string("Unexpected '") + (char) c
+                                 + "' after operand on line "
+                                 + int_to_string(this->line_number));
+        }
+        return operand;
+    }
+
+    void error_if_not_8_bits(const Operand& operand, const char* what) {
+        if (!operand.label.empty()) {
+            throw AssemblerError(std::string(what) + " must be a number, "
+                                 "not label '" + operand.label + "'");
+        } else if (operand.value > 0xff) {
+            throw AssemblerError(std::string(what) + " "
+                                 + int_to_string(operand.value)
+                                 + " is too large. It must be 8-bits");
+        }
+    }
+
+    void push_instruction(const std::string& instruction, const Operand& operand) {
+        switch (operand.kind) {
+        case Operand::NONE:
+            // "ASL" on its own is short for "ASL A"
+            if (this->find_instruction(instruction, IMP) < 0
+                    && this->find_instruction(instruction, ACC) >= 0) {
+                this->push_accumulator_opcodes(instruction);
+            } else {
+                this->push_implied_opcodes(instruction);
+            }
+            break;
+        case Operand::ACCUMULATOR:
+            this->push_accumulator_opcodes(instruction);
+            break;
+        case Operand::IMMEDIATE:
+            this->error_if_not_8_bits(operand, "Immediate value");
+            this->push_immediate_opcodes(instruction, operand.value & 0xff);
+            break;
+        case Operand::DIRECT: {
+            const AddressMode zp_mode = operand.index == 'X' ? ZPX
+                                      : operand.index == 'Y' ? ZPY : ZP;
+            const AddressMode abs_mode = operand.index == 'X' ? ABSX
+                                       : operand.index == 'Y' ? ABSY : ABS;
+
+            if (this->mode_for_instr_w_label(instruction) == REL) {
+                if (operand.label.empty() || operand.index) {
+                    throw AssemblerError(std::string("The target of ")
+                                         + instruction + " must be a label");
                 }
+                this->push_label_opcodes(instruction, operand, REL);
+            } else if (!operand.label.empty()) {
+                // code addresses are relocated, so they are never in the zero page
+                this->push_label_opcodes(instruction, operand, abs_mode);
+            } else if (operand.value > 0xffff) {
+                throw AssemblerError(std::string("Value ")
+                                     + int_to_string(operand.value)
+                                     + " is too large.");
+            // addressing mode is determined by the value of the argument.
+            // values larger than 0xff are outside the zero page, and some
+            // instructions have no zero page form (e.g. JMP or LDA $12,Y)
+            } else if (operand.value <= 0xff
+                       && this->find_instruction(instruction, zp_mode) >= 0) {
+                this->push_zero_page_opcodes(instruction, operand.value, zp_mode);
+            } else {
+                this->push_absolute_opcodes(instruction, operand.value, false,
+                                            abs_mode);
+            }
+            break;
+        }
+        case Operand::INDIRECT:
+            if (!operand.label.empty()) {
+                this->push_label_opcodes(instruction, operand, IND);
+            } else if (operand.value > 0xffff) {
+                throw AssemblerError(std::string("Indirect address ")
+                                     + int_to_string(operand.value)
+                                     + " is too large.");
             } else {
-                // the label hasn't been seen, but we can fill its address in later
-                this->push_unresolved_label_opcodes(instruction, label, addr_mode);
+                this->push_absolute_opcodes(instruction, operand.value, false, IND);
             }
+            break;
+        case Operand::INDIRECT_X:
+        case Operand::INDIRECT_Y:
+            this->error_if_not_8_bits(operand, "Indirect zero page address");
+            this->push_zero_page_opcodes(
+                instruction, operand.value,
+                operand.kind == Operand::INDIRECT_X ? INDX : INDY);
+            break;
+        }
+    }
+
+    /* A label (plus offset) used as an argument. If the label is already
+     * defined, its address is filled in now. Otherwise it is filled in by
+     * resolve_labels once the whole source has been read. */
+    void push_label_opcodes(const std::string& instruction,
+                            const Operand& operand, AddressMode addr_mode) {
+        /* Our labels are actually indices into the code vector, i.e. they
+         * are relative code addresses. Absolute uses of a label are recorded
+         * in relative_addresses, so they can be adjusted when the code is
+         * relocated to the address it is loaded at.
+         */
+        std::map<std::string, uint16_t>::const_iterator it =
+            this->labels.find(operand.label);
+        if (it == this->labels.end()) {
+            // the label hasn't been seen, but we can fill its address in later
+            this->push_unresolved_label_opcodes(instruction, operand.label,
+                                                addr_mode, operand.value);
+            return;
+        }
+
+        uint16_t address = this->label_address(operand.label, it->second,
+                                               operand.value);
+        if (addr_mode == REL) {
+            this->push_relative_opcodes(instruction, address);
         } else {
-            throw AssemblerError("BUG: While assembling a line");
+            this->push_absolute_opcodes(instruction, address, true, addr_mode);
         }
-        return true;
+    }
+
+    uint16_t label_address(const std::string& label, uint16_t address,
+                           int32_t offset) {
+        int32_t result = address + offset;
+        if (result < 0 || result > 0xffff) {
+            throw AssemblerError(std::string("Offset from label '") + label
+                                 + "' is out of bounds");
+        }
+        return result;
+    }
+
+    void push_accumulator_opcodes(const std::string& instruction) {
+        int op_code = this->find_instruction(instruction, ACC);
+        this->error_if_bad_opcode(op_code, instruction, ACC);
+        mos_assert(OPS[op_code].n_bytes == 1);
+        this->code.push_back(op_code);
     }
 
     void push_implied_opcodes(const std::string instruction) {
@@ -286,9 +532,11 @@ private:
         this->code.push_back(argument);
     }
 
-    void push_absolute_opcodes(const std::string& instruction, uint16_t argument, bool label_address = false) {
-        int op_code = this->find_instruction(instruction, ABS);
-        this->error_if_bad_opcode(op_code, instruction, ABS);
+    void push_absolute_opcodes(const std::string& instruction, uint16_t argument,
+                               bool label_address = false,
+                               AddressMode addr_mode = ABS) {
+        int op_code = this->find_instruction(instruction, addr_mode);
+        this->error_if_bad_opcode(op_code, instruction, addr_mode);
         mos_assert(OPS[op_code].n_bytes == 3);
         this->code.push_back(op_code);
         // TODO: What order do we store 16 byte values?
@@ -311,10 +559,10 @@ private:
         this->code.push_back(this->compute_8bit_offset(this->code.size() + 1, argument));
     }
 
-    void push_zero_page_opcodes(const std::string& instruction, uint8_t argument) {
-        int op_code = this->find_instruction(instruction, ZP);
-        this->error_if_bad_opcode(op_code, instruction, ZP);
-//        std::cout << instruction << std::endl;
+    void push_zero_page_opcodes(const std::string& instruction, uint8_t argument,
+                                AddressMode addr_mode = ZP) {
+        int op_code = this->find_instruction(instruction, addr_mode);
+        this->error_if_bad_opcode(op_code, instruction, addr_mode);
         mos_assert(OPS[op_code].n_bytes == 2);
         this->code.push_back(op_code);
         this->code.push_back(argument);
@@ -322,10 +570,13 @@ private:
 
     void push_unresolved_label_opcodes(const std::string& instruction,
                                        const std::string& label,
-                                       AddressMode addr_mode) {
-        mos_assert(addr_mode == ABS || addr_mode == REL);
+                                       AddressMode addr_mode,
+                                       int32_t offset = 0) {
+        mos_assert(addr_mode == ABS || addr_mode == ABSX || addr_mode == ABSY
+                   || addr_mode == IND || addr_mode == REL);
         // store information to fill in the address later
-        this->unresolved_labels[this->code.size() + 1] = std::make_pair(label.c_str(), addr_mode);
+        UnresolvedLabel unresolved = { label, addr_mode, offset };
+        this->unresolved_labels[this->code.size() + 1] = unresolved;
 
         int op_code = this ->find_instruction(instruction, addr_mode);
         this->error_if_bad_opcode(op_code, instruction, addr_mode);
@@ -339,20 +590,22 @@ private:
     }
 
     void resolve_labels() {
-        std::map<size_t, std::pair<std::string, AddressMode> >::const_iterator it;
+        std::map<size_t, UnresolvedLabel>::const_iterator it;
         for (it = this->unresolved_labels.begin(); it != this->unresolved_labels.end(); ++it) {
             // code[i] needs the address of the label
             size_t i = it->first;
-            const std::string& label = it->second.first;
-            AddressMode addr_mode = it->second.second;
+            const std::string& label = it->second.label;
+            AddressMode addr_mode = it->second.addr_mode;
 
             if (this->labels.find(label) == this->labels.end()) {
                 throw AssemblerError(std::string("Undefined label ").append(label));
             }
 
-            uint16_t address = this->labels[label];
-            if (addr_mode == ABS) {
-                mos_assert(code[i] = 0x00 && code[i + 1] == 0x00);
+            uint16_t address = this->label_address(label, this->labels[label],
+                                                   it->second.offset);
+            if (addr_mode == ABS || addr_mode == ABSX || addr_mode == ABSY
+                    || addr_mode == IND) {
+                mos_assert(code[i] == 0x00 && code[i + 1] == 0x00);
                 this->code[i] = address & 0xff;
                 this->code[i + 1] = (address >> 8) & 0xff;
                 // we will need to adjust this address again at either link or load time
@@ -379,31 +632,75 @@ public:
      * throws std::invalid_argument if base_addr pushes code passed 0xffff
      */
     void relocate_code(uint16_t base_addr, std::vector<uint8_t>& result) const {
-        if (base_addr + this->code.size() > 0xffff) {
+        Assembler::relocate_code(this->code, this->relative_addresses,
+                                 base_addr, result);
+    }
+
+    /* Relocate code that was assembled elsewhere (e.g. loaded from an
+     * AssemblyCache) using its relative_addresses. */
+    static void relocate_code(const std::vector<uint8_t>& code,
+                              const std::vector<size_t>& relative_addresses,
+                              uint16_t base_addr, std::vector<uint8_t>& result) {
+        if (base_addr + code.size() > 0xffff) {
             throw std::invalid_argument("Relocation pushes code out of bounds");
         }
 
-        result.clear();
-        result.resize(this->code.size(), 0);  // ensure there is enough room
-        std::copy(this->code.begin(), this->code.end(), result.begin());
+        result.assign(code.begin(), code.end());
+        if (!result.empty()) {
+            Assembler::apply_fixups(&result[0], relative_addresses, base_addr);
+        }
+    }
+
+    /* Link the code straight into memory, without an intermediate copy.
+     * mem is indexed by address, so the code lands at mem[base_addr] and
+     * every relative address is fixed up in place. Code may not extend past
+     * limit (e.g. the interrupt vectors at the top of memory).
+     *
+     * throws std::invalid_argument if the code doesn't fit below limit
+     */
+    void link_into(uint16_t base_addr, uint8_t* mem, size_t limit) const {
+        Assembler::link_into(this->code, this->relative_addresses,
+                             base_addr, mem, limit);
+    }
+
+    static void link_into(const std::vector<uint8_t>& code,
+                          const std::vector<size_t>& relative_addresses,
+                          uint16_t base_addr, uint8_t* mem, size_t limit) {
+        if (base_addr + code.size() > limit) {
+            throw std::invalid_argument("Code doesn't fit in memory at address "
+                                        + int_to_string(base_addr));
+        }
 
-        for (size_t i = 0; i < this->relative_addresses.size(); ++i) {
-            size_t pc = this->relative_addresses[i];
+        if (!code.empty()) {
+            std::memcpy(mem + base_addr, &code[0], code.size());
+            Assembler::apply_fixups(mem + base_addr, relative_addresses, base_addr);
+        }
+    }
 
-            uint16_t lo = result[pc];
-            uint16_t hi = result[pc + 1];
+private:
+    /* Add base_addr to each relative address in the image, where image[0] is
+     * the first byte of code */
+    static void apply_fixups(uint8_t* image,
+                             const std::vector<size_t>& relative_addresses,
+                             uint16_t base_addr) {
+        for (size_t i = 0; i < relative_addresses.size(); ++i) {
+            size_t pc = relative_addresses[i];
+
+            uint16_t lo = image[pc];
+            uint16_t hi = image[pc + 1];
             uint32_t old_addr = (((hi << 8) & 0xff00) | (lo & 0xff)) & 0xffff;
             uint32_t new_addr = old_addr + base_addr;
             if (new_addr > 0xffff) {
                 throw std::invalid_argument(std::string("Relocation push address ")
                                             + int_to_string(old_addr) + "out of bounds");
             } else {
-                result[pc] = new_addr & 0xff;
-                result[pc + 1] = (new_addr >> 8) & 0xff;
+                image[pc] = new_addr & 0xff;
+                image[pc + 1] = (new_addr >> 8) & 0xff;
             }
         }
     }
 
+public:
     static std::string get_code_hex(const std::vector<uint8_t>& code) {
         std::stringstream ss;
         for (size_t i = 0; i < code.size(); ++i) {
@@ -421,6 +718,15 @@ public:
     std::vector<uint8_t> code;
     std::map<std::string, uint16_t> labels;
 
+    /* One entry per instruction, in code order: the instruction starting at
+     * code[offset] was assembled from the given (1-based) source line. */
+    struct SourceLine {
+        size_t offset;
+        int line;
+    };
+    std::vector<SourceLine> source_lines;
+    int line_number;
+
     /* If i is in relative_addresses, then code[i] and code[i+1]
      * form a relative address. When loading the code into memory
      * at location X, these addresses must have X added to them.
@@ -434,12 +740,13 @@ public:
      * here. A second pass over the code vector fills in the correct
      * label addresses.
      *
-     * This fundamentally stores (index, label, mode) tuples.
+     * This fundamentally stores (index, label, mode, offset) tuples.
      * This says that code[index] needs to be filled in with the
-     * address of the label. mode should be either REL or ABS.
+     * address of the label plus the offset. mode should be REL, or
+     * one of the modes with a 16-bit address (ABS, ABSX, ABSY, IND).
      * If mode is REL, than an 8-bit offset to the label's address
-     * is computed (error if too far away). If mode is ABS, then the
-     * label's address is copied to code[index] and code[index + 1].
+     * is computed (error if too far away). Otherwise, the label's
+     * address is copied to code[index] and code[index + 1].
      *
      * This gets slightly problematic supporting both:
      *      JMP labelname
@@ -448,7 +755,12 @@ public:
      * is relative to the address of the branch instruction. It takes
      * a signed 8-bit offset and jumps forward or backward that amount.
      */
-    std::map<size_t, std::pair<std::string, AddressMode> > unresolved_labels;
+    struct UnresolvedLabel {
+        std::string label;
+        AddressMode addr_mode;
+        int32_t offset;
+    };
+    std::map<size_t, UnresolvedLabel> unresolved_labels;
 };
 
 #endif // ASSEMBLER_H
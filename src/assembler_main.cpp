@@ -1,43 +1,182 @@
 #include "assembler.h"
+#include "asm_cache.h"
+#include "coverage.h"
+#include "symbols.h"
+#include "runner.h"
+#include "wcet.h"
 
 void print_usage(char* prog_name) {
-    std::cout << "Usage: " << prog_name << " <filename>" << std::endl;
+    std::cout << "Usage: " << prog_name << " [options] <filename>" << std::endl
+              << "  --base <addr>       address the code will be loaded at,"
+                 " for the outputs below (default 0x600)" << std::endl
+              << "  --listing <file>    write a listing of source lines,"
+                 " addresses and bytes" << std::endl
+              << "  --map <file>        write a symbol map sorted by address"
+              << std::endl
+              << "  --index <file>      write a binary address -> line/symbol"
+                 " index" << std::endl
+              << "  --coverage <file>   print a listing marked with the"
+                 " coverage in <file> (see mos6502 --coverage)" << std::endl
+              << "  --wcet <routine>    print the best and worst case cycles"
+                 " of the routine at a label or address" << std::endl
+              << "  --loop-bound <loop>=<n>" << std::endl
+              << "                      the loop headed by a label or address"
+                 " runs at most n times" << std::endl
+              << "  --cycle-budget <n>  fail if the --wcet routine's worst case"
+                 " is over n cycles" << std::endl;
+}
+
+/* A label of the program, or an address */
+static bool resolve_address(const Assembler& assembler, uint16_t base_addr,
+                            const std::string& s, uint16_t& addr) {
+    std::map<std::string, uint16_t>::const_iterator it = assembler.labels.find(s);
+    if (it != assembler.labels.end()) {
+        addr = it->second + base_addr;
+        return true;
+    }
+    return parse_address(s, addr);
+}
+
+/* Print the bounds of the routine, and return whether they're in budget */
+static bool report_wcet(const Assembler& assembler, uint16_t base_addr,
+                        const std::string& routine,
+                        const std::vector<std::string>& loop_bounds,
+                        uint64_t cycle_budget) {
+    std::vector<uint8_t> mem(Mem::MEM_SIZE, 0);
+    assembler.link_into(base_addr, mem.data(), mem.size());
+    ControlFlowGraph cfg;
+    cfg.build(mem.data(), base_addr, base_addr + assembler.code.size(),
+              ControlFlowGraph::entry_points(assembler.labels, base_addr));
+
+    WcetAnalyzer analyzer(cfg);
+    for (size_t i = 0; i < loop_bounds.size(); ++i) {
+        const std::string& bound = loop_bounds[i];
+        const size_t eq = bound.find('=');
+        uint16_t header;
+        uint64_t n;
+        if (eq == std::string::npos
+                || !resolve_address(assembler, base_addr, bound.substr(0, eq), header)
+                || !parse_number(bound.substr(eq + 1), 0xffffffff, n) || n == 0) {
+            throw std::invalid_argument("Bad loop bound '" + bound + "'");
+        }
+        analyzer.set_loop_bound(header, n);
+    }
+
+    uint16_t entry;
+    if (!resolve_address(assembler, base_addr, routine, entry)) {
+        throw std::invalid_argument("No label or address '" + routine + "'");
+    }
+    const WcetResult result = analyzer.analyze(entry);
+    write_wcet_report(std::cout, result);
+    if (cycle_budget && result.worst > cycle_budget) {
+        std::cerr << "Over budget: worst case " << result.worst << " cycles, budget "
+                  << cycle_budget << std::endl;
+        return false;
+    }
+    return true;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    const char* filename = NULL;
+    const char* listing_file = NULL;
+    const char* map_file = NULL;
+    const char* index_file = NULL;
+    const char* coverage_file = NULL;
+    const char* wcet_routine = NULL;
+    std::vector<std::string> loop_bounds;
+    uint64_t cycle_budget = 0;
+    uint16_t base_addr = 0x600;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--base" && i + 1 < argc) {
+            if (!parse_address(argv[++i], base_addr)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--listing" && i + 1 < argc) {
+            listing_file = argv[++i];
+        } else if (arg == "--map" && i + 1 < argc) {
+            map_file = argv[++i];
+        } else if (arg == "--index" && i + 1 < argc) {
+            index_file = argv[++i];
+        } else if (arg == "--coverage" && i + 1 < argc) {
+            coverage_file = argv[++i];
+        } else if (arg == "--wcet" && i + 1 < argc) {
+            wcet_routine = argv[++i];
+        } else if (arg == "--loop-bound" && i + 1 < argc) {
+            loop_bounds.push_back(argv[++i]);
+        } else if (arg == "--cycle-budget" && i + 1 < argc) {
+            if (!parse_number(argv[++i], (uint64_t) -1, cycle_budget)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (!filename) {
+            filename = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!filename) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    std::cout << "Using input file: " << argv[1] << std::endl;
+    std::cout << "Using input file: " << filename << std::endl;
     try {
-        std::ifstream src(argv[1]);
-        if (!src.is_open()) {
+        std::string source;
+        if (!read_file(filename, source)) {
             throw std::invalid_argument(
-                std::string("File not found: '").append(argv[1]).append("'"));
+                std::string("File not found: '").append(filename).append("'"));
         }
 
+        std::istringstream src(source);
         Assembler assembler(src);
 
         std::cout << assembler.get_code_hex() << std::endl;
 
+        if (listing_file) {
+            std::ofstream f;
+            open_output(f, listing_file);
+            write_listing(f, assembler, source, base_addr);
+        }
+        if (map_file) {
+            std::ofstream f;
+            open_output(f, map_file);
+            write_symbol_map(f, assembler, base_addr);
+        }
+        if (index_file) {
+            std::ofstream f;
+            open_output(f, index_file, std::ios::out | std::ios::binary);
+            SymbolIndex index(assembler, base_addr);
+            f.write(index.data().data(), index.data().size());
+        }
+        if (coverage_file) {
+            std::string buf;
+            Coverage coverage;
+            if (!read_file(coverage_file, buf) || !coverage.load(buf)) {
+                throw std::invalid_argument(std::string("Not a coverage file: '")
+                                            .append(coverage_file).append("'"));
+            }
+            write_coverage_report(std::cout, coverage, assembler, source, base_addr);
+        }
+        if (wcet_routine
+                && !report_wcet(assembler, base_addr, wcet_routine, loop_bounds,
+                                cycle_budget)) {
+            return 1;
+        }
+
+    } catch (WcetError& error) {
+        std::cerr << "WcetError: " << error.what() << std::endl;
+        return 1;
     } catch (AssemblerError& error) {
         std::cerr << "AssemblerError: " << error.what() << std::endl;
+        return 1;
     } catch (std::invalid_argument& error) {
         std::cerr << "Invalid argument: " << error.what() << std::endl;
+        return 1;
     } catch (std::exception& error) {
         std::cerr << "Exception: " << error.what() << std::endl;
+        return 1;
     }
-
-//    std::cout << "Loading source file: " << argv[1] << std::endl;
-//    std::ifstream source_file(argv[1]);
-//    if (!source_file.is_open()) {
-//        std::cout << "file doesn't exist" << std::endl;
-//        return 1;
-//    }
-
-//    std::string line;
-//    for (int i = 1; std::getline(source_file, line); ++i) {
-//        std::cout << i <<  ": " << line << std::endl;
-//    }
 }
@@ -0,0 +1,219 @@
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include "batch.h"
+#include "cpu_pool.h"
+
+std::vector<BatchJob> read_manifest(std::istream& in, const std::string& dir) {
+    std::vector<BatchJob> jobs;
+    std::string text;
+    for (int line = 1; std::getline(in, text); ++line) {
+        std::istringstream words(text);
+        std::vector<std::string> args;
+        std::string word;
+        while (words >> word) {
+            args.push_back(word);
+        }
+        if (args.empty() || args[0][0] == '#') {
+            continue;
+        }
+
+        BatchJob job;
+        job.line = line;
+        job.file = (args[0][0] == '/' || dir.empty()) ? args[0] : dir + "/" + args[0];
+        for (size_t i = 1; i < args.size(); ) {
+            const std::string option = args[i];
+            if (parse_job_option(args, i, job.options) != OPTION_OK) {
+                std::ostringstream msg;
+                msg << "Manifest line " << line << ": bad option '" << option << "'";
+                throw std::invalid_argument(msg.str());
+            }
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+OrderedWriter::OrderedWriter(std::ostream& out, size_t n_lines, size_t buffer_size)
+        : out(out), pending(n_lines), done(n_lines, false), next(0),
+          buffer_size(buffer_size) {
+    this->buf.reserve(buffer_size);
+}
+
+void OrderedWriter::put(size_t i, std::string& line) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->pending[i].swap(line);
+    this->done[i] = true;
+
+    // move every line that is now in order into the buffer
+    while (this->next < this->done.size() && this->done[this->next]) {
+        this->buf.append(this->pending[this->next]).push_back('\n');
+        std::string().swap(this->pending[this->next]);
+        ++this->next;
+    }
+    if (this->buf.size() >= this->buffer_size) {
+        this->out.write(this->buf.data(), this->buf.size());
+        this->buf.clear();
+    }
+}
+
+void OrderedWriter::flush() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->out.write(this->buf.data(), this->buf.size());
+    this->out.flush();
+    this->buf.clear();
+}
+
+/* A distinct file named by the manifest, and the program built from it */
+struct BatchProgram {
+    std::string file;
+    bool binary;
+    AssemblyCache::Entry program;
+    std::string error;  // empty if the program was built
+};
+
+struct BuildProgram {
+    void operator()(size_t i) {
+        BatchProgram& p = (*this->programs)[i];
+        try {
+            std::string text;
+            if (!read_file(p.file, text)) {
+                p.error = "File not found";
+                return;
+            }
+            build_program(text, p.binary, this->cache_dir, p.program);
+        } catch (std::exception& error) {
+            p.error = error.what();
+        }
+    }
+
+    std::vector<BatchProgram>* programs;
+    const char* cache_dir;
+};
+
+struct RunJob {
+    void operator()(size_t i) {
+        const BatchJob& job = (*this->jobs)[i];
+        const BatchProgram& p = (*this->programs)[(*this->program_for_job)[i]];
+
+        std::ostringstream line;
+        line << "{\"job\":" << i << ",\"file\":";
+        write_json_string(line, job.file);
+        std::string error = p.error;
+        if (error.empty()) {
+            error = (*this->link_errors)[i];
+        }
+        if (error.empty()) {
+            try {
+                CpuPool::Lease lease(job.options.sparse_mem ? *this->sparse_pool
+                                                            : *this->dense_pool);
+                Cpu& cpu = *lease;
+                prepare_job(cpu, p.program, job.options, (*this->images)[i]);
+                std::unique_ptr<Coverage> coverage;
+                if (this->coverage) {
+                    coverage.reset(new Coverage());
+                    cpu.set_coverage(coverage.get());
+                }
+                RunStats stats = run_cpu(cpu, job.options.max_cycles,
+                                         job.options.max_instructions,
+                                         job.options.detect_loops);
+                if (coverage) {
+                    std::lock_guard<std::mutex> guard(*this->coverage_lock);
+                    this->coverage->merge(*coverage);
+                }
+                line << ",";
+                write_json_stats_members(line, stats);
+                if (!job.options.dumps.empty()) {
+                    line << ",\"dumps\":[";
+                    for (size_t d = 0; d < job.options.dumps.size(); ++d) {
+                        line << (d ? "," : "");
+                        write_json_dump(line, cpu.mem, job.options.dumps[d].first,
+                                        job.options.dumps[d].second);
+                    }
+                    line << "]";
+                }
+            } catch (std::exception& e) {
+                error = e.what();
+            }
+        }
+        if (!error.empty()) {
+            ++*this->failures;
+            line << ",\"error\":";
+            write_json_string(line, error);
+        }
+        line << "}";
+
+        std::string result = line.str();
+        this->writer->put(i, result);
+    }
+
+    const std::vector<BatchJob>* jobs;
+    const std::vector<BatchProgram>* programs;
+    const std::vector<size_t>* program_for_job;
+    const std::vector<std::shared_ptr<const SharedImage> >* images;
+    const std::vector<std::string>* link_errors;
+    OrderedWriter* writer;
+    std::atomic<size_t>* failures;
+    CpuPool* dense_pool;
+    CpuPool* sparse_pool;
+    Coverage* coverage;
+    std::mutex* coverage_lock;
+};
+
+size_t run_batch(const std::vector<BatchJob>& jobs, unsigned n_threads,
+                 const char* cache_dir, std::ostream& out, Coverage* coverage) {
+    // each distinct file is read and built once, however many jobs use it
+    std::vector<BatchProgram> programs;
+    std::vector<size_t> program_for_job(jobs.size());
+    std::map<std::pair<std::string, bool>, size_t> seen;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        std::pair<std::string, bool> key(jobs[i].file, jobs[i].options.binary);
+        std::map<std::pair<std::string, bool>, size_t>::iterator it = seen.find(key);
+        if (it == seen.end()) {
+            it = seen.insert(std::make_pair(key, programs.size())).first;
+            programs.push_back(BatchProgram());
+            programs.back().file = key.first;
+            programs.back().binary = key.second;
+        }
+        program_for_job[i] = it->second;
+    }
+
+    BuildProgram build = { &programs, cache_dir };
+    parallel_for(programs.size(), n_threads, build);
+
+    // jobs running the same program at the same address share its code pages
+    std::vector<std::shared_ptr<const SharedImage> > images(jobs.size());
+    std::vector<std::string> link_errors(jobs.size());
+    std::map<std::pair<size_t, uint16_t>, size_t> linked;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        const BatchProgram& p = programs[program_for_job[i]];
+        if (!p.error.empty()) {
+            continue;
+        }
+        std::pair<size_t, uint16_t> key(program_for_job[i], jobs[i].options.load_addr);
+        std::map<std::pair<size_t, uint16_t>, size_t>::iterator it = linked.find(key);
+        if (it != linked.end()) {
+            images[i] = images[it->second];
+            link_errors[i] = link_errors[it->second];
+            continue;
+        }
+        linked.insert(std::make_pair(key, i));
+        try {
+            images[i] = Cpu::link_shared(p.program, key.second);
+        } catch (std::exception& error) {
+            link_errors[i] = error.what();
+        }
+    }
+
+    OrderedWriter writer(out, jobs.size());
+    std::atomic<size_t> failures(0);
+    CpuPool dense_pool(MEM_DENSE);
+    CpuPool sparse_pool(MEM_SPARSE);
+    std::mutex coverage_lock;
+    RunJob run = { &jobs, &programs, &program_for_job, &images, &link_errors,
+                   &writer, &failures, &dense_pool, &sparse_pool, coverage,
+                   &coverage_lock };
+    parallel_for(jobs.size(), n_threads, run);
+    writer.flush();
+    return failures;
+}
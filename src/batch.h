@@ -0,0 +1,101 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "runner.h"
+
+/* Batch mode runs many programs from one process (mos6502 --batch).
+ *
+ * A manifest has one job per line: a file name followed by job options
+ * (see parse_job_option), for example
+ *
+ *      # file              options
+ *      one.6502            --max-cycles 10000 --dump 0x200:0x201
+ *      one.6502            --load-addr 0x700 --reg X=3
+ *      rom.bin --binary    --load-addr 0xc000 --poke 0x10=0xff
+ *
+ * Blank lines and lines starting with '#' are ignored, and relative file
+ * names are relative to the manifest.
+ *
+ * Each distinct file is read and assembled once, and linked once for each
+ * load address it is run at; jobs map the linked code as shared pages (see
+ * SharedImage) rather than copying it. The jobs run on a pool of threads.
+ * Results come out in manifest order, one JSON object per line:
+ *
+ *      {"job":0,"file":"one.6502","cycles":64,...,"stop_reason":"brk",
+ *       "dumps":[{"start":512,"bytes":"0303"}]}
+ *      {"job":2,"file":"rom.bin","error":"File not found"}
+ */
+struct BatchJob {
+    std::string file;
+    int line;   // in the manifest
+    JobOptions options;
+};
+
+/* Parse a manifest. dir is prefixed to relative file names. Throws
+ * std::invalid_argument, naming the line, if a line can't be parsed. */
+std::vector<BatchJob> read_manifest(std::istream& in, const std::string& dir);
+
+/* Collects lines that are finished out of order and writes them to out in
+ * order, through one buffer. put() may be called from any thread. */
+class OrderedWriter {
+public:
+    OrderedWriter(std::ostream& out, size_t n_lines, size_t buffer_size = 1 << 16);
+
+    /* Line i is finished. line is taken (left empty). */
+    void put(size_t i, std::string& line);
+
+    /* Write out everything that is buffered */
+    void flush();
+
+private:
+    std::mutex lock;
+    std::ostream& out;
+    std::vector<std::string> pending;
+    std::vector<bool> done;
+    size_t next;
+    std::string buf;
+    size_t buffer_size;
+};
+
+/* Call fn(0) ... fn(n - 1) from a pool of n_threads threads, each taking
+ * the next index until there are none left. fn must not throw. */
+template <typename Fn>
+void parallel_for(size_t n, unsigned n_threads, Fn& fn) {
+    struct Worker {
+        static void run(size_t n, std::atomic<size_t>* next, Fn* fn) {
+            for (size_t i = (*next)++; i < n; i = (*next)++) {
+                (*fn)(i);
+            }
+        }
+    };
+    std::atomic<size_t> next(0);
+    if (n_threads > n) {
+        n_threads = n;
+    }
+    if (n_threads <= 1) {
+        Worker::run(n, &next, &fn);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < n_threads; ++i) {
+        threads.push_back(std::thread(Worker::run, n, &next, &fn));
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+}
+
+/* Run the jobs and write their results to out. Returns the number of jobs
+ * that failed to run (bad files, bad source, ...). If coverage isn't NULL,
+ * every job's coverage is added to it. */
+size_t run_batch(const std::vector<BatchJob>& jobs, unsigned n_threads,
+                 const char* cache_dir, std::ostream& out,
+                 Coverage* coverage = NULL);
+
+#endif // BATCH_H
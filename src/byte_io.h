@@ -0,0 +1,104 @@
+#ifndef BYTE_IO_H
+#define BYTE_IO_H
+
+#include <string>
+#include <stdint.h>
+
+/* Little endian encoding helpers for the binary files we write
+ * (assembly cache entries, symbol indexes, ...)
+ */
+inline void put_u16(std::string& buf, uint16_t val) {
+    buf.push_back((char) (val & 0xff));
+    buf.push_back((char) ((val >> 8) & 0xff));
+}
+
+inline void put_u32(std::string& buf, uint32_t val) {
+    put_u16(buf, val & 0xffff);
+    put_u16(buf, (val >> 16) & 0xffff);
+}
+
+inline void put_u64(std::string& buf, uint64_t val) {
+    put_u32(buf, val & 0xffffffff);
+    put_u32(buf, (val >> 32) & 0xffffffff);
+}
+
+/* Seven bits at a time, low bits first, with the top bit set on every byte
+ * but the last, so small values take one byte */
+inline void put_varint(std::string& buf, uint64_t val) {
+    while (val >= 0x80) {
+        buf.push_back((char) ((val & 0x7f) | 0x80));
+        val >>= 7;
+    }
+    buf.push_back((char) val);
+}
+
+inline uint16_t get_u16(const char* p) {
+    return (uint16_t) ((uint8_t) p[0] | ((uint8_t) p[1] << 8));
+}
+
+inline uint32_t get_u32(const char* p) {
+    return get_u16(p) | ((uint32_t) get_u16(p + 2) << 16);
+}
+
+/* Reads values out of a buffer, failing (rather than reading past the end)
+ * when the buffer is truncated. Once a read fails, ok is false and all
+ * further reads return zero. */
+class ByteReader {
+public:
+    ByteReader(const std::string& buf) : buf(buf), pos(0), ok(true) { }
+
+    const char* take(size_t n) {
+        if (!this->ok || this->buf.size() - this->pos < n) {
+            this->ok = false;
+            return NULL;
+        }
+        const char* p = this->buf.data() + this->pos;
+        this->pos += n;
+        return p;
+    }
+
+    uint16_t u16() {
+        const char* p = this->take(2);
+        return p ? get_u16(p) : 0;
+    }
+
+    uint32_t u32() {
+        const char* p = this->take(4);
+        return p ? get_u32(p) : 0;
+    }
+
+    uint64_t u64() {
+        uint64_t lo = this->u32();
+        uint64_t hi = this->u32();
+        return lo | (hi << 32);
+    }
+
+    uint8_t u8() {
+        const char* p = this->take(1);
+        return p ? (uint8_t) p[0] : 0;
+    }
+
+    uint64_t varint() {
+        uint64_t val = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const char* p = this->take(1);
+            if (!p) {
+                return 0;
+            }
+            val |= (uint64_t) (*p & 0x7f) << shift;
+            if (!(*p & 0x80)) {
+                return val;
+            }
+        }
+        this->ok = false;   // too long for 64 bits
+        return 0;
+    }
+
+    bool at_end() const { return this->ok && this->pos == this->buf.size(); }
+
+    const std::string& buf;
+    size_t pos;
+    bool ok;
+};
+
+#endif // BYTE_IO_H
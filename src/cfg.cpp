@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <cstring>
+#include "cfg.h"
+#include "opcodes.h"
+
+static const uint8_t OP_BRK = 0x00;
+static const uint8_t OP_JSR = 0x20;
+static const uint8_t OP_RTI = 0x40;
+static const uint8_t OP_JMP_ABS = 0x4c;
+static const uint8_t OP_RTS = 0x60;
+static const uint8_t OP_JMP_IND = 0x6c;
+
+/* Orders blocks by start address */
+struct BlockStartLess {
+    bool operator()(const ControlFlowGraph::Block& a,
+                    const ControlFlowGraph::Block& b) const {
+        return a.start < b.start;
+    }
+    bool operator()(const ControlFlowGraph::Block& a, address_t addr) const {
+        return a.start < addr;
+    }
+};
+
+std::vector<address_t> ControlFlowGraph::entry_points(
+        const std::map<std::string, uint16_t>& labels, uint16_t base_addr) {
+    std::vector<address_t> entries;
+    entries.reserve(labels.size() + 1);
+    entries.push_back(base_addr);
+    std::map<std::string, uint16_t>::const_iterator it;
+    for (it = labels.begin(); it != labels.end(); ++it) {
+        entries.push_back((address_t) (it->second + base_addr));
+    }
+    return entries;
+}
+
+ControlFlowGraph::ControlFlowGraph() : mem(NULL), start(0), end(0) {
+    std::memset(this->instructions, 0, sizeof(this->instructions));
+    std::memset(this->leaders, 0, sizeof(this->leaders));
+}
+
+void ControlFlowGraph::build(const uint8_t* mem, size_t start, size_t end,
+                             const std::vector<address_t>& entries) {
+    this->mem = mem;
+    this->start = start;
+    this->end = std::min(end, Mem::MEM_SIZE);
+    std::memset(this->instructions, 0, sizeof(this->instructions));
+    std::memset(this->leaders, 0, sizeof(this->leaders));
+    this->block_list.clear();
+
+    std::vector<address_t> work;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const address_t addr = entries[i];
+        if (addr >= this->start && addr < this->end && !is_set(this->leaders, addr)) {
+            set(this->leaders, addr);
+            work.push_back(addr);
+        }
+    }
+
+    while (!work.empty()) {
+        const address_t addr = work.back();
+        work.pop_back();
+        // a leader inside code that's already decoded is left to split_blocks
+        if (!this->is_instruction(addr)) {
+            this->decode_block(addr, work);
+        }
+    }
+    this->split_blocks();
+}
+
+void ControlFlowGraph::add_edge(Block& block, address_t target, EdgeKind kind,
+                                std::vector<address_t>& work) {
+    Edge& edge = block.edges[block.n_edges++];
+    edge.target = target;
+    edge.kind = kind;
+    if (target < this->start || target >= this->end) {
+        block.flags |= BLOCK_UNKNOWN;
+    } else if (!is_set(this->leaders, target)) {
+        set(this->leaders, target);
+        work.push_back(target);
+    }
+}
+
+void ControlFlowGraph::decode_block(address_t addr, std::vector<address_t>& work) {
+    Block block;
+    block.start = addr;
+    block.last = addr;
+    block.n_instructions = 0;
+    block.flags = 0;
+    block.n_edges = 0;
+
+    uint32_t pc = addr;
+    for (;;) {
+        if (pc >= this->end) {
+            block.flags |= BLOCK_UNKNOWN;
+            break;
+        }
+        const uint8_t op = this->mem[pc];
+        const OpInfo& op_info = OPS[op];
+        if (op_info.is_null() || pc + op_info.n_bytes > this->end) {
+            block.flags |= BLOCK_UNKNOWN;
+            break;
+        }
+        set(this->instructions, pc);
+        block.last = pc;
+        ++block.n_instructions;
+
+        const uint32_t next = pc + op_info.n_bytes;
+        address_t operand = 0;
+        if (op_info.n_bytes > 1) {
+            operand = this->mem[pc + 1];
+        }
+        if (op_info.n_bytes > 2) {
+            operand |= this->mem[pc + 2] << 8;
+        }
+        pc = next;
+
+        if (op_info.address_mode == REL) {
+            // the displacement is from the PC after the branch, as in _do_branch
+            this->add_edge(block, (address_t) next, EDGE_FALLTHROUGH, work);
+            this->add_edge(block, (address_t) (next + (int8_t) operand), EDGE_BRANCH, work);
+            break;
+        } else if (op == OP_JSR) {
+            this->add_edge(block, operand, EDGE_CALL, work);
+            this->add_edge(block, (address_t) next, EDGE_FALLTHROUGH, work);
+            break;
+        } else if (op == OP_JMP_ABS) {
+            this->add_edge(block, operand, EDGE_JUMP, work);
+            break;
+        } else if (op == OP_JMP_IND) {
+            block.flags |= BLOCK_INDIRECT;
+            break;
+        } else if (op == OP_RTS || op == OP_RTI || op == OP_BRK) {
+            break;
+        }
+
+        // stop where another block starts or code is already decoded
+        if (next < this->end
+                && (is_set(this->leaders, next) || is_set(this->instructions, next))) {
+            this->add_edge(block, (address_t) next, EDGE_FALLTHROUGH, work);
+            break;
+        }
+    }
+    block.end = pc;
+    this->block_list.push_back(block);
+}
+
+void ControlFlowGraph::split_blocks() {
+    std::vector<Block> split;
+    split.reserve(this->block_list.size());
+    for (size_t i = 0; i < this->block_list.size(); ++i) {
+        Block block = this->block_list[i];
+        uint32_t pc = block.start;
+        address_t last = block.start;
+        unsigned n = 0;
+        while (pc < block.end && n < block.n_instructions) {
+            const uint32_t next = pc + OPS[this->mem[pc]].n_bytes;
+            last = pc;
+            ++n;
+            if (n < block.n_instructions && is_set(this->leaders, next)) {
+                Block head = block;
+                head.last = last;
+                head.end = next;
+                head.n_instructions = n;
+                head.flags = 0;
+                head.n_edges = 1;
+                head.edges[0].target = (address_t) next;
+                head.edges[0].kind = EDGE_FALLTHROUGH;
+                split.push_back(head);
+
+                block.start = (address_t) next;
+                block.n_instructions -= n;
+                n = 0;
+            }
+            pc = next;
+        }
+        split.push_back(block);
+    }
+    std::sort(split.begin(), split.end(), BlockStartLess());
+    this->block_list.swap(split);
+}
+
+const ControlFlowGraph::Block* ControlFlowGraph::block_at(address_t addr) const {
+    std::vector<Block>::const_iterator it = std::lower_bound(
+        this->block_list.begin(), this->block_list.end(), addr, BlockStartLess());
+    if (it == this->block_list.end() || it->start != addr) {
+        return NULL;
+    }
+    return &*it;
+}
+
+size_t ControlFlowGraph::count_flagged(BlockFlags flag) const {
+    size_t n = 0;
+    for (size_t i = 0; i < this->block_list.size(); ++i) {
+        if (this->block_list[i].flags & flag) {
+            ++n;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,125 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "mem.h"
+
+/* A static control-flow graph of the code in a memory image, split into
+ * basic blocks.
+ *
+ * Decoding starts at the given entry points (usually the program's start
+ * and its labels, see entry_points) and follows every path the code can
+ * take, using OPS for instruction sizes and address modes. A block ends at
+ * any instruction that can transfer control, or where another block starts:
+ *
+ *      branches        two edges, the fall through and the target, which is
+ *                      worked out the way Cpu::_do_branch does
+ *      JMP abs         one edge
+ *      JSR             a call edge to the subroutine, and a fall through
+ *                      edge for where it returns to
+ *      JMP (ind)       no edges; the block is flagged INDIRECT
+ *      RTS, RTI, BRK   no edges
+ *
+ * Blocks are flagged UNKNOWN where decoding can't continue: a byte that
+ * isn't an opcode, an instruction running off the end of the image, or a
+ * target outside it. Those edges are still listed.
+ *
+ * Decoding is a single worklist pass over a bitmap of the address space, so
+ * a whole 64K image takes a few milliseconds.
+ */
+class ControlFlowGraph {
+public:
+    enum EdgeKind {
+        EDGE_FALLTHROUGH,
+        EDGE_BRANCH,
+        EDGE_JUMP,
+        EDGE_CALL,
+    };
+
+    enum BlockFlags {
+        BLOCK_INDIRECT = 1,     // ends in an indirect jump
+        BLOCK_UNKNOWN = 2,      // ends where decoding stopped
+    };
+
+    struct Edge {
+        address_t target;
+        EdgeKind kind;
+    };
+
+    struct Block {
+        address_t start;
+        address_t last;             // the address of the last instruction
+        uint32_t end;               // one past the last byte
+        unsigned n_instructions;
+        unsigned flags;
+        unsigned n_edges;
+        Edge edges[2];
+
+        bool is_indirect() const { return this->flags & BLOCK_INDIRECT; }
+        bool is_unknown() const { return this->flags & BLOCK_UNKNOWN; }
+    };
+
+    /* The start of the program and each of its labels, which the Assembler
+     * gives relative to the start, as addresses */
+    static std::vector<address_t> entry_points(
+            const std::map<std::string, uint16_t>& labels, uint16_t base_addr);
+
+    ControlFlowGraph();
+
+    /* Build the graph of the code in mem[start, end) reachable from entries.
+     * mem is indexed by address. Entries outside [start, end) are ignored.
+     * Replaces any graph built before. */
+    void build(const uint8_t* mem, size_t start, size_t end,
+               const std::vector<address_t>& entries);
+
+    /* The image the graph was built from */
+    const uint8_t* image() const { return this->mem; }
+
+    /* Blocks in order of their start address */
+    const std::vector<Block>& blocks() const { return this->block_list; }
+
+    /* Returns NULL if no block starts at addr */
+    const Block* block_at(address_t addr) const;
+
+    /* Whether an instruction reachable from the entries starts at addr */
+    bool is_instruction(address_t addr) const {
+        return (this->instructions[addr >> 6] >> (addr & 63)) & 1;
+    }
+
+    /* Number of blocks with the given flag */
+    size_t count_flagged(BlockFlags flag) const;
+
+private:
+    static const size_t N_WORDS = Mem::MEM_SIZE / 64;
+
+    static bool is_set(const uint64_t* bits, uint32_t addr) {
+        return (bits[addr >> 6] >> (addr & 63)) & 1;
+    }
+
+    static void set(uint64_t* bits, uint32_t addr) {
+        bits[addr >> 6] |= (uint64_t) 1 << (addr & 63);
+    }
+
+    /* Decode the block starting at addr, queueing the blocks it leads to */
+    void decode_block(address_t addr, std::vector<address_t>& work);
+
+    /* Add an edge from block, marking its target as a leader */
+    void add_edge(Block& block, address_t target, EdgeKind kind,
+                  std::vector<address_t>& work);
+
+    /* Split blocks that run into a leader found after they were decoded */
+    void split_blocks();
+
+    const uint8_t* mem;
+    size_t start;
+    size_t end;
+
+    uint64_t instructions[N_WORDS];
+    uint64_t leaders[N_WORDS];
+    std::vector<Block> block_list;
+};
+
+#endif // CFG_H
@@ -0,0 +1,62 @@
+#include <iterator>
+#include "console.h"
+
+const size_t Console::DEFAULT_BUFFER_SIZE;
+
+Console::Console(std::ostream& out, size_t buffer_size)
+    : out(out), buffer_size(buffer_size ? buffer_size : 1), input_pos(0),
+      has_output(false), has_input(false), output_addr(0), input_addr(0) {
+    this->buffer.reserve(this->buffer_size);
+}
+
+Console::~Console() {
+    this->flush();
+}
+
+void Console::map_output(Mem& mem, address_t addr) {
+    this->has_output = true;
+    this->output_addr = addr;
+    mem.map_device(addr >> 8, 1, this);
+}
+
+void Console::map_input(Mem& mem, address_t addr) {
+    this->has_input = true;
+    this->input_addr = addr;
+    mem.map_device(addr >> 8, 1, this);
+}
+
+uint8_t Console::read(address_t addr) {
+    if (!this->has_input || addr != this->input_addr
+            || this->input_pos == this->input.size()) {
+        return 0;
+    }
+    return this->input[this->input_pos++];
+}
+
+void Console::write(address_t addr, uint8_t value) {
+    if (!this->has_output || addr != this->output_addr) {
+        return;
+    }
+    this->buffer.push_back(value);
+    if (this->buffer.size() == this->buffer_size) {
+        this->flush();
+    }
+}
+
+void Console::read_input(std::istream& in) {
+    this->input.append(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+}
+
+void Console::add_input(const std::string& text) {
+    this->input += text;
+}
+
+void Console::flush() {
+    if (this->buffer.empty()) {
+        return;
+    }
+    this->out.write(this->buffer.data(), this->buffer.size());
+    this->out.flush();
+    this->buffer.clear();
+}
@@ -0,0 +1,60 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "mem.h"
+
+/* A character console for programs: a byte written to the output address
+ * is printed, and a read of the input address takes the next byte of input.
+ *
+ * Output collects in a buffer that is written to the stream in one go when
+ * it fills up, on flush and when the Console is destroyed, so a program
+ * printing a character at a time doesn't cost a write per character. Input
+ * is read in full before the run (see read_input) and handed out from
+ * memory; once it runs out, reads give 0.
+ *
+ * The Console is mapped as a device over the whole page of each address,
+ * so the rest of those pages read 0 and ignore writes, while every other
+ * page is plain memory and as fast as ever.
+ */
+class Console : public MemDevice {
+public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    explicit Console(std::ostream& out, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+    ~Console();
+
+    /* Map the page of addr in mem to the console, with output at addr */
+    void map_output(Mem& mem, address_t addr);
+
+    /* Map the page of addr in mem to the console, with input at addr */
+    void map_input(Mem& mem, address_t addr);
+
+    uint8_t read(address_t addr);
+    void write(address_t addr, uint8_t value);
+
+    /* Add the rest of in (or text) to the input */
+    void read_input(std::istream& in);
+    void add_input(const std::string& text);
+
+    /* Bytes of input not read yet */
+    size_t input_left() const { return this->input.size() - this->input_pos; }
+
+    /* Write the buffered output to the stream */
+    void flush();
+
+private:
+    std::ostream& out;
+    std::vector<char> buffer;
+    size_t buffer_size;
+    std::string input;
+    size_t input_pos;
+
+    bool has_output, has_input;
+    address_t output_addr, input_addr;
+};
+
+#endif // CONSOLE_H
@@ -0,0 +1,134 @@
+#include <bitset>
+#include <cstring>
+#include <iomanip>
+#include "byte_io.h"
+#include "coverage.h"
+#include "opcodes.h"
+#include "symbols.h"
+
+static const char MAGIC[4] = { 'M', '6', '5', 'V' };
+static const uint32_t FORMAT_VERSION = 1;
+
+const size_t Coverage::N_WORDS;
+const bool Coverage::ENABLED;
+
+static size_t count_bits(const uint64_t* bits, size_t n_words) {
+    size_t n = 0;
+    for (size_t i = 0; i < n_words; ++i) {
+        n += std::bitset<64>(bits[i]).count();
+    }
+    return n;
+}
+
+void Coverage::clear() {
+    std::memset(this->executed, 0, sizeof(this->executed));
+    std::memset(this->taken, 0, sizeof(this->taken));
+    std::memset(this->not_taken, 0, sizeof(this->not_taken));
+}
+
+void Coverage::merge(const Coverage& other) {
+    for (size_t i = 0; i < N_WORDS; ++i) {
+        this->executed[i] |= other.executed[i];
+        this->taken[i] |= other.taken[i];
+        this->not_taken[i] |= other.not_taken[i];
+    }
+}
+
+size_t Coverage::n_executed() const {
+    return count_bits(this->executed, N_WORDS);
+}
+
+std::string Coverage::data() const {
+    const uint64_t* bitmaps[] = { this->executed, this->taken, this->not_taken };
+    std::string buf;
+    buf.reserve(8 + sizeof(bitmaps) / sizeof(bitmaps[0]) * N_WORDS * 8);
+    buf.append(MAGIC, sizeof(MAGIC));
+    put_u32(buf, FORMAT_VERSION);
+    for (size_t b = 0; b < sizeof(bitmaps) / sizeof(bitmaps[0]); ++b) {
+        for (size_t i = 0; i < N_WORDS; ++i) {
+            put_u64(buf, bitmaps[b][i]);
+        }
+    }
+    return buf;
+}
+
+bool Coverage::load(const std::string& buf) {
+    this->clear();
+    ByteReader r(buf);
+    const char* magic = r.take(sizeof(MAGIC));
+    if (!magic || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+            || r.u32() != FORMAT_VERSION) {
+        return false;
+    }
+    uint64_t* bitmaps[] = { this->executed, this->taken, this->not_taken };
+    for (size_t b = 0; b < sizeof(bitmaps) / sizeof(bitmaps[0]); ++b) {
+        for (size_t i = 0; i < N_WORDS; ++i) {
+            bitmaps[b][i] = r.u64();
+        }
+    }
+    if (!r.at_end()) {
+        this->clear();
+        return false;
+    }
+    return true;
+}
+
+/* Whether a line's instruction ran, and for a branch which ways it went,
+ * counting them for the summary */
+class CoverageColumns : public SourceRowWriter {
+public:
+    CoverageColumns(const Coverage& coverage, const std::vector<uint8_t>& code,
+                    uint16_t base_addr)
+        : n_instructions(0), n_executed(0), n_directions(0),
+          n_directions_seen(0), coverage(coverage), code(code),
+          base_addr(base_addr) { }
+
+    void write_columns(std::ostream& out, size_t offset, size_t) {
+        if (offset == std::string::npos) {
+            out << std::string(6 + 6 + 8, ' ');
+            return;
+        }
+        const uint16_t addr = this->base_addr + offset;
+        const bool executed = this->coverage.was_executed(addr);
+        ++this->n_instructions;
+        this->n_executed += executed;
+        out << std::hex << std::setfill('0') << std::setw(4) << addr
+            << (executed ? "     *  " : "  ####  ");
+        if (OPS[this->code[offset]].address_mode == REL) {
+            this->n_directions += 2;
+            this->n_directions_seen += this->coverage.was_taken(addr)
+                                       + this->coverage.was_not_taken(addr);
+            out << (this->coverage.was_taken(addr) ? " T" : " -")
+                << (this->coverage.was_not_taken(addr) ? " N" : " -") << "    ";
+        } else {
+            out << std::string(8, ' ');
+        }
+    }
+
+    size_t n_instructions, n_executed;
+    size_t n_directions, n_directions_seen;
+
+private:
+    const Coverage& coverage;
+    const std::vector<uint8_t>& code;
+    uint16_t base_addr;
+};
+
+void write_coverage_report(std::ostream& out, const Coverage& coverage,
+                           const Assembler& assembler, const std::string& source,
+                           uint16_t base_addr) {
+    std::vector<uint8_t> code;
+    assembler.relocate_code(base_addr, code);
+
+    std::ios::fmtflags flags = out.flags();
+    char fill = out.fill();
+    out << "line  addr  exec  branch  source" << std::endl;
+    CoverageColumns columns(coverage, code, base_addr);
+    write_source_rows(out, assembler, code, source, columns);
+
+    out << std::dec << columns.n_executed << " of " << columns.n_instructions
+        << " instructions executed, " << columns.n_directions_seen << " of "
+        << columns.n_directions << " branch directions taken" << std::endl;
+    out.flags(flags);
+    out.fill(fill);
+}
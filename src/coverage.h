@@ -0,0 +1,94 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <iostream>
+#include <string>
+#include <stdint.h>
+#include "assembler.h"
+#include "mem.h"
+
+/* Which addresses a Cpu has executed an instruction at, and which ways the
+ * branches there went (see Cpu::set_coverage).
+ *
+ * Each is a bitmap with one bit per address, so marking an instruction is a
+ * single bit set, and coverage from any number of runs merges by OR. The
+ * Cpu only marks instructions when built with MOS6502_COVERAGE (the CMake
+ * option of the same name, on by default); otherwise the dispatch loop
+ * doesn't look at coverage at all.
+ *
+ * Serialized as:
+ *
+ *      "M65V"                  magic
+ *      u32                     FORMAT_VERSION
+ *      3 * 1024 * u64          executed, taken and not taken bitmaps
+ *
+ * All integers are little endian.
+ */
+class Coverage {
+public:
+    static const size_t N_WORDS = Mem::MEM_SIZE / 64;
+
+#ifdef MOS6502_COVERAGE
+    static const bool ENABLED = true;
+#else
+    static const bool ENABLED = false;
+#endif
+
+    Coverage() { this->clear(); }
+
+    void clear();
+
+    inline void mark_executed(address_t addr) {
+        this->executed[addr >> 6] |= (uint64_t) 1 << (addr & 63);
+    }
+
+    inline void mark_branch(address_t addr, bool taken) {
+        uint64_t* bits = taken ? this->taken : this->not_taken;
+        bits[addr >> 6] |= (uint64_t) 1 << (addr & 63);
+    }
+
+    bool was_executed(address_t addr) const { return is_set(this->executed, addr); }
+    bool was_taken(address_t addr) const { return is_set(this->taken, addr); }
+    bool was_not_taken(address_t addr) const { return is_set(this->not_taken, addr); }
+
+    /* Add everything other has covered */
+    void merge(const Coverage& other);
+
+    /* The number of addresses executed */
+    size_t n_executed() const;
+
+    /* The serialized coverage, ready to be written to a file */
+    std::string data() const;
+
+    /* Use previously written coverage. Returns false (leaving this coverage
+     * empty) if buf isn't valid coverage. */
+    bool load(const std::string& buf);
+
+private:
+    static bool is_set(const uint64_t* bits, address_t addr) {
+        return (bits[addr >> 6] >> (addr & 63)) & 1;
+    }
+
+    uint64_t executed[N_WORDS];
+    uint64_t taken[N_WORDS];
+    uint64_t not_taken[N_WORDS];
+};
+
+/* Write a listing of the program with its coverage, one row per source line:
+ *
+ *      line  addr  exec  branch  source
+ *         2  0602     *          CMP #$02
+ *         3  0604     *   T -    BNE notequal
+ *         4  0606  ####          STA $22
+ *
+ * where unexecuted instructions are marked "####", and branches show "T"
+ * if they were ever taken and "N" if they ever fell through. A summary of
+ * instructions and branch directions covered follows. source must be the
+ * text the assembler was given, and base_addr the address the program ran
+ * at.
+ */
+void write_coverage_report(std::ostream& out, const Coverage& coverage,
+                           const Assembler& assembler, const std::string& source,
+                           uint16_t base_addr);
+
+#endif // COVERAGE_H
@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include "coverage.h"
 #include "cpu.h"
+#include "memo.h"
 #include "opcodes.h"
 
 /* To ensure we don't forget a break in the big switch statement */
@@ -7,6 +12,11 @@
 
 #define DEBUG_EMU true
 
+const uint64_t Cpu::NO_EVENT;
+
+/* The most bytes of code an idle loop can take up */
+static const uint32_t MAX_IDLE_LOOP = 32;
+
 template <typename T>
 inline void debug(const T& val) {
 #ifdef DEBUG_EMU
@@ -16,53 +26,558 @@ inline void debug(const T& val) {
 
 void Cpu::load_code(const std::vector<uint8_t> &code, address_t addr) {
     size_t max_addr = code.size() + addr;
-    if (max_addr >= 0xFFFA) {
+    if (max_addr > VECTORS_START) {
         throw "code doesn't fit in memory";
     } else {
-        std::copy(code.begin(), code.end(), &this->mem.data[addr]);
+        this->mem.write_block(addr, code.data(), code.size());
         this->PC.write(addr);
     }
 }
 
-void Cpu::emu_loop() {
-    int n_steps = 0;
-    int total_cycles = 0;
+void Cpu::check_fits(size_t size, address_t addr) {
+    if (addr + size > VECTORS_START) {
+        std::ostringstream msg;
+        msg << "Code doesn't fit in memory at address " << addr;
+        throw std::invalid_argument(msg.str());
+    }
+}
+
+void Cpu::reset(ResetMode mode) {
+    if (this->memo) {
+        this->memo->abandon();
+    }
+    this->nmi_pending = false;
+    this->idle_activity = NO_EVENT;
+    if (mode == RESET_WARM) {
+        // the reset sequence does three stack reads instead of pushes
+        this->S.write(this->S.read() - 3);
+        this->P.set_interrupt();
+        this->P.clear_breakpoint();
+        this->PC.write(this->mem.read_16(RESET_VECTOR));
+        this->cycles += 7;
+        return;
+    }
+
+    this->A.write(0);
+    this->X.write(0);
+    this->Y.write(0);
+    this->S.write(0xFF);
+    this->P.write(0);
+    this->PC.write(0);
+    this->cycles = 0;
+    this->instructions = 0;
+    this->irq_line = false;
+    this->events.clear();
+    this->next_event_cycle = NO_EVENT;
+    if (mode == RESET_POWER_ON) {
+        this->mem.clear();
+    }
+}
+
+const char* stop_reason_to_string(StopReason reason) {
+    switch (reason) {
+        case STOP_BRK: return "brk";
+        case STOP_INVALID_OPCODE: return "invalid_opcode";
+        case STOP_CYCLE_LIMIT: return "cycle_limit";
+        case STOP_INSTRUCTION_LIMIT: return "instruction_limit";
+        case STOP_WRITE_PROTECT: return "write_protect";
+        case STOP_REPEATED_STATE: return "repeated_state";
+        case STOP_DEVICE_STALL: return "device_stall";
+        default: return "unknown";
+    }
+}
+
+StopReason Cpu::emu_loop(uint64_t max_cycles, uint64_t max_instructions) {
+    const uint64_t start_cycles = this->cycles;
+    const uint64_t start_instructions = this->instructions;
     int n_cycles;
 
-    this->out << std::endl << "Step: " << n_steps << std::endl
-              << *this << std::endl;
+    if (this->trace) {
+        *this->out << std::endl << "Step: " << this->instructions << std::endl
+                  << *this << std::endl;
+    }
+
+    // nothing that could see between fused instructions, or see passes
+    // round an idle loop being skipped, changes mid-run
+    const bool fuse = this->fusion && !this->trace && !this->interrupt_tap
+                      && !this->coverage;
+    const bool skip = this->idle_skip && !this->trace && !this->interrupt_tap
+                      && !this->mem.is_observed();
+    const uint64_t cycle_deadline = max_cycles ? start_cycles + max_cycles : NO_EVENT;
+    const uint64_t instruction_deadline =
+        max_instructions ? start_instructions + max_instructions : NO_EVENT;
+
+    for (;;) {
+        if (max_cycles && this->cycles - start_cycles >= max_cycles) {
+            return STOP_CYCLE_LIMIT;
+        }
+        if (max_instructions
+                && this->instructions - start_instructions >= max_instructions) {
+            return STOP_INSTRUCTION_LIMIT;
+        }
+
+        if (this->cycles >= this->next_event_cycle) {
+            this->run_events();
+        }
 
-    do {
-        n_steps += 1;
-        this->out << std::endl << "Step: " << n_steps << std::endl;
-        n_cycles = this->emu_step();
-        total_cycles += n_cycles;
+        if (this->trace) {
+            *this->out << std::endl << "Step: " << this->instructions + 1
+                      << std::endl;
+        }
+        try {
+            n_cycles = 0;
+            if (fuse && !this->nmi_pending && !this->irq_line) {
+                n_cycles = this->emu_fused(
+                    max_cycles ? max_cycles - (this->cycles - start_cycles) : (uint64_t) -1,
+                    max_instructions ? max_instructions - (this->instructions - start_instructions)
+                                     : (uint64_t) -1);
+            }
+            if (n_cycles == 0) {
+                n_cycles = this->emu_step();
+            }
+        } catch (WriteProtectError& error) {
+            if (this->trace) {
+                *this->out << error.what() << std::endl;
+            }
+            return STOP_WRITE_PROTECT;
+        } catch (DeviceStall& error) {
+            // nothing but the PC has changed since the instruction started
+            this->PC.write(this->step_addr);
+            if (this->trace) {
+                *this->out << error.what() << std::endl;
+            }
+            return STOP_DEVICE_STALL;
+        }
+        if (n_cycles < 0) {
+            return STOP_INVALID_OPCODE;
+        }
 
         if (this->P.has_breakpoint()) {
             // TODO: not the normal behavior -- see Cpu::brk().
-            this->out << "BRK seen -- terminating" << std::endl;
-            break;
+            if (this->trace) {
+                *this->out << "BRK seen -- terminating" << std::endl;
+            }
+            return STOP_BRK;
         }
 
-        this->out << "Took " << n_cycles << " cycles" << std::endl
-                  << *this << std::endl;
-    } while (n_cycles >= 0);
+        if (this->trace) {
+            *this->out << "Took " << n_cycles << " cycles" << std::endl
+                      << *this << std::endl;
+        }
+
+        // step_addr is the last instruction run, which may follow op_addr
+        // in a fused idiom
+        const address_t pc = this->PC.read();
+        if (skip && pc < this->step_addr
+                && (uint32_t) (this->step_addr - pc) < MAX_IDLE_LOOP) {
+            this->skip_idle(this->step_addr, cycle_deadline, instruction_deadline);
+        }
+    }
+}
+
+void Cpu::set_memo(SubroutineMemo* memo) {
+    if (this->memo) {
+        this->memo->abandon();
+    }
+    this->memo = memo;
+}
+
+void Cpu::set_host_call(uint8_t number, HostCall* handler) {
+    if (this->host_calls.empty()) {
+        this->host_calls.assign(OPS_SIZE, NULL);
+    }
+    this->host_calls[number] = handler;
+}
+
+void Cpu::schedule(CycleEvent* event, uint64_t cycle) {
+    this->cancel(event);
+    ScheduledEvent scheduled = { cycle, event };
+    this->events.push_back(scheduled);
+    this->next_event_cycle = std::min(this->next_event_cycle, cycle);
+}
+
+void Cpu::cancel(CycleEvent* event) {
+    for (size_t i = 0; i < this->events.size(); ++i) {
+        if (this->events[i].event == event) {
+            this->events.erase(this->events.begin() + i);
+            this->update_next_event();
+            return;
+        }
+    }
+}
+
+Cpu::Pending Cpu::save_pending() const {
+    Pending pending = { this->irq_line, this->nmi_pending, this->events };
+    return pending;
+}
+
+void Cpu::restore_pending(const Pending& pending) {
+    this->irq_line = pending.irq_line;
+    this->nmi_pending = pending.nmi_pending;
+    this->events = pending.events;
+    this->update_next_event();
+    // whatever idle loop was being watched, it wasn't this one
+    ++this->outside_activity;
+}
+
+void Cpu::update_next_event() {
+    this->next_event_cycle = NO_EVENT;
+    for (size_t i = 0; i < this->events.size(); ++i) {
+        this->next_event_cycle = std::min(this->next_event_cycle, this->events[i].cycle);
+    }
+}
+
+void Cpu::run_events() {
+    // handlers may schedule more events, so take the due ones one at a time
+    while (this->cycles >= this->next_event_cycle) {
+        size_t due = 0;
+        for (size_t i = 1; i < this->events.size(); ++i) {
+            if (this->events[i].cycle < this->events[due].cycle) {
+                due = i;
+            }
+        }
+        const ScheduledEvent event = this->events[due];
+        this->events.erase(this->events.begin() + due);
+        this->update_next_event();
+        ++this->outside_activity;
+        event.event->on_cycle(event.cycle);
+    }
+}
+
+/* What an instruction does, as far as deciding whether a loop is idle */
+enum IdleKind {
+    IDLE_NEVER,         // anything that isn't listed below
+    IDLE_REGISTERS,     // only reads and writes registers
+    IDLE_READ,          // reads its ZP or ABS operand
+    IDLE_STORE,         // writes its ZP or ABS operand
+    IDLE_BRANCH,
+};
+
+/* The IdleKind of each opcode, worked out from OPS once */
+struct IdleKindTable {
+    IdleKind kinds[OPS_SIZE];
+
+    IdleKindTable() {
+        static const char* const READS[] = {
+            "lda", "ldx", "ldy", "cmp", "cpx", "cpy",
+            "bit", "and", "ora", "eor", "adc", "sbc",
+        };
+        static const char* const STORES[] = { "sta", "stx", "sty" };
+        static const char* const REGISTERS[] = {
+            "nop", "clc", "sec", "cli", "sei", "clv", "cld", "sed",
+            "tax", "tay", "txa", "tya", "tsx", "txs",
+            "inx", "iny", "dex", "dey",
+        };
+        static const char* const SHIFTS[] = { "asl", "lsr", "rol", "ror" };
+        for (int op = 0; op < OPS_SIZE; ++op) {
+            const OpInfo& info = OPS[op];
+            const bool direct = info.address_mode == ZP || info.address_mode == ABS;
+            IdleKind& kind = this->kinds[op];
+            kind = IDLE_NEVER;
+            if (info.is_null()) {
+                continue;
+            } else if (info.address_mode == REL) {
+                kind = IDLE_BRANCH;
+            } else if (has_any_name(info, REGISTERS, sizeof(REGISTERS) / sizeof(REGISTERS[0]))
+                       || (info.address_mode == ACC
+                           && has_any_name(info, SHIFTS, sizeof(SHIFTS) / sizeof(SHIFTS[0])))) {
+                kind = IDLE_REGISTERS;
+            } else if (has_any_name(info, READS, sizeof(READS) / sizeof(READS[0]))) {
+                if (info.address_mode == IMM) {
+                    kind = IDLE_REGISTERS;
+                } else if (direct) {
+                    kind = IDLE_READ;
+                }
+            } else if (direct && has_any_name(info, STORES, sizeof(STORES) / sizeof(STORES[0]))) {
+                kind = IDLE_STORE;
+            }
+        }
+    }
+
+    static bool has_any_name(const OpInfo& info, const char* const* names, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            if (info.has_name(names[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+void Cpu::skip_idle(address_t branch_addr, uint64_t cycle_deadline,
+                    uint64_t instruction_deadline) {
+    const Registers now = this->save_registers();
+    const Registers start = this->idle_start;
+    this->idle_start = now;
+    if (this->idle_activity != this->outside_activity || now.PC != start.PC
+            || now.A != start.A || now.X != start.X || now.Y != start.Y
+            || now.S != start.S || now.P != start.P) {
+        // watch the next pass
+        this->idle_activity = this->outside_activity;
+        return;
+    }
+
+    // a whole pass left the registers as they were
+    if (!this->is_idle_loop(now.PC, branch_addr)) {
+        return;
+    }
+    const uint64_t pass_cycles = now.cycles - start.cycles;
+    const uint64_t pass_instructions = now.instructions - start.instructions;
+    const uint64_t deadline = std::min(cycle_deadline, this->next_event_cycle);
+    uint64_t n_passes = NO_EVENT;
+    if (deadline != NO_EVENT) {
+        n_passes = deadline > now.cycles ? (deadline - now.cycles) / pass_cycles : 0;
+    }
+    if (instruction_deadline != NO_EVENT) {
+        n_passes = std::min(n_passes, instruction_deadline > now.instructions
+            ? (instruction_deadline - now.instructions) / pass_instructions : 0);
+    }
+    // with nothing to end the loop, it spins as it would have anyway
+    if (n_passes == NO_EVENT || n_passes == 0) {
+        return;
+    }
+    // every skipped pass starts before the deadlines, so none of them would
+    // have been stopped or had an event run
+    this->cycles += n_passes * pass_cycles;
+    this->instructions += n_passes * pass_instructions;
+    this->idle_start = this->save_registers();
+}
+
+bool Cpu::is_idle_loop(address_t head, address_t branch_addr) const {
+    static const IdleKindTable table;
+    address_t reads[MAX_IDLE_LOOP];
+    address_t stores[MAX_IDLE_LOOP];
+    address_t targets[MAX_IDLE_LOOP];
+    uint32_t starts = 0;    // bit i set for an instruction at head + i
+    size_t n_reads = 0, n_stores = 0, n_targets = 0;
+
+    uint32_t pc = head;
+    uint32_t end;
+    for (;;) {
+        const uint32_t offset = pc - head;
+        if (offset >= MAX_IDLE_LOOP || pc > branch_addr || this->mem.is_device(pc)) {
+            return false;
+        }
+        const address_t op_addr = pc;
+        const uint8_t op = this->mem.peek_8(pc);
+        const OpInfo& op_info = OPS[op];
+        const IdleKind kind = table.kinds[op];
+        if (kind == IDLE_NEVER || offset + op_info.n_bytes > MAX_IDLE_LOOP
+                || this->mem.is_device(pc + op_info.n_bytes - 1)) {
+            return false;
+        }
+        starts |= (uint32_t) 1 << offset;
+        address_t operand = 0;
+        if (op_info.n_bytes > 1) {
+            operand = this->mem.peek_8(pc + 1);
+        }
+        if (op_info.n_bytes > 2) {
+            operand |= this->mem.peek_8(pc + 2) << 8;
+        }
+        pc += op_info.n_bytes;
+
+        if (kind == IDLE_BRANCH) {
+            const address_t target = pc + (int8_t) operand;
+            // only the branch that was taken closes the loop; an earlier
+            // one back to head is just a branch inside it
+            if (op_addr == branch_addr) {
+                if (target != head) {
+                    return false;
+                }
+                end = pc;
+                break;
+            }
+            targets[n_targets++] = target;
+        } else if (kind != IDLE_REGISTERS && this->mem.is_device(operand)) {
+            return false;
+        } else if (kind == IDLE_READ) {
+            reads[n_reads++] = operand;
+        } else if (kind == IDLE_STORE) {
+            stores[n_stores++] = operand;
+        }
+    }
+
+    // branches must stay on the instructions checked here
+    for (size_t i = 0; i < n_targets; ++i) {
+        if (targets[i] < head || targets[i] >= end
+                || !((starts >> (targets[i] - head)) & 1)) {
+            return false;
+        }
+    }
+    // and stores mustn't change anything the loop reads, its code included
+    for (size_t i = 0; i < n_stores; ++i) {
+        if (stores[i] >= head && stores[i] < end) {
+            return false;
+        }
+        for (size_t j = 0; j < n_reads; ++j) {
+            if (stores[i] == reads[j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int Cpu::emu_fused(uint64_t cycle_budget, uint64_t instruction_budget) {
+    const address_t pc = this->PC.read();
+    int total = 0;
+    switch (this->mem.peek_8(pc)) {
+        case 0xCA:  // DEX; BNE
+            if (this->mem.peek_8(pc + 1) != 0xD0) {
+                return 0;
+            }
+            this->next_code_byte();
+            this->i_dex();
+            if (this->end_fused_step(OPS[0xCA].n_cycles, total, cycle_budget,
+                                     instruction_budget)) {
+                this->end_fused_step(this->fused_bne(), total, cycle_budget,
+                                     instruction_budget);
+            }
+            return total;
+
+        case 0xC8:  // INY; BNE
+            if (this->mem.peek_8(pc + 1) != 0xD0) {
+                return 0;
+            }
+            this->next_code_byte();
+            this->i_iny();
+            if (this->end_fused_step(OPS[0xC8].n_cycles, total, cycle_budget,
+                                     instruction_budget)) {
+                this->end_fused_step(this->fused_bne(), total, cycle_budget,
+                                     instruction_budget);
+            }
+            return total;
+
+        case 0xE0:  // CPX #imm; BNE
+            if (this->mem.peek_8(pc + 2) != 0xD0) {
+                return 0;
+            }
+            this->next_code_byte();
+            this->i_cpx(this->next_code_byte());
+            if (this->end_fused_step(OPS[0xE0].n_cycles, total, cycle_budget,
+                                     instruction_budget)) {
+                this->end_fused_step(this->fused_bne(), total, cycle_budget,
+                                     instruction_budget);
+            }
+            return total;
+
+        case 0xA9:  // LDA #imm; STA zp
+            if (this->mem.peek_8(pc + 2) != 0x85) {
+                return 0;
+            }
+            this->next_code_byte();
+            this->i_lda(this->next_code_byte());
+            if (this->end_fused_step(OPS[0xA9].n_cycles, total, cycle_budget,
+                                     instruction_budget)) {
+                this->next_code_byte();
+                this->i_sta(this->next_code_byte());
+                this->end_fused_step(OPS[0x85].n_cycles, total, cycle_budget,
+                                     instruction_budget);
+            }
+            return total;
+
+        case 0x18:  // CLC; ADC #imm, and STA zp if it follows
+            if (this->mem.peek_8(pc + 1) != 0x69) {
+                return 0;
+            }
+            this->next_code_byte();
+            this->i_clc();
+            if (!this->end_fused_step(OPS[0x18].n_cycles, total, cycle_budget,
+                                      instruction_budget)) {
+                return total;
+            }
+            this->next_code_byte();
+            this->i_adc(this->next_code_byte());
+            if (this->end_fused_step(OPS[0x69].n_cycles, total, cycle_budget,
+                                     instruction_budget)
+                    && this->mem.peek_8(pc + 3) == 0x85) {
+                this->next_code_byte();
+                this->i_sta(this->next_code_byte());
+                this->end_fused_step(OPS[0x85].n_cycles, total, cycle_budget,
+                                     instruction_budget);
+            }
+            return total;
+
+        default:
+            return 0;
+    }
+}
+
+bool Cpu::end_fused_step(int n_cycles, int& total, uint64_t& cycle_budget,
+                         uint64_t& instruction_budget) {
+    this->cycles += n_cycles;
+    this->instructions += 1;
+    total += n_cycles;
+    cycle_budget -= std::min(cycle_budget, (uint64_t) n_cycles);
+    instruction_budget -= 1;
+    return cycle_budget && instruction_budget && !this->nmi_pending && !this->irq_line
+           && this->cycles < this->next_event_cycle;
+}
+
+int Cpu::fused_bne() {
+    this->step_addr = this->PC.read();
+    this->next_code_byte();
+    const int8_t displacement = this->next_code_byte();
+    const address_t next_addr = this->PC.read();
+    const bool taken = this->i_bne(displacement);
+    return OPS[0xD0].n_cycles + branch_extra_cycles(taken, next_addr, this->PC.read());
+}
+
+int Cpu::take_interrupt() {
+    Interrupt pending = INTERRUPT_NONE;
+    if (this->nmi_pending) {
+        pending = INTERRUPT_NMI;
+    } else if (this->irq_line && !this->P.has_interrupt()) {
+        pending = INTERRUPT_IRQ;
+    }
+    if (this->interrupt_tap) {
+        pending = this->interrupt_tap->tap_interrupt(pending);
+    }
+    if (pending == INTERRUPT_NONE) {
+        return 0;
+    }
+    if (pending == INTERRUPT_NMI) {
+        this->nmi_pending = false;
+    }
+    ++this->outside_activity;
+    if (this->trace) {
+        *this->out << "Interrupt: " << (pending == INTERRUPT_NMI ? "NMI" : "IRQ")
+                   << std::endl;
+    }
+
+    PReg pushed = this->P;
+    pushed.clear_breakpoint();
+    this->push_register_16(this->PC);
+    this->push_register_8(pushed);
+    this->P.set_interrupt();
+    this->PC.write(this->mem.read_16(pending == INTERRUPT_NMI ? NMI_VECTOR
+                                                              : IRQ_VECTOR));
+    this->cycles += 7;
+    return 7;
 }
 
 /* Emulate a single instruction and return the number of cycles */
 int Cpu::emu_step() {
+    if (this->cycles >= this->next_event_cycle) {
+        this->run_events();
+    }
+    int interrupt_cycles = 0;
+    if (this->nmi_pending || this->irq_line || this->interrupt_tap) {
+        interrupt_cycles = this->take_interrupt();
+    }
 
-    // TODO: check interrupts?
-
+    const address_t op_addr = this->PC.read();
+    this->step_addr = op_addr;
     uint8_t next_op = this->next_code_byte();
     const OpInfo& op_info = OPS[next_op];
     if (op_info.is_null()) {
-        this->out << "Unsupport op_code: 0x" << std::hex << next_op
-                  << std::dec << std::endl;
+        if (this->trace) {
+            *this->out << "Unsupport op_code: 0x" << std::hex << (int) next_op
+                      << std::dec << std::endl;
+        }
         return -1;
-    } else {
-        this->out << "Instruction: " << op_info.name << std::endl;
-
+    } else if (this->trace) {
+        *this->out << "Instruction: " << op_info.name << std::endl;
     }
 
     int n_cycles = op_info.n_cycles;
@@ -72,44 +587,17 @@ int Cpu::emu_step() {
      *    http://users.telenet.be/kim1-6502/6502/hwman.html#AA
      */
     int extra_cycles = 0;
-
-    /* If a page boundary is crossed in ABS, ABSY, or INDY
-     * addressing modes for these instructions, add one cycle.
-     *  ADC          CMP          EOR          LDY
-     *  AND          CPX          LDA          ORA
-     *  BIT          CPY          LDX          SBC
-     */
-    if ((this->peek_two_code_bytes() & 0x0F) == 0x0F
-        && (op_info.address_mode == ABSX
-            || op_info.address_mode == ABSY
-            || op_info.address_mode == INDY)
-        && (op_info.has_name("adc")
-            || op_info.has_name("and")
-            || op_info.has_name("bit")
-            || op_info.has_name("cmp")
-            || op_info.has_name("cpx")
-            || op_info.has_name("cpy")
-            || op_info.has_name("eor")
-            || op_info.has_name("lda")
-            || op_info.has_name("ldx")
-            || op_info.has_name("ldy")
-            || op_info.has_name("ora")
-            || op_info.has_name("sbc"))) {
+    if (has_page_cross_cycle(next_op) && this->index_crosses_page(op_info.address_mode)) {
         extra_cycles = 1;
     }
 
-    // TODO: extra cycle addition
-//    uint16_t addr = 0x00;
-    /* If a branch is not taken and a page boundary is crossed, add two cycles.
-     * Else if the branch is not taken, add one cycle.
-     * Else add zero cycles.
-     */
     bool branch_taken = true;
     uint16_t prior_pc = this->PC.read();
     uint16_t addr;
     switch (next_op) {
-        /** Break **/
+        /** Break and return from interrupt **/
         CASE(0x00, this->i_brk());
+        CASE(0x40, this->i_rti());
 
         /** Store instructions */
         CASE(0x85, this->i_sta(this->next_code_byte()));        // STA (zp)
@@ -118,9 +606,19 @@ int Cpu::emu_step() {
         /** Load instructions **/
         CASE(0xA2, this->i_ldx(this->next_code_byte()));  // LDX (imm)
         CASE(0xA9, this->i_lda(this->next_code_byte()));  // LDA (imm)
+        CASE(0xA5, this->i_lda_mem(this->next_code_byte()));      // LDA (zp)
+        CASE(0xAD, this->i_lda_mem(this->next_two_code_bytes())); // LDA (abs)
 
         /** Increment/decrement instructions **/
         CASE(0xCA, this->i_dex());
+        CASE(0xC8, this->i_iny());
+
+        /** Flag instructions **/
+        CASE(0x18, this->i_clc());
+
+        /** Arithmetic instructions **/
+        CASE(0x69, this->i_adc(this->next_code_byte()));  // ADC (imm)
+        CASE(0xE9, this->i_sbc(this->next_code_byte()));  // SBC (imm)
 
         /** Branch instructions **/
         CASE(0x10, branch_taken = this->i_bpl(this->next_code_byte()));
@@ -136,6 +634,31 @@ int Cpu::emu_step() {
         CASE(0xE0, this->i_cpx(this->next_code_byte()));  // CPX (imm)
         CASE(0xC9, this->i_cmp(this->next_code_byte()));  // CMP (imm)
 
+        /** Subroutines **/
+        CASE(0x20,  // JSR (abs)
+             addr = this->next_two_code_bytes();
+             this->i_jsr(addr, this->PC.read());
+             if (this->memo) {
+                 n_cycles += this->memo->on_call(*this);
+             }
+        );
+        CASE(0x60, this->i_rts());
+
+        /** Host calls **/
+        case HOST_CALL_OPCODE: {
+            const uint8_t number = this->next_code_byte();
+            HostCall* handler = number < this->host_calls.size()
+                                ? this->host_calls[number] : NULL;
+            if (!handler) {
+                if (this->trace) {
+                    *this->out << "No handler for host call " << (int) number
+                              << std::endl;
+                }
+                return -1;
+            }
+            n_cycles += handler->call(*this, number);
+        } break;
+
         /** ORA instruction **/
         CASE(0x01,  // ORA (indx)
              addr = from_base_offset(this->next_code_byte(), this->X.read());
@@ -165,37 +688,38 @@ int Cpu::emu_step() {
         );
 
         default:
-            std::cerr << "Unimplemented opcode 0x" << std::hex << (int) next_op
-                      << std::dec << std::endl
-                      << "  -- instruction " << op_info.name << std::endl;
+            if (this->trace) {
+                *this->out << "Unimplemented opcode 0x" << std::hex << (int) next_op
+                          << std::dec << std::endl
+                          << "  -- instruction " << op_info.name << std::endl;
+            }
             return -1;
     }
 
-    /* If a branch is not taken and a page boundary is crossed, add two cycles.
-     * Else if the branch is not taken, add one cycle.
-     * Else add zero cycles.
-     */
-    if (!branch_taken && (op_info.has_name("bpl")
-                          || op_info.has_name("bmi")
-                          || op_info.has_name("bvc")
-                          || op_info.has_name("bvs")
-                          || op_info.has_name("bcc")
-                          || op_info.has_name("bcs")
-                          || op_info.has_name("bne")
-                          || op_info.has_name("beq"))) {
-        uint16_t current_pc = this->PC.read();
-        if ((prior_pc & 0xFF00) != (current_pc & 0xFF00)) {
-            extra_cycles = 2;
-        } else {
-            extra_cycles = 1;
+    if (op_info.address_mode == REL) {
+        // prior_pc is the branch's operand, so the next instruction is just past it
+        extra_cycles = branch_extra_cycles(branch_taken, prior_pc + 1, this->PC.read());
+    }
+
+#ifdef MOS6502_COVERAGE
+    if (this->coverage) {
+        this->coverage->mark_executed(op_addr);
+        if (op_info.address_mode == REL) {
+            this->coverage->mark_branch(op_addr, branch_taken);
         }
     }
+#endif
 
-    if (extra_cycles != 0) {
-        this->out << "-- Added " << extra_cycles << " extra cycles";
+    if (extra_cycles != 0 && this->trace) {
+        *this->out << "-- Added " << extra_cycles << " extra cycles";
     }
 
-    return n_cycles + extra_cycles;
+    this->cycles += n_cycles + extra_cycles;
+    this->instructions += 1;
+    if (this->memo && next_op == 0x60) {
+        this->memo->on_return(*this);
+    }
+    return interrupt_cycles + n_cycles + extra_cycles;
 }
 
 /* Push the given value to the top of the stack */
@@ -304,50 +828,101 @@ void Cpu::i_bit(const int8_t val) {
 
 void Cpu::i_adc(const int8_t val) {
     if (this->P.has_bcd()) {
-        throw "BCD mode not implemented";
+        this->_adc_decimal(val);
+        return;
+    }
+    const bool signs_differ = (this->A.read() ^ val) & 0x80;
+    const int16_t carry = this->P.has_carry() ? 1 : 0;
+    const int16_t sum = _add_signed(this->A.read(), val, carry);
+    this->A.write(sum & 0xFF);
+
+    this->_set_zero_and_neg_flags(this->A.read());
+
+    /* if the signs of the inputs were the same, and if the sum has
+     * a different sign than the inputs, then set the overflow bit
+     */
+    if (!signs_differ && (sum & 0x80) != (val & 0x80)) {
+        this->P.set_overflow();
     } else {
-        const bool signs_differ = (this->A.read() ^ val) & 0x80;
-        const int16_t carry = this->P.has_carry() ? 1 : 0;
-        const int16_t sum = _add_signed(this->A.read(), val, carry);
-        this->A.write(sum & 0xFF);
-
-        this->_set_zero_and_neg_flags(this->A.read());
-
-        /* if the signs of the inputs were the same, and if the sum has
-         * a different sign than the inputs, then set the overflow bit
-         */
-        if (!signs_differ && (sum & 0x80) != (val & 0x80)) {
-            this->P.set_overflow();
-        } else {
-            this->P.clear_overflow();
-        }
+        this->P.clear_overflow();
+    }
+
+    this->_set_addition_carry_flag(sum);
+}
 
-        this->_set_addition_carry_flag(sum);
+/* Decimal mode ADC as the NMOS 6502 does it: Z comes from the binary sum,
+ * N and V from the sum after the low digit is adjusted but before the high
+ * one is, and C from the decimal result */
+void Cpu::_adc_decimal(const uint8_t val) {
+    const uint8_t a = this->A.read();
+    const int carry = this->P.has_carry() ? 1 : 0;
+    const bool binary_zero = ((a + val + carry) & 0xFF) == 0;
+
+    int low = (a & 0x0F) + (val & 0x0F) + carry;
+    if (low >= 0x0A) {
+        low = ((low + 0x06) & 0x0F) + 0x10;
+    }
+    int sum = (a & 0xF0) + (val & 0xF0) + low;
+    if (sum & 0x80) {
+        this->P.set_negative();
+    } else {
+        this->P.clear_negative();
+    }
+    if (~(a ^ val) & (a ^ sum) & 0x80) {
+        this->P.set_overflow();
+    } else {
+        this->P.clear_overflow();
+    }
+    if (sum >= 0xA0) {
+        sum += 0x60;
+    }
+    if (sum >= 0x100) {
+        this->P.set_carry();
+    } else {
+        this->P.clear_carry();
     }
+    if (binary_zero) {
+        this->P.set_zero();
+    } else {
+        this->P.clear_zero();
+    }
+    this->A.write(sum & 0xFF);
 }
 
 void Cpu::i_sbc(const int8_t val) {
-    if (this->P.has_bcd()) {
-        throw "BCD mode not implemented";
+    const uint8_t a = this->A.read();
+    const int borrow = this->P.has_carry() ? 0 : 1;
+    const bool signs_differ = (this->A.read() ^ val) & 0x80;
+    const int16_t not_carry = this->P.has_carry() ? 0 : 1;
+    const int16_t diff = _add_signed(this->A.read(), -val, -not_carry);
+    this->A.write(diff & 0xFF);
+
+    this->_set_zero_and_neg_flags(this->A.read());
+
+    /* subtraction flips the sign of the second operand, so if the
+     * signs of the inputs were different, and if the difference
+     * has the same sign as the second input, then set the overflow bit
+     */
+    if (signs_differ && (diff & 0x80) == (val & 0x80)) {
+        this->P.set_overflow();
     } else {
-        const bool signs_differ = (this->A.read() ^ val) & 0x80;
-        const int16_t not_carry = this->P.has_carry() ? 0 : 1;
-        const int16_t diff = _add_signed(this->A.read(), -val, -not_carry);
-        this->A.write(diff & 0xFF);
-
-        this->_set_zero_and_neg_flags(this->A.read());
-
-        /* subtraction flips the sign of the second operand, so if the
-         * signs of the inputs were different, and if the difference
-         * has the same sign as the second input, then set the overflow bit
-         */
-        if (signs_differ && (diff & 0x80) == (val & 0x80)) {
-            this->P.set_overflow();
-        } else {
-            this->P.clear_overflow();
-        }
+        this->P.clear_overflow();
+    }
 
-        this->_set_subtraction_carry_flag(diff);
+    this->_set_subtraction_carry_flag(diff);
+
+    // the NMOS 6502 sets every flag from the binary difference in decimal
+    // mode too, and only adjusts the result
+    if (this->P.has_bcd()) {
+        int low = (a & 0x0F) - ((uint8_t) val & 0x0F) - borrow;
+        if (low < 0) {
+            low = ((low - 0x06) & 0x0F) - 0x10;
+        }
+        int result = (a & 0xF0) - ((uint8_t) val & 0xF0) + low;
+        if (result < 0) {
+            result -= 0x60;
+        }
+        this->A.write(result & 0xFF);
     }
 }
 
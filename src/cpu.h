@@ -3,10 +3,13 @@
 
 #include <iostream>
 #include <stdio.h>
+#include <string>
 #include <vector>
+#include <memory>
 #include "reg.h"
 #include "mem.h"
 #include "nullstream.h"
+#include "opcodes.h"
 
 inline int16_t _add_signed(int16_t a, int16_t b, int16_t c) {
     return a + b + c;
@@ -17,18 +20,283 @@ inline address_t from_base_offset(const address_t base,
     return base + offset;
 }
 
+/* Why Cpu::emu_loop returned */
+enum StopReason {
+    STOP_BRK,                   // a BRK instruction was executed
+    STOP_INVALID_OPCODE,        // unknown or unimplemented instruction
+    STOP_CYCLE_LIMIT,           // ran for max_cycles
+    STOP_INSTRUCTION_LIMIT,     // ran for max_instructions
+    STOP_WRITE_PROTECT,         // wrote to a shared page set to SHARED_TRAP
+    STOP_REPEATED_STATE,        // came back to an earlier state (run_cpu only)
+    STOP_DEVICE_STALL           // a device read threw DeviceStall
+};
+
+const char* stop_reason_to_string(StopReason reason);
+
+/* See Cpu::reset */
+enum ResetMode {
+    RESET_POWER_ON,     // as if newly constructed: registers, counters, memory
+    RESET_WARM,         // the RESET line: jump through the reset vector
+    RESET_REGISTERS,    // registers and counters as if new; memory is kept
+};
+
+/* An interrupt the Cpu takes before an instruction */
+enum Interrupt {
+    INTERRUPT_NONE,
+    INTERRUPT_IRQ,
+    INTERRUPT_NMI,
+};
+
+/* Stands between a Cpu and its interrupt lines (see Cpu::set_interrupt_tap),
+ * to watch which interrupts are taken or to decide in their place */
+class InterruptTap {
+public:
+    virtual ~InterruptTap() { }
+
+    /* Called before every instruction with the interrupt the lines call for
+     * (often none). Returns the interrupt to take. */
+    virtual Interrupt tap_interrupt(Interrupt pending) = 0;
+};
+
+/* Something, like a device's timer, that needs to act at a given cycle
+ * (see Cpu::schedule) */
+class CycleEvent {
+public:
+    virtual ~CycleEvent() { }
+
+    /* Called before the first instruction that starts at or after the cycle
+     * the event was scheduled for, which is passed in */
+    virtual void on_cycle(uint64_t cycle) = 0;
+};
+
+/* State kept outside the Cpu, such as a device's registers, that has to be
+ * saved and put back along with the Cpu to take a run back to an earlier
+ * point (see TimeTravel::add_state) */
+class SavesState {
+public:
+    virtual ~SavesState() { }
+    virtual void save_state(std::string& state) const = 0;
+    virtual void restore_state(const std::string& state) = 0;
+};
+
+class Coverage;
+class Cpu;
+class SubroutineMemo;
+
+/* Native code standing in for a 6502 routine, run by the HCL instruction
+ * (see Cpu::set_host_call) */
+class HostCall {
+public:
+    virtual ~HostCall() { }
+
+    /* Do the routine's work on cpu's registers and memory; the PC is past
+     * the HCL. Returns the cycles the routine takes, which are charged on
+     * top of the 2 for the HCL itself. */
+    virtual int call(Cpu& cpu, uint8_t number) = 0;
+};
+
 class Cpu {
 public:
     static const address_t STACK_BOTTOM = 0x0100;
+    /* NMI, reset and IRQ vectors live at 0xFFFA - 0xFFFF. Code can't be
+     * loaded over them. */
+    static const address_t VECTORS_START = 0xFFFA;
+    static const address_t NMI_VECTOR = 0xFFFA;
+    static const address_t RESET_VECTOR = 0xFFFC;
+    static const address_t IRQ_VECTOR = 0xFFFE;
 
     /* All messages are printed to the given out_stream. By default, output is
      * disabled. Pass in std::cout or std::cerr or an ofstream to put the
      * output where you want.
+     *
+     * Without an out_stream, nothing is traced at all, so no time is spent
+     * formatting messages nobody will read.
+     *
+     * Use MEM_SPARSE when running many Cpus that each touch little memory
+     * (see Mem).
      */
-    Cpu(std::ostream& out_stream = NULLSTREAM) : out(out_stream) {
+    explicit Cpu(MemModel mem_model = MEM_DENSE)
+        : mem(mem_model), cycles(0), instructions(0), irq_line(false),
+          nmi_pending(false), interrupt_tap(NULL), coverage(NULL), memo(NULL),
+          step_addr(0), fusion(true), idle_skip(true), next_event_cycle(NO_EVENT),
+          outside_activity(0), idle_activity(NO_EVENT),
+          out(&NULLSTREAM),
+          trace(false) {
         this->S.write(0xFF);
+        this->idle_start = this->save_registers();
     }
 
+    explicit Cpu(std::ostream& out_stream, MemModel mem_model = MEM_DENSE)
+        : mem(mem_model), cycles(0), instructions(0), irq_line(false),
+          nmi_pending(false), interrupt_tap(NULL), coverage(NULL), memo(NULL),
+          step_addr(0), fusion(true), idle_skip(true), next_event_cycle(NO_EVENT),
+          outside_activity(0), idle_activity(NO_EVENT),
+          out(&out_stream),
+          trace(true) {
+        this->S.write(0xFF);
+        this->idle_start = this->save_registers();
+    }
+
+    /* Trace to out_stream from now on */
+    void set_output(std::ostream& out_stream) {
+        this->out = &out_stream;
+        this->trace = true;
+    }
+
+    /* Stop tracing */
+    void clear_output() {
+        this->out = &NULLSTREAM;
+        this->trace = false;
+    }
+
+    /* Get the Cpu ready to run again without constructing a new one:
+     *
+     *  RESET_POWER_ON      the state of a new Cpu with the same memory model.
+     *                      Memory is cleared lazily, a page at a time as
+     *                      pages are next written, so this is cheap however
+     *                      much memory was used.
+     *  RESET_WARM          what the 6502 does on RESET: load the PC from the
+     *                      reset vector at $FFFC, set I and move S down by
+     *                      three, taking 7 cycles. Memory, A, X and Y are
+     *                      kept.
+     *  RESET_REGISTERS     the registers and counters of a new Cpu, keeping
+     *                      memory, e.g. to run a loaded program again.
+     *
+     * Every mode drops a pending NMI, and all but RESET_WARM release the
+     * IRQ line. The trace output and interrupt tap aren't changed.
+     */
+    void reset(ResetMode mode);
+
+    /* The interrupt lines, for devices to drive.
+     *
+     * IRQ is level triggered: while the line is held and the I flag is
+     * clear, the Cpu takes an IRQ before its next instruction, so a device
+     * must release the line once the handler has dealt with it. NMI is edge
+     * triggered: each call to nmi() is taken once, before the next
+     * instruction, whatever the I flag.
+     *
+     * Taking an interrupt pushes the PC and P (with B clear), sets I and
+     * jumps through NMI_VECTOR or IRQ_VECTOR, adding 7 cycles to the
+     * instruction that follows.
+     */
+    void set_irq(bool held) { this->irq_line = held; }
+    void nmi() { this->nmi_pending = true; }
+
+    /* Decide interrupts through tap (NULL to go by the lines alone) */
+    void set_interrupt_tap(InterruptTap* tap) { this->interrupt_tap = tap; }
+
+    /* Mark each instruction executed from now on in coverage, or stop
+     * marking with NULL. Does nothing unless Coverage::ENABLED. */
+    void set_coverage(Coverage* coverage) { this->coverage = coverage; }
+
+    /* Skip calls to the pure subroutines declared in memo when it has
+     * already seen the same inputs, or stop memoizing with NULL. Any
+     * reset, or a change of memo, throws away a call being recorded. The
+     * memo must be set to NULL before it or this Cpu is destroyed. */
+    void set_memo(SubroutineMemo* memo);
+
+    /* Let emu_loop run common pairs and triples of instructions, like
+     * DEX; BNE, as one fused step, with one dispatch instead of one each.
+     * On by default. The result is exactly the same as without fusion:
+     * it's skipped while tracing, marking coverage or tapping interrupts,
+     * and a fused step stops after any instruction where a limit is reached
+     * or an interrupt becomes due, as emu_loop would. */
+    void set_fusion(bool enabled) { this->fusion = enabled; }
+    bool fusion_enabled() const { return this->fusion; }
+
+    /* HCL #n, which takes an opcode slot the 6502 leaves unused, runs
+     * handler->call(cpu, n) in place of emulated code, so a hot routine
+     * like a multiply can be replaced with native code while keeping its
+     * cycle count. A handler whose result depends on anything outside the
+     * Cpu should pass it through InputRecorder::host_call, so the run can be
+     * replayed. HCL with no handler (NULL) stops emu_loop with
+     * STOP_INVALID_OPCODE. Resets keep the handlers. */
+    static const uint8_t HOST_CALL_OPCODE = 0x22;
+    void set_host_call(uint8_t number, HostCall* handler);
+    void clear_host_calls() { this->host_calls.clear(); }
+
+    static const uint64_t NO_EVENT = (uint64_t) -1;
+
+    /* Call event->on_cycle before the first instruction that starts at or
+     * after cycle, replacing any cycle the event was already scheduled for.
+     * Events due at the same cycle run in the order they were scheduled.
+     * Every reset but RESET_WARM drops scheduled events. */
+    void schedule(CycleEvent* event, uint64_t cycle);
+    void cancel(CycleEvent* event);
+
+    /* The cycle the next event is due at, or NO_EVENT */
+    uint64_t next_event() const { return this->next_event_cycle; }
+
+    /* Whether nothing outside the program can change what it does next: no
+     * devices, scheduled events, interrupt tap or interrupts waiting */
+    bool is_closed() const {
+        return this->mem.n_devices() == 0 && this->next_event_cycle == NO_EVENT
+               && !this->interrupt_tap && !this->irq_line && !this->nmi_pending;
+    }
+
+    /* Let emu_loop fast-forward idle loops, on by default.
+     *
+     * An idle loop is a short loop ending in a branch back to its start,
+     * like LDA $status; BEQ loop, that reads no devices and doesn't write
+     * anything it reads. Once a pass round it leaves the registers as they
+     * were, with no interrupt or event in between, every later pass will be
+     * the same until an event or interrupt changes something. So emu_loop
+     * skips straight to the last pass that ends before the next event or
+     * the run's limits, adding the cycles and instructions of the passes
+     * skipped. Nothing is skipped while tracing, tapping interrupts, or
+     * while memory is observed or profiled, nor when no event or limit
+     * would ever end the loop. */
+    void set_idle_skip(bool enabled) { this->idle_skip = enabled; }
+    bool idle_skip_enabled() const { return this->idle_skip; }
+
+    /* The registers and counts of a Cpu. With its Pending state and its
+     * memory, that is everything about it. */
+    struct Registers {
+        uint8_t A, X, Y, S, P;
+        uint16_t PC;
+        uint64_t cycles;
+        uint64_t instructions;
+    };
+
+    Registers save_registers() const {
+        Registers r = { this->A.read(), this->X.read(), this->Y.read(),
+                        this->S.read(), this->P.read(), this->PC.read(),
+                        this->cycles, this->instructions };
+        return r;
+    }
+
+    void restore_registers(const Registers& r) {
+        this->A.write(r.A);
+        this->X.write(r.X);
+        this->Y.write(r.Y);
+        this->S.write(r.S);
+        this->P.write(r.P);
+        this->PC.write(r.PC);
+        this->cycles = r.cycles;
+        this->instructions = r.instructions;
+    }
+
+    struct ScheduledEvent {
+        uint64_t cycle;
+        CycleEvent* event;
+    };
+
+    /* What is waiting to happen to a Cpu: its IRQ line, an NMI not taken
+     * yet and its scheduled events */
+    struct Pending {
+        bool irq_line;
+        bool nmi_pending;
+        std::vector<ScheduledEvent> events;
+    };
+
+    Pending save_pending() const;
+
+    /* Put back the pending state, replacing the scheduled events. The events
+     * themselves keep the state they have now. */
+    void restore_pending(const Pending& pending);
+
+    friend class SubroutineMemo;
+
     friend std::ostream& operator<<(std::ostream& o, const Cpu& cpu) {
         return o
             << "A: " << cpu.A
@@ -43,9 +311,45 @@ public:
     /* Load the given code at the given address */
     void load_code(const std::vector<uint8_t>& code, address_t addr = 0x0600);
 
+    /* Link an assembled program (anything with a link_into method, like an
+     * Assembler or an AssemblyCache::Entry) straight into memory at the
+     * given address. This skips the copies through relocate_code and
+     * load_code. A sparse Mem has no single buffer to link into, so the
+     * program is relocated and then copied in. */
+    template <typename Program>
+    void load_program(const Program& program, address_t addr = 0x0600) {
+        if (this->mem.dense_data()) {
+            program.link_into(addr, this->mem.dense_data(), VECTORS_START);
+        } else {
+            std::vector<uint8_t> code;
+            program.relocate_code(addr, code);
+            Cpu::check_fits(code.size(), addr);
+            this->mem.write_block(addr, code.data(), code.size());
+        }
+        this->PC.write(addr);
+    }
+
+    /* Link a program into an image that any number of Cpus can map with
+     * load_shared, rather than each of them holding a copy */
+    template <typename Program>
+    static std::shared_ptr<const SharedImage> link_shared(const Program& program,
+                                                          address_t addr = 0x0600) {
+        std::vector<uint8_t> code;
+        program.relocate_code(addr, code);
+        Cpu::check_fits(code.size(), addr);
+        return SharedImage::create(addr, code.data(), code.size());
+    }
+
+    /* Map a shared image into memory and point the PC at it. Writes to its
+     * pages follow mem's SharedWrites policy. */
+    void load_shared(const std::shared_ptr<const SharedImage>& image) {
+        this->mem.map_image(image);
+        this->PC.write(image->start());
+    }
+
     /* Return the byte of code at the PC, and increment the PC */
     uint8_t next_code_byte() {
-        uint8_t result = this->mem.read_8(this->PC.read());
+        uint8_t result = this->mem.fetch_8(this->PC.read());
         this->PC.add(1);
         return result;
     }
@@ -57,16 +361,48 @@ public:
     }
 
     uint8_t peek_code_byte() {
-        return this->mem.read_8(this->PC.read());
+        return this->mem.peek_8(this->PC.read());
     }
 
-    uint8_t peek_two_code_bytes() const {
-        uint16_t lo = this->mem.read_8(this->PC.read());
-        uint16_t hi = this->mem.read_8(this->PC.read() + 1);
+    uint16_t peek_two_code_bytes() const {
+        uint16_t lo = this->mem.peek_8(this->PC.read());
+        uint16_t hi = this->mem.peek_8(this->PC.read() + 1);
         return ((hi << 8) & 0xff00) | (lo & 0xff);
     }
 
-    void emu_loop();
+    /* Whether the indexed address of the instruction whose operand is at PC
+     * is on a different page from its base address */
+    bool index_crosses_page(AddressMode mode) const {
+        uint16_t base;
+        uint8_t index;
+        if (mode == ABSX || mode == ABSY) {
+            base = this->peek_two_code_bytes();
+            index = mode == ABSX ? this->X.read() : this->Y.read();
+        } else if (mode == INDY) {
+            const uint8_t zp = this->mem.peek_8(this->PC.read());
+            base = this->mem.peek_8(zp) | (this->mem.peek_8(zp + 1) << 8);
+            index = this->Y.read();
+        } else {
+            return false;
+        }
+        return crosses_page(base, base + index);
+    }
+
+    /* Run until a BRK or an invalid instruction, or until max_cycles or
+     * max_instructions have run (zero means no limit). The limits count
+     * from the start of this call.
+     *
+     * A write to a trapping shared page stops the run part way through the
+     * instruction, with STOP_WRITE_PROTECT. A device read that throws
+     * DeviceStall stops it before the instruction, with STOP_DEVICE_STALL.
+     */
+    StopReason emu_loop(uint64_t max_cycles = 0, uint64_t max_instructions = 0);
+
+    /* Emulate a single instruction, after taking any interrupt that is due,
+     * and return the number of cycles it took, or -1 if the instruction
+     * isn't supported. Throws WriteProtectError on a write to a trapping
+     * shared page, and lets DeviceStall through with the PC part way
+     * through the instruction. */
     int emu_step();
 
     /** STACK OPERATIONS **/
@@ -180,6 +516,7 @@ public:
      *      CPY - compare a value to Y
      */
     void i_adc(const int8_t val);
+    void _adc_decimal(const uint8_t val);
     void i_sbc(const int8_t val);
     void _do_compare(const int8_t a, const int8_t b);
     inline void i_cmp(const int8_t val) { this->_do_compare(this->A.read(), val); }
@@ -351,8 +688,68 @@ public:
     Reg_16 PC;
 
     Mem mem;
+
+    /* Totals over the life of the Cpu, updated by emu_step */
+    uint64_t cycles;
+    uint64_t instructions;
 private:
-    std::ostream& out;
+    /* Throw std::invalid_argument if size bytes of code at addr would run
+     * into the vectors */
+    static void check_fits(size_t size, address_t addr);
+
+    /* Take the interrupt that is due, if any, and return the cycles taken */
+    int take_interrupt();
+
+    /* Run the fused idiom at the PC (see set_fusion), as far as the budgets
+     * allow, and return the cycles taken, or 0 if there's no idiom there */
+    int emu_fused(uint64_t cycle_budget, uint64_t instruction_budget);
+
+    /* Count one instruction of a fused idiom, and return whether the next
+     * one may run as part of it */
+    bool end_fused_step(int n_cycles, int& total, uint64_t& cycle_budget,
+                        uint64_t& instruction_budget);
+
+    /* A BNE in a fused idiom. Returns its cycles. */
+    int fused_bne();
+
+    /* Run the events that are due */
+    void run_events();
+    void update_next_event();
+
+    /* Called when the branch at branch_addr has been taken a short way
+     * back, with the PC at the start of the loop. Skips passes round the
+     * loop if it's idle (see set_idle_skip), as far as the cycle and
+     * instruction deadlines allow. */
+    void skip_idle(address_t branch_addr, uint64_t cycle_deadline,
+                   uint64_t instruction_deadline);
+
+    /* Whether the loop from head to the branch at branch_addr, which closes
+     * it, can only be idle */
+    bool is_idle_loop(address_t head, address_t branch_addr) const;
+
+    bool irq_line;
+    bool nmi_pending;
+    InterruptTap* interrupt_tap;
+    Coverage* coverage;
+    SubroutineMemo* memo;
+    address_t step_addr;    // where the last instruction run started
+    std::vector<HostCall*> host_calls;      // by number, or empty for none
+    bool fusion;
+    bool idle_skip;
+
+    std::vector<ScheduledEvent> events;     // in the order they were scheduled
+    uint64_t next_event_cycle;
+
+    /* Counts interrupts taken and events run, which are the only things
+     * that can change what an idle loop sees */
+    uint64_t outside_activity;
+
+    /* The pass round a loop that skip_idle is watching */
+    Registers idle_start;
+    uint64_t idle_activity;
+
+    std::ostream* out;
+    bool trace;
 };
 
 #endif // CPU_H
@@ -0,0 +1,44 @@
+#include "cpu_pool.h"
+
+CpuPool::~CpuPool() {
+    for (size_t i = 0; i < this->free_cpus.size(); ++i) {
+        delete this->free_cpus[i];
+    }
+}
+
+Cpu* CpuPool::acquire() {
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (!this->free_cpus.empty()) {
+            Cpu* cpu = this->free_cpus.back();
+            this->free_cpus.pop_back();
+            return cpu;
+        }
+    }
+    return new Cpu(this->mem_model);
+}
+
+void CpuPool::release(Cpu* cpu) {
+    // reset outside the lock, so threads giving Cpus back don't wait
+    cpu->reset(RESET_POWER_ON);
+    cpu->clear_output();
+    cpu->set_coverage(NULL);
+    cpu->set_memo(NULL);
+    cpu->set_interrupt_tap(NULL);
+    cpu->mem.set_device_tap(NULL);
+    cpu->clear_host_calls();
+    cpu->set_fusion(true);
+    cpu->set_idle_skip(true);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->free_cpus.size() < this->max_idle) {
+        this->free_cpus.push_back(cpu);
+    } else {
+        delete cpu;
+    }
+}
+
+size_t CpuPool::idle() const {
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->free_cpus.size();
+}
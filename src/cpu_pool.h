@@ -0,0 +1,60 @@
+#ifndef CPU_POOL_H
+#define CPU_POOL_H
+
+#include <mutex>
+#include <vector>
+#include "cpu.h"
+
+/* Hands out ready to run Cpus, reusing the ones that are given back rather
+ * than constructing new ones. A Cpu from the pool is in the state of a new
+ * Cpu of the pool's memory model, with no trace output. Returned Cpus are
+ * reset with RESET_POWER_ON, which only costs something for the pages the
+ * Cpu used (see Mem::clear), and lose everything attached to them: host
+ * calls, coverage, memo, interrupt and device taps, and the fusion and idle
+ * skip settings go back to their defaults. A memo attached to a Cpu must
+ * still be alive when the Cpu is given back, since the reset abandons it.
+ *
+ * A pool can be shared between threads.
+ */
+class CpuPool {
+public:
+    /* Holds a Cpu from the pool, and gives it back when it goes away */
+    class Lease {
+    public:
+        explicit Lease(CpuPool& pool) : pool(pool), cpu(pool.acquire()) { }
+        ~Lease() { this->pool.release(this->cpu); }
+
+        Cpu& operator*() const { return *this->cpu; }
+        Cpu* operator->() const { return this->cpu; }
+
+    private:
+        Lease(const Lease&);
+        Lease& operator=(const Lease&);
+
+        CpuPool& pool;
+        Cpu* cpu;
+    };
+
+    /* Keep at most max_idle Cpus that aren't in use */
+    explicit CpuPool(MemModel mem_model = MEM_DENSE, size_t max_idle = 64)
+        : mem_model(mem_model), max_idle(max_idle) { }
+
+    ~CpuPool();
+
+    Cpu* acquire();
+    void release(Cpu* cpu);
+
+    /* The number of Cpus waiting to be handed out */
+    size_t idle() const;
+
+private:
+    CpuPool(const CpuPool&);
+    CpuPool& operator=(const CpuPool&);
+
+    mutable std::mutex lock;
+    MemModel mem_model;
+    size_t max_idle;
+    std::vector<Cpu*> free_cpus;
+};
+
+#endif // CPU_POOL_H
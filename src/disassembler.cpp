@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cstring>
+#include "disassembler.h"
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static inline char* put_hex_8(uint8_t val, char* p) {
+    p[0] = HEX_DIGITS[val >> 4];
+    p[1] = HEX_DIGITS[val & 0x0f];
+    return p + 2;
+}
+
+static inline char* put_hex_16(uint16_t val, char* p) {
+    return put_hex_8(val & 0xff, put_hex_8(val >> 8, p));
+}
+
+static inline char* put_str(const char* s, size_t len, char* p) {
+    std::memcpy(p, s, len);
+    return p + len;
+}
+
+#define PUT_LITERAL(s, p) put_str((s), sizeof(s) - 1, (p))
+
+/* Orders (address, name) pairs by address only, for searching */
+static bool address_less(const std::pair<uint16_t, std::string>& a,
+                         const std::pair<uint16_t, std::string>& b) {
+    return a.first < b.first;
+}
+
+Disassembler::Disassembler() : has_label(LABEL_BITS_SIZE, 0), max_label_len(0) {
+    for (int i = 0; i < OPS_SIZE; ++i) {
+        Decoded& op = this->ops[i];
+        const bool valid = !OPS[i].is_null();
+        std::memcpy(op.name, OPS[i].name, sizeof(op.name));
+        op.name[sizeof(op.name) - 1] = '\0';
+        op.name_len = std::strlen(op.name);
+        op.n_bytes = valid ? OPS[i].n_bytes : 0;
+        op.address_mode = OPS[i].address_mode;
+    }
+}
+
+void Disassembler::set_labels(const std::map<std::string, uint16_t>& labels,
+                              uint16_t base_addr) {
+    std::fill(this->has_label.begin(), this->has_label.end(), 0);
+    this->sorted_labels.clear();
+    this->sorted_labels.reserve(labels.size());
+    this->max_label_len = 0;
+
+    std::map<std::string, uint16_t>::const_iterator it;
+    for (it = labels.begin(); it != labels.end(); ++it) {
+        uint16_t addr = it->second + base_addr;
+        this->has_label[addr >> 3] |= 1 << (addr & 7);
+        this->sorted_labels.push_back(std::make_pair(addr, it->first));
+        this->max_label_len = std::max(this->max_label_len, it->first.size());
+    }
+    std::stable_sort(this->sorted_labels.begin(), this->sorted_labels.end(),
+                     address_less);
+}
+
+const std::string* Disassembler::label_for(uint16_t addr) const {
+    if (!(this->has_label[addr >> 3] & (1 << (addr & 7)))) {
+        return NULL;
+    }
+    std::vector<std::pair<uint16_t, std::string> >::const_iterator it =
+        std::lower_bound(this->sorted_labels.begin(), this->sorted_labels.end(),
+                         std::make_pair(addr, std::string()), address_less);
+    return &it->second;
+}
+
+/* Write a label name if there is one, otherwise $ followed by the address */
+char* Disassembler::write_address(uint16_t addr, int n_digits, char* p) const {
+    const std::string* label = this->label_for(addr);
+    if (label) {
+        return put_str(label->data(), label->size(), p);
+    }
+    *p++ = '$';
+    if (n_digits == 2) {
+        return put_hex_8(addr & 0xff, p);
+    }
+    return put_hex_16(addr, p);
+}
+
+char* Disassembler::write_operand(const Decoded& op, const uint8_t* args,
+                                  size_t addr, char* p) const {
+    const uint16_t arg_16 = args[0] | (args[1] << 8);
+    switch (op.address_mode) {
+        case ACC:
+            return PUT_LITERAL(" A", p);
+        case IMM:
+            return put_hex_8(args[0], PUT_LITERAL(" #$", p));
+        case ZP:
+            return this->write_address(args[0], 2, PUT_LITERAL(" ", p));
+        case ZPX:
+            p = this->write_address(args[0], 2, PUT_LITERAL(" ", p));
+            return PUT_LITERAL(",X", p);
+        case ZPY:
+            p = this->write_address(args[0], 2, PUT_LITERAL(" ", p));
+            return PUT_LITERAL(",Y", p);
+        case ABS:
+            return this->write_address(arg_16, 4, PUT_LITERAL(" ", p));
+        case ABSX:
+            p = this->write_address(arg_16, 4, PUT_LITERAL(" ", p));
+            return PUT_LITERAL(",X", p);
+        case ABSY:
+            p = this->write_address(arg_16, 4, PUT_LITERAL(" ", p));
+            return PUT_LITERAL(",Y", p);
+        case IND:
+            p = this->write_address(arg_16, 4, PUT_LITERAL(" (", p));
+            return PUT_LITERAL(")", p);
+        case INDX:
+            p = this->write_address(args[0], 2, PUT_LITERAL(" (", p));
+            return PUT_LITERAL(",X)", p);
+        case INDY:
+            p = this->write_address(args[0], 2, PUT_LITERAL(" (", p));
+            return PUT_LITERAL("),Y", p);
+        case REL: {
+            // the displacement is from the address after the branch (see
+            // Cpu::_do_branch)
+            uint16_t target = addr + op.n_bytes + (int8_t) args[0];
+            return this->write_address(target, 4, PUT_LITERAL(" ", p));
+        }
+        case IMP:
+        default:
+            return p;
+    }
+}
+
+char* Disassembler::write_instruction(const uint8_t* mem, size_t addr,
+                                      size_t end, int& n_bytes, char* p) const {
+    const Decoded& op = this->ops[mem[addr]];
+    if (op.n_bytes == 0 || addr + op.n_bytes > end) {
+        n_bytes = 1;
+        return put_hex_8(mem[addr], PUT_LITERAL(".byte $", p));
+    }
+
+    n_bytes = op.n_bytes;
+    p = put_str(op.name, op.name_len, p);
+    // BRK is 2 bytes, but its padding byte isn't an operand
+    if (op.n_bytes > 1 && op.address_mode != IMP) {
+        uint8_t args[2] = { mem[addr + 1], 0 };
+        if (op.n_bytes > 2) {
+            args[1] = mem[addr + 2];
+        }
+        p = this->write_operand(op, args, addr, p);
+    } else if (op.address_mode == ACC) {
+        p = PUT_LITERAL(" A", p);
+    }
+    return p;
+}
+
+int Disassembler::disassemble_one(const uint8_t* mem, size_t addr, size_t end,
+                                  std::string& out) const {
+    const size_t pos = out.size();
+    out.resize(pos + this->max_line_len());
+    int n_bytes;
+    char* p = this->write_instruction(mem, addr, end, n_bytes, &out[pos]);
+    out.resize(p - out.data());
+    return n_bytes;
+}
+
+size_t Disassembler::disassemble(const uint8_t* mem, size_t start, size_t end,
+                                 std::string& out) const {
+    // Lines are written through a raw cursor. The buffer is grown whenever
+    // there may not be room for one more line, then trimmed at the end.
+    size_t pos = out.size();
+    out.resize(pos + (end - start) * 16 + this->max_line_len());
+
+    size_t n_instructions = 0;
+    size_t addr = start;
+    while (addr < end) {
+        const uint16_t addr_16 = addr & 0xffff;
+        size_t labels_len = 0;
+        std::vector<std::pair<uint16_t, std::string> >::const_iterator first_label =
+            this->sorted_labels.end();
+        if (this->has_label[addr_16 >> 3] & (1 << (addr_16 & 7))) {
+            first_label = std::lower_bound(this->sorted_labels.begin(),
+                                           this->sorted_labels.end(),
+                                           std::make_pair(addr_16, std::string()),
+                                           address_less);
+            std::vector<std::pair<uint16_t, std::string> >::const_iterator it;
+            for (it = first_label; it != this->sorted_labels.end()
+                                   && it->first == addr_16; ++it) {
+                labels_len += it->second.size() + 2;
+            }
+        }
+        if (out.size() - pos < labels_len + this->max_line_len()) {
+            out.resize(2 * out.size() + labels_len + this->max_line_len());
+        }
+        char* const line = &out[pos];
+        char* p = line;
+
+        for (; first_label != this->sorted_labels.end()
+               && first_label->first == addr_16; ++first_label) {
+            p = put_str(first_label->second.data(), first_label->second.size(), p);
+            p = PUT_LITERAL(":\n", p);
+        }
+
+        // address and raw bytes, padded so that the mnemonics line up
+        p = PUT_LITERAL("  ", put_hex_16(addr_16, p));
+        const Decoded& op = this->ops[mem[addr]];
+        const size_t n_bytes =
+            (op.n_bytes == 0 || addr + op.n_bytes > end) ? 1 : op.n_bytes;
+        char* const bytes_start = p;
+        std::memset(bytes_start, ' ', 10);
+        for (size_t i = 0; i < n_bytes; ++i, p += 3) {
+            put_hex_8(mem[addr + i], p);
+        }
+        p = bytes_start + 10;
+
+        int n_decoded;
+        p = this->write_instruction(mem, addr, end, n_decoded, p);
+        *p++ = '\n';
+
+        addr += n_decoded;
+        pos += p - line;
+        ++n_instructions;
+    }
+    out.resize(pos);
+    return n_instructions;
+}
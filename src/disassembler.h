@@ -0,0 +1,78 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "opcodes.h"
+
+/* Turns memory back into assembly, one line per instruction:
+ *
+ *      0600  a2 08     LDX #$08
+ *      decrement:
+ *      0602  ca        DEX
+ *
+ * Decoding is driven entirely by the OPS table (n_bytes and address_mode).
+ * Bytes that don't decode to an instruction are written as ".byte $xx".
+ *
+ * Output is appended to a caller-owned string, so one buffer can be reused
+ * across calls without any per-instruction allocation. Lines are formatted
+ * by hand rather than through iostreams, so whole 64K memory images can be
+ * decoded inline by trace and profiler tools.
+ */
+class Disassembler {
+public:
+    Disassembler();
+
+    /* Use names from labels in place of addresses. Labels from the Assembler
+     * are relative to the start of the code, so give the address the code
+     * was loaded at as base_addr. */
+    void set_labels(const std::map<std::string, uint16_t>& labels,
+                    uint16_t base_addr = 0);
+
+    /* Disassemble the instructions in mem[start, end) and append them to out.
+     * mem is indexed by address. Returns the number of instructions decoded.
+     */
+    size_t disassemble(const uint8_t* mem, size_t start, size_t end,
+                       std::string& out) const;
+
+    /* Disassemble the single instruction at mem[addr], without the address
+     * and bytes columns. Returns the size of the instruction in bytes. */
+    int disassemble_one(const uint8_t* mem, size_t addr, size_t end,
+                        std::string& out) const;
+
+    /* Returns NULL if there is no label at the address */
+    const std::string* label_for(uint16_t addr) const;
+
+private:
+    static const size_t LABEL_BITS_SIZE = 0x10000 / 8;
+
+    /* The parts of OPS needed for decoding, flattened so that the hot loop
+     * doesn't go through OpInfo's string comparisons */
+    struct Decoded {
+        char name[4];
+        uint8_t name_len;
+        uint8_t n_bytes;        // zero if the opcode isn't an instruction
+        AddressMode address_mode;
+    };
+
+    /* Upper bound on the length of one line, excluding label definitions */
+    size_t max_line_len() const { return 32 + this->max_label_len; }
+
+    /* These write at p and return the position after what was written */
+    char* write_instruction(const uint8_t* mem, size_t addr, size_t end,
+                            int& n_bytes, char* p) const;
+    char* write_operand(const Decoded& op, const uint8_t* args, size_t addr,
+                        char* p) const;
+    char* write_address(uint16_t addr, int n_digits, char* p) const;
+
+    /* has_label is a bitmap over the address space, so the common case of an
+     * operand without a label never has to search the sorted labels */
+    Decoded ops[OPS_SIZE];
+    std::vector<uint8_t> has_label;
+    std::vector<std::pair<uint16_t, std::string> > sorted_labels;
+    size_t max_label_len;
+};
+
+#endif // DISASSEMBLER_H
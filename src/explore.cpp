@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include "coverage.h"
+#include "explore.h"
+#include "state_hash.h"
+
+/* Hands out the input a path was given, once; after that a read stalls */
+class InputPort : public MemDevice {
+public:
+    explicit InputPort(address_t addr) : addr(addr), pending(false), value(0) { }
+
+    uint8_t read(address_t addr) {
+        if (addr != this->addr) {
+            return 0;
+        }
+        if (!this->pending) {
+            throw DeviceStall();
+        }
+        this->pending = false;
+        return this->value;
+    }
+
+    void write(address_t, uint8_t) { }
+
+    address_t addr;
+    bool pending;
+    uint8_t value;
+};
+
+/* A state that paths continue from, with the inputs that led to it */
+struct Fork {
+    explicit Fork(const Mem& mem) : mem(mem) { }
+
+    Mem mem;
+    Cpu::Registers registers;
+    uint64_t page_hashes[Mem::N_PAGES];
+    std::vector<uint8_t> inputs;
+};
+
+/* A path: the fork it starts from and its next input, or the start itself
+ * when value is negative */
+struct Task {
+    std::shared_ptr<const Fork> fork;
+    int value;
+};
+
+struct TaskQueue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+};
+
+/* What each worker thread runs paths on */
+struct Worker {
+    explicit Worker(address_t input_addr)
+        : cpu(MEM_SPARSE), port(input_addr), hash(cpu) { }
+
+    Cpu cpu;
+    InputPort port;
+    StateHash hash;
+    Coverage coverage;
+};
+
+class Exploration {
+public:
+    Exploration(const Cpu& start, const ExploreOptions& options);
+
+    ExploreResult run();
+
+private:
+    void work(size_t id);
+
+    /* The next task from the back of queue id, or else stolen from the
+     * front of another queue */
+    bool take(size_t id, Task& task);
+
+    void run_path(Worker& worker, const Task& task, size_t id);
+
+    const ExploreOptions& options;
+    std::vector<uint8_t> alphabet;
+    std::vector<std::unique_ptr<TaskQueue> > queues;
+
+    /* Tasks queued or running; the search is over when there are none */
+    std::atomic<uint64_t> outstanding;
+    StateSet visited;
+
+    std::mutex reached_lock;
+    std::vector<std::vector<uint8_t> > reached;
+    std::atomic<uint64_t> n_runs, n_forks, n_pruned, n_ended, n_cut_off;
+};
+
+Exploration::Exploration(const Cpu& start, const ExploreOptions& options)
+    : options(options), alphabet(options.alphabet), outstanding(0), n_runs(0),
+      n_forks(0), n_pruned(0), n_ended(0), n_cut_off(0) {
+    if (options.has_target && !Coverage::ENABLED) {
+        throw std::invalid_argument("exploring for a target needs coverage");
+    }
+    if (this->alphabet.empty()) {
+        for (int value = 0; value < 256; ++value) {
+            this->alphabet.push_back(value);
+        }
+    }
+    const size_t n_threads = std::max(1u, options.n_threads);
+    for (size_t i = 0; i < n_threads; ++i) {
+        this->queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+    }
+
+    std::shared_ptr<Fork> root(new Fork(start.mem));
+    root->mem.share_pages();
+    root->registers = start.save_registers();
+    Task task = { root, -1 };
+    this->queues[0]->tasks.push_back(task);
+    this->outstanding = 1;
+}
+
+ExploreResult Exploration::run() {
+    if (this->queues.size() == 1) {
+        this->work(0);
+    } else {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < this->queues.size(); ++i) {
+            threads.push_back(std::thread(&Exploration::work, this, i));
+        }
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+    }
+
+    ExploreResult result;
+    result.reached.swap(this->reached);
+    std::sort(result.reached.begin(), result.reached.end());
+    result.n_runs = this->n_runs;
+    result.n_forks = this->n_forks;
+    result.n_pruned = this->n_pruned;
+    result.n_ended = this->n_ended;
+    result.n_cut_off = this->n_cut_off;
+    return result;
+}
+
+void Exploration::work(size_t id) {
+    Worker worker(this->options.input_addr);
+    if (this->options.has_target) {
+        worker.cpu.set_coverage(&worker.coverage);
+    }
+    Task task;
+    while (this->outstanding > 0) {
+        if (!this->take(id, task)) {
+            std::this_thread::yield();
+            continue;
+        }
+        this->run_path(worker, task, id);
+        task.fork.reset();
+        --this->outstanding;
+    }
+}
+
+bool Exploration::take(size_t id, Task& task) {
+    {
+        TaskQueue& own = *this->queues[id];
+        std::lock_guard<std::mutex> hold(own.lock);
+        if (!own.tasks.empty()) {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < this->queues.size(); ++i) {
+        TaskQueue& other = *this->queues[(id + i) % this->queues.size()];
+        std::lock_guard<std::mutex> hold(other.lock);
+        if (!other.tasks.empty()) {
+            task = other.tasks.front();
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Exploration::run_path(Worker& worker, const Task& task, size_t id) {
+    const Fork& fork = *task.fork;
+    Cpu& cpu = worker.cpu;
+    cpu.mem = fork.mem;
+    cpu.mem.map_device(this->options.input_addr >> 8, 1, &worker.port);
+    cpu.restore_registers(fork.registers);
+    if (task.value < 0) {
+        worker.hash.rehash();
+    } else {
+        worker.hash.restore(fork.page_hashes);
+    }
+    worker.port.pending = task.value >= 0;
+    worker.port.value = task.value;
+
+    std::vector<uint8_t> inputs(fork.inputs);
+    if (task.value >= 0) {
+        inputs.push_back(task.value);
+    }
+
+    ++this->n_runs;
+    const StopReason reason = cpu.emu_loop(0, this->options.max_instructions);
+    if (this->options.has_target && worker.coverage.was_executed(this->options.target)) {
+        worker.coverage.clear();
+        std::lock_guard<std::mutex> hold(this->reached_lock);
+        this->reached.push_back(inputs);
+        return;
+    }
+    if (reason == STOP_INSTRUCTION_LIMIT) {
+        ++this->n_cut_off;
+        return;
+    } else if (reason != STOP_DEVICE_STALL) {
+        ++this->n_ended;
+        return;
+    }
+    if (inputs.size() >= this->options.max_inputs) {
+        ++this->n_cut_off;
+        return;
+    }
+    // the same state with fewer inputs left can't go as far, so the number
+    // of inputs is part of the key
+    const uint64_t key = worker.hash.state() ^ (inputs.size() * 0x9e3779b97f4a7c15ULL);
+    if (!this->visited.insert(key)) {
+        ++this->n_pruned;
+        return;
+    }
+
+    // the fork's paths share what this path wrote, and copy what they write
+    ++this->n_forks;
+    cpu.mem.share_pages();
+    std::shared_ptr<Fork> next(new Fork(cpu.mem));
+    next->registers = cpu.save_registers();
+    std::copy(worker.hash.pages(), worker.hash.pages() + Mem::N_PAGES,
+              next->page_hashes);
+    next->inputs.swap(inputs);
+
+    // queued so the first value is taken first
+    this->outstanding += this->alphabet.size();
+    TaskQueue& own = *this->queues[id];
+    std::lock_guard<std::mutex> hold(own.lock);
+    for (size_t i = this->alphabet.size(); i-- > 0; ) {
+        Task path = { next, this->alphabet[i] };
+        own.tasks.push_back(path);
+    }
+}
+
+ExploreResult explore(const Cpu& start, const ExploreOptions& options) {
+    Exploration exploration(start, options);
+    return exploration.run();
+}
@@ -0,0 +1,78 @@
+#ifndef EXPLORE_H
+#define EXPLORE_H
+
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include "cpu.h"
+
+struct ExploreOptions {
+    ExploreOptions()
+        : input_addr(0xd000), max_inputs(8), max_instructions(1000000),
+          n_threads(std::thread::hardware_concurrency()), has_target(false),
+          target(0) { }
+
+    /* Reads of input_addr are the program's inputs. The whole page is
+     * given over to the input port; the rest of it reads as zero. */
+    address_t input_addr;
+
+    /* The values each input can take, or empty for all 256 */
+    std::vector<uint8_t> alphabet;
+
+    /* Inputs per path; a path that asks for more is cut off there */
+    size_t max_inputs;
+
+    /* Instructions a path can run between two inputs (zero means no
+     * limit); a path that runs longer is cut off there */
+    uint64_t max_instructions;
+
+    unsigned n_threads;
+
+    /* Look for the paths that execute an instruction at target. A path
+     * ends as soon as it reaches the target. Needs Coverage::ENABLED. */
+    bool has_target;
+    address_t target;
+};
+
+struct ExploreResult {
+    ExploreResult() : n_runs(0), n_forks(0), n_pruned(0), n_ended(0),
+                      n_cut_off(0) { }
+
+    /* The inputs of each path that reached the target, sorted */
+    std::vector<std::vector<uint8_t> > reached;
+
+    uint64_t n_runs;        // runs between inputs
+    uint64_t n_forks;       // input reads that forked a path
+    uint64_t n_pruned;      // input reads in a state already explored
+    uint64_t n_ended;       // paths that stopped on their own (BRK, ...)
+    uint64_t n_cut_off;     // paths stopped by max_inputs or max_instructions
+};
+
+/* Explore every sequence of inputs a program can be given, from start's
+ * state.
+ *
+ * Each path runs until the program reads the input port, which stalls the
+ * Cpu before the reading instruction (see DeviceStall). The state there is
+ * saved as a fork, and one new path per value of the alphabet continues
+ * from it, each running the read again with its own value.
+ *
+ * Paths are tasks on a pool of worker threads. Each worker pushes the paths
+ * it forks onto its own deque and takes its next path from the back, so
+ * each worker searches depth first through memory it has just used; a
+ * worker whose deque is empty steals from the front of another's, taking
+ * the oldest, largest subtrees. The pages written on the way to a fork
+ * are shared by all its paths, and by their forks in turn (see
+ * Mem::share_pages), so with a MEM_SPARSE start a path only copies the
+ * pages it writes itself.
+ *
+ * A fork whose registers and memory (by StateHash) have been seen before,
+ * on any worker, is pruned: every path from it would repeat one already
+ * explored. So each reached input sequence stands for all the others that
+ * lead to the same states.
+ *
+ * start must not have devices mapped, and nothing else may use it while
+ * exploring. Throws std::invalid_argument for a target without coverage.
+ */
+ExploreResult explore(const Cpu& start, const ExploreOptions& options);
+
+#endif // EXPLORE_H
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include "framebuffer.h"
+
+const uint8_t Framebuffer::PALETTE[16][3] = {
+    { 0x00, 0x00, 0x00 }, { 0xff, 0xff, 0xff }, { 0x88, 0x00, 0x00 },
+    { 0xaa, 0xff, 0xee }, { 0xcc, 0x44, 0xcc }, { 0x00, 0xcc, 0x55 },
+    { 0x00, 0x00, 0xaa }, { 0xee, 0xee, 0x77 }, { 0xdd, 0x88, 0x55 },
+    { 0x66, 0x44, 0x00 }, { 0xff, 0x77, 0x77 }, { 0x33, 0x33, 0x33 },
+    { 0x77, 0x77, 0x77 }, { 0xaa, 0xff, 0x66 }, { 0x00, 0x88, 0xff },
+    { 0xbb, 0xbb, 0xbb },
+};
+
+Framebuffer::Framebuffer(Cpu& cpu, uint64_t interval, address_t addr,
+                         unsigned width, unsigned height)
+    : cpu(cpu), interval(0), addr(addr), frame_width(width),
+      frame_height(height), size(width * height), changed(true), back(0),
+      front(1), middle(2), n_published(0) {
+    if (this->size == 0 || addr + this->size > Mem::MEM_SIZE) {
+        throw std::invalid_argument("framebuffer doesn't fit in memory");
+    }
+    this->first_page = addr >> 8;
+    this->n_pages = ((addr + this->size - 1) >> 8) - this->first_page + 1;
+    for (int i = 0; i < 3; ++i) {
+        this->slots[i].width = width;
+        this->slots[i].height = height;
+        this->slots[i].pixels.resize(this->size);
+        this->dirty[i].assign(this->n_pages, true);
+    }
+    this->cpu.mem.add_observer(this);
+    this->set_interval(interval);
+}
+
+Framebuffer::~Framebuffer() {
+    this->cpu.cancel(this);
+    this->cpu.mem.remove_observer(this);
+}
+
+void Framebuffer::set_interval(uint64_t interval) {
+    this->interval = interval;
+    if (interval) {
+        this->cpu.schedule(this, this->cpu.cycles + interval);
+    } else {
+        this->cpu.cancel(this);
+    }
+}
+
+bool Framebuffer::publish() {
+    if (!this->changed) {
+        return false;
+    }
+    Frame& frame = this->slots[this->back];
+    std::vector<bool>& dirty = this->dirty[this->back];
+    const Mem& mem = this->cpu.mem;
+    for (size_t page = 0; page < this->n_pages; ++page) {
+        if (!dirty[page]) {
+            continue;
+        }
+        dirty[page] = false;
+        const size_t start = std::max<size_t>(this->addr, (this->first_page + page) << 8);
+        const size_t end = std::min<size_t>(this->addr + this->size,
+                                            (this->first_page + page + 1) << 8);
+        for (size_t a = start; a < end; ++a) {
+            frame.pixels[a - this->addr] = mem.peek_8(a);
+        }
+    }
+    frame.number = this->n_published++;
+    frame.cycle = this->cpu.cycles;
+    this->changed = false;
+
+    // hand the back slot over, and carry on with the one that was waiting
+    this->back = this->middle.exchange(this->back | FRESH, std::memory_order_acq_rel)
+                 & ~FRESH;
+    return true;
+}
+
+const Frame* Framebuffer::take_frame() {
+    if (!(this->middle.load(std::memory_order_relaxed) & FRESH)) {
+        return NULL;
+    }
+    this->front = this->middle.exchange(this->front, std::memory_order_acq_rel)
+                  & ~FRESH;
+    return &this->slots[this->front];
+}
+
+void Framebuffer::on_write(address_t addr, uint8_t old_value, uint8_t new_value) {
+    if (addr < this->addr || addr >= this->addr + this->size || old_value == new_value) {
+        return;
+    }
+    const size_t page = (addr >> 8) - this->first_page;
+    for (int i = 0; i < 3; ++i) {
+        this->dirty[i][page] = true;
+    }
+    this->changed = true;
+}
+
+void Framebuffer::on_cycle(uint64_t cycle) {
+    this->publish();
+    this->cpu.schedule(this, cycle + this->interval);
+}
+
+void Framebuffer::write_ppm(std::ostream& out, const Frame& frame) {
+    out << "P6\n" << frame.width << " " << frame.height << "\n255\n";
+    std::vector<char> rgb(frame.pixels.size() * 3);
+    for (size_t i = 0; i < frame.pixels.size(); ++i) {
+        const uint8_t* color = PALETTE[frame.pixels[i] & 0x0f];
+        rgb[i * 3] = color[0];
+        rgb[i * 3 + 1] = color[1];
+        rgb[i * 3 + 2] = color[2];
+    }
+    out.write(rgb.data(), rgb.size());
+}
+
+FrameDumper::FrameDumper(Framebuffer& framebuffer, const std::string& prefix)
+    : framebuffer(framebuffer), prefix(prefix), stopping(false), n_written(0),
+      n_failed(0), thread(&FrameDumper::run, this) { }
+
+FrameDumper::~FrameDumper() {
+    this->stop();
+}
+
+void FrameDumper::stop() {
+    if (!this->thread.joinable()) {
+        return;
+    }
+    this->stopping = true;
+    this->thread.join();
+}
+
+void FrameDumper::run() {
+    while (!this->stopping) {
+        if (!this->write_frame()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    // the last frame may have been published after we last looked
+    this->write_frame();
+}
+
+bool FrameDumper::write_frame() {
+    const Frame* frame = this->framebuffer.take_frame();
+    if (!frame) {
+        return false;
+    }
+    char number[32];
+    std::snprintf(number, sizeof(number), "%06llu", (unsigned long long) frame->number);
+    std::ofstream f((this->prefix + number + ".ppm").c_str(),
+                    std::ios::out | std::ios::binary);
+    if (!f.is_open()) {
+        ++this->n_failed;
+        return true;
+    }
+    Framebuffer::write_ppm(f, *frame);
+    if (f) {
+        ++this->n_written;
+    } else {
+        ++this->n_failed;
+    }
+    return true;
+}
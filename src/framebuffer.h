@@ -0,0 +1,116 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include "cpu.h"
+
+/* A picture of the framebuffer at some cycle: one byte per pixel, a row at
+ * a time, with the low 4 bits picking a color from the palette */
+struct Frame {
+    Frame() : number(0), cycle(0), width(0), height(0) { }
+
+    uint64_t number;    // counts up from 0 as frames are published
+    uint64_t cycle;
+    unsigned width, height;
+    std::vector<uint8_t> pixels;
+};
+
+/* Watches a region of a Cpu's memory that a program draws into, easy6502
+ * style: 32x32 pixels from $0200 to $05ff by default, a byte each.
+ *
+ * Every interval cycles (by a CycleEvent, so nothing happens in between) the
+ * region is published as a Frame, if it has been written since the last
+ * one. Frames go through a triple buffer: the Cpu's thread fills the back
+ * slot and swaps it with the middle one, and a reader on another thread
+ * swaps the middle slot for its front one when it wants the latest frame.
+ * Both swaps are a single atomic exchange, so neither side ever waits for
+ * the other; if the reader falls behind, it skips to the newest frame.
+ *
+ * Writes to the region are followed as a MemObserver, which marks the pages
+ * they land in dirty for every slot, and a slot being filled only copies the
+ * pages that changed since it was last filled. Resets of the Cpu drop its
+ * scheduled events, so call set_interval again after one.
+ */
+class Framebuffer : private MemObserver, private CycleEvent {
+public:
+    Framebuffer(Cpu& cpu, uint64_t interval, address_t addr = 0x0200,
+                unsigned width = 32, unsigned height = 32);
+    ~Framebuffer();
+
+    /* Publish every interval cycles from now, or only on publish() when
+     * interval is zero */
+    void set_interval(uint64_t interval);
+
+    /* Publish the region now, if it has changed. Returns true if it had. */
+    bool publish();
+
+    /* For the reader's thread: the newest frame published since the last
+     * call, or NULL if there isn't one. The frame stays valid until the
+     * next call. */
+    const Frame* take_frame();
+
+    uint64_t frames_published() const { return this->n_published; }
+
+    unsigned width() const { return this->frame_width; }
+    unsigned height() const { return this->frame_height; }
+
+    /* The easy6502 palette, as RGB */
+    static const uint8_t PALETTE[16][3];
+
+    /* Write frame as a binary PPM */
+    static void write_ppm(std::ostream& out, const Frame& frame);
+
+private:
+    void on_write(address_t addr, uint8_t old_value, uint8_t new_value);
+    void on_cycle(uint64_t cycle);
+
+    static const unsigned FRESH = 4;    // with the middle slot: not taken yet
+
+    Cpu& cpu;
+    uint64_t interval;
+    address_t addr;
+    unsigned frame_width, frame_height;
+    size_t size;
+    size_t first_page, n_pages;
+
+    Frame slots[3];
+    std::vector<bool> dirty[3];     // pages changed since each slot was filled
+    bool changed;                   // since the last frame was published
+    unsigned back, front;
+    std::atomic<unsigned> middle;
+    uint64_t n_published;
+};
+
+/* Writes the frames of a Framebuffer to PPM files on a thread of its own,
+ * named <prefix>000000.ppm, <prefix>000001.ppm, ... by frame number. Frames
+ * published faster than they can be written are skipped. */
+class FrameDumper {
+public:
+    FrameDumper(Framebuffer& framebuffer, const std::string& prefix);
+
+    /* Calls stop() */
+    ~FrameDumper();
+
+    /* Write the newest frame, if it hasn't been, and end the thread */
+    void stop();
+
+    uint64_t frames_written() const { return this->n_written; }
+    uint64_t frames_failed() const { return this->n_failed; }
+
+private:
+    void run();
+    bool write_frame();
+
+    Framebuffer& framebuffer;
+    std::string prefix;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> n_written, n_failed;
+    std::thread thread;
+};
+
+#endif // FRAMEBUFFER_H
@@ -0,0 +1,184 @@
+#include <cstring>
+#include <sstream>
+#include "byte_io.h"
+#include "input_log.h"
+
+static const char MAGIC[4] = { 'M', '6', '5', 'I' };
+static const uint32_t FORMAT_VERSION = 1;
+
+static bool has_value(InputKind kind) {
+    return kind == INPUT_DEVICE_READ || kind == INPUT_HOST_CALL;
+}
+
+std::string InputLog::data() const {
+    std::string buf;
+    buf.reserve(12 + 6 * this->events.size());
+    buf.append(MAGIC, sizeof(MAGIC));
+    put_u32(buf, FORMAT_VERSION);
+    put_u32(buf, this->events.size());
+
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    for (size_t i = 0; i < this->events.size(); ++i) {
+        const InputEvent& e = this->events[i];
+        buf.push_back((char) e.kind);
+        put_varint(buf, e.instructions - instructions);
+        put_varint(buf, e.cycles - cycles);
+        if (has_value(e.kind)) {
+            put_u16(buf, e.addr);
+            buf.push_back((char) e.value);
+        }
+        instructions = e.instructions;
+        cycles = e.cycles;
+    }
+    return buf;
+}
+
+bool InputLog::load(const std::string& buf) {
+    this->events.clear();
+    ByteReader r(buf);
+    const char* magic = r.take(sizeof(MAGIC));
+    if (!magic || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+            || r.u32() != FORMAT_VERSION) {
+        return false;
+    }
+
+    const uint32_t n = r.u32();
+    std::vector<InputEvent> events;
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    for (uint32_t i = 0; i < n && r.ok; ++i) {
+        InputEvent e = { INPUT_DEVICE_READ, 0, 0, 0, 0 };
+        const uint8_t kind = r.u8();
+        if (kind < INPUT_DEVICE_READ || kind > INPUT_HOST_CALL) {
+            return false;
+        }
+        e.kind = (InputKind) kind;
+        instructions += r.varint();
+        cycles += r.varint();
+        e.instructions = instructions;
+        e.cycles = cycles;
+        if (has_value(e.kind)) {
+            e.addr = r.u16();
+            e.value = r.u8();
+        }
+        events.push_back(e);
+    }
+    if (!r.at_end()) {
+        return false;
+    }
+    this->events.swap(events);
+    return true;
+}
+
+InputRecorder::InputRecorder(Cpu& cpu, InputLog& log) : cpu(cpu), log(log) {
+    this->cpu.mem.set_device_tap(this);
+    this->cpu.set_interrupt_tap(this);
+}
+
+InputRecorder::~InputRecorder() {
+    this->cpu.mem.set_device_tap(NULL);
+    this->cpu.set_interrupt_tap(NULL);
+}
+
+void InputRecorder::add(InputKind kind, address_t addr, uint8_t value) {
+    InputEvent e = { kind, this->cpu.instructions, this->cpu.cycles, addr, value };
+    this->log.events.push_back(e);
+}
+
+uint8_t InputRecorder::tap_read(MemDevice* device, address_t addr) {
+    const uint8_t value = device->read(addr);
+    this->add(INPUT_DEVICE_READ, addr, value);
+    return value;
+}
+
+void InputRecorder::tap_write(MemDevice* device, address_t addr, uint8_t value) {
+    device->write(addr, value);
+}
+
+Interrupt InputRecorder::tap_interrupt(Interrupt pending) {
+    if (pending != INTERRUPT_NONE) {
+        this->add(pending == INTERRUPT_NMI ? INPUT_NMI : INPUT_IRQ, 0, 0);
+    }
+    return pending;
+}
+
+uint8_t InputRecorder::host_call(address_t addr, uint8_t result) {
+    this->add(INPUT_HOST_CALL, addr, result);
+    return result;
+}
+
+static const char* kind_name(InputKind kind) {
+    switch (kind) {
+        case INPUT_DEVICE_READ: return "device read";
+        case INPUT_IRQ: return "IRQ";
+        case INPUT_NMI: return "NMI";
+        case INPUT_HOST_CALL: return "host call";
+        default: return "unknown input";
+    }
+}
+
+static void describe(std::ostream& out, InputKind kind, address_t addr,
+                     uint64_t instructions, uint64_t cycles) {
+    out << kind_name(kind);
+    if (has_value(kind)) {
+        out << " of 0x" << std::hex << addr << std::dec;
+    }
+    out << " at instruction " << instructions << ", cycle " << cycles;
+}
+
+InputReplayer::InputReplayer(Cpu& cpu, const InputLog& log)
+        : cpu(cpu), log(log), next(0) {
+    this->cpu.mem.set_device_tap(this);
+    this->cpu.set_interrupt_tap(this);
+}
+
+InputReplayer::~InputReplayer() {
+    this->cpu.mem.set_device_tap(NULL);
+    this->cpu.set_interrupt_tap(NULL);
+}
+
+const InputEvent& InputReplayer::take(InputKind kind, address_t addr) {
+    const InputEvent* e = this->finished() ? NULL : &this->log.events[this->next];
+    if (!e || e->kind != kind || e->addr != addr
+            || e->instructions != this->cpu.instructions
+            || e->cycles != this->cpu.cycles) {
+        std::ostringstream msg;
+        msg << "Replay diverged: ";
+        describe(msg, kind, addr, this->cpu.instructions, this->cpu.cycles);
+        if (e) {
+            msg << ", but the log has ";
+            describe(msg, e->kind, e->addr, e->instructions, e->cycles);
+        } else {
+            msg << ", past the end of the log";
+        }
+        throw ReplayError(msg.str());
+    }
+    ++this->next;
+    return *e;
+}
+
+uint8_t InputReplayer::tap_read(MemDevice*, address_t addr) {
+    return this->take(INPUT_DEVICE_READ, addr).value;
+}
+
+void InputReplayer::tap_write(MemDevice*, address_t, uint8_t) {
+}
+
+Interrupt InputReplayer::tap_interrupt(Interrupt) {
+    if (this->finished()) {
+        return INTERRUPT_NONE;
+    }
+    const InputEvent& e = this->log.events[this->next];
+    if ((e.kind != INPUT_IRQ && e.kind != INPUT_NMI)
+            || e.instructions > this->cpu.instructions) {
+        return INTERRUPT_NONE;
+    }
+    // an interrupt we've run past throws here
+    this->take(e.kind, 0);
+    return e.kind == INPUT_NMI ? INTERRUPT_NMI : INTERRUPT_IRQ;
+}
+
+uint8_t InputReplayer::host_call(address_t addr, uint8_t) {
+    return this->take(INPUT_HOST_CALL, addr).value;
+}
@@ -0,0 +1,122 @@
+#ifndef INPUT_LOG_H
+#define INPUT_LOG_H
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "cpu.h"
+
+/* The things that can make two runs of the same program differ */
+enum InputKind {
+    INPUT_DEVICE_READ = 1,  // a MemDevice returned value for a read of addr
+    INPUT_IRQ = 2,          // the Cpu took an IRQ
+    INPUT_NMI = 3,          // the Cpu took an NMI
+    INPUT_HOST_CALL = 4,    // host code returned value for call number addr
+};
+
+struct InputEvent {
+    InputKind kind;
+    uint64_t instructions;  // Cpu::instructions and Cpu::cycles as the
+    uint64_t cycles;        // instruction it happened in started
+    address_t addr;         // device reads and host calls only
+    uint8_t value;
+};
+
+/* The inputs of one run, in the order they happened, serialized as:
+ *
+ *      "M65I"                  magic
+ *      u32                     FORMAT_VERSION
+ *      u32                     n_events
+ *      n_events * (u8 kind, varint instructions, varint cycles,
+ *                  [u16 addr, u8 value])
+ *
+ * where the stamps count from the previous event and addr and value are
+ * only there for device reads and host calls. Events are usually close
+ * together, so most take five or six bytes.
+ */
+class InputLog {
+public:
+    /* The serialized log, ready to be written to a file */
+    std::string data() const;
+
+    /* Use a previously written log. Returns false (leaving this log empty)
+     * if buf isn't a valid log. */
+    bool load(const std::string& buf);
+
+    std::vector<InputEvent> events;
+};
+
+/* Records the inputs of a Cpu into a log while it runs.
+ *
+ * Device reads go to the devices as usual and the values they return are
+ * logged. Interrupts are logged as they are taken, so an IRQ held while the
+ * I flag is set isn't an input until the Cpu acts on it.
+ *
+ * The recorder takes over the Cpu's device and interrupt taps until it is
+ * destroyed.
+ */
+class InputRecorder : private DeviceTap, private InterruptTap {
+public:
+    InputRecorder(Cpu& cpu, InputLog& log);
+    ~InputRecorder();
+
+    /* Log the result of a call out to host code, and return it */
+    uint8_t host_call(address_t addr, uint8_t result);
+
+private:
+    uint8_t tap_read(MemDevice* device, address_t addr);
+    void tap_write(MemDevice* device, address_t addr, uint8_t value);
+    Interrupt tap_interrupt(Interrupt pending);
+
+    void add(InputKind kind, address_t addr, uint8_t value);
+
+    Cpu& cpu;
+    InputLog& log;
+};
+
+/* Thrown by InputReplayer when the run asks for an input other than the
+ * next one in the log */
+class ReplayError : public std::runtime_error {
+public:
+    explicit ReplayError(const std::string& message)
+        : std::runtime_error(message) { }
+};
+
+/* Feeds a recorded log back into a Cpu, so it repeats the recorded run
+ * exactly: same memory, registers and cycle counts at every instruction.
+ *
+ * The Cpu must start as the recorded one did and have the same address
+ * ranges mapped to devices, but the devices themselves are never used:
+ * reads get the logged values, writes are dropped, and interrupts are
+ * taken where the log says, whatever the interrupt lines are doing.
+ *
+ * If the run goes differently (a different program, say, or a different
+ * engine build that doesn't match the one that recorded), the first input
+ * that doesn't match the log throws ReplayError out of Cpu::emu_loop.
+ */
+class InputReplayer : private DeviceTap, private InterruptTap {
+public:
+    InputReplayer(Cpu& cpu, const InputLog& log);
+    ~InputReplayer();
+
+    /* The logged result of a call out to host code; result is ignored */
+    uint8_t host_call(address_t addr, uint8_t result);
+
+    /* Whether every event in the log has been replayed */
+    bool finished() const { return this->next == this->log.events.size(); }
+
+private:
+    uint8_t tap_read(MemDevice* device, address_t addr);
+    void tap_write(MemDevice* device, address_t addr, uint8_t value);
+    Interrupt tap_interrupt(Interrupt pending);
+
+    /* The next event, which must be one of kind for addr happening now */
+    const InputEvent& take(InputKind kind, address_t addr);
+
+    Cpu& cpu;
+    const InputLog& log;
+    size_t next;
+};
+
+#endif // INPUT_LOG_H
@@ -3,37 +3,323 @@
 #include "cpu.h"
 #include "mem.h"
 #include "assembler.h"
+#include "asm_cache.h"
+#include "runner.h"
+#include "batch.h"
+#include "mem_profile.h"
+#include "console.h"
+#include "framebuffer.h"
 
 using namespace std;
 
+void print_usage(char* prog_name) {
+    std::cerr << "Usage: " << prog_name << " [options] <filename>" << std::endl
+              << "       " << prog_name << " [options] --batch <manifest>"
+              << std::endl
+              << "  --cache-dir <dir>         reuse assembled code from <dir>"
+              << std::endl
+              << "  -q, --quiet               don't trace each instruction"
+              << std::endl
+              << "  --json                    print a one line JSON summary"
+                 " of the run" << std::endl
+              << "  --batch <manifest>        run each job in the manifest and"
+                 " print JSON results" << std::endl
+              << "  --threads <n>             run batch jobs on <n> threads"
+              << std::endl
+              << "  --coverage <file>         add the code covered to <file>"
+                 " (see asm6502 --coverage)" << std::endl
+              << "  --heatmap <file>          write a 256x256 map of memory"
+                 " accesses (.csv, or else .pgm)" << std::endl
+              << "  --watch-page <page>       count each address of <page> for"
+                 " the heatmap" << std::endl
+              << "  --working-set <file>      write pages touched per 10000"
+                 " cycles as CSV" << std::endl
+              << "  --console-out <addr>      print the bytes written to <addr>"
+              << std::endl
+              << "  --console-in <addr>       reads of <addr> take the next"
+                 " byte of stdin" << std::endl
+              << "  --frames <prefix>         write the $0200-$05ff"
+                 " framebuffer to <prefix>NNNNNN.ppm" << std::endl
+              << "  --frame-cycles <n>        cycles between frames"
+                 " (default 16667)" << std::endl
+              << "Job options:" << std::endl
+              << "  --binary                  the file is code, not source"
+              << std::endl
+              << "  --sparse-mem              allocate memory pages as they"
+                 " are written" << std::endl
+              << "  --protect-code            stop if the program writes to"
+                 " its code" << std::endl
+              << "  --detect-loops            stop if the program gets back to"
+                 " an earlier state (not with the console or frames)" << std::endl
+              << "  --max-cycles <n>          stop after <n> cycles" << std::endl
+              << "  --max-instructions <n>    stop after <n> instructions"
+              << std::endl
+              << "  --load-addr <addr>        load the code at <addr>"
+                 " (default 0x600)" << std::endl
+              << "  --reg <reg>=<value>       set A, X, Y, S, P or PC before"
+                 " running" << std::endl
+              << "  --poke <addr>=<value>     set a byte of memory before"
+                 " running" << std::endl
+              << "  --dump <start>:<end>      hex dump memory when the run ends"
+              << std::endl;
+}
+
+struct Options {
+    Options() : filename(NULL), cache_dir(NULL), batch(NULL), coverage(NULL),
+                heatmap(NULL), working_set(NULL), quiet(false), json(false),
+                has_console_out(false), has_console_in(false),
+                console_out(0), console_in(0), frames(NULL),
+                frame_cycles(16667),
+                threads(std::thread::hardware_concurrency()) { }
+
+    const char* filename;
+    const char* cache_dir;
+    const char* batch;
+    const char* coverage;
+    const char* heatmap;
+    const char* working_set;
+    std::vector<uint16_t> watch_pages;
+    bool quiet;
+    bool json;
+    bool has_console_out, has_console_in;
+    uint16_t console_out, console_in;
+    const char* frames;
+    uint64_t frame_cycles;
+    unsigned threads;
+    JobOptions job;
+};
+
+bool parse_options(int argc, char* argv[], Options& options) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ) {
+        OptionResult result = parse_job_option(args, i, options.job);
+        if (result == OPTION_BAD) {
+            return false;
+        } else if (result == OPTION_OK) {
+            continue;
+        }
+
+        const std::string& arg = args[i];
+        bool has_value = i + 1 < args.size();
+        uint64_t threads;
+        uint64_t page;
+        if (arg == "--cache-dir" && has_value) {
+            options.cache_dir = argv[i + 2];
+            i += 2;
+        } else if (arg == "--batch" && has_value) {
+            options.batch = argv[i + 2];
+            i += 2;
+        } else if (arg == "--coverage" && has_value) {
+            options.coverage = argv[i + 2];
+            i += 2;
+        } else if (arg == "--heatmap" && has_value) {
+            options.heatmap = argv[i + 2];
+            i += 2;
+        } else if (arg == "--working-set" && has_value) {
+            options.working_set = argv[i + 2];
+            i += 2;
+        } else if (arg == "--watch-page" && has_value) {
+            if (!parse_number(args[i + 1], 0xff, page)) {
+                return false;
+            }
+            options.watch_pages.push_back(page);
+            i += 2;
+        } else if (arg == "--console-out" && has_value) {
+            if (!parse_address(args[i + 1], options.console_out)) {
+                return false;
+            }
+            options.has_console_out = true;
+            i += 2;
+        } else if (arg == "--console-in" && has_value) {
+            if (!parse_address(args[i + 1], options.console_in)) {
+                return false;
+            }
+            options.has_console_in = true;
+            i += 2;
+        } else if (arg == "--frames" && has_value) {
+            options.frames = argv[i + 2];
+            i += 2;
+        } else if (arg == "--frame-cycles" && has_value) {
+            if (!parse_number(args[i + 1], UINT64_MAX, options.frame_cycles)
+                    || options.frame_cycles == 0) {
+                return false;
+            }
+            i += 2;
+        } else if (arg == "--threads" && has_value) {
+            if (!parse_number(args[i + 1], 1024, threads) || threads == 0) {
+                return false;
+            }
+            options.threads = threads;
+            i += 2;
+        } else if (arg == "-q" || arg == "--quiet") {
+            options.quiet = true;
+            ++i;
+        } else if (arg == "--json") {
+            options.json = true;
+            ++i;
+        } else if (!options.filename && arg[0] != '-') {
+            options.filename = argv[i + 1];
+            ++i;
+        } else {
+            return false;
+        }
+    }
+    if (options.batch && (options.heatmap || options.working_set
+                          || options.has_console_out || options.has_console_in
+                          || options.frames)) {
+        return false;   // profiles, the console and frames are for a single run
+    }
+    if (options.job.detect_loops && (options.has_console_out || options.has_console_in
+                                     || options.frames)) {
+        return false;   // loops can't be told from waiting on the outside
+    }
+    return (options.filename != NULL) != (options.batch != NULL);
+}
+
+/* Load the program, run it and report on the run */
+void run(Cpu& cpu, const AssemblyCache::Entry& program, const Options& options) {
+    prepare_job(cpu, program, options.job);
+    if (!options.quiet) {
+        std::cout << "Code linked at address 0x" << std::hex
+                  << options.job.load_addr << std::dec << std::endl;
+    }
+
+    Coverage coverage;
+    if (options.coverage) {
+        cpu.set_coverage(&coverage);
+    }
+    MemProfile profile(10000, &cpu.cycles);
+    for (size_t i = 0; i < options.watch_pages.size(); ++i) {
+        profile.watch_page(options.watch_pages[i]);
+    }
+    if (options.heatmap || options.working_set) {
+        cpu.mem.set_profile(&profile);
+    }
+    Console console(std::cout);
+    if (options.has_console_out) {
+        console.map_output(cpu.mem, options.console_out);
+    }
+    if (options.has_console_in) {
+        console.read_input(std::cin);
+        console.map_input(cpu.mem, options.console_in);
+    }
+    std::unique_ptr<Framebuffer> framebuffer;
+    std::unique_ptr<FrameDumper> dumper;
+    if (options.frames) {
+        framebuffer.reset(new Framebuffer(cpu, options.frame_cycles));
+        dumper.reset(new FrameDumper(*framebuffer, options.frames));
+    }
+    RunStats stats = run_cpu(cpu, options.job.max_cycles,
+                             options.job.max_instructions,
+                             options.job.detect_loops);
+    console.flush();
+    if (options.frames) {
+        framebuffer->publish();
+        dumper->stop();
+        if (dumper->frames_failed()) {
+            std::cerr << dumper->frames_failed() << " frames couldn't be written"
+                      << std::endl;
+        }
+    }
+    cpu.mem.set_profile(NULL);
+    if (options.coverage) {
+        add_coverage_to_file(options.coverage, coverage);
+    }
+    if (options.heatmap) {
+        const std::string path(options.heatmap);
+        std::ofstream f;
+        open_output(f, options.heatmap, std::ios::out | std::ios::binary);
+        if (path.size() >= 4 && path.substr(path.size() - 4) == ".csv") {
+            profile.write_heatmap_csv(f, ACCESS_ANY);
+        } else {
+            profile.write_heatmap_pgm(f, ACCESS_ANY);
+        }
+    }
+    if (options.working_set) {
+        std::ofstream f;
+        open_output(f, options.working_set);
+        profile.write_working_set_csv(f);
+    }
+
+    for (size_t i = 0; i < options.job.dumps.size(); ++i) {
+        write_memory_dump(std::cout, cpu.mem, options.job.dumps[i].first,
+                          options.job.dumps[i].second);
+    }
+    if (options.json) {
+        write_json_stats(std::cout, stats);
+        std::cout << std::endl;
+    }
+}
+
+/* Run every job in the manifest, writing one line of JSON per job.
+ * Returns 0 if every job ran, or 2 if some of them failed. */
+int run_manifest(const Options& options) {
+    std::ifstream manifest(options.batch);
+    if (!manifest.is_open()) {
+        throw std::invalid_argument(
+            std::string("File not found: '") + options.batch + "'");
+    }
+    std::string dir(options.batch);
+    size_t slash = dir.rfind('/');
+    dir = (slash == std::string::npos) ? "" : dir.substr(0, slash);
+
+    std::vector<BatchJob> jobs = read_manifest(manifest, dir);
+    Coverage coverage;
+    size_t failures = run_batch(jobs, options.threads ? options.threads : 1,
+                                options.cache_dir, std::cout,
+                                options.coverage ? &coverage : NULL);
+    if (options.coverage) {
+        add_coverage_to_file(options.coverage, coverage);
+    }
+    return failures ? 2 : 0;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Need a file as input" << std::endl;
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        print_usage(argv[0]);
         return 1;
     }
+    if (options.coverage && !Coverage::ENABLED) {
+        std::cerr << "This build can't record coverage (MOS6502_COVERAGE is off)"
+                  << std::endl;
+        return 1;
+    }
+    const char* filename = options.filename;
 
-    std::cout << "Using input file: " << argv[1] << std::endl;
     try {
-        std::ifstream src(argv[1]);
-        if (!src.is_open()) {
-            throw std::invalid_argument(
-                std::string("File not found: '") + argv[1] + "'");
+        if (options.batch) {
+            return run_manifest(options);
         }
 
-        // assemble the input file
-        Assembler assembler(src);
-        std::cout << "Code: " << assembler.get_code_hex() << std::endl;
+        if (!options.quiet) {
+            std::cout << "Using input file: " << filename << std::endl;
+        }
+        std::string text;
+        if (!read_file(filename, text)) {
+            throw std::invalid_argument(
+                std::string("File not found: '") + filename + "'");
+        }
 
-        // relocate code to the correct address
-        uint16_t addr = 0x600;
-        std::vector<uint8_t> code;
-        assembler.relocate_code(0x600, code);
-        std::cout << "Code relocated to address 0x" << std::hex << addr << std::dec
-                  << ": " << Assembler::get_code_hex(code) << std::endl;
+        // assemble the input file, or reuse the code from a previous run
+        AssemblyCache::Entry program;
+        if (build_program(text, options.job.binary, options.cache_dir, program)
+                && !options.quiet) {
+            std::cout << "Using cached code from "
+                      << AssemblyCache(options.cache_dir).path_for(
+                             AssemblyCache::hash_source(text))
+                      << std::endl;
+        }
 
-        Cpu cpu(std::cout);
-        cpu.load_code(code, addr);
-        cpu.emu_loop();
+        if (options.quiet) {
+            Cpu cpu(job_mem_model(options.job));
+            run(cpu, program, options);
+        } else {
+            std::cout << "Code: " << Assembler::get_code_hex(program.code)
+                      << std::endl;
+            Cpu cpu(std::cout, job_mem_model(options.job));
+            run(cpu, program, options);
+        }
 
     } catch (std::invalid_argument& error) {
         std::cerr << error.what() << std::endl;
@@ -0,0 +1,447 @@
+#include <algorithm>
+#include "mem.h"
+#include "mem_profile.h"
+
+const size_t PageArena::PAGE_SIZE;
+const size_t PageArena::PAGES_PER_BLOCK;
+const size_t Mem::MEM_SIZE;
+const size_t Mem::PAGE_SIZE;
+const size_t Mem::N_PAGES;
+
+// never written, because pages pointing here aren't owned
+static uint8_t ZERO_PAGE[Mem::PAGE_SIZE] = { 0 };
+
+std::shared_ptr<const SharedImage> SharedImage::create(address_t addr,
+                                                      const uint8_t* src,
+                                                      size_t n) {
+    const size_t first = addr / Mem::PAGE_SIZE;
+    const size_t last = (std::min(addr + n, Mem::MEM_SIZE) + Mem::PAGE_SIZE - 1)
+                        / Mem::PAGE_SIZE;
+    std::shared_ptr<SharedImage> image(new SharedImage());
+    image->addr = addr;
+    image->n_bytes = std::min(n, Mem::MEM_SIZE - addr);
+    image->bytes.assign((last - first) * Mem::PAGE_SIZE, 0);
+    if (image->n_bytes) {
+        std::memcpy(&image->bytes[addr % Mem::PAGE_SIZE], src, image->n_bytes);
+    }
+    return image;
+}
+
+static std::string write_protect_message(address_t addr) {
+    std::ostringstream msg;
+    msg << "Write to shared read-only page at address 0x" << std::hex << addr;
+    return msg.str();
+}
+
+WriteProtectError::WriteProtectError(address_t addr)
+        : std::runtime_error(write_protect_message(addr)), addr(addr) { }
+
+PageArena::~PageArena() {
+    for (size_t i = 0; i < this->blocks.size(); ++i) {
+        delete[] this->blocks[i];
+    }
+}
+
+uint8_t* PageArena::allocate() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->free_pages.empty()) {
+        uint8_t* block = new uint8_t[PAGE_SIZE * PAGES_PER_BLOCK];
+        this->blocks.push_back(block);
+        this->free_pages.reserve(this->free_pages.size() + PAGES_PER_BLOCK);
+        // hand out the pages in address order
+        for (size_t i = PAGES_PER_BLOCK; i > 0; --i) {
+            this->free_pages.push_back(block + (i - 1) * PAGE_SIZE);
+        }
+    }
+    uint8_t* page = this->free_pages.back();
+    this->free_pages.pop_back();
+    ++this->n_used;
+    std::memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+void PageArena::release(uint8_t* page) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->free_pages.push_back(page);
+    --this->n_used;
+}
+
+size_t PageArena::size() const {
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->n_used;
+}
+
+PageArena& PageArena::shared() {
+    // never destroyed, so Mems can outlive static destruction
+    static PageArena* arena = new PageArena();
+    return *arena;
+}
+
+Mem::Mem(MemModel model, PageArena& arena)
+        : dense(NULL), arena(&arena), shared_writes(SHARED_COPY_ON_WRITE),
+          device_tap(NULL), profile(NULL) {
+    if (model == MEM_DENSE) {
+        this->dense = new uint8_t[MEM_SIZE];
+        std::memset(this->dense, 0, MEM_SIZE);
+        for (size_t i = 0; i < N_PAGES; ++i) {
+            this->pages[i] = this->dense + i * PAGE_SIZE;
+        }
+        std::memset(this->owned, 0xff, sizeof(this->owned));
+        std::memset(this->fast_writes, 0xff, sizeof(this->fast_writes));
+    } else {
+        for (size_t i = 0; i < N_PAGES; ++i) {
+            this->pages[i] = ZERO_PAGE;
+        }
+        std::memset(this->owned, 0, sizeof(this->owned));
+        std::memset(this->fast_writes, 0, sizeof(this->fast_writes));
+    }
+}
+
+Mem::Mem(const Mem& other)
+        : dense(NULL), arena(other.arena), shared_writes(other.shared_writes),
+          device_tap(NULL), profile(NULL) {
+    this->copy_from(other);
+}
+
+Mem& Mem::operator=(const Mem& other) {
+    if (this != &other) {
+        this->release_pages();
+        this->arena = other.arena;
+        this->shared_writes = other.shared_writes;
+        this->copy_from(other);
+    }
+    return *this;
+}
+
+Mem::~Mem() {
+    this->set_profile(NULL);
+    this->release_pages();
+}
+
+/* Become a copy of other, which has the same model. Only the pages other
+ * owns are copied; shared pages stay shared. */
+void Mem::copy_from(const Mem& other) {
+    // other's observers and profile aren't copied, but this Mem keeps its own
+    std::memcpy(this->owned, other.owned, sizeof(this->owned));
+    this->update_fast_writes();
+    this->images = other.images;
+    this->devices = other.devices;
+    if (other.dense) {
+        this->dense = new uint8_t[MEM_SIZE];
+        std::memcpy(this->dense, other.dense, MEM_SIZE);
+    } else {
+        this->dense = NULL;
+    }
+    for (size_t i = 0; i < N_PAGES; ++i) {
+        uint8_t*& page = this->page_slot(i);
+        if (!other.is_owned(i)) {
+            page = other.page_ptr(i);
+        } else if (this->dense) {
+            page = this->dense + i * PAGE_SIZE;
+        } else {
+            page = this->arena->allocate();
+            std::memcpy(page, other.page_ptr(i), PAGE_SIZE);
+        }
+    }
+}
+
+void Mem::release_pages() {
+    this->images.clear();
+    if (this->dense) {
+        delete[] this->dense;
+        this->dense = NULL;
+        return;
+    }
+    for (size_t i = 0; i < N_PAGES; ++i) {
+        if (this->is_owned(i)) {
+            this->arena->release(this->page_slot(i));
+            this->page_slot(i) = ZERO_PAGE;
+        }
+    }
+    std::memset(this->owned, 0, sizeof(this->owned));
+    std::memset(this->fast_writes, 0, sizeof(this->fast_writes));
+}
+
+void Mem::make_writable(address_t addr) {
+    const size_t page = addr / PAGE_SIZE;
+    const uint8_t* shared = this->page_ptr(page);
+    if (shared != ZERO_PAGE && this->shared_writes == SHARED_TRAP) {
+        throw WriteProtectError(addr);
+    }
+    uint8_t* own = this->dense ? this->dense + page * PAGE_SIZE
+                               : this->arena->allocate();
+    if (shared != ZERO_PAGE) {
+        std::memcpy(own, shared, PAGE_SIZE);
+    } else if (this->dense) {
+        // the page was cleared since it was last written
+        std::memset(own, 0, PAGE_SIZE);
+    }
+    this->page_slot(page) = own;
+    this->owned[page >> 3] |= 1 << (page & 7);
+    if (this->writes_are_fast()) {
+        this->fast_writes[page >> 3] |= 1 << (page & 7);
+    }
+}
+
+void Mem::write_slow(address_t addr, uint8_t val) {
+    if (this->profile) {
+        this->profile->count(addr, ACCESS_WRITE);
+    }
+    if (!this->page_ptr(addr >> 8)) {
+        this->write_device(addr, val);
+        return;
+    }
+    if (!this->is_owned(addr >> 8)) {
+        this->make_writable(addr);
+    }
+    uint8_t& byte = this->page_slot(addr >> 8)[addr & 0xff];
+    const uint8_t old = byte;
+    byte = val;
+    for (size_t i = 0; i < this->observers.size(); ++i) {
+        this->observers[i]->on_write(addr, old, val);
+    }
+}
+
+uint8_t Mem::read_slow(address_t addr, MemAccess kind) const {
+    if (this->profile) {
+        this->profile->count(addr, kind);
+        const uint8_t* page = this->profile->pages[addr >> 8];
+        if (page) {
+            return page[addr & 0xff];
+        }
+    }
+    return this->read_device(addr);
+}
+
+uint8_t Mem::peek_slow(address_t addr) const {
+    const uint8_t* page = this->page_ptr(addr >> 8);
+    if (page) {
+        return page[addr & 0xff];
+    }
+    return 0;
+}
+
+uint8_t*& Mem::page_slot(size_t page) {
+    return this->profile ? this->profile->pages[page] : this->pages[page];
+}
+
+uint8_t* Mem::page_ptr(size_t page) const {
+    return this->profile ? this->profile->pages[page] : this->pages[page];
+}
+
+bool Mem::writes_are_fast() const {
+    return this->observers.empty() && !this->profile;
+}
+
+void Mem::update_fast_writes() {
+    if (this->writes_are_fast()) {
+        std::memcpy(this->fast_writes, this->owned, sizeof(this->fast_writes));
+    } else {
+        std::memset(this->fast_writes, 0, sizeof(this->fast_writes));
+    }
+}
+
+void Mem::set_profile(MemProfile* profile) {
+    if (this->profile) {
+        std::memcpy(this->pages, this->profile->pages, sizeof(this->pages));
+        this->profile->mem = NULL;
+    }
+    this->profile = profile;
+    if (profile) {
+        if (profile->mem) {
+            profile->mem->set_profile(NULL);
+        }
+        profile->mem = this;
+        std::memcpy(profile->pages, this->pages, sizeof(this->pages));
+        std::memset(this->pages, 0, sizeof(this->pages));
+    }
+    this->update_fast_writes();
+}
+
+MemDevice* Mem::device_for(address_t addr) const {
+    const size_t page = addr / PAGE_SIZE;
+    for (size_t i = this->devices.size(); i > 0; --i) {
+        const DeviceRange& range = this->devices[i - 1];
+        if (page >= range.first_page && page < range.end_page) {
+            return range.device;
+        }
+    }
+    return NULL;    // never happens: only device pages are NULL
+}
+
+uint8_t Mem::read_device(address_t addr) const {
+    MemDevice* device = this->device_for(addr);
+    if (this->device_tap) {
+        return this->device_tap->tap_read(device, addr);
+    }
+    return device->read(addr);
+}
+
+void Mem::write_device(address_t addr, uint8_t val) {
+    MemDevice* device = this->device_for(addr);
+    if (this->device_tap) {
+        this->device_tap->tap_write(device, addr, val);
+    } else {
+        device->write(addr, val);
+    }
+}
+
+void Mem::map_device(size_t first_page, size_t n_pages, MemDevice* device) {
+    const size_t end_page = std::min(first_page + n_pages, N_PAGES);
+    for (size_t page = first_page; page < end_page; ++page) {
+        if (this->is_owned(page)) {
+            if (!this->dense) {
+                this->arena->release(this->page_slot(page));
+            }
+            this->owned[page >> 3] &= ~(1 << (page & 7));
+            this->fast_writes[page >> 3] &= ~(1 << (page & 7));
+        }
+        this->page_slot(page) = NULL;
+    }
+    // searched from the back, so this mapping wins over older ones, and
+    // those it covers entirely would never be found again
+    for (size_t i = this->devices.size(); i > 0; --i) {
+        const DeviceRange& old = this->devices[i - 1];
+        if (old.first_page >= first_page && old.end_page <= end_page) {
+            this->devices.erase(this->devices.begin() + (i - 1));
+        }
+    }
+    DeviceRange range = { first_page, end_page, device };
+    this->devices.push_back(range);
+}
+
+void Mem::add_observer(MemObserver* observer) {
+    this->observers.push_back(observer);
+    this->update_fast_writes();
+}
+
+void Mem::remove_observer(MemObserver* observer) {
+    this->observers.erase(std::remove(this->observers.begin(), this->observers.end(),
+                                      observer),
+                          this->observers.end());
+    this->update_fast_writes();
+}
+
+void Mem::clear() {
+    this->images.clear();
+    this->devices.clear();
+    this->shared_writes = SHARED_COPY_ON_WRITE;
+    for (size_t i = 0; i < N_PAGES; ++i) {
+        if (this->is_owned(i) && !this->dense) {
+            this->arena->release(this->page_slot(i));
+        }
+        this->page_slot(i) = ZERO_PAGE;
+    }
+    std::memset(this->owned, 0, sizeof(this->owned));
+    std::memset(this->fast_writes, 0, sizeof(this->fast_writes));
+}
+
+uint8_t* Mem::dense_data() {
+    if (!this->dense) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(this->owned); ++i) {
+        if (this->owned[i] != 0xff) {
+            return NULL;
+        }
+    }
+    return this->dense;
+}
+
+void Mem::map_image(const std::shared_ptr<const SharedImage>& image) {
+    for (size_t i = 0; i < image->n_pages(); ++i) {
+        const size_t page = image->first_page() + i;
+        if (this->is_owned(page)) {
+            if (!this->dense) {
+                this->arena->release(this->page_slot(page));
+            }
+            this->owned[page >> 3] &= ~(1 << (page & 7));
+            this->fast_writes[page >> 3] &= ~(1 << (page & 7));
+        }
+        // the table is never written through for pages that aren't owned
+        this->page_slot(page) = const_cast<uint8_t*>(image->page(i));
+    }
+    this->images.push_back(image);
+}
+
+void Mem::share_pages() {
+    if (this->shared_writes == SHARED_TRAP) {
+        return;
+    }
+    // let go of the images that have been written over entirely
+    std::vector<std::shared_ptr<const SharedImage> > mapped;
+    for (size_t i = 0; i < this->images.size(); ++i) {
+        const SharedImage& image = *this->images[i];
+        for (size_t j = 0; j < image.n_pages(); ++j) {
+            if (this->page_ptr(image.first_page() + j) == image.page(j)) {
+                mapped.push_back(this->images[i]);
+                break;
+            }
+        }
+    }
+    this->images.swap(mapped);
+
+    // an image for each run of owned pages
+    for (size_t first = 0; first < N_PAGES; ) {
+        if (!this->is_owned(first)) {
+            ++first;
+            continue;
+        }
+        size_t end = first + 1;
+        while (end < N_PAGES && this->is_owned(end)) {
+            ++end;
+        }
+        std::shared_ptr<SharedImage> image(new SharedImage());
+        image->addr = first * PAGE_SIZE;
+        image->n_bytes = (end - first) * PAGE_SIZE;
+        image->bytes.resize(image->n_bytes);
+        for (size_t page = first; page < end; ++page) {
+            std::memcpy(&image->bytes[(page - first) * PAGE_SIZE],
+                        this->page_ptr(page), PAGE_SIZE);
+        }
+        this->map_image(image);
+        first = end;
+    }
+}
+
+void Mem::write_block(address_t addr, const uint8_t* src, size_t n) {
+    if (!this->writes_are_fast()) {
+        // observers and profiles see each byte
+        for (size_t i = 0; i < n && addr + i < MEM_SIZE; ++i) {
+            this->write_8(addr + i, src[i]);
+        }
+        return;
+    }
+    size_t pos = addr;
+    const size_t end = std::min(pos + n, MEM_SIZE);
+    while (pos < end) {
+        const size_t page = pos / PAGE_SIZE;
+        const size_t offset = pos % PAGE_SIZE;
+        const size_t len = std::min(PAGE_SIZE - offset, end - pos);
+        if (!this->page_ptr(page)) {
+            for (size_t i = 0; i < len; ++i) {
+                this->write_device(pos + i, src[i]);
+            }
+            src += len;
+            pos += len;
+            continue;
+        }
+        if (!this->is_owned(page)) {
+            this->make_writable(pos);
+        }
+        std::memcpy(this->page_slot(page) + offset, src, len);
+        src += len;
+        pos += len;
+    }
+}
+
+size_t Mem::n_pages() const {
+    if (this->dense) {
+        return N_PAGES;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < N_PAGES; ++i) {
+        n += this->is_owned(i);
+    }
+    return n;
+}
@@ -4,13 +4,177 @@
 #include <iomanip>
 #include <sstream>
 #include <iostream>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
 #include <stdint.h>
 
 typedef uint16_t address_t;
 
+/* A pool of fixed size pages for sparse memories (see Mem).
+ *
+ * Pages are carved out of large blocks and recycled through a free list,
+ * so allocating one is cheap and the pages of many Mems share a few big
+ * allocations. Pages are handed out zero filled. An arena can be shared
+ * between threads.
+ */
+class PageArena {
+public:
+    static const size_t PAGE_SIZE = 256;
+    static const size_t PAGES_PER_BLOCK = 256;
+
+    PageArena() : n_used(0) { }
+
+    /* Every page must have been released */
+    ~PageArena();
+
+    uint8_t* allocate();
+    void release(uint8_t* page);
+
+    /* The number of pages currently allocated */
+    size_t size() const;
+
+    /* The arena used by sparse Mems that aren't given one */
+    static PageArena& shared();
+
+private:
+    PageArena(const PageArena&);
+    PageArena& operator=(const PageArena&);
+
+    mutable std::mutex lock;
+    std::vector<uint8_t*> blocks;
+    std::vector<uint8_t*> free_pages;
+    size_t n_used;
+};
+
+/* Told about every write to the Mems it is added to (see Mem::add_observer),
+ * after the write has happened */
+class MemObserver {
+public:
+    virtual ~MemObserver() { }
+    virtual void on_write(address_t addr, uint8_t old_value, uint8_t new_value) = 0;
+};
+
+/* Memory mapped hardware, for Mem::map_device. A device sees every read and
+ * write to its pages, with the full address. Reads aren't const because on
+ * real hardware they often aren't (reading a status register can clear it). */
+class MemDevice {
+public:
+    virtual ~MemDevice() { }
+    virtual uint8_t read(address_t addr) = 0;
+    virtual void write(address_t addr, uint8_t value) = 0;
+};
+
+/* Thrown by MemDevice::read when the device has nothing to give yet, such
+ * as an input that hasn't been decided. The Cpu stops before the instruction
+ * that read the device (see STOP_DEVICE_STALL) and runs it again when it is
+ * next run. Only instructions that read a device before writing anything
+ * can stall, so devices must not be mapped over the stack or the vectors. */
+class DeviceStall : public std::runtime_error {
+public:
+    DeviceStall() : std::runtime_error("device stalled") { }
+};
+
+/* Stands between a Mem and its devices (see Mem::set_device_tap), to watch
+ * what they return or to answer in their place */
+class DeviceTap {
+public:
+    virtual ~DeviceTap() { }
+    virtual uint8_t tap_read(MemDevice* device, address_t addr) = 0;
+    virtual void tap_write(MemDevice* device, address_t addr, uint8_t value) = 0;
+};
+
+/* An immutable image of some memory (say, a program's code) that any number
+ * of Mems can map as shared, read-only pages. Hold it by shared_ptr: each
+ * Mem it is mapped into keeps a reference. */
+class SharedImage {
+public:
+    /* An image of n bytes from src, as they would be loaded at addr. The
+     * image covers whole pages; the rest of its first and last pages are
+     * zero. */
+    static std::shared_ptr<const SharedImage> create(address_t addr,
+                                                     const uint8_t* src,
+                                                     size_t n);
+
+    address_t start() const { return this->addr; }
+    size_t size() const { return this->n_bytes; }
+
+    size_t first_page() const { return this->addr / PageArena::PAGE_SIZE; }
+    size_t n_pages() const { return this->bytes.size() / PageArena::PAGE_SIZE; }
+
+    /* The i'th page of the image, counting from first_page() */
+    const uint8_t* page(size_t i) const {
+        return &this->bytes[i * PageArena::PAGE_SIZE];
+    }
+
+private:
+    friend class Mem;   // for Mem::share_pages
+
+    SharedImage() : addr(0), n_bytes(0) { }
+
+    address_t addr;
+    size_t n_bytes;
+    std::vector<uint8_t> bytes;
+};
+
+/* What a Mem does when something writes to a page of a SharedImage */
+enum SharedWrites {
+    SHARED_COPY_ON_WRITE,   // give this Mem its own copy of the page
+    SHARED_TRAP,            // throw WriteProtectError
+};
+
+class WriteProtectError : public std::runtime_error {
+public:
+    explicit WriteProtectError(address_t addr);
+
+    address_t addr;
+};
+
+/* The kinds of access a MemProfile counts */
+enum MemAccess {
+    ACCESS_READ,
+    ACCESS_WRITE,
+    ACCESS_EXECUTE,     // bytes fetched as instructions (see Mem::fetch_8)
+    ACCESS_ANY,         // all of the above, when asking for counts
+};
+
+class MemProfile;
+
+enum MemModel {
+    MEM_DENSE,      // all 64 KB are allocated up front
+    MEM_SPARSE,     // pages are allocated from a PageArena on first write
+};
+
+/* The 64 KB address space, as 256 pages of 256 bytes.
+ *
+ * Every access goes through a page table, and writes also check a bitmap of
+ * the pages they can write straight into. A dense Mem points the table at
+ * one 64 KB buffer. A sparse Mem starts with every page reading from a
+ * shared page of zeros and owning no pages; the first write to a page
+ * allocates it from the arena. A sparse Mem running a program that only
+ * touches the zero page, the stack and its code needs a handful of pages
+ * rather than 64 KB.
+ *
+ * Either kind of Mem can also map a SharedImage, pointing the table at the
+ * image's pages rather than copying them. The Mem doesn't own those pages,
+ * and the first write to one either copies it or traps (see SharedWrites).
+ *
+ * Pages mapped to a MemDevice have no entry in the table at all, so reads
+ * find out they need the device from the one pointer they already load.
+ * A MemProfile uses the same trick: while one is attached, it holds the
+ * page table and every entry here is NULL, so every access takes the slow
+ * path past the profile and a Mem without one pays nothing for profiling.
+ *
+ * While a Mem has observers, every write takes the slow path so they can
+ * be told about it. Mems without observers don't pay for them.
+ */
 class Mem {
 public:
     static const size_t MEM_SIZE = 1 << 16;
+    static const size_t PAGE_SIZE = PageArena::PAGE_SIZE;
+    static const size_t N_PAGES = MEM_SIZE / PAGE_SIZE;
 
     static std::string as_hex(int value) {
         std::stringstream ss;
@@ -18,29 +182,119 @@ public:
         return ss.str();
     }
 
-    Mem() {
-        memset(this->data, 0, MEM_SIZE);
-    }
+    explicit Mem(MemModel model = MEM_DENSE, PageArena& arena = PageArena::shared());
+    Mem(const Mem& other);
+    Mem& operator=(const Mem& other);
+    ~Mem();
 
     inline uint8_t read_8(address_t index) const {
-        return data[index];
+        const uint8_t* page = this->pages[index >> 8];
+        if (page) {
+            return page[index & 0xff];
+        }
+        return this->read_slow(index, ACCESS_READ);
+    }
+
+    /* read_8 for instruction bytes, which a MemProfile counts as executed */
+    inline uint8_t fetch_8(address_t index) const {
+        const uint8_t* page = this->pages[index >> 8];
+        if (page) {
+            return page[index & 0xff];
+        }
+        return this->read_slow(index, ACCESS_EXECUTE);
+    }
+
+    /* read_8 that a MemProfile doesn't count, for looking without running.
+     * Device pages read as 0: reading a device can change it, and a peek
+     * mustn't, so neither the device nor the device tap is asked. */
+    inline uint8_t peek_8(address_t index) const {
+        const uint8_t* page = this->pages[index >> 8];
+        if (page) {
+            return page[index & 0xff];
+        }
+        return this->peek_slow(index);
     }
 
     inline uint16_t read_16(address_t index) const {
         // little endian - least significant byte in smallest address
-        return ((data[index + 1] << 8) & 0xff00) | (data[index] & 0xff);
+        return (this->read_8(index + 1) << 8) | this->read_8(index);
     }
 
     inline void write_8(address_t index, uint8_t val) {
-        data[index] = val;
+        const size_t page = index >> 8;
+        if (this->is_fast_write(page)) {
+            this->pages[page][index & 0xff] = val;
+        } else {
+            this->write_slow(index, val);
+        }
     }
 
     inline void write_16(address_t index, uint16_t val) {
         // little endian - least significant byte in smallest address
-        data[index] = (uint8_t) (val & 0xFF);
-        data[index + 1] = (uint8_t) (val >> 8) & 0xFF;
+        this->write_8(index, (uint8_t) (val & 0xFF));
+        this->write_8(index + 1, (uint8_t) (val >> 8));
     }
 
+    /* Copy n bytes from src into memory starting at addr */
+    void write_block(address_t addr, const uint8_t* src, size_t n);
+
+    /* Map the image's pages, replacing whatever those pages held */
+    void map_image(const std::shared_ptr<const SharedImage>& image);
+
+    void set_shared_writes(SharedWrites policy) { this->shared_writes = policy; }
+
+    /* Move the pages this Mem owns into SharedImages and map them, so that
+     * copies of this Mem share them, copying only the pages they go on to
+     * write. Images none of whose pages are still mapped are let go. Does
+     * nothing under SHARED_TRAP, which would make the pages read-only. */
+    void share_pages();
+
+    /* Send every read and write of n_pages pages, from first_page, to the
+     * device, replacing whatever those pages held, including any device
+     * mapped over all of them. Devices are kept when the Mem is copied, but
+     * not by clear. Observers aren't told about writes to devices. */
+    void map_device(size_t first_page, size_t n_pages, MemDevice* device);
+
+    /* The number of device mappings that can still be reached */
+    size_t n_devices() const { return this->devices.size(); }
+
+    /* Route device reads and writes through tap (NULL to go straight to the
+     * devices). The tap isn't copied with the Mem. */
+    void set_device_tap(DeviceTap* tap) { this->device_tap = tap; }
+
+    /* Whether reads and writes of addr go to a device */
+    bool is_device(address_t addr) const { return this->page_ptr(addr >> 8) == NULL; }
+
+    /* Whether anything is told about writes or counts accesses, in which
+     * case every write has to really happen */
+    bool is_observed() const { return !this->writes_are_fast(); }
+
+    /* Count every access in profile from now on, or stop with NULL. A
+     * profile can only be attached to one Mem at a time, and isn't copied
+     * with the Mem. */
+    void set_profile(MemProfile* profile);
+
+    /* Observers are told about writes (including write_block), but not
+     * about map_image or clear. They aren't copied with the Mem. */
+    void add_observer(MemObserver* observer);
+    void remove_observer(MemObserver* observer);
+
+    /* Zero all of memory, unmap any images and devices and go back to copy
+     * on write. Every page reads as zero until it is next written, so
+     * clearing costs the same however much memory was in use. */
+    void clear();
+
+    /* The whole address space as one buffer if this Mem is dense and every
+     * page is in the buffer (none are shared or waiting to be cleared), or
+     * NULL */
+    uint8_t* dense_data();
+
+    MemModel model() const { return this->dense ? MEM_DENSE : MEM_SPARSE; }
+
+    /* The number of pages this Mem owns: N_PAGES when dense, or the pages
+     * that have been written to when sparse. Shared pages aren't counted. */
+    size_t n_pages() const;
+
     friend std::ostream& operator<<(std::ostream& o, const Mem& mem) {
         for (size_t i = 0; i < MEM_SIZE; ++i) {
             int val = mem.read_8(i);
@@ -62,8 +316,62 @@ public:
         return o;
     }
 
-public:
-    uint8_t data[MEM_SIZE];
+private:
+    bool is_owned(size_t page) const {
+        return this->owned[page >> 3] & (1 << (page & 7));
+    }
+
+    bool is_fast_write(size_t page) const {
+        return this->fast_writes[page >> 3] & (1 << (page & 7));
+    }
+
+    /* Give this Mem its own copy of the page holding addr, on the first
+     * write to it */
+    void make_writable(address_t addr);
+
+    /* A write to a page that isn't owned, or while there are observers */
+    void write_slow(address_t addr, uint8_t val);
+
+    /* A read of a device page, or while profiling */
+    uint8_t read_slow(address_t addr, MemAccess kind) const;
+    uint8_t peek_slow(address_t addr) const;
+
+    /* Where the page's real table entry is: here, or in the profile while
+     * there is one */
+    uint8_t*& page_slot(size_t page);
+    uint8_t* page_ptr(size_t page) const;
+
+    /* fast_writes is owned, unless there are observers or a profile */
+    bool writes_are_fast() const;
+    void update_fast_writes();
+
+    MemDevice* device_for(address_t addr) const;
+    uint8_t read_device(address_t addr) const;
+    void write_device(address_t addr, uint8_t val);
+
+    void copy_from(const Mem& other);
+    void release_pages();
+
+    struct DeviceRange {
+        size_t first_page;
+        size_t end_page;
+        MemDevice* device;
+    };
+
+    /* Pages that aren't owned point at a shared page and must not be
+     * written through. Device pages are NULL, as is every page while there
+     * is a profile (see page_slot). */
+    uint8_t* pages[N_PAGES];
+    uint8_t owned[N_PAGES / 8];
+    uint8_t fast_writes[N_PAGES / 8];  // see writes_are_fast
+    uint8_t* dense;                     // NULL when sparse
+    PageArena* arena;
+    SharedWrites shared_writes;
+    std::vector<std::shared_ptr<const SharedImage> > images;   // mapped
+    std::vector<MemObserver*> observers;
+    std::vector<DeviceRange> devices;   // in the order they were mapped
+    DeviceTap* device_tap;
+    MemProfile* profile;
 };
 
 #endif // MEM_H
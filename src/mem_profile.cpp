@@ -0,0 +1,123 @@
+#include <bitset>
+#include <cmath>
+#include <cstring>
+#include "mem_profile.h"
+
+const size_t MemProfile::N_KINDS;
+
+MemProfile::MemProfile(uint64_t window, const uint64_t* clock)
+        : window(window ? window : 1), clock(clock), n_accesses(0),
+          window_start(0), window_end(0), mem(NULL) {
+    std::memset(this->page_counts, 0, sizeof(this->page_counts));
+    std::memset(this->touched, 0, sizeof(this->touched));
+    std::memset(this->pages, 0, sizeof(this->pages));
+}
+
+MemProfile::~MemProfile() {
+    if (this->mem) {
+        this->mem->set_profile(NULL);
+    }
+}
+
+void MemProfile::watch_page(size_t page) {
+    if (!this->is_watched(page)) {
+        this->address_counts[page].assign(N_KINDS * Mem::PAGE_SIZE, 0);
+    }
+}
+
+uint64_t MemProfile::page_count(size_t page, MemAccess kind) const {
+    if (kind == ACCESS_ANY) {
+        uint64_t n = 0;
+        for (size_t k = 0; k < N_KINDS; ++k) {
+            n += this->page_counts[k][page];
+        }
+        return n;
+    }
+    return this->page_counts[kind][page];
+}
+
+uint64_t MemProfile::address_count(address_t addr, MemAccess kind) const {
+    const std::vector<uint64_t>& counts = this->address_counts[addr >> 8];
+    if (counts.empty()) {
+        return 0;
+    }
+    if (kind == ACCESS_ANY) {
+        uint64_t n = 0;
+        for (size_t k = 0; k < N_KINDS; ++k) {
+            n += counts[k * Mem::PAGE_SIZE + (addr & 0xff)];
+        }
+        return n;
+    }
+    return counts[kind * Mem::PAGE_SIZE + (addr & 0xff)];
+}
+
+unsigned MemProfile::n_touched() const {
+    unsigned n = 0;
+    for (size_t i = 0; i < sizeof(this->touched) / sizeof(this->touched[0]); ++i) {
+        n += std::bitset<64>(this->touched[i]).count();
+    }
+    return n;
+}
+
+void MemProfile::next_window(uint64_t now) {
+    const unsigned n = this->n_touched();
+    if (n) {
+        WorkingSetSample sample = { this->window_start, n };
+        this->samples.push_back(sample);
+    }
+    std::memset(this->touched, 0, sizeof(this->touched));
+    this->window_start = now - now % this->window;
+    this->window_end = this->window_start + this->window;
+}
+
+std::vector<MemProfile::WorkingSetSample> MemProfile::working_set() const {
+    std::vector<WorkingSetSample> result(this->samples);
+    const unsigned n = this->n_touched();
+    if (n) {
+        WorkingSetSample sample = { this->window_start, n };
+        result.push_back(sample);
+    }
+    return result;
+}
+
+double MemProfile::heat(address_t addr, MemAccess kind) const {
+    if (this->is_watched(addr >> 8)) {
+        return this->address_count(addr, kind);
+    }
+    return (double) this->page_count(addr >> 8, kind) / Mem::PAGE_SIZE;
+}
+
+void MemProfile::write_heatmap_pgm(std::ostream& out, MemAccess kind) const {
+    double max_heat = 0;
+    for (size_t addr = 0; addr < Mem::MEM_SIZE; ++addr) {
+        max_heat = std::max(max_heat, this->heat(addr, kind));
+    }
+
+    out << "P5\n" << Mem::PAGE_SIZE << " " << Mem::N_PAGES << "\n255\n";
+    std::string row(Mem::PAGE_SIZE, '\0');
+    const double scale = max_heat > 0 ? 255 / std::log1p(max_heat) : 0;
+    for (size_t page = 0; page < Mem::N_PAGES; ++page) {
+        for (size_t i = 0; i < Mem::PAGE_SIZE; ++i) {
+            const double heat = this->heat(page * Mem::PAGE_SIZE + i, kind);
+            row[i] = (char) (uint8_t) std::lround(std::log1p(heat) * scale);
+        }
+        out.write(row.data(), row.size());
+    }
+}
+
+void MemProfile::write_heatmap_csv(std::ostream& out, MemAccess kind) const {
+    for (size_t page = 0; page < Mem::N_PAGES; ++page) {
+        for (size_t i = 0; i < Mem::PAGE_SIZE; ++i) {
+            out << (i ? "," : "") << this->heat(page * Mem::PAGE_SIZE + i, kind);
+        }
+        out << "\n";
+    }
+}
+
+void MemProfile::write_working_set_csv(std::ostream& out) const {
+    std::vector<WorkingSetSample> samples = this->working_set();
+    out << "start,pages\n";
+    for (size_t i = 0; i < samples.size(); ++i) {
+        out << samples[i].start << "," << samples[i].n_pages << "\n";
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef MEM_PROFILE_H
+#define MEM_PROFILE_H
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include "mem.h"
+
+/* Counts how a program uses the address space (see Mem::set_profile).
+ *
+ * Every read, write and instruction fetch is counted against its page.
+ * Pages given to watch_page are also counted per address. Reads and writes
+ * of 16 bit values count as two accesses.
+ *
+ * The profile also samples the working set: the number of distinct pages
+ * touched in each window of `window` ticks of clock (usually &cpu.cycles,
+ * so windows are in cycles), or of accesses if clock is NULL.
+ */
+class MemProfile {
+public:
+    struct WorkingSetSample {
+        uint64_t start;     // the first tick of the window
+        unsigned n_pages;   // pages touched during it
+    };
+
+    explicit MemProfile(uint64_t window = 10000, const uint64_t* clock = NULL);
+
+    /* Detaches from the Mem, if still attached */
+    ~MemProfile();
+
+    /* Count each address of the page from now on, as well as the page */
+    void watch_page(size_t page);
+    bool is_watched(size_t page) const { return !this->address_counts[page].empty(); }
+
+    uint64_t page_count(size_t page, MemAccess kind) const;
+
+    /* The count for one address, or 0 if its page isn't watched */
+    uint64_t address_count(address_t addr, MemAccess kind) const;
+
+    /* One sample per window with any accesses, including the current one */
+    std::vector<WorkingSetSample> working_set() const;
+
+    /* A 256x256 map of the address space, one row per page and one column
+     * per address in the page, as a binary PGM image. Brighter is busier,
+     * on a log scale. Pages that aren't watched are shown as their average
+     * per address. */
+    void write_heatmap_pgm(std::ostream& out, MemAccess kind) const;
+
+    /* The same map as 256 lines of 256 comma separated counts */
+    void write_heatmap_csv(std::ostream& out, MemAccess kind) const;
+
+    /* "start,pages" followed by a line per working set sample */
+    void write_working_set_csv(std::ostream& out) const;
+
+    inline void count(address_t addr, MemAccess kind) {
+        const size_t page = addr >> 8;
+        ++this->page_counts[kind][page];
+        if (!this->address_counts[page].empty()) {
+            ++this->address_counts[page][kind * Mem::PAGE_SIZE + (addr & 0xff)];
+        }
+        const uint64_t now = this->clock ? *this->clock : this->n_accesses;
+        ++this->n_accesses;
+        if (now >= this->window_end) {
+            this->next_window(now);
+        }
+        this->touched[page >> 6] |= (uint64_t) 1 << (page & 63);
+    }
+
+private:
+    MemProfile(const MemProfile&);
+    MemProfile& operator=(const MemProfile&);
+
+    friend class Mem;
+
+    static const size_t N_KINDS = ACCESS_ANY;
+
+    void next_window(uint64_t now);
+    unsigned n_touched() const;
+
+    /* The heatmap's count for an address */
+    double heat(address_t addr, MemAccess kind) const;
+
+    uint64_t page_counts[N_KINDS][Mem::N_PAGES];
+    std::vector<uint64_t> address_counts[Mem::N_PAGES];  // kind, then address
+
+    const uint64_t window;
+    const uint64_t* clock;
+    uint64_t n_accesses;
+    uint64_t window_start;
+    uint64_t window_end;
+    uint64_t touched[Mem::N_PAGES / 64];
+    std::vector<WorkingSetSample> samples;
+
+    /* The page table of the Mem this profile is attached to */
+    uint8_t* pages[Mem::N_PAGES];
+    Mem* mem;
+};
+
+#endif // MEM_PROFILE_H
@@ -0,0 +1,145 @@
+#include "memo.h"
+#include "cpu.h"
+
+/* JSR (abs) */
+static const uint8_t JSR_OPCODE = 0x20;
+
+SubroutineMemo::SubroutineMemo(size_t max_entries)
+    : max_entries(max_entries), recording(NULL), start_cycles(0),
+      start_instructions(0), start_activity(0), n_hits(0), n_misses(0),
+      n_cycles_saved(0), n_instructions_saved(0) { }
+
+SubroutineMemo::~SubroutineMemo() {
+    this->abandon();
+}
+
+void SubroutineMemo::declare_pure(address_t entry, address_t input, size_t n_input) {
+    if (n_input > Mem::MEM_SIZE) {
+        throw std::invalid_argument("input window is larger than memory");
+    }
+    Window window = { input, n_input };
+    this->routines[entry] = window;
+    // results recorded with the old window don't apply any more
+    this->clear();
+}
+
+void SubroutineMemo::clear() {
+    this->abandon();
+    this->results.clear();
+}
+
+bool SubroutineMemo::Key::operator==(const Key& other) const {
+    return this->entry == other.entry && this->A == other.A && this->X == other.X
+           && this->Y == other.Y && this->P == other.P && this->S == other.S
+           && this->input == other.input;
+}
+
+size_t SubroutineMemo::KeyHash::operator()(const Key& key) const {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const uint8_t regs[] = {
+        (uint8_t) key.entry, (uint8_t) (key.entry >> 8),
+        key.A, key.X, key.Y, key.P, key.S,
+    };
+    for (size_t i = 0; i < sizeof(regs); ++i) {
+        hash = (hash ^ regs[i]) * 0x100000001b3ULL;
+    }
+    for (size_t i = 0; i < key.input.size(); ++i) {
+        hash = (hash ^ key.input[i]) * 0x100000001b3ULL;
+    }
+    return (size_t) hash;
+}
+
+int SubroutineMemo::on_call(Cpu& cpu) {
+    const address_t entry = cpu.PC.read();
+    std::map<address_t, Window>::const_iterator routine = this->routines.find(entry);
+    if (routine == this->routines.end()) {
+        return 0;
+    }
+
+    Key key;
+    key.entry = entry;
+    key.A = cpu.A.read();
+    key.X = cpu.X.read();
+    key.Y = cpu.Y.read();
+    key.P = cpu.P.read();
+    key.S = cpu.S.read();
+    key.input.resize(routine->second.n_input);
+    for (size_t i = 0; i < key.input.size(); ++i) {
+        key.input[i] = cpu.mem.peek_8(routine->second.input + i);
+    }
+
+    std::unordered_map<Key, Result, KeyHash>::const_iterator found = this->results.find(key);
+    if (found == this->results.end()) {
+        ++this->n_misses;
+        if (!this->recording) {
+            this->recording = &cpu;
+            this->key = key;
+            this->result.writes.clear();
+            this->start_cycles = cpu.cycles + OPS[JSR_OPCODE].n_cycles;
+            this->start_instructions = cpu.instructions + 1;
+            this->start_activity = cpu.outside_activity;
+            cpu.mem.add_observer(this);
+        }
+        return 0;
+    }
+
+    // do what the routine and its RTS did
+    const Result& result = found->second;
+    for (size_t i = 0; i < result.writes.size(); ++i) {
+        cpu.mem.write_8(result.writes[i].addr, result.writes[i].value);
+    }
+    cpu.A.write(result.A);
+    cpu.X.write(result.X);
+    cpu.Y.write(result.Y);
+    cpu.P.write(result.P);
+    cpu.PC.write(cpu.pop_16() + 1);
+    cpu.instructions += result.instructions;
+
+    ++this->n_hits;
+    this->n_cycles_saved += result.cycles;
+    this->n_instructions_saved += result.instructions;
+    return (int) result.cycles;
+}
+
+void SubroutineMemo::on_return(Cpu& cpu) {
+    if (this->recording != &cpu || cpu.S.read() != (uint8_t) (this->key.S + 2)) {
+        return;
+    }
+    this->finish(cpu, cpu.outside_activity == this->start_activity);
+}
+
+void SubroutineMemo::abandon() {
+    if (this->recording) {
+        this->finish(*this->recording, false);
+    }
+}
+
+void SubroutineMemo::on_write(address_t addr, uint8_t, uint8_t new_value) {
+    for (size_t i = 0; i < this->result.writes.size(); ++i) {
+        if (this->result.writes[i].addr == addr) {
+            this->result.writes[i].value = new_value;
+            return;
+        }
+    }
+    Write write = { addr, new_value };
+    this->result.writes.push_back(write);
+}
+
+void SubroutineMemo::finish(Cpu& cpu, bool keep) {
+    cpu.mem.remove_observer(this);
+    this->recording = NULL;
+    if (!keep) {
+        return;
+    }
+    this->result.A = cpu.A.read();
+    this->result.X = cpu.X.read();
+    this->result.Y = cpu.Y.read();
+    this->result.P = cpu.P.read();
+    this->result.cycles = cpu.cycles - this->start_cycles;
+    this->result.instructions = cpu.instructions - this->start_instructions;
+    if (this->results.size() >= this->max_entries) {
+        this->results.clear();
+    }
+    this->results[this->key] = this->result;
+}
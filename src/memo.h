@@ -0,0 +1,123 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "mem.h"
+
+class Cpu;
+
+/* Remembers what calls to pure subroutines did, so a later JSR with the same
+ * inputs can skip the routine and just apply its effects (see
+ * Cpu::set_memo).
+ *
+ * A routine declared pure promises that everything it does depends only on
+ * A, X, Y, P, S and the bytes of its input window, and that it touches no
+ * devices. The key of a call is the routine's entry point, those registers
+ * and the window's bytes, looked up by a hash of them all. Its result is
+ * what the routine left behind when its RTS returned past the JSR: A, X, Y
+ * and P, the last value of every byte it wrote, and the cycles and
+ * instructions it took, RTS included.
+ *
+ * So a hit has exactly the effects of running the routine: the same
+ * registers and memory, and the same cycle and instruction counts. Only
+ * the routine's own instructions are missing from traces, coverage and
+ * memory profiles, and emu_loop's limits can only stop the run before or
+ * after the whole call.
+ *
+ * A call is only recorded when no other recording is under way, and is
+ * thrown away if an interrupt is taken or an event runs before it returns.
+ * When the cache holds max_entries results it is emptied.
+ */
+class SubroutineMemo : private MemObserver {
+public:
+    explicit SubroutineMemo(size_t max_entries = 1 << 16);
+    ~SubroutineMemo();
+
+    /* Declare the routine at entry pure, with an input window of n_input
+     * bytes from input (which may be empty) */
+    void declare_pure(address_t entry, address_t input = 0, size_t n_input = 0);
+    bool is_pure(address_t entry) const {
+        return this->routines.find(entry) != this->routines.end();
+    }
+
+    /* Forget every result, and any call being recorded */
+    void clear();
+
+    uint64_t hits() const { return this->n_hits; }
+    uint64_t misses() const { return this->n_misses; }
+    double hit_rate() const {
+        const uint64_t calls = this->n_hits + this->n_misses;
+        return calls ? (double) this->n_hits / calls : 0;
+    }
+    uint64_t cycles_saved() const { return this->n_cycles_saved; }
+    uint64_t instructions_saved() const { return this->n_instructions_saved; }
+    size_t size() const { return this->results.size(); }
+
+    /* Called by the Cpu when a JSR has pushed its return address and
+     * jumped. On a hit, finishes the call as the RTS would have, adds the
+     * routine's instructions and returns its cycles; otherwise returns 0. */
+    int on_call(Cpu& cpu);
+
+    /* Called by the Cpu after every RTS */
+    void on_return(Cpu& cpu);
+
+    /* Called by the Cpu when it is reset, or stops using this memo */
+    void abandon();
+
+private:
+    struct Window {
+        address_t input;
+        size_t n_input;
+    };
+
+    struct Key {
+        address_t entry;
+        uint8_t A, X, Y, P, S;
+        std::vector<uint8_t> input;
+
+        bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Write {
+        address_t addr;
+        uint8_t value;
+    };
+
+    struct Result {
+        uint8_t A, X, Y, P;
+        std::vector<Write> writes;
+        uint64_t cycles;
+        uint64_t instructions;
+    };
+
+    void on_write(address_t addr, uint8_t old_value, uint8_t new_value);
+
+    /* Stop recording, keeping the result if keep is set */
+    void finish(Cpu& cpu, bool keep);
+
+    size_t max_entries;
+    std::map<address_t, Window> routines;
+    std::unordered_map<Key, Result, KeyHash> results;
+
+    /* The call being recorded, unless recording is NULL */
+    Cpu* recording;
+    Key key;
+    Result result;
+    uint64_t start_cycles;
+    uint64_t start_instructions;
+    uint64_t start_activity;
+
+    uint64_t n_hits;
+    uint64_t n_misses;
+    uint64_t n_cycles_saved;
+    uint64_t n_instructions_saved;
+};
+
+#endif // MEMO_H
@@ -18,3 +18,33 @@ const char* addr_mode_to_string(AddressMode mode) {
         default: return "UNKNOWN";
     }
 }
+
+/* The opcodes with a page crossing cycle, worked out from OPS once */
+struct PageCrossTable {
+    bool has_cycle[OPS_SIZE];
+
+    PageCrossTable() {
+        static const char* const NAMES[] = {
+            "adc", "and", "bit", "cmp", "cpx", "cpy",
+            "eor", "lda", "ldx", "ldy", "ora", "sbc",
+        };
+        for (int op = 0; op < OPS_SIZE; ++op) {
+            const OpInfo& info = OPS[op];
+            this->has_cycle[op] = false;
+            if (info.address_mode != ABSX && info.address_mode != ABSY
+                    && info.address_mode != INDY) {
+                continue;
+            }
+            for (size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); ++i) {
+                if (info.has_name(NAMES[i])) {
+                    this->has_cycle[op] = true;
+                }
+            }
+        }
+    }
+};
+
+bool has_page_cross_cycle(uint8_t opcode) {
+    static const PageCrossTable table;
+    return table.has_cycle[opcode];
+}
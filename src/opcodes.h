@@ -87,7 +87,7 @@ const OpInfo OPS[OPS_SIZE] = {
     NONE,                 OP("ORA", 3, 4, ABSX), OP("ASL", 3, 7, ABSX), NONE,
 
     /* 0x20 - 0x2F */
-    OP("JSR", 3, 6, ABS), OP("AND", 2, 6, INDX), NONE,                 NONE,
+    OP("JSR", 3, 6, ABS), OP("AND", 2, 6, INDX), OP("HCL", 2, 2, IMM), NONE,
     OP("BIT", 2, 3, ZP),  OP("AND", 2, 3, ZP),   OP("ROL", 2, 5, ZP),  NONE,
     OP("PLP", 1, 4, IMP), OP("AND", 2, 2, IMM),  OP("ROL", 1, 2, ACC), NONE,
     OP("BIT", 3, 4, ABS), OP("AND", 3, 4, ABS),  OP("ROL", 3, 6, ABS), NONE,
@@ -174,5 +174,30 @@ const OpInfo OPS[OPS_SIZE] = {
 #undef NONE
 };
 
+/* Cycle timing beyond OpInfo::n_cycles, shared by the Cpu and the static
+ * analyses so that they agree:
+ *      http://users.telenet.be/kim1-6502/6502/hwman.html#AA
+ */
+
+/* Whether the instruction takes one more cycle when its indexed address is
+ * on a different page from the base address. This is the loads, compares
+ * and arithmetic (ADC, AND, BIT, CMP, CPX, CPY, EOR, LDA, LDX, LDY, ORA and
+ * SBC) in the ABSX, ABSY and INDY modes. Stores and read-modify-write
+ * instructions always take the extra cycle, so it's in their n_cycles. */
+bool has_page_cross_cycle(uint8_t opcode);
+
+inline bool crosses_page(uint16_t a, uint16_t b) {
+    return (a & 0xff00) != (b & 0xff00);
+}
+
+/* A branch takes one more cycle if it's taken, and another if it lands on a
+ * different page from the instruction after the branch */
+inline int branch_extra_cycles(bool taken, uint16_t next_addr, uint16_t target) {
+    if (!taken) {
+        return 0;
+    }
+    return crosses_page(next_addr, target) ? 2 : 1;
+}
+
 
 #endif // OPCODES_H
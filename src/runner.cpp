@@ -0,0 +1,323 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include "runner.h"
+#include "opcodes.h"
+#include "state_hash.h"
+
+bool parse_number(const std::string& s, uint64_t max, uint64_t& value) {
+    const char* str = s.c_str();
+    char* end;
+    if (str[0] == '$') {
+        ++str;
+        value = std::strtoull(str, &end, 16);
+    } else {
+        value = std::strtoull(str, &end, 0);
+    }
+    return *str != '\0' && *str != '-' && *end == '\0' && value <= max;
+}
+
+bool parse_address_range(const std::string& s, uint16_t& start, uint16_t& end) {
+    size_t colon = s.find(':');
+    return colon != std::string::npos
+        && parse_address(s.substr(0, colon), start)
+        && parse_address(s.substr(colon + 1), end)
+        && start <= end;
+}
+
+bool set_register(Cpu& cpu, const std::string& s) {
+    size_t eq = s.find('=');
+    if (eq == std::string::npos) {
+        return false;
+    }
+    const std::string reg = OpInfo::to_lower(s.substr(0, eq));
+    uint64_t value;
+    if (!parse_number(s.substr(eq + 1), reg == "pc" ? 0xffff : 0xff, value)) {
+        return false;
+    }
+
+    if (reg == "a") {
+        cpu.A.write(value);
+    } else if (reg == "x") {
+        cpu.X.write(value);
+    } else if (reg == "y") {
+        cpu.Y.write(value);
+    } else if (reg == "s") {
+        cpu.S.write(value);
+    } else if (reg == "p") {
+        cpu.P.write(value);
+    } else if (reg == "pc") {
+        cpu.PC.write(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Parse "<addr>=<value>" */
+static bool parse_poke(const std::string& s, std::pair<uint16_t, uint8_t>& poke) {
+    size_t eq = s.find('=');
+    uint64_t value;
+    if (eq == std::string::npos || !parse_address(s.substr(0, eq), poke.first)
+            || !parse_number(s.substr(eq + 1), 0xff, value)) {
+        return false;
+    }
+    poke.second = value;
+    return true;
+}
+
+OptionResult parse_job_option(const std::vector<std::string>& args, size_t& i,
+                              JobOptions& options) {
+    const std::string& arg = args[i];
+    if (arg == "--binary") {
+        options.binary = true;
+        ++i;
+        return OPTION_OK;
+    } else if (arg == "--sparse-mem") {
+        options.sparse_mem = true;
+        ++i;
+        return OPTION_OK;
+    } else if (arg == "--protect-code") {
+        options.protect_code = true;
+        ++i;
+        return OPTION_OK;
+    } else if (arg == "--detect-loops") {
+        options.detect_loops = true;
+        ++i;
+        return OPTION_OK;
+    }
+    if (arg != "--max-cycles" && arg != "--max-instructions"
+            && arg != "--load-addr" && arg != "--reg" && arg != "--poke"
+            && arg != "--dump") {
+        return OPTION_UNKNOWN;
+    }
+    if (i + 1 >= args.size()) {
+        return OPTION_BAD;
+    }
+
+    const std::string& value = args[i + 1];
+    bool ok = true;
+    if (arg == "--max-cycles") {
+        ok = parse_number(value, UINT64_MAX, options.max_cycles);
+    } else if (arg == "--max-instructions") {
+        ok = parse_number(value, UINT64_MAX, options.max_instructions);
+    } else if (arg == "--load-addr") {
+        ok = parse_address(value, options.load_addr);
+    } else if (arg == "--reg") {
+        options.registers.push_back(value);
+    } else if (arg == "--poke") {
+        std::pair<uint16_t, uint8_t> poke;
+        ok = parse_poke(value, poke);
+        options.pokes.push_back(poke);
+    } else {
+        std::pair<uint16_t, uint16_t> range;
+        ok = parse_address_range(value, range.first, range.second);
+        options.dumps.push_back(range);
+    }
+    i += 2;
+    return ok ? OPTION_OK : OPTION_BAD;
+}
+
+bool build_program(const std::string& text, bool binary, const char* cache_dir,
+                   AssemblyCache::Entry& program) {
+    if (binary) {
+        program = AssemblyCache::Entry();
+        program.code.assign(text.begin(), text.end());
+        return false;
+    }
+    if (cache_dir) {
+        AssemblyCache cache(cache_dir);
+        return cache.assemble(text, program);
+    }
+    std::istringstream src(text);
+    Assembler assembler(src);
+    program.code = assembler.code;
+    program.labels = assembler.labels;
+    program.relative_addresses = assembler.relative_addresses;
+    return false;
+}
+
+void prepare_job(Cpu& cpu, const AssemblyCache::Entry& program,
+                 const JobOptions& options,
+                 std::shared_ptr<const SharedImage> image) {
+    if (!image && options.protect_code) {
+        image = Cpu::link_shared(program, options.load_addr);
+    }
+    if (image) {
+        cpu.load_shared(image);
+    } else {
+        cpu.load_program(program, options.load_addr);
+    }
+    for (size_t i = 0; i < options.pokes.size(); ++i) {
+        cpu.mem.write_8(options.pokes[i].first, options.pokes[i].second);
+    }
+    if (options.protect_code) {
+        cpu.mem.set_shared_writes(SHARED_TRAP);
+    }
+    for (size_t i = 0; i < options.registers.size(); ++i) {
+        if (!set_register(cpu, options.registers[i])) {
+            throw std::invalid_argument("Bad register assignment: '"
+                                        + options.registers[i] + "'");
+        }
+    }
+}
+
+static StopReason run_detecting_loops(Cpu& cpu, uint64_t max_cycles,
+                                      uint64_t max_instructions) {
+    const uint64_t start_cycles = cpu.cycles;
+    const uint64_t start_instructions = cpu.instructions;
+    StateHash hash(cpu);
+    uint64_t saved = hash.state();
+    uint64_t power = 1;
+    uint64_t length = 0;
+    for (;;) {
+        const uint64_t cycles = cpu.cycles - start_cycles;
+        if (max_cycles && cycles >= max_cycles) {
+            return STOP_CYCLE_LIMIT;
+        }
+        if (max_instructions && cpu.instructions - start_instructions >= max_instructions) {
+            return STOP_INSTRUCTION_LIMIT;
+        }
+        const StopReason reason = cpu.emu_loop(max_cycles ? max_cycles - cycles : 0, 1);
+        if (reason != STOP_INSTRUCTION_LIMIT) {
+            return reason;
+        }
+
+        const uint64_t state = hash.state();
+        if (!cpu.is_closed()) {
+            // the hash doesn't cover devices, events or interrupts, so the
+            // same hash needn't mean the same state; start the search over
+            saved = state;
+            power = 1;
+            length = 0;
+            continue;
+        }
+        if (state == saved) {
+            return STOP_REPEATED_STATE;
+        }
+        // compare against the state at each power of two steps
+        if (++length == power) {
+            saved = state;
+            power *= 2;
+            length = 0;
+        }
+    }
+}
+
+RunStats run_cpu(Cpu& cpu, uint64_t max_cycles, uint64_t max_instructions,
+                 bool detect_loops) {
+    RunStats stats;
+    const uint64_t start_cycles = cpu.cycles;
+    const uint64_t start_instructions = cpu.instructions;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (detect_loops) {
+        stats.stop_reason = run_detecting_loops(cpu, max_cycles, max_instructions);
+    } else {
+        stats.stop_reason = cpu.emu_loop(max_cycles, max_instructions);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    stats.wall_seconds = std::chrono::duration<double>(end - start).count();
+    stats.cycles = cpu.cycles - start_cycles;
+    stats.instructions = cpu.instructions - start_instructions;
+    return stats;
+}
+
+void write_json_stats(std::ostream& out, const RunStats& stats) {
+    out << "{";
+    write_json_stats_members(out, stats);
+    out << "}";
+}
+
+void write_json_stats_members(std::ostream& out, const RunStats& stats) {
+    std::ios::fmtflags flags = out.flags();
+    out << std::dec
+        << "\"cycles\":" << stats.cycles
+        << ",\"instructions\":" << stats.instructions
+        << ",\"wall_time_s\":" << std::fixed << std::setprecision(6)
+        << stats.wall_seconds
+        << ",\"emulated_mhz\":" << std::setprecision(3) << stats.emulated_mhz()
+        << ",\"stop_reason\":\"" << stop_reason_to_string(stats.stop_reason)
+        << "\"";
+    out.flags(flags);
+}
+
+void write_json_string(std::ostream& out, const std::string& s) {
+    static const char HEX[] = "0123456789abcdef";
+    out << '"';
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c == '\n') {
+            out << "\\n";
+        } else if (c < 0x20) {
+            out << "\\u00" << HEX[c >> 4] << HEX[c & 0xf];
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+void write_json_dump(std::ostream& out, const Mem& mem,
+                     uint16_t start, uint16_t end) {
+    static const char HEX[] = "0123456789abcdef";
+    std::string bytes;
+    bytes.reserve(2 * (end - start + 1));
+    for (uint32_t addr = start; addr <= end; ++addr) {
+        const uint8_t byte = mem.read_8(addr);
+        bytes.push_back(HEX[byte >> 4]);
+        bytes.push_back(HEX[byte & 0xf]);
+    }
+    std::ios::fmtflags flags = out.flags();
+    out << std::dec << "{\"start\":" << start << ",\"bytes\":\"" << bytes << "\"}";
+    out.flags(flags);
+}
+
+void write_memory_dump(std::ostream& out, const Mem& mem,
+                       uint16_t start, uint16_t end) {
+    std::ios::fmtflags flags = out.flags();
+    char fill = out.fill();
+    out << std::hex << std::setfill('0');
+    for (uint32_t line = start & ~0xf; line <= end; line += 16) {
+        out << std::setw(4) << line << ":";
+        for (uint32_t addr = line; addr < line + 16; ++addr) {
+            if (addr < start || addr > end) {
+                out << "   ";
+            } else {
+                out << " " << std::setw(2) << (int) mem.read_8(addr);
+            }
+        }
+        out << std::endl;
+    }
+    out.flags(flags);
+    out.fill(fill);
+}
+
+void open_output(std::ofstream& f, const char* path, std::ios::openmode mode) {
+    f.open(path, mode | std::ios::trunc);
+    if (!f.is_open()) {
+        throw std::invalid_argument(
+            std::string("Can't write to '").append(path).append("'"));
+    }
+}
+
+void add_coverage_to_file(const std::string& path, const Coverage& coverage) {
+    Coverage total;
+    std::string buf;
+    if (read_file(path, buf)) {
+        total.load(buf);
+    }
+    total.merge(coverage);
+
+    std::ofstream f(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    const std::string data = total.data();
+    if (!f.write(data.data(), data.size())) {
+        throw std::invalid_argument("Can't write to '" + path + "'");
+    }
+}
@@ -0,0 +1,161 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include "cpu.h"
+#include "asm_cache.h"
+#include "coverage.h"
+
+/* Helpers shared by the command line tools for setting up a Cpu, running it
+ * and reporting on the run. */
+
+/* Parse $hex, 0xhex or decimal, failing if the value is larger than max */
+bool parse_number(const std::string& s, uint64_t max, uint64_t& value);
+
+inline bool parse_address(const std::string& s, uint16_t& addr) {
+    uint64_t value;
+    if (!parse_number(s, 0xffff, value)) {
+        return false;
+    }
+    addr = value;
+    return true;
+}
+
+/* Parse "<start>:<end>", an inclusive range of addresses */
+bool parse_address_range(const std::string& s, uint16_t& start, uint16_t& end);
+
+/* Apply an assignment like "A=$10" or "PC=0x700" to the Cpu. The registers
+ * are A, X, Y, S, P and PC. Returns false if s isn't a valid assignment. */
+bool set_register(Cpu& cpu, const std::string& s);
+
+/* The options that describe a single run of a program. mos6502 takes these
+ * on the command line, and each line of a batch manifest is a file name
+ * followed by the same options (see batch.h). */
+struct JobOptions {
+    JobOptions() : binary(false), sparse_mem(false), protect_code(false),
+                   detect_loops(false), max_cycles(0), max_instructions(0),
+                   load_addr(0x600) { }
+
+    bool binary;                // the file is raw code, not assembly source
+    bool sparse_mem;            // run with a MEM_SPARSE Cpu
+    bool protect_code;          // stop the run if it writes to its code
+    bool detect_loops;          // stop the run if its state repeats
+    uint64_t max_cycles;        // zero means unlimited
+    uint64_t max_instructions;  // zero means unlimited
+    uint16_t load_addr;
+    std::vector<std::string> registers;                 // "A=$10", ...
+    std::vector<std::pair<uint16_t, uint8_t> > pokes;    // address, value
+    std::vector<std::pair<uint16_t, uint16_t> > dumps;   // start, end
+};
+
+enum OptionResult {
+    OPTION_OK,          // args[i] was a job option, and i is now past it
+    OPTION_UNKNOWN,     // args[i] isn't a job option
+    OPTION_BAD,         // args[i] is a job option but its value is bad
+};
+
+/* Parse the job option at args[i]:
+ *
+ *      --binary                    --sparse-mem
+ *      --protect-code              --detect-loops
+ *      --load-addr <addr>
+ *      --max-cycles <n>            --max-instructions <n>
+ *      --reg <reg>=<value>         --poke <addr>=<value>
+ *      --dump <start>:<end>
+ */
+OptionResult parse_job_option(const std::vector<std::string>& args, size_t& i,
+                              JobOptions& options);
+
+/* Turn the contents of a file into a program ready to be loaded. Binary
+ * files are used as they are; source is assembled, or taken from the cache
+ * when cache_dir isn't NULL. Returns true if the code came from the cache.
+ * Throws AssemblerError if the source doesn't assemble. */
+bool build_program(const std::string& text, bool binary, const char* cache_dir,
+                   AssemblyCache::Entry& program);
+
+inline MemModel job_mem_model(const JobOptions& options) {
+    return options.sparse_mem ? MEM_SPARSE : MEM_DENSE;
+}
+
+/* Load the program into the Cpu and apply the pokes and registers.
+ *
+ * If image isn't NULL, it must be the program linked at the load address
+ * (see Cpu::link_shared), and it is mapped rather than copied. With
+ * protect_code, the code is always mapped from an image and the Cpu traps
+ * writes to it; pokes into the code pages happen before that.
+ *
+ * Throws std::invalid_argument if a register assignment is bad. */
+void prepare_job(Cpu& cpu, const AssemblyCache::Entry& program,
+                 const JobOptions& options,
+                 std::shared_ptr<const SharedImage> image = NULL);
+
+struct RunStats {
+    RunStats() : stop_reason(STOP_BRK), cycles(0), instructions(0),
+                 wall_seconds(0) { }
+
+    StopReason stop_reason;
+    uint64_t cycles;
+    uint64_t instructions;
+    double wall_seconds;
+
+    /* The speed of the emulated CPU, in millions of cycles per second */
+    double emulated_mhz() const {
+        return this->wall_seconds > 0 ? this->cycles / this->wall_seconds / 1e6 : 0;
+    }
+};
+
+/* Time cpu.emu_loop() with the given limits (zero means unlimited).
+ *
+ * With detect_loops, the Cpu is run one instruction at a time, watching a
+ * StateHash of its registers and memory for a state it has been in before
+ * (by Brent's cycle finding, so it keeps one earlier state rather than all
+ * of them). A program that gets back to an earlier state while the Cpu is
+ * closed (see Cpu::is_closed) will go round the same loop forever, so the
+ * run stops with STOP_REPEATED_STATE within two trips round the loop. While
+ * the Cpu isn't closed, states aren't compared. */
+RunStats run_cpu(Cpu& cpu, uint64_t max_cycles, uint64_t max_instructions,
+                 bool detect_loops = false);
+
+/* Write the stats as a single line of JSON, without a trailing newline:
+ *
+ *  {"cycles":26,"instructions":12,"wall_time_s":0.000002,
+ *   "emulated_mhz":13.0,"stop_reason":"brk"}
+ */
+void write_json_stats(std::ostream& out, const RunStats& stats);
+
+/* The members of the write_json_stats object, without the braces, so they
+ * can be part of a larger object */
+void write_json_stats_members(std::ostream& out, const RunStats& stats);
+
+/* Write s as a quoted and escaped JSON string */
+void write_json_string(std::ostream& out, const std::string& s);
+
+/* Write memory from start to end (inclusive) as a JSON object:
+ *
+ *      {"start":512,"bytes":"0303"}
+ */
+void write_json_dump(std::ostream& out, const Mem& mem,
+                     uint16_t start, uint16_t end);
+
+/* Hex dump of memory from start to end (inclusive), 16 bytes per line:
+ *
+ *      0200: 03 03 00 00 ...
+ */
+void write_memory_dump(std::ostream& out, const Mem& mem,
+                       uint16_t start, uint16_t end);
+
+/* Open the file for writing, or throw std::invalid_argument */
+void open_output(std::ofstream& f, const char* path,
+                 std::ios::openmode mode = std::ios::out);
+
+/* OR coverage into the coverage file at path, starting a new file if path
+ * doesn't hold coverage yet, so each run of a corpus can add its part.
+ * Throws std::invalid_argument if the file can't be written. */
+void add_coverage_to_file(const std::string& path, const Coverage& coverage);
+
+#endif // RUNNER_H
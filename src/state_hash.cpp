@@ -0,0 +1,93 @@
+#include "state_hash.h"
+
+/* The splitmix64 finalizer: every bit of x affects every bit of the result */
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/* Keeps register keys apart from byte keys */
+static const uint64_t REGISTERS_SALT = 0x9e3779b97f4a7c15ULL;
+
+StateHash::StateHash(Cpu& cpu) : cpu(cpu) {
+    this->rehash();
+    this->cpu.mem.add_observer(this);
+}
+
+StateHash::~StateHash() {
+    this->cpu.mem.remove_observer(this);
+}
+
+uint64_t StateHash::byte_key(address_t addr, uint8_t value) {
+    return mix(((uint64_t) addr << 8) | value);
+}
+
+void StateHash::rehash() {
+    const Mem& mem = this->cpu.mem;
+    this->memory_hash = 0;
+    for (size_t page = 0; page < Mem::N_PAGES; ++page) {
+        uint64_t hash = 0;
+        const address_t base = page * Mem::PAGE_SIZE;
+        if (!mem.is_device(base)) {
+            for (size_t i = 0; i < Mem::PAGE_SIZE; ++i) {
+                hash ^= byte_key(base + i, mem.peek_8(base + i));
+            }
+        }
+        this->page_hashes[page] = hash;
+        this->memory_hash ^= hash;
+    }
+}
+
+void StateHash::restore(const uint64_t* page_hashes) {
+    this->memory_hash = 0;
+    for (size_t page = 0; page < Mem::N_PAGES; ++page) {
+        this->page_hashes[page] = page_hashes[page];
+        this->memory_hash ^= page_hashes[page];
+    }
+}
+
+uint64_t StateHash::state() const {
+    const Cpu::Registers r = this->cpu.save_registers();
+    const uint64_t packed = (uint64_t) r.A | ((uint64_t) r.X << 8)
+                            | ((uint64_t) r.Y << 16) | ((uint64_t) r.S << 24)
+                            | ((uint64_t) r.P << 32) | ((uint64_t) r.PC << 40);
+    return this->memory_hash ^ mix(packed ^ REGISTERS_SALT);
+}
+
+void StateHash::on_write(address_t addr, uint8_t old_value, uint8_t new_value) {
+    const uint64_t change = byte_key(addr, old_value) ^ byte_key(addr, new_value);
+    this->page_hashes[addr >> 8] ^= change;
+    this->memory_hash ^= change;
+}
+
+bool StateSet::insert(uint64_t hash) {
+    Shard& shard = this->shard_for(hash);
+    std::lock_guard<std::mutex> hold(shard.lock);
+    return shard.hashes.insert(hash).second;
+}
+
+bool StateSet::contains(uint64_t hash) const {
+    const Shard& shard = this->shard_for(hash);
+    std::lock_guard<std::mutex> hold(shard.lock);
+    return shard.hashes.count(hash) != 0;
+}
+
+size_t StateSet::size() const {
+    size_t n = 0;
+    for (size_t i = 0; i < N_SHARDS; ++i) {
+        std::lock_guard<std::mutex> hold(this->shards[i].lock);
+        n += this->shards[i].hashes.size();
+    }
+    return n;
+}
+
+void StateSet::clear() {
+    for (size_t i = 0; i < N_SHARDS; ++i) {
+        std::lock_guard<std::mutex> hold(this->shards[i].lock);
+        this->shards[i].hashes.clear();
+    }
+}
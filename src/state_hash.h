@@ -0,0 +1,84 @@
+#ifndef STATE_HASH_H
+#define STATE_HASH_H
+
+#include <mutex>
+#include <unordered_set>
+#include <stdint.h>
+#include "cpu.h"
+
+/* A 64 bit hash of a Cpu's registers and memory that is kept up to date as
+ * memory is written, so asking for it costs the same however much memory
+ * the program uses.
+ *
+ * Memory is hashed Zobrist style: every (address, value) pair has its own
+ * random key, and a page's hash is the XOR of the keys of its 256 bytes. A
+ * write swaps one key for another with two XORs, in the page's hash and in
+ * the running hash of all the pages. Keys are worked out by mixing the
+ * address and value rather than kept in a table. The registers A, X, Y, S,
+ * P and PC are mixed in when the hash is asked for; the cycle and
+ * instruction counts are not, since they never repeat.
+ *
+ * The hash follows writes as a MemObserver, so while it is attached every
+ * write takes Mem's slow path. Device pages aren't hashed. Changes Mem
+ * doesn't tell observers about (map_image, clear, loading a program before
+ * the StateHash was made) need a rehash.
+ */
+class StateHash : private MemObserver {
+public:
+    explicit StateHash(Cpu& cpu);
+    ~StateHash();
+
+    /* Hash memory from scratch */
+    void rehash();
+
+    /* Take the page hashes of a copy of this memory, saved from pages(),
+     * rather than hashing it from scratch */
+    void restore(const uint64_t* page_hashes);
+
+    /* The Cpu's registers and memory */
+    uint64_t state() const;
+
+    uint64_t memory() const { return this->memory_hash; }
+    uint64_t page(size_t page) const { return this->page_hashes[page]; }
+    const uint64_t* pages() const { return this->page_hashes; }
+
+    /* The key of value at addr */
+    static uint64_t byte_key(address_t addr, uint8_t value);
+
+private:
+    void on_write(address_t addr, uint8_t old_value, uint8_t new_value);
+
+    Cpu& cpu;
+    uint64_t memory_hash;
+    uint64_t page_hashes[Mem::N_PAGES];
+};
+
+/* A set of state hashes that any number of threads can add to at once, for
+ * workers to skip states another worker has already seen. The set is split
+ * into shards with a lock each, chosen by the hash, so workers rarely wait
+ * for each other. */
+class StateSet {
+public:
+    /* Add hash. Returns false if it was already there. */
+    bool insert(uint64_t hash);
+
+    bool contains(uint64_t hash) const;
+    size_t size() const;
+    void clear();
+
+private:
+    static const size_t N_SHARDS = 64;
+
+    struct Shard {
+        mutable std::mutex lock;
+        std::unordered_set<uint64_t> hashes;
+    };
+
+    /* The hashes are already well mixed, so the low bits will do */
+    Shard& shard_for(uint64_t hash) { return this->shards[hash % N_SHARDS]; }
+    const Shard& shard_for(uint64_t hash) const { return this->shards[hash % N_SHARDS]; }
+
+    Shard shards[N_SHARDS];
+};
+
+#endif // STATE_HASH_H
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include "symbols.h"
+#include "byte_io.h"
+
+static const char MAGIC[4] = { 'M', '6', '5', 'S' };
+static const uint32_t FORMAT_VERSION = 1;
+
+/* Labels sorted by absolute address, then by name */
+static std::vector<std::pair<uint16_t, std::string> >
+sorted_symbols(const Assembler& assembler, uint16_t base_addr) {
+    std::vector<std::pair<uint16_t, std::string> > result;
+    result.reserve(assembler.labels.size());
+    std::map<std::string, uint16_t>::const_iterator it;
+    for (it = assembler.labels.begin(); it != assembler.labels.end(); ++it) {
+        result.push_back(std::make_pair((uint16_t) (it->second + base_addr),
+                                        it->first));
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+SymbolIndex::SymbolIndex(const Assembler& assembler, uint16_t base_addr)
+        : n_ranges(assembler.source_lines.size()), n_symbols(0) {
+    const std::vector<Assembler::SourceLine>& lines = assembler.source_lines;
+    std::vector<std::pair<uint16_t, std::string> > symbols =
+        sorted_symbols(assembler, base_addr);
+    this->n_symbols = symbols.size();
+
+    std::string strings;
+    std::string symbol_records;
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        put_u16(symbol_records, symbols[i].first);
+        put_u16(symbol_records, 0);
+        put_u32(symbol_records, strings.size());
+        strings.append(symbols[i].second).push_back('\0');
+    }
+
+    this->buf.reserve(HEADER_SIZE + RECORD_SIZE * this->n_ranges
+                      + symbol_records.size() + strings.size());
+    this->buf.append(MAGIC, sizeof(MAGIC));
+    put_u32(this->buf, FORMAT_VERSION);
+    put_u32(this->buf, this->n_ranges);
+    put_u32(this->buf, this->n_symbols);
+    put_u32(this->buf, strings.size());
+
+    // source_lines is in code order, so the ranges come out sorted
+    for (size_t i = 0; i < lines.size(); ++i) {
+        size_t end = (i + 1 < lines.size()) ? lines[i + 1].offset
+                                            : assembler.code.size();
+        put_u16(this->buf, base_addr + lines[i].offset);
+        put_u16(this->buf, end - lines[i].offset);
+        put_u32(this->buf, lines[i].line);
+    }
+    this->buf.append(symbol_records);
+    this->buf.append(strings);
+}
+
+bool SymbolIndex::load(const std::string& data) {
+    ByteReader r(data);
+    const char* magic = r.take(sizeof(MAGIC));
+    if (!magic || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+            || r.u32() != FORMAT_VERSION) {
+        return false;
+    }
+    const size_t n_ranges = r.u32();
+    const size_t n_symbols = r.u32();
+    const size_t strings_size = r.u32();
+    if (!r.ok || (uint64_t) data.size() != (uint64_t) HEADER_SIZE
+            + RECORD_SIZE * ((uint64_t) n_ranges + n_symbols) + strings_size) {
+        return false;
+    }
+    if (strings_size > 0 && data[data.size() - 1] != '\0') {
+        return false;
+    }
+
+    this->buf = data;
+    this->n_ranges = n_ranges;
+    this->n_symbols = n_symbols;
+    for (size_t i = 0; i < n_symbols; ++i) {
+        if (get_u32(this->symbols() + i * RECORD_SIZE + 4) >= strings_size) {
+            *this = SymbolIndex();
+            return false;
+        }
+    }
+    return true;
+}
+
+SymbolIndex::Range SymbolIndex::range(size_t i) const {
+    const char* p = this->ranges() + i * RECORD_SIZE;
+    Range r = { get_u16(p), get_u16(p + 2), (int) get_u32(p + 4) };
+    return r;
+}
+
+int SymbolIndex::line_for(uint16_t addr) const {
+    // find the last range starting at or before addr
+    size_t lo = 0, hi = this->n_ranges;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (get_u16(this->ranges() + mid * RECORD_SIZE) <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    Range r = this->range(lo - 1);
+    if (addr - r.start < r.length) {
+        return r.line;
+    }
+    return -1;
+}
+
+bool SymbolIndex::symbol_for(uint16_t addr, std::string& name,
+                             uint16_t& offset) const {
+    size_t lo = 0, hi = this->n_symbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (get_u16(this->symbols() + mid * RECORD_SIZE) <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return false;
+    }
+    // of several symbols at the same address, use the first
+    const uint16_t sym_addr = get_u16(this->symbols() + (lo - 1) * RECORD_SIZE);
+    while (lo > 1 && get_u16(this->symbols() + (lo - 2) * RECORD_SIZE) == sym_addr) {
+        --lo;
+    }
+    const char* p = this->symbols() + (lo - 1) * RECORD_SIZE;
+    name = this->strings() + get_u32(p + 4);
+    offset = addr - sym_addr;
+    return true;
+}
+
+void write_source_rows(std::ostream& out, const Assembler& assembler,
+                       const std::vector<uint8_t>& code, const std::string& source,
+                       SourceRowWriter& writer) {
+    const std::vector<Assembler::SourceLine>& lines = assembler.source_lines;
+    size_t next = 0;  // index into lines
+    size_t pos = 0;   // index into source
+    for (int line = 1; pos < source.size(); ++line) {
+        size_t eol = source.find('\n', pos);
+        if (eol == std::string::npos) {
+            eol = source.size();
+        }
+        std::string text = source.substr(pos, eol - pos);
+        if (!text.empty() && text[text.size() - 1] == '\r') {
+            text.erase(text.size() - 1);
+        }
+        pos = eol + 1;
+
+        out << std::dec << std::setfill(' ') << std::setw(4) << line << "  ";
+        if (next < lines.size() && lines[next].line == line) {
+            const size_t offset = lines[next].offset;
+            ++next;
+            if (offset < code.size()) {
+                writer.write_columns(out, offset, next < lines.size()
+                                                  ? lines[next].offset : code.size());
+            } else {
+                writer.write_columns(out, std::string::npos, std::string::npos);
+            }
+        } else {
+            writer.write_columns(out, std::string::npos, std::string::npos);
+        }
+        out << text << std::endl;
+    }
+}
+
+/* The address and up to three bytes of code of a line */
+class ListingColumns : public SourceRowWriter {
+public:
+    ListingColumns(const std::vector<uint8_t>& code, uint16_t base_addr)
+        : code(code), base_addr(base_addr) { }
+
+    void write_columns(std::ostream& out, size_t offset, size_t end) {
+        if (offset == std::string::npos) {
+            out << std::string(6 + 10, ' ');
+            return;
+        }
+        out << std::hex << std::setfill('0') << std::setw(4)
+            << (this->base_addr + offset) << "  ";
+        std::string bytes = Assembler::get_code_hex(std::vector<uint8_t>(
+            this->code.begin() + offset, this->code.begin() + end));
+        for (size_t i = 0; i < 6; i += 2) {
+            out << (i < bytes.size() ? bytes.substr(i, 2) : "  ") << " ";
+        }
+        out << " ";
+    }
+
+private:
+    const std::vector<uint8_t>& code;
+    uint16_t base_addr;
+};
+
+void write_listing(std::ostream& out, const Assembler& assembler,
+                   const std::string& source, uint16_t base_addr) {
+    std::vector<uint8_t> code;
+    assembler.relocate_code(base_addr, code);
+
+    std::ios::fmtflags flags = out.flags();
+    char fill = out.fill();
+    out << "line  addr  bytes     source" << std::endl;
+    ListingColumns columns(code, base_addr);
+    write_source_rows(out, assembler, code, source, columns);
+    out.flags(flags);
+    out.fill(fill);
+}
+
+void write_symbol_map(std::ostream& out, const Assembler& assembler,
+                      uint16_t base_addr) {
+    std::vector<std::pair<uint16_t, std::string> > symbols =
+        sorted_symbols(assembler, base_addr);
+    std::ios::fmtflags flags = out.flags();
+    char fill = out.fill();
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        out << std::hex << std::setfill('0') << std::setw(4)
+            << symbols[i].first << " " << symbols[i].second << std::endl;
+    }
+    out.flags(flags);
+    out.fill(fill);
+}
@@ -0,0 +1,101 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <iostream>
+#include <string>
+#include <stdint.h>
+#include "assembler.h"
+
+/* A compact binary index for address -> source symbolization, so tools can
+ * map a PC back to a source line or label without re-parsing the source.
+ *
+ * The index is stored exactly as it is written to disk, and lookups binary
+ * search the fixed size records in place, so loading an index is just
+ * reading the file:
+ *
+ *      "M65S"                  magic
+ *      u32                     FORMAT_VERSION
+ *      u32 n_ranges, n_symbols, strings_size
+ *      n_ranges * (u16 start, u16 length, u32 line)    sorted by start
+ *      n_symbols * (u16 address, u16 0, u32 name)      sorted by address
+ *      strings_size bytes      NUL terminated names, indexed by name
+ *
+ * All integers are little endian.
+ */
+class SymbolIndex {
+public:
+    struct Range {
+        uint16_t start;
+        uint16_t length;
+        int line;
+    };
+
+    SymbolIndex() : n_ranges(0), n_symbols(0) { }
+
+    /* Index a program that was loaded at base_addr */
+    SymbolIndex(const Assembler& assembler, uint16_t base_addr);
+
+    /* Use a previously written index. Returns false (leaving this index
+     * empty) if buf isn't a valid index. */
+    bool load(const std::string& buf);
+
+    /* The serialized index, ready to be written to a file */
+    const std::string& data() const { return this->buf; }
+
+    size_t size() const { return this->n_ranges; }
+    Range range(size_t i) const;
+
+    /* Returns the source line of the instruction containing addr,
+     * or -1 if addr isn't part of an instruction. */
+    int line_for(uint16_t addr) const;
+
+    /* Find the closest symbol at or before addr, so that addr is
+     * name + offset. Returns false if there is no such symbol. */
+    bool symbol_for(uint16_t addr, std::string& name, uint16_t& offset) const;
+
+private:
+    static const size_t HEADER_SIZE = 20;
+    static const size_t RECORD_SIZE = 8;
+
+    const char* ranges() const { return this->buf.data() + HEADER_SIZE; }
+    const char* symbols() const { return this->ranges() + this->n_ranges * RECORD_SIZE; }
+    const char* strings() const { return this->symbols() + this->n_symbols * RECORD_SIZE; }
+
+    std::string buf;
+    size_t n_ranges;
+    size_t n_symbols;
+};
+
+/* Writes the columns between the line number and the text of a row of a
+ * report with one row per source line (see write_source_rows) */
+class SourceRowWriter {
+public:
+    virtual ~SourceRowWriter() { }
+
+    /* offset is where the line's code starts in the program and end where
+     * it ends, or both are npos if the line assembled to no code */
+    virtual void write_columns(std::ostream& out, size_t offset, size_t end) = 0;
+};
+
+/* Write a row for each line of source, the text the assembler was given:
+ * the line number, the columns from writer and the line itself. code is
+ * the assembled program, as relocated. */
+void write_source_rows(std::ostream& out, const Assembler& assembler,
+                       const std::vector<uint8_t>& code, const std::string& source,
+                       SourceRowWriter& writer);
+
+/* Write a listing with one row per source line:
+ *
+ *      line  addr  bytes     source
+ *         1  0600  a2 08       LDX #$08
+ *
+ * source must be the text the assembler was given.
+ */
+void write_listing(std::ostream& out, const Assembler& assembler,
+                   const std::string& source, uint16_t base_addr);
+
+/* Write "address label" lines, sorted by address */
+void write_symbol_map(std::ostream& out, const Assembler& assembler,
+                      uint16_t base_addr);
+
+#endif // SYMBOLS_H
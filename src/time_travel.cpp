@@ -0,0 +1,177 @@
+#include <algorithm>
+#include "time_travel.h"
+
+TimeTravel::TimeTravel(Cpu& cpu, uint64_t interval, size_t max_journal)
+        : cpu(cpu), interval(interval ? interval : 1), max_journal(max_journal),
+          journal_start(0), undoing(false) {
+    this->cpu.mem.add_observer(this);
+    this->checkpoint();
+}
+
+TimeTravel::~TimeTravel() {
+    this->cpu.mem.remove_observer(this);
+}
+
+void TimeTravel::on_write(address_t addr, uint8_t old_value, uint8_t) {
+    if (!this->undoing) {
+        JournalEntry entry = { addr, old_value };
+        this->journal.push_back(entry);
+    }
+}
+
+void TimeTravel::add_state(SavesState* state) {
+    this->states.push_back(state);
+    for (size_t i = 0; i < this->saved.size(); ++i) {
+        this->saved[i].states.push_back(std::string());
+        state->save_state(this->saved[i].states.back());
+    }
+}
+
+void TimeTravel::checkpoint() {
+    Checkpoint c;
+    c.registers = this->cpu.save_registers();
+    c.pending = this->cpu.save_pending();
+    c.states.resize(this->states.size());
+    for (size_t i = 0; i < this->states.size(); ++i) {
+        this->states[i]->save_state(c.states[i]);
+    }
+    c.journal_pos = this->journal_start + this->journal.size();
+    this->saved.push_back(c);
+
+    // drop the oldest checkpoints, and the journal only they need
+    size_t n_dropped = 0;
+    while (this->journal.size() > this->max_journal
+            && n_dropped + 1 < this->saved.size()) {
+        ++n_dropped;
+        const uint64_t pos = this->saved[n_dropped].journal_pos;
+        this->journal.erase(this->journal.begin(),
+                            this->journal.begin() + (pos - this->journal_start));
+        this->journal_start = pos;
+    }
+    this->saved.erase(this->saved.begin(), this->saved.begin() + n_dropped);
+}
+
+StopReason TimeTravel::run(uint64_t max_cycles, uint64_t max_instructions) {
+    const uint64_t end_cycles = this->cpu.cycles + max_cycles;
+    const uint64_t end_instructions = this->cpu.instructions + max_instructions;
+
+    // run to each checkpoint in turn with emu_loop's limits
+    for (;;) {
+        if (max_cycles && this->cpu.cycles >= end_cycles) {
+            return STOP_CYCLE_LIMIT;
+        }
+        if (max_instructions && this->cpu.instructions >= end_instructions) {
+            return STOP_INSTRUCTION_LIMIT;
+        }
+        const uint64_t next = this->saved.back().registers.cycles + this->interval;
+        if (this->cpu.cycles >= next) {
+            this->checkpoint();
+            continue;
+        }
+
+        uint64_t cycles = next - this->cpu.cycles;
+        if (max_cycles) {
+            cycles = std::min(cycles, end_cycles - this->cpu.cycles);
+        }
+        StopReason reason = this->cpu.emu_loop(
+            cycles, max_instructions ? end_instructions - this->cpu.instructions : 0);
+        if (reason != STOP_CYCLE_LIMIT) {
+            return reason;
+        }
+    }
+}
+
+size_t TimeTravel::checkpoint_before(uint64_t n, bool by_cycles) const {
+    size_t i = this->saved.size() - 1;
+    while (i > 0 && (by_cycles ? this->saved[i].registers.cycles
+                               : this->saved[i].registers.instructions) > n) {
+        --i;
+    }
+    return i;
+}
+
+void TimeTravel::rewind_to(size_t i) {
+    const Checkpoint c = this->saved[i];
+    // devices first, since putting them back may schedule their events
+    for (size_t j = 0; j < this->states.size(); ++j) {
+        this->states[j]->restore_state(c.states[j]);
+    }
+    this->undoing = true;
+    while (this->journal_start + this->journal.size() > c.journal_pos) {
+        const JournalEntry& entry = this->journal.back();
+        this->cpu.mem.write_8(entry.addr, entry.old_value);
+        this->journal.pop_back();
+    }
+    this->undoing = false;
+    this->saved.resize(i + 1);
+    this->cpu.restore_registers(c.registers);
+    this->cpu.restore_pending(c.pending);
+}
+
+bool TimeTravel::seek_to_instruction(uint64_t n) {
+    if (n < this->saved.front().registers.instructions) {
+        return false;
+    }
+    if (n < this->cpu.instructions) {
+        this->rewind_to(this->checkpoint_before(n, false));
+    }
+    if (n > this->cpu.instructions) {
+        this->run(0, n - this->cpu.instructions);
+    }
+    return this->cpu.instructions == n;
+}
+
+bool TimeTravel::seek_to_cycle(uint64_t n) {
+    if (n < this->saved.front().registers.cycles) {
+        return false;
+    }
+    if (n < this->cpu.cycles) {
+        this->rewind_to(this->checkpoint_before(n, true));
+    }
+    if (n > this->cpu.cycles) {
+        this->run(n - this->cpu.cycles, 0);
+    }
+    return this->cpu.cycles >= n;
+}
+
+bool TimeTravel::reverse_step() {
+    if (this->cpu.instructions <= this->saved.front().registers.instructions) {
+        return false;
+    }
+    return this->seek_to_instruction(this->cpu.instructions - 1);
+}
+
+bool TimeTravel::reverse_continue(const std::set<address_t>& breakpoints) {
+    uint64_t end = this->cpu.instructions;
+
+    // search back a checkpoint at a time, replaying each span up to where
+    // the last search started
+    for (;;) {
+        size_t i = this->checkpoint_before(end, false);
+        if (i > 0 && this->saved[i].registers.instructions == end) {
+            --i;
+        }
+        this->rewind_to(i);
+        const uint64_t start = this->cpu.instructions;
+
+        bool found = false;
+        uint64_t hit = 0;
+        while (this->cpu.instructions < end) {
+            if (breakpoints.count(this->cpu.PC.read())) {
+                found = true;
+                hit = this->cpu.instructions;
+            }
+            if (this->run(0, 1) != STOP_INSTRUCTION_LIMIT) {
+                break;
+            }
+        }
+        if (found) {
+            return this->seek_to_instruction(hit);
+        }
+        if (i == 0) {
+            this->rewind_to(0);
+            return false;
+        }
+        end = start;
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef TIME_TRAVEL_H
+#define TIME_TRAVEL_H
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "cpu.h"
+
+/* Records a run so it can be stepped backwards.
+ *
+ * While recording, every memory write is journaled as (address, old value),
+ * and every interval cycles a checkpoint saves the registers, the pending
+ * interrupts and scheduled events (Cpu::Pending), the state of any devices
+ * added with add_state and the position in the journal. Checkpoints don't
+ * copy memory: going back to one undoes the journal down to its position
+ * and restores the rest. From there the run is replayed forward to the
+ * exact instruction wanted, which gives the same result every time because
+ * the Cpu is deterministic.
+ *
+ * Writes to devices aren't journaled, so every device or event with state
+ * of its own (a timer, say) must be added with add_state, or replays won't
+ * match the run.
+ *
+ * The journal is kept under max_journal entries (4 bytes each) by dropping
+ * the oldest checkpoints, which limits how far back the run can go. It can
+ * grow past max_journal by the writes of one interval.
+ *
+ * The Cpu must only be run through the TimeTravel while it is recording.
+ */
+class TimeTravel : private MemObserver {
+public:
+    struct Checkpoint {
+        Cpu::Registers registers;
+        Cpu::Pending pending;
+        std::vector<std::string> states;    // of each add_state, in order
+        uint64_t journal_pos;       // counting every entry ever journaled
+    };
+
+    /* Start recording, with a checkpoint of the Cpu as it is now */
+    TimeTravel(Cpu& cpu, uint64_t interval = 100000, size_t max_journal = 1 << 22);
+    ~TimeTravel();
+
+    /* Save and restore state with every checkpoint. Add everything before
+     * running, as the checkpoints already taken get its state as it is now. */
+    void add_state(SavesState* state);
+
+    /* Run forward like Cpu::emu_loop, recording */
+    StopReason run(uint64_t max_cycles = 0, uint64_t max_instructions = 0);
+
+    /* Put the Cpu in the state it had after n instructions. Returns false
+     * if that is before the oldest checkpoint (the Cpu doesn't move) or
+     * the program stops before it gets there (the Cpu is where it stopped).
+     */
+    bool seek_to_instruction(uint64_t n);
+
+    /* Put the Cpu at the first instruction boundary at or after cycle n.
+     * Returns false as seek_to_instruction does. */
+    bool seek_to_cycle(uint64_t n);
+
+    /* Go back one instruction. Returns false at the oldest checkpoint. */
+    bool reverse_step();
+
+    /* Go back to the last time, before now, that the PC was one of the
+     * breakpoints. Returns false, leaving the Cpu at the oldest checkpoint,
+     * if there was no such time. */
+    bool reverse_continue(const std::set<address_t>& breakpoints);
+
+    const std::vector<Checkpoint>& checkpoints() const { return this->saved; }
+    size_t journal_size() const { return this->journal.size(); }
+
+private:
+    struct JournalEntry {
+        uint16_t addr;
+        uint8_t old_value;
+    };
+
+    void on_write(address_t addr, uint8_t old_value, uint8_t new_value);
+
+    void checkpoint();
+
+    /* Undo the journal back to checkpoint i, drop the later checkpoints
+     * and restore its registers */
+    void rewind_to(size_t i);
+
+    /* The last checkpoint at or before the given instruction or cycle */
+    size_t checkpoint_before(uint64_t n, bool by_cycles) const;
+
+    Cpu& cpu;
+    std::vector<SavesState*> states;
+    const uint64_t interval;
+    const size_t max_journal;
+    std::vector<Checkpoint> saved;
+    std::deque<JournalEntry> journal;
+    uint64_t journal_start;     // the journal position of journal.front()
+    bool undoing;
+};
+
+#endif // TIME_TRAVEL_H
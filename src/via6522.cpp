@@ -0,0 +1,215 @@
+#include <algorithm>
+#include "byte_io.h"
+#include "via6522.h"
+
+const uint8_t Via6522::ACR_T1_FREE_RUN;
+
+Via6522::Via6522(Cpu& cpu) : cpu(cpu), pins_a(0xff), pins_b(0xff) {
+    this->reset();
+}
+
+Via6522::~Via6522() {
+    this->cpu.cancel(this);
+}
+
+void Via6522::reset() {
+    this->orb = this->ora = this->ddrb = this->ddra = 0;
+    this->sr = this->acr = this->pcr = this->ifr = this->ier = 0;
+    this->t1_latch_lo = this->t1_latch_hi = 0;
+    this->t1_start = this->cpu.cycles;
+    this->t1_value = 0;
+    this->t1_irq_at = Cpu::NO_EVENT;
+    this->t2_latch_lo = 0;
+    this->t2_start = this->cpu.cycles;
+    this->t2_value = 0;
+    this->t2_irq_at = Cpu::NO_EVENT;
+    this->update();
+}
+
+void Via6522::save_state(std::string& state) const {
+    const uint8_t regs[] = {
+        this->orb, this->ora, this->ddrb, this->ddra, this->pins_a, this->pins_b,
+        this->sr, this->acr, this->pcr, this->ifr, this->ier,
+        this->t1_latch_lo, this->t1_latch_hi, this->t2_latch_lo,
+    };
+    state.assign((const char*) regs, sizeof(regs));
+    put_u64(state, this->t1_start);
+    put_u16(state, this->t1_value);
+    put_u64(state, this->t1_irq_at);
+    put_u64(state, this->t2_start);
+    put_u16(state, this->t2_value);
+    put_u64(state, this->t2_irq_at);
+}
+
+void Via6522::restore_state(const std::string& state) {
+    ByteReader in(state);
+    uint8_t* regs[] = {
+        &this->orb, &this->ora, &this->ddrb, &this->ddra, &this->pins_a, &this->pins_b,
+        &this->sr, &this->acr, &this->pcr, &this->ifr, &this->ier,
+        &this->t1_latch_lo, &this->t1_latch_hi, &this->t2_latch_lo,
+    };
+    for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); ++i) {
+        *regs[i] = in.u8();
+    }
+    this->t1_start = in.u64();
+    this->t1_value = in.u16();
+    this->t1_irq_at = in.u64();
+    this->t2_start = in.u64();
+    this->t2_value = in.u16();
+    this->t2_irq_at = in.u64();
+    this->update();
+}
+
+uint16_t Via6522::timer1() const {
+    const uint64_t elapsed = this->cpu.cycles - this->t1_start;
+    if (elapsed <= this->t1_value || !(this->acr & ACR_T1_FREE_RUN)) {
+        return this->t1_value - elapsed;
+    }
+    // after the first underflow the counter shows $ffff for a cycle, then
+    // counts down from the latches
+    const uint16_t latch = this->t1_latch_lo | (this->t1_latch_hi << 8);
+    const uint64_t phase = (elapsed - this->t1_value - 1) % (latch + 2);
+    return phase == 0 ? 0xffff : latch - (phase - 1);
+}
+
+uint16_t Via6522::timer2() const {
+    return this->t2_value - (this->cpu.cycles - this->t2_start);
+}
+
+uint8_t Via6522::read(address_t addr) {
+    switch (addr & 0x0f) {
+    case ORB:
+        return this->port_b();
+    case ORA:
+    case ORA_NH:
+        return this->port_a();
+    case DDRB:
+        return this->ddrb;
+    case DDRA:
+        return this->ddra;
+    case T1C_L:
+        this->ifr &= ~IRQ_T1;
+        this->update();
+        return this->timer1() & 0xff;
+    case T1C_H:
+        return this->timer1() >> 8;
+    case T1L_L:
+        return this->t1_latch_lo;
+    case T1L_H:
+        return this->t1_latch_hi;
+    case T2C_L:
+        this->ifr &= ~IRQ_T2;
+        this->update();
+        return this->timer2() & 0xff;
+    case T2C_H:
+        return this->timer2() >> 8;
+    case SR:
+        return this->sr;
+    case ACR:
+        return this->acr;
+    case PCR:
+        return this->pcr;
+    case IFR:
+        return this->ifr | (this->irq() ? 0x80 : 0);
+    case IER:
+        return this->ier | 0x80;
+    }
+    return 0;
+}
+
+void Via6522::write(address_t addr, uint8_t value) {
+    switch (addr & 0x0f) {
+    case ORB:
+        this->orb = value;
+        break;
+    case ORA:
+    case ORA_NH:
+        this->ora = value;
+        break;
+    case DDRB:
+        this->ddrb = value;
+        break;
+    case DDRA:
+        this->ddra = value;
+        break;
+    case T1C_L:
+    case T1L_L:
+        this->t1_latch_lo = value;
+        break;
+    case T1C_H:
+        this->t1_latch_hi = value;
+        this->t1_value = this->t1_latch_lo | (this->t1_latch_hi << 8);
+        this->t1_start = this->cpu.cycles;
+        this->t1_irq_at = this->t1_start + this->t1_value + 1;
+        this->ifr &= ~IRQ_T1;
+        break;
+    case T1L_H:
+        this->t1_latch_hi = value;
+        this->ifr &= ~IRQ_T1;
+        break;
+    case T2C_L:
+        this->t2_latch_lo = value;
+        break;
+    case T2C_H:
+        this->t2_value = this->t2_latch_lo | (value << 8);
+        this->t2_start = this->cpu.cycles;
+        this->t2_irq_at = this->t2_start + this->t2_value + 1;
+        this->ifr &= ~IRQ_T2;
+        break;
+    case SR:
+        this->sr = value;
+        break;
+    case ACR:
+        if ((value ^ this->acr) & ACR_T1_FREE_RUN) {
+            // carry on from where the counter is now in the new mode
+            this->t1_value = this->timer1();
+            this->t1_start = this->cpu.cycles;
+            if (this->t1_irq_at != Cpu::NO_EVENT || (value & ACR_T1_FREE_RUN)) {
+                this->t1_irq_at = this->t1_start + this->t1_value + 1;
+            }
+        }
+        this->acr = value;
+        break;
+    case PCR:
+        this->pcr = value;
+        break;
+    case IFR:
+        this->ifr &= ~(value & 0x7f);
+        break;
+    case IER:
+        if (value & 0x80) {
+            this->ier |= value & 0x7f;
+        } else {
+            this->ier &= ~value;
+        }
+        break;
+    }
+    this->update();
+}
+
+void Via6522::on_cycle(uint64_t cycle) {
+    if (this->t1_irq_at <= cycle) {
+        this->ifr |= IRQ_T1;
+        if (this->acr & ACR_T1_FREE_RUN) {
+            const uint16_t latch = this->t1_latch_lo | (this->t1_latch_hi << 8);
+            this->t1_irq_at += latch + 2;
+        } else {
+            this->t1_irq_at = Cpu::NO_EVENT;
+        }
+    }
+    if (this->t2_irq_at <= cycle) {
+        this->ifr |= IRQ_T2;
+        this->t2_irq_at = Cpu::NO_EVENT;
+    }
+    this->update();
+}
+
+void Via6522::update() {
+    const uint64_t next = std::min(this->t1_irq_at, this->t2_irq_at);
+    if (next == Cpu::NO_EVENT) {
+        this->cpu.cancel(this);
+    } else {
+        this->cpu.schedule(this, next);
+    }
+    this->cpu.set_irq(this->irq());
+}
@@ -0,0 +1,98 @@
+#ifndef VIA6522_H
+#define VIA6522_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+/* A 6522 VIA: two 16 bit timers, two 8 bit ports and the interrupt
+ * registers, for mapping into a Cpu's memory with Mem::map_device. The
+ * 16 registers repeat through the page(s) it is mapped at.
+ *
+ * Nothing runs per cycle or per instruction. A timer only remembers the
+ * cycle it was started at and its start value, and works out its counter
+ * from Cpu::cycles when it is read. Underflows that interrupt are
+ * CycleEvents scheduled on the Cpu, so between them the VIA costs nothing.
+ * Reads and writes happen at the cycle the accessing instruction started.
+ *
+ * Timer 1 counts down from the value written to its counter, interrupts
+ * when it passes zero, and then either keeps counting down from $ffff
+ * (one shot) or reloads from its latches every latch + 2 cycles (free run,
+ * ACR bit 6). Timer 2 is one shot only; pulse counting (ACR bit 5) isn't
+ * modeled. The VIA drives the Cpu's IRQ line whenever a flag is set in
+ * both IFR and IER, so it should be the only device using set_irq. Resets
+ * of the Cpu drop its scheduled events, so reset the VIA along with it.
+ * Its state can be saved and restored, for TimeTravel::add_state.
+ *
+ * The ports read the output register for pins set as outputs in the data
+ * direction register, and the pins set with set_port_a_pins and
+ * set_port_b_pins for the rest. The shift register, PCR and the CA/CB
+ * handshake lines are plain registers that do nothing.
+ */
+class Via6522 : public MemDevice, public SavesState, private CycleEvent {
+public:
+    enum Register {
+        ORB, ORA, DDRB, DDRA, T1C_L, T1C_H, T1L_L, T1L_H,
+        T2C_L, T2C_H, SR, ACR, PCR, IFR, IER, ORA_NH,
+    };
+
+    /* IFR and IER bits */
+    enum Interrupt {
+        IRQ_T2 = 0x20,
+        IRQ_T1 = 0x40,
+    };
+
+    /* ACR bit 6 */
+    static const uint8_t ACR_T1_FREE_RUN = 0x40;
+
+    explicit Via6522(Cpu& cpu);
+    ~Via6522();
+
+    uint8_t read(address_t addr);
+    void write(address_t addr, uint8_t value);
+
+    /* Back to power on: timers stopped, interrupts disabled and clear, and
+     * all pins inputs */
+    void reset();
+
+    /* What the pins of each port read when they're inputs */
+    void set_port_a_pins(uint8_t pins) { this->pins_a = pins; }
+    void set_port_b_pins(uint8_t pins) { this->pins_b = pins; }
+
+    /* The port as it is driven: outputs, and pins for the inputs */
+    uint8_t port_a() const { return this->port(this->ora, this->ddra, this->pins_a); }
+    uint8_t port_b() const { return this->port(this->orb, this->ddrb, this->pins_b); }
+
+    void save_state(std::string& state) const;
+    void restore_state(const std::string& state);
+
+    uint16_t timer1() const;
+    uint16_t timer2() const;
+    bool irq() const { return this->ifr & this->ier & 0x7f; }
+
+private:
+    static uint8_t port(uint8_t out, uint8_t ddr, uint8_t pins) {
+        return (out & ddr) | (pins & ~ddr);
+    }
+
+    void on_cycle(uint64_t cycle);
+
+    /* Schedule the next underflow that interrupts, and drive the IRQ line */
+    void update();
+
+    Cpu& cpu;
+    uint8_t orb, ora, ddrb, ddra;
+    uint8_t pins_a, pins_b;
+    uint8_t sr, acr, pcr, ifr, ier;
+
+    uint8_t t1_latch_lo, t1_latch_hi;
+    uint64_t t1_start;      // the cycle the timer was loaded at
+    uint16_t t1_value;      // and what with
+    uint64_t t1_irq_at;     // Cpu::NO_EVENT if it won't interrupt again
+
+    uint8_t t2_latch_lo;
+    uint64_t t2_start;
+    uint16_t t2_value;
+    uint64_t t2_irq_at;
+};
+
+#endif // VIA6522_H
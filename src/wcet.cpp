@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include "wcet.h"
+#include "opcodes.h"
+
+static const uint8_t OP_JSR = 0x20;
+
+/* The node every return, RTI and BRK leads to */
+static const size_t EXIT = 0;
+static const size_t NONE = (size_t) -1;
+static const uint64_t UNREACHED = (uint64_t) -1;
+
+static std::string hex_address(address_t addr) {
+    std::ostringstream ss;
+    ss << "0x" << std::hex << std::setw(4) << std::setfill('0') << addr;
+    return ss.str();
+}
+
+/* Add count runs of block to steps, merged with any earlier step for it */
+static void add_step(std::vector<WcetStep>& steps, address_t block, uint64_t count) {
+    for (size_t i = 0; i < steps.size(); ++i) {
+        if (steps[i].block == block) {
+            steps[i].count += count;
+            return;
+        }
+    }
+    WcetStep step = { block, count };
+    steps.push_back(step);
+}
+
+static void add_steps(std::vector<WcetStep>& steps, const std::vector<WcetStep>& more,
+                      uint64_t times) {
+    if (times == 0) {
+        return;
+    }
+    for (size_t i = 0; i < more.size(); ++i) {
+        add_step(steps, more[i].block, more[i].count * times);
+    }
+}
+
+/* The node that n has been collapsed into, if any */
+static size_t find(std::vector<size_t>& rep, size_t n) {
+    while (rep[n] != n) {
+        rep[n] = rep[rep[n]];
+        n = rep[n];
+    }
+    return n;
+}
+
+/* Orders loops innermost first */
+struct LoopSizeLess {
+    template <typename Loop>
+    bool operator()(const Loop& a, const Loop& b) const {
+        return a.body.size() < b.body.size();
+    }
+};
+
+WcetAnalyzer::WcetAnalyzer(const ControlFlowGraph& cfg) : cfg(cfg) { }
+
+void WcetAnalyzer::set_loop_bound(address_t header, unsigned max_iterations,
+                                  unsigned min_iterations) {
+    if (min_iterations < 1 || min_iterations > max_iterations) {
+        throw std::invalid_argument("Loop bounds need 1 <= min <= max");
+    }
+    LoopBound bound = { min_iterations, max_iterations };
+    this->bounds[header] = bound;
+    // bounds change the cost of anything analyzed so far
+    this->routines.clear();
+}
+
+WcetResult WcetAnalyzer::analyze(address_t entry) {
+    const Routine& routine = this->routine(entry);
+    WcetResult result;
+    result.best = routine.lo;
+    result.worst = routine.hi;
+    result.critical_path = routine.steps;
+    result.page_crossings.assign(routine.page_crossings.begin(),
+                                 routine.page_crossings.end());
+    return result;
+}
+
+const WcetAnalyzer::Routine& WcetAnalyzer::routine(address_t entry) {
+    std::map<address_t, Routine>::const_iterator found = this->routines.find(entry);
+    if (found != this->routines.end()) {
+        return found->second;
+    }
+    if (this->in_progress.count(entry)) {
+        throw WcetError("Recursive call to " + hex_address(entry));
+    }
+    if (!this->cfg.block_at(entry)) {
+        throw WcetError("No code at " + hex_address(entry));
+    }
+
+    this->in_progress.insert(entry);
+    Routine result;
+    try {
+        std::vector<Node> nodes(1);
+        nodes[EXIT].addr = 0;
+        nodes[EXIT].lo = nodes[EXIT].hi = 0;
+        std::map<address_t, size_t> index;
+        std::vector<size_t> work;
+        const size_t start = this->node_for(entry, nodes, index, work, result);
+
+        while (!work.empty()) {
+            const size_t n = work.back();
+            work.pop_back();
+            const ControlFlowGraph::Block& block = *this->cfg.block_at(nodes[n].addr);
+            if (block.n_edges == 0) {
+                Arc arc = { EXIT, 0, 0, std::vector<WcetStep>() };
+                nodes[n].out.push_back(arc);
+            }
+            for (unsigned i = 0; i < block.n_edges; ++i) {
+                const ControlFlowGraph::Edge& edge = block.edges[i];
+                if (edge.kind == ControlFlowGraph::EDGE_CALL) {
+                    continue;   // costed with the block
+                }
+                Arc arc = { 0, 0, 0, std::vector<WcetStep>() };
+                arc.to = this->node_for(edge.target, nodes, index, work, result);
+                if (edge.kind == ControlFlowGraph::EDGE_BRANCH) {
+                    arc.lo = arc.hi = branch_extra_cycles(true, block.end, edge.target);
+                    if (arc.hi > 1) {
+                        result.page_crossings.insert(block.last);
+                    }
+                }
+                nodes[n].out.push_back(arc);
+            }
+        }
+
+        std::vector<Loop> loops;
+        this->find_loops(nodes, start, loops);
+        std::sort(loops.begin(), loops.end(), LoopSizeLess());
+        std::vector<size_t> rep(nodes.size());
+        for (size_t i = 0; i < rep.size(); ++i) {
+            rep[i] = i;
+        }
+        for (size_t i = 0; i < loops.size(); ++i) {
+            this->collapse(loops[i], nodes, rep);
+        }
+
+        std::vector<char> members(nodes.size(), 0);
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            members[i] = find(rep, i) == i;
+        }
+        std::vector<uint64_t> lo, hi;
+        std::vector<std::pair<size_t, size_t> > worst_arc;
+        this->paths(start, nodes, rep, members, lo, hi, worst_arc);
+        if (lo[EXIT] == UNREACHED) {
+            throw WcetError("The routine at " + hex_address(entry) + " never returns");
+        }
+        result.lo = lo[EXIT];
+        result.hi = hi[EXIT];
+        this->worst_steps(start, EXIT, nodes, worst_arc, result.steps);
+    } catch (...) {
+        this->in_progress.erase(entry);
+        throw;
+    }
+    this->in_progress.erase(entry);
+    return this->routines[entry] = result;
+}
+
+size_t WcetAnalyzer::node_for(address_t addr, std::vector<Node>& nodes,
+                              std::map<address_t, size_t>& index,
+                              std::vector<size_t>& work, Routine& result) {
+    std::map<address_t, size_t>::const_iterator found = index.find(addr);
+    if (found != index.end()) {
+        return found->second;
+    }
+    const ControlFlowGraph::Block& block = *this->cfg.block_at(addr);
+    if (block.is_indirect()) {
+        throw WcetError("Indirect jump at " + hex_address(block.last));
+    } else if (block.is_unknown()) {
+        throw WcetError("Unknown instruction or target after " + hex_address(block.last));
+    }
+
+    Node node;
+    node.addr = addr;
+    node.lo = node.hi = 0;
+    add_step(node.steps, addr, 1);
+
+    const uint8_t* mem = this->cfg.image();
+    for (uint32_t pc = block.start; pc < block.end; pc += OPS[mem[pc]].n_bytes) {
+        const uint8_t op = mem[pc];
+        const OpInfo& op_info = OPS[op];
+        node.lo += op_info.n_cycles;
+        node.hi += op_info.n_cycles;
+        // an absolute base at the start of a page can't be indexed past it
+        if (has_page_cross_cycle(op) && (op_info.address_mode == INDY || mem[pc + 1] != 0)) {
+            ++node.hi;
+            result.page_crossings.insert(pc);
+        }
+        if (op == OP_JSR) {
+            const Routine& sub = this->routine(mem[pc + 1] | (mem[pc + 2] << 8));
+            node.lo += sub.lo;
+            node.hi += sub.hi;
+            add_steps(node.steps, sub.steps, 1);
+            result.page_crossings.insert(sub.page_crossings.begin(),
+                                         sub.page_crossings.end());
+        }
+    }
+
+    index[addr] = nodes.size();
+    nodes.push_back(node);
+    work.push_back(nodes.size() - 1);
+    return nodes.size() - 1;
+}
+
+void WcetAnalyzer::find_loops(const std::vector<Node>& nodes, size_t start,
+                              std::vector<Loop>& loops) const {
+    // a depth first search finds the back edges, and so the loop headers
+    enum { NEW, ON_STACK, DONE };
+    std::vector<char> state(nodes.size(), NEW);
+    std::map<size_t, std::vector<size_t> > latches;
+    std::vector<std::pair<size_t, size_t> > stack;
+    stack.push_back(std::make_pair(start, 0));
+    state[start] = ON_STACK;
+    while (!stack.empty()) {
+        const size_t n = stack.back().first;
+        const size_t i = stack.back().second;
+        if (i == nodes[n].out.size()) {
+            state[n] = DONE;
+            stack.pop_back();
+            continue;
+        }
+        ++stack.back().second;
+        const size_t to = nodes[n].out[i].to;
+        if (state[to] == ON_STACK) {
+            latches[to].push_back(n);
+        } else if (state[to] == NEW) {
+            state[to] = ON_STACK;
+            stack.push_back(std::make_pair(to, 0));
+        }
+    }
+
+    std::vector<std::vector<size_t> > preds(nodes.size());
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        for (size_t i = 0; i < nodes[n].out.size(); ++i) {
+            preds[nodes[n].out[i].to].push_back(n);
+        }
+    }
+
+    // the body is everything that reaches a latch without going through the
+    // header, and should only be entered through the header
+    std::map<size_t, std::vector<size_t> >::const_iterator it;
+    for (it = latches.begin(); it != latches.end(); ++it) {
+        Loop loop;
+        loop.header = it->first;
+        std::vector<char> in_body(nodes.size(), 0);
+        in_body[loop.header] = 1;
+        loop.body.push_back(loop.header);
+        std::vector<size_t> work;
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            const size_t latch = it->second[i];
+            if (!in_body[latch]) {
+                in_body[latch] = 1;
+                loop.body.push_back(latch);
+                work.push_back(latch);
+            }
+        }
+        while (!work.empty()) {
+            const size_t n = work.back();
+            work.pop_back();
+            for (size_t i = 0; i < preds[n].size(); ++i) {
+                const size_t p = preds[n][i];
+                if (!in_body[p]) {
+                    in_body[p] = 1;
+                    loop.body.push_back(p);
+                    work.push_back(p);
+                }
+            }
+        }
+        for (size_t i = 0; i < loop.body.size(); ++i) {
+            const size_t n = loop.body[i];
+            for (size_t j = 0; n != loop.header && j < preds[n].size(); ++j) {
+                if (!in_body[preds[n][j]]) {
+                    throw WcetError("The loop at " + hex_address(nodes[loop.header].addr)
+                                    + " is also entered at " + hex_address(nodes[n].addr));
+                }
+            }
+        }
+        loops.push_back(loop);
+    }
+}
+
+void WcetAnalyzer::collapse(const Loop& loop, std::vector<Node>& nodes,
+                            std::vector<size_t>& rep) const {
+    const size_t header = loop.header;
+    std::map<address_t, LoopBound>::const_iterator bound =
+        this->bounds.find(nodes[header].addr);
+    if (bound == this->bounds.end()) {
+        throw WcetError("No bound for the loop at " + hex_address(nodes[header].addr));
+    }
+
+    std::vector<char> members(nodes.size(), 0);
+    for (size_t i = 0; i < loop.body.size(); ++i) {
+        members[find(rep, loop.body[i])] = 1;
+    }
+    std::vector<uint64_t> lo, hi;
+    std::vector<std::pair<size_t, size_t> > worst_arc;
+    this->paths(header, nodes, rep, members, lo, hi, worst_arc);
+
+    // one pass round the loop ends with an arc back to the header
+    uint64_t pass_lo = UNREACHED;
+    uint64_t pass_hi = 0;
+    size_t pass_node = NONE;
+    size_t pass_arc = 0;
+    std::vector<Arc> exits;
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        if (!members[n] || lo[n] == UNREACHED) {
+            continue;
+        }
+        for (size_t i = 0; i < nodes[n].out.size(); ++i) {
+            const Arc& arc = nodes[n].out[i];
+            const size_t to = find(rep, arc.to);
+            if (to == header) {
+                pass_lo = std::min(pass_lo, lo[n] + arc.lo);
+                if (pass_node == NONE || hi[n] + arc.hi > pass_hi) {
+                    pass_hi = hi[n] + arc.hi;
+                    pass_node = n;
+                    pass_arc = i;
+                }
+            } else if (!members[to]) {
+                Arc exit = { to, lo[n] + arc.lo, hi[n] + arc.hi, std::vector<WcetStep>() };
+                this->worst_steps(header, n, nodes, worst_arc, exit.via);
+                add_steps(exit.via, arc.via, 1);
+                exits.push_back(exit);
+            }
+        }
+    }
+
+    std::vector<WcetStep> pass;
+    this->worst_steps(header, pass_node, nodes, worst_arc, pass);
+    add_steps(pass, nodes[pass_node].out[pass_arc].via, 1);
+
+    // the last pass is the one that leaves, so it's costed on the exits
+    Node& node = nodes[header];
+    node.lo = (bound->second.min - 1) * pass_lo;
+    node.hi = (bound->second.max - 1) * pass_hi;
+    node.steps.clear();
+    add_steps(node.steps, pass, bound->second.max - 1);
+    node.out.swap(exits);
+
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        if (members[n] && n != header) {
+            rep[n] = header;
+        }
+    }
+}
+
+void WcetAnalyzer::paths(size_t start, const std::vector<Node>& nodes,
+                         std::vector<size_t>& rep, const std::vector<char>& members,
+                         std::vector<uint64_t>& lo, std::vector<uint64_t>& hi,
+                         std::vector<std::pair<size_t, size_t> >& worst_arc) const {
+    // inner loops are collapsed by now, so what's left is acyclic
+    enum { NEW, ON_STACK, DONE };
+    std::vector<char> state(nodes.size(), NEW);
+    std::vector<size_t> order;
+    std::vector<std::pair<size_t, size_t> > stack;
+    stack.push_back(std::make_pair(start, 0));
+    state[start] = ON_STACK;
+    while (!stack.empty()) {
+        const size_t n = stack.back().first;
+        const size_t i = stack.back().second;
+        if (i == nodes[n].out.size()) {
+            state[n] = DONE;
+            order.push_back(n);
+            stack.pop_back();
+            continue;
+        }
+        ++stack.back().second;
+        const size_t to = find(rep, nodes[n].out[i].to);
+        if (!members[to] || to == start) {
+            continue;
+        } else if (state[to] == ON_STACK) {
+            throw WcetError("Can't bound the cycle through " + hex_address(nodes[to].addr));
+        } else if (state[to] == NEW) {
+            state[to] = ON_STACK;
+            stack.push_back(std::make_pair(to, 0));
+        }
+    }
+
+    lo.assign(nodes.size(), UNREACHED);
+    hi.assign(nodes.size(), 0);
+    worst_arc.assign(nodes.size(), std::make_pair(NONE, (size_t) 0));
+    lo[start] = nodes[start].lo;
+    hi[start] = nodes[start].hi;
+    for (size_t k = order.size(); k-- > 0;) {
+        const size_t n = order[k];
+        for (size_t i = 0; i < nodes[n].out.size(); ++i) {
+            const Arc& arc = nodes[n].out[i];
+            const size_t to = find(rep, arc.to);
+            if (!members[to] || to == start) {
+                continue;
+            }
+            lo[to] = std::min(lo[to], lo[n] + arc.lo + nodes[to].lo);
+            const uint64_t worst = hi[n] + arc.hi + nodes[to].hi;
+            if (worst_arc[to].first == NONE || worst > hi[to]) {
+                hi[to] = worst;
+                worst_arc[to] = std::make_pair(n, i);
+            }
+        }
+    }
+}
+
+void WcetAnalyzer::worst_steps(size_t start, size_t node, const std::vector<Node>& nodes,
+                               const std::vector<std::pair<size_t, size_t> >& worst_arc,
+                               std::vector<WcetStep>& steps) const {
+    std::vector<std::pair<size_t, size_t> > path;
+    for (size_t n = node; n != start; n = worst_arc[n].first) {
+        path.push_back(worst_arc[n]);
+    }
+    add_steps(steps, nodes[start].steps, 1);
+    for (size_t k = path.size(); k-- > 0;) {
+        const Arc& arc = nodes[path[k].first].out[path[k].second];
+        add_steps(steps, arc.via, 1);
+        const size_t to = k > 0 ? path[k - 1].first : node;
+        add_steps(steps, nodes[to].steps, 1);
+    }
+}
+
+void write_wcet_report(std::ostream& out, const WcetResult& result) {
+    out << "best " << result.best << " cycles, worst " << result.worst
+        << " cycles\ncritical path:\n";
+    out << std::hex << std::setfill('0');
+    for (size_t i = 0; i < result.critical_path.size(); ++i) {
+        out << "  " << std::setw(4) << result.critical_path[i].block << "  x"
+            << std::dec << result.critical_path[i].count << std::hex << "\n";
+    }
+    if (!result.page_crossings.empty()) {
+        out << "may cross a page:\n";
+        for (size_t i = 0; i < result.page_crossings.size(); ++i) {
+            out << "  " << std::setw(4) << result.page_crossings[i] << "\n";
+        }
+    }
+    out << std::dec << std::setfill(' ');
+}
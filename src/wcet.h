@@ -0,0 +1,155 @@
+#ifndef WCET_H
+#define WCET_H
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "cfg.h"
+
+/* Thrown when a routine's cycle count can't be bounded */
+class WcetError : public std::runtime_error {
+public:
+    explicit WcetError(const std::string& message)
+        : std::runtime_error(message) { }
+};
+
+/* A block on a routine's worst case path, with the number of times it runs
+ * along that path */
+struct WcetStep {
+    address_t block;
+    uint64_t count;
+};
+
+struct WcetResult {
+    uint64_t best;
+    uint64_t worst;
+
+    /* The blocks of the worst case path, in the order they're first run.
+     * This includes the blocks of the subroutines it calls. */
+    std::vector<WcetStep> critical_path;
+
+    /* Instructions that may take an extra cycle for crossing a page: indexed
+     * loads and arithmetic whose base isn't page aligned, and branches to
+     * another page. Sorted by address. */
+    std::vector<address_t> page_crossings;
+};
+
+/* Works out the best and worst case cycle counts of routines from their
+ * ControlFlowGraph, without running them.
+ *
+ * A routine runs from its entry point until an RTS, RTI or BRK, and its
+ * cycles are those emu_loop would count: OpInfo::n_cycles for each
+ * instruction, plus the page crossing and branch cycles from opcodes.h.
+ * JSR adds the bounds of the subroutine it calls. HCL counts only its own
+ * cycles, since what its handler charges isn't known until it runs.
+ *
+ * Every loop needs a bound, given by set_loop_bound for the loop's header:
+ * the block the loop is entered through, which is where its back edges go.
+ * The bound is the number of times the header runs each time the loop is
+ * entered. Nested loops multiply, so an inner loop's bound is per pass of
+ * the loop around it.
+ *
+ * analyze throws WcetError for a loop without a bound, a loop with more
+ * than one way in, an indirect jump, code that can't be decoded, recursion,
+ * or a routine that never returns.
+ */
+class WcetAnalyzer {
+public:
+    explicit WcetAnalyzer(const ControlFlowGraph& cfg);
+
+    void set_loop_bound(address_t header, unsigned max_iterations,
+                        unsigned min_iterations = 1);
+
+    WcetResult analyze(address_t entry);
+
+private:
+    struct LoopBound {
+        unsigned min;
+        unsigned max;
+    };
+
+    /* A routine's bounds, kept so each subroutine is only analyzed once */
+    struct Routine {
+        uint64_t lo;
+        uint64_t hi;
+        std::vector<WcetStep> steps;
+        std::set<address_t> page_crossings;
+    };
+
+    /* An edge between nodes in the graph of one routine, with its cost.
+     * Exits from a collapsed loop carry the path through the loop to the
+     * exit as via. */
+    struct Arc {
+        size_t to;
+        uint64_t lo;
+        uint64_t hi;
+        std::vector<WcetStep> via;
+    };
+
+    /* A block of the routine, or a loop collapsed into its header */
+    struct Node {
+        address_t addr;
+        uint64_t lo;
+        uint64_t hi;
+        std::vector<WcetStep> steps;
+        std::vector<Arc> out;
+    };
+
+    struct Loop {
+        size_t header;
+        std::vector<size_t> body;
+    };
+
+    const Routine& routine(address_t entry);
+
+    /* The node for the block at addr, adding it (with its cost and, for a
+     * JSR, its subroutine's) if it's new */
+    size_t node_for(address_t addr, std::vector<Node>& nodes,
+                    std::map<address_t, size_t>& index, std::vector<size_t>& work,
+                    Routine& result);
+
+    void find_loops(const std::vector<Node>& nodes, size_t exit,
+                    std::vector<Loop>& loops) const;
+
+    /* Replace the loop with its header, whose cost becomes that of all but
+     * the last pass, and whose arcs become the ways out of the loop */
+    void collapse(const Loop& loop, std::vector<Node>& nodes,
+                  std::vector<size_t>& rep) const;
+
+    /* Longest and shortest paths from start through the nodes in members
+     * (indexed by node, nonzero for members), not following arcs back to
+     * start. Fills in the best and worst cost to the end of each node, and
+     * the arc taken to it on the worst path. */
+    void paths(size_t start, const std::vector<Node>& nodes,
+               std::vector<size_t>& rep, const std::vector<char>& members,
+               std::vector<uint64_t>& lo, std::vector<uint64_t>& hi,
+               std::vector<std::pair<size_t, size_t> >& worst_arc) const;
+
+    /* The steps of the worst path from start to the end of node */
+    void worst_steps(size_t start, size_t node, const std::vector<Node>& nodes,
+                     const std::vector<std::pair<size_t, size_t> >& worst_arc,
+                     std::vector<WcetStep>& steps) const;
+
+    const ControlFlowGraph& cfg;
+    std::map<address_t, LoopBound> bounds;
+    std::map<address_t, Routine> routines;
+    std::set<address_t> in_progress;
+};
+
+/* Write the bounds, the worst case path and the possible page crossings:
+ *
+ *      best 62 cycles, worst 67 cycles
+ *      critical path:
+ *        0600  x1
+ *        0602  x5
+ *        060a  x1
+ *      may cross a page:
+ *        0610
+ */
+void write_wcet_report(std::ostream& out, const WcetResult& result);
+
+#endif // WCET_H
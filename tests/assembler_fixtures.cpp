@@ -42,3 +42,44 @@ IMPL_CODE_FIXTURE(AssemblyWithForwardDeclaredLabel,
     "notequal:\n"          // 0x08
     "BRK"                  // 0x08: 00 00
 )
+
+/* One instruction per addressing mode. Zero page forms are picked for
+ * numbers that fit in 8-bits, unless the instruction has no zero page form
+ * (LDA has no zero page,Y mode so LDA $10,Y assembles as absolute,Y).
+ * Labels are code addresses, so they always use the 16-bit forms.
+ */
+IMPL_CODE_FIXTURE(AssemblyWithAllAddressModes,
+    "Start:\n"             // 0x00
+    "  LDA #$10\n"         // 0x00: a9 10
+    "  LDA $10\n"          // 0x02: a5 10
+    "  LDA $10,X\n"        // 0x04: b5 10
+    "  LDA $1234\n"        // 0x06: ad 34 12
+    "  LDA $1234,X\n"      // 0x09: bd 34 12
+    "  lda $1234, y\n"     // 0x0c: b9 34 12
+    "  LDA $10,Y\n"        // 0x0f: b9 10 00
+    "  LDX $10,Y\n"        // 0x12: b6 10
+    "  LDA ($20,X)\n"      // 0x14: a1 20
+    "  LDA ($20),Y\n"      // 0x16: b1 20
+    "  ASL A\n"            // 0x18: 0a
+    "  ASL  ; comment\n"   // 0x19: 0a
+    "  STA table,X\n"      // 0x1a: 9d 29 00  -- relocated
+    "  LDA table+1\n"      // 0x1d: ad 2a 00  -- relocated
+    "  JMP (table)\n"      // 0x20: 6c 29 00  -- relocated
+    "  JMP $0010\n"        // 0x23: 4c 10 00
+    "  JMP Start\n"        // 0x26: 4c 00 00  -- relocated
+    "table:\n"             // 0x29
+    "  BRK\n"              // 0x29: 00 00
+)
+
+/* Counts X down from 0 through 255 to 0, storing it each time */
+static const uint8_t STORE_LOOP[] = {
+    0xa2, 0x00,         // 0600: LDX #$00
+    0x8e, 0x00, 0x02,   // 0602: STX $0200
+    0xca,               // 0605: DEX
+    0xd0, 0xfa,         // 0606: BNE $0602
+    0x00, 0x00,         // 0608: BRK
+};
+
+void load_store_loop(Cpu& cpu) {
+    cpu.load_code(std::vector<uint8_t>(STORE_LOOP, STORE_LOOP + sizeof(STORE_LOOP)));
+}
@@ -25,5 +25,10 @@ protected:
 
 DECL_CODE_FIXTURE(AssemblyCodeWithLabel);
 DECL_CODE_FIXTURE(AssemblyWithForwardDeclaredLabel);
+DECL_CODE_FIXTURE(AssemblyWithAllAddressModes);
+
+/* Load a loop at $0600 that counts X down from 0 through 255 to 0, storing
+ * it to $0200 each time, then stops at a BRK at $0608 */
+void load_store_loop(Cpu& cpu);
 
 #endif // ASSEMBLER_FIXTURES_H
@@ -0,0 +1,53 @@
+#include <cstdio>
+#include <fstream>
+#include "gtest/gtest.h"
+#include "asm_cache.h"
+#include "assembler_fixtures.h"
+
+TEST(AssemblyCache, HashDependsOnSource) {
+    ASSERT_EQ(AssemblyCache::hash_source("LDA #$01\n"),
+              AssemblyCache::hash_source("LDA #$01\n"));
+    ASSERT_NE(AssemblyCache::hash_source("LDA #$01\n"),
+              AssemblyCache::hash_source("LDA #$02\n"));
+}
+
+TEST_F(AssemblyCodeWithLabel, CacheRoundTrip) {
+    const std::string source = codetext.str();
+    AssemblyCache cache(testing::TempDir());
+    std::remove(cache.path_for(AssemblyCache::hash_source(source)).c_str());
+
+    AssemblyCache::Entry entry;
+    ASSERT_FALSE(cache.lookup(source, entry));
+    // the first call assembles and stores, the second is a hit
+    ASSERT_FALSE(cache.assemble(source, entry));
+    AssemblyCache::Entry cached;
+    ASSERT_TRUE(cache.assemble(source, cached));
+
+    Assembler assembler(codetext);
+    ASSERT_EQ(assembler.code, cached.code);
+    ASSERT_EQ(assembler.labels, cached.labels);
+    ASSERT_EQ(assembler.relative_addresses, cached.relative_addresses);
+
+    std::vector<uint8_t> expected, relocated;
+    assembler.relocate_code(0x600, expected);
+    cached.relocate_code(0x600, relocated);
+    ASSERT_EQ(expected, relocated);
+}
+
+TEST_F(AssemblyWithForwardDeclaredLabel, CacheIgnoresCorruptEntry) {
+    const std::string source = codetext.str();
+    AssemblyCache cache(testing::TempDir());
+    const std::string path = cache.path_for(AssemblyCache::hash_source(source));
+    {
+        std::ofstream f(path.c_str(), std::ios::binary | std::ios::trunc);
+        f << "M65C garbage";
+    }
+
+    AssemblyCache::Entry entry;
+    ASSERT_FALSE(cache.lookup(source, entry));
+    // a miss repairs the entry
+    ASSERT_FALSE(cache.assemble(source, entry));
+    ASSERT_EQ("a901c902d00285220000", Assembler::get_code_hex(entry.code));
+    ASSERT_TRUE(cache.lookup(source, entry));
+    std::remove(path.c_str());
+}
@@ -30,8 +30,77 @@ TEST_F(AssemblyCodeWithLabel, Relocation_BaseAddr1234) {
               Assembler::get_code_hex(relocated_code));
 }
 
+TEST(Assembler, HostCall) {
+    std::stringstream codetext("HCL #$07\nBRK\n");
+    Assembler assembler(codetext);
+    ASSERT_EQ("22070000", assembler.get_code_hex());
+}
+
 TEST_F(AssemblyWithForwardDeclaredLabel, Assembly) {
     Assembler assembler(codetext);
     ASSERT_EQ("a901c902d00285220000", assembler.get_code_hex());
 }
 
+TEST_F(AssemblyCodeWithLabel, LinkInto_MatchesRelocation) {
+    Assembler assembler(codetext);
+    std::vector<uint8_t> relocated_code;
+    assembler.relocate_code(0x1234, relocated_code);
+
+    std::vector<uint8_t> mem(0x10000, 0xee);
+    assembler.link_into(0x1234, &mem[0], 0xfffa);
+    ASSERT_TRUE(std::equal(relocated_code.begin(), relocated_code.end(),
+                           mem.begin() + 0x1234));
+    // nothing outside the code is touched
+    ASSERT_EQ(0xee, mem[0x1233]);
+    ASSERT_EQ(0xee, mem[0x1234 + relocated_code.size()]);
+}
+
+TEST_F(AssemblyCodeWithLabel, LinkInto_OutOfBounds) {
+    Assembler assembler(codetext);
+    std::vector<uint8_t> mem(0x10000, 0);
+    const size_t size = assembler.code.size();
+    // ending exactly at the limit is fine, one byte further is not
+    assembler.link_into(0xfffa - size, &mem[0], 0xfffa);
+    ASSERT_THROW(assembler.link_into(0xfffa - size + 1, &mem[0], 0xfffa),
+                 std::invalid_argument);
+}
+
+TEST_F(AssemblyWithAllAddressModes, Assembly) {
+    Assembler assembler(codetext);
+    ASSERT_EQ("a910a510b510ad3412bd3412b93412b91000b610a120b1200a0a"
+              "9d2900ad2a006c29004c10004c00000000",
+              assembler.get_code_hex());
+}
+
+TEST_F(AssemblyWithAllAddressModes, Relocation) {
+    Assembler assembler(codetext);
+    std::vector<uint8_t> relocated_code;
+    assembler.relocate_code(0x600, relocated_code);
+    ASSERT_EQ("a910a510b510ad3412bd3412b93412b91000b610a120b1200a0a"
+              "9d2906ad2a066c29064c10004c00060000",
+              Assembler::get_code_hex(relocated_code));
+}
+
+/* Assemble a single line, expecting failure */
+static void assert_assembler_error(const char* line) {
+    std::stringstream src(line);
+    ASSERT_THROW(Assembler assembler(src), AssemblerError) << line;
+}
+
+TEST(Assembler, AddressModeErrors) {
+    assert_assembler_error("LDA ($1234),Y\n");      // not zero page
+    assert_assembler_error("LDA ($12),X\n");        // no such mode
+    assert_assembler_error("LDA ($12,Y)\n");        // no such mode
+    assert_assembler_error("STX $1234,X\n");        // STX has no abs,X
+    assert_assembler_error("JMP $12,X\n");
+    assert_assembler_error("LDA #$100\n");
+    assert_assembler_error("LDA #$FFFFFFFF\n");   // too large to wrap round
+    assert_assembler_error("LDA $FFFFFF10\n");
+    assert_assembler_error("LDA $10000\n");
+    assert_assembler_error("LDA #99999999999999999999\n");
+    assert_assembler_error("x:\nLDA x+$10000\n");
+    assert_assembler_error("LDA $10 junk\n");
+    assert_assembler_error("x:\nBNE $10\n");        // branches need labels
+    assert_assembler_error("x:\nLDA (x,X)\n");      // labels aren't zero page
+    assert_assembler_error("x:\nLDA x-1\n");        // before address zero
+}
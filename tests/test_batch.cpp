@@ -0,0 +1,107 @@
+#include <fstream>
+#include <sstream>
+#include "gtest/gtest.h"
+#include "batch.h"
+#include "assembler_fixtures.h"
+
+TEST(Batch, ReadManifest) {
+    std::istringstream manifest(
+        "# a comment\n"
+        "\n"
+        "one.6502 --max-cycles 100 --dump 0x200:0x201\n"
+        "  /abs/rom.bin --binary --load-addr $c000 --poke 0x10=$ff\n");
+    std::vector<BatchJob> jobs = read_manifest(manifest, "dir");
+    ASSERT_EQ(2u, jobs.size());
+
+    ASSERT_EQ("dir/one.6502", jobs[0].file);
+    ASSERT_EQ(3, jobs[0].line);
+    ASSERT_FALSE(jobs[0].options.binary);
+    ASSERT_EQ(100u, jobs[0].options.max_cycles);
+    ASSERT_EQ(1u, jobs[0].options.dumps.size());
+    ASSERT_EQ(0x201, jobs[0].options.dumps[0].second);
+
+    ASSERT_EQ("/abs/rom.bin", jobs[1].file);
+    ASSERT_TRUE(jobs[1].options.binary);
+    ASSERT_EQ(0xc000, jobs[1].options.load_addr);
+    ASSERT_EQ(1u, jobs[1].options.pokes.size());
+    ASSERT_EQ(0x10, jobs[1].options.pokes[0].first);
+    ASSERT_EQ(0xff, jobs[1].options.pokes[0].second);
+}
+
+TEST(Batch, ManifestErrorsNameTheLine) {
+    std::istringstream manifest("one.6502\none.6502 --max-cycles lots\n");
+    try {
+        read_manifest(manifest, "");
+        FAIL() << "expected std::invalid_argument";
+    } catch (std::invalid_argument& error) {
+        ASSERT_EQ("Manifest line 2: bad option '--max-cycles'",
+                  std::string(error.what()));
+    }
+}
+
+TEST(Batch, OrderedWriter) {
+    std::ostringstream out;
+    OrderedWriter writer(out, 3, 1);
+    std::string line = "two";
+    writer.put(2, line);
+    ASSERT_TRUE(line.empty());
+    line = "one";
+    writer.put(1, line);
+    ASSERT_EQ("", out.str());
+    line = "zero";
+    writer.put(0, line);
+    writer.flush();
+    ASSERT_EQ("zero\none\ntwo\n", out.str());
+}
+
+struct CountCalls {
+    void operator()(size_t i) { ++this->calls[i]; }
+    std::vector<std::atomic<int> > calls;
+};
+
+TEST(Batch, ParallelForCallsEachIndexOnce) {
+    CountCalls count;
+    std::vector<std::atomic<int> > calls(1000);
+    count.calls.swap(calls);
+    parallel_for(count.calls.size(), 4, count);
+    for (size_t i = 0; i < count.calls.size(); ++i) {
+        ASSERT_EQ(1, count.calls[i]);
+    }
+}
+
+TEST_F(AssemblyCodeWithLabel, RunBatch) {
+    const std::string dir = testing::TempDir();
+    {
+        std::ofstream source((dir + "/batch_one.6502").c_str());
+        source << codetext.str();
+        std::ofstream binary((dir + "/batch_brk.bin").c_str(), std::ios::binary);
+        binary << '\0' << '\0';
+    }
+    std::istringstream manifest(
+        "batch_one.6502 --dump 0x200:0x201\n"
+        "batch_brk.bin --binary --max-instructions 1\n"
+        "batch_one.6502 --max-instructions 4\n"
+        "batch_missing.6502\n");
+    std::vector<BatchJob> jobs = read_manifest(manifest, dir);
+
+    std::ostringstream out;
+    ASSERT_EQ(1u, run_batch(jobs, 3, NULL, out));
+
+    std::istringstream lines(out.str());
+    std::string line;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        ASSERT_TRUE(std::getline(lines, line));
+        std::ostringstream prefix;
+        prefix << "{\"job\":" << i << ",\"file\":\"" << jobs[i].file << "\"";
+        ASSERT_EQ(0u, line.find(prefix.str())) << line;
+    }
+    ASSERT_FALSE(std::getline(lines, line));
+
+    const std::string text = out.str();
+    ASSERT_NE(std::string::npos, text.find(
+        "\"stop_reason\":\"brk\",\"dumps\":[{\"start\":512,\"bytes\":\"0303\"}]}"));
+    ASSERT_NE(std::string::npos, text.find(
+        "\"instructions\":4,"));
+    ASSERT_NE(std::string::npos, text.find(
+        "batch_missing.6502\",\"error\":\"File not found\"}"));
+}
@@ -0,0 +1,128 @@
+#include "gtest/gtest.h"
+#include "assembler.h"
+#include "cfg.h"
+#include "assembler_fixtures.h"
+
+typedef ControlFlowGraph::Block Block;
+
+static void assert_edge(const Block& block, unsigned i, address_t target,
+                        ControlFlowGraph::EdgeKind kind) {
+    ASSERT_LT(i, block.n_edges);
+    ASSERT_EQ(target, block.edges[i].target);
+    ASSERT_EQ(kind, block.edges[i].kind);
+}
+
+TEST_F(AssemblyCodeWithLabel, ControlFlowGraph) {
+    Assembler assembler(codetext);
+    std::vector<uint8_t> mem(Mem::MEM_SIZE, 0);
+    assembler.link_into(0x0600, mem.data(), mem.size());
+
+    ControlFlowGraph cfg;
+    cfg.build(mem.data(), 0x0600, 0x0600 + assembler.code.size(),
+              ControlFlowGraph::entry_points(assembler.labels, 0x0600));
+    ASSERT_EQ(3u, cfg.blocks().size());
+
+    const Block& start = cfg.blocks()[0];
+    ASSERT_EQ(0x0600, start.start);
+    ASSERT_EQ(0x0602u, start.end);
+    ASSERT_EQ(1u, start.n_instructions);
+    ASSERT_EQ(1u, start.n_edges);
+    assert_edge(start, 0, 0x0602, ControlFlowGraph::EDGE_FALLTHROUGH);
+
+    const Block* loop = cfg.block_at(0x0602);
+    ASSERT_TRUE(loop != NULL);
+    ASSERT_EQ(4u, loop->n_instructions);
+    ASSERT_EQ(0x0608, loop->last);
+    ASSERT_EQ(0u, loop->flags);
+    assert_edge(*loop, 0, 0x060a, ControlFlowGraph::EDGE_FALLTHROUGH);
+    assert_edge(*loop, 1, 0x0602, ControlFlowGraph::EDGE_BRANCH);
+
+    const Block* exit = cfg.block_at(0x060a);
+    ASSERT_TRUE(exit != NULL);
+    ASSERT_EQ(2u, exit->n_instructions);
+    ASSERT_EQ(0u, exit->n_edges);
+    ASSERT_EQ(0x060fu, exit->end);
+
+    ASSERT_TRUE(cfg.block_at(0x0603) == NULL);
+    ASSERT_TRUE(cfg.is_instruction(0x0603));
+    ASSERT_FALSE(cfg.is_instruction(0x0604));
+}
+
+TEST(ControlFlowGraph, CallsJumpsAndUnknownTargets) {
+    static const uint8_t CODE[] = {
+        0x20, 0x0b, 0x06,   // 0600: JSR $060b
+        0xa2, 0x00,         // 0603: LDX #$00
+        0xe8,               // 0605: INX
+        0xd0, 0xfd,         // 0606: BNE $0605
+        0x6c, 0x00, 0x02,   // 0608: JMP ($0200)
+        0xa9, 0x01,         // 060b: LDA #$01
+        0xf0, 0x03,         // 060d: BEQ $0612, outside the image
+        0x60,               // 060f: RTS
+        0x02,               // 0610: not an opcode
+    };
+    std::vector<uint8_t> mem(Mem::MEM_SIZE, 0);
+    std::copy(CODE, CODE + sizeof(CODE), mem.begin() + 0x0600);
+    std::vector<address_t> entries;
+    entries.push_back(0x0600);
+    entries.push_back(0x0610);
+    entries.push_back(0x0700);  // ignored
+
+    ControlFlowGraph cfg;
+    cfg.build(mem.data(), 0x0600, 0x0600 + sizeof(CODE), entries);
+    ASSERT_EQ(7u, cfg.blocks().size());
+
+    const Block* call = cfg.block_at(0x0600);
+    assert_edge(*call, 0, 0x060b, ControlFlowGraph::EDGE_CALL);
+    assert_edge(*call, 1, 0x0603, ControlFlowGraph::EDGE_FALLTHROUGH);
+
+    // the branch back to the INX splits the block it was decoded in
+    const Block* ldx = cfg.block_at(0x0603);
+    ASSERT_EQ(1u, ldx->n_instructions);
+    assert_edge(*ldx, 0, 0x0605, ControlFlowGraph::EDGE_FALLTHROUGH);
+    const Block* loop = cfg.block_at(0x0605);
+    ASSERT_EQ(2u, loop->n_instructions);
+    assert_edge(*loop, 1, 0x0605, ControlFlowGraph::EDGE_BRANCH);
+
+    ASSERT_TRUE(cfg.block_at(0x0608)->is_indirect());
+    ASSERT_EQ(0u, cfg.block_at(0x0608)->n_edges);
+
+    const Block* sub = cfg.block_at(0x060b);
+    ASSERT_TRUE(sub->is_unknown());
+    assert_edge(*sub, 1, 0x0612, ControlFlowGraph::EDGE_BRANCH);
+    ASSERT_EQ(0u, cfg.block_at(0x060f)->n_edges);
+
+    const Block* invalid = cfg.block_at(0x0610);
+    ASSERT_TRUE(invalid->is_unknown());
+    ASSERT_EQ(0u, invalid->n_instructions);
+    ASSERT_FALSE(cfg.is_instruction(0x0610));
+
+    ASSERT_EQ(1u, cfg.count_flagged(ControlFlowGraph::BLOCK_INDIRECT));
+    ASSERT_EQ(2u, cfg.count_flagged(ControlFlowGraph::BLOCK_UNKNOWN));
+}
+
+TEST(ControlFlowGraph, WholeAddressSpace) {
+    std::vector<uint8_t> mem(Mem::MEM_SIZE);
+    uint32_t seed = 6502;
+    for (size_t i = 0; i < mem.size(); ++i) {
+        seed = seed * 1103515245 + 12345;
+        mem[i] = seed >> 16;
+    }
+    std::vector<address_t> entries;
+    for (size_t addr = 0; addr < Mem::MEM_SIZE; addr += 7) {
+        entries.push_back(addr);
+    }
+
+    ControlFlowGraph cfg;
+    cfg.build(mem.data(), 0, Mem::MEM_SIZE, entries);
+    const std::vector<Block>& blocks = cfg.blocks();
+    ASSERT_GT(blocks.size(), 1000u);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (i > 0) {
+            ASSERT_LT(blocks[i - 1].start, blocks[i].start);
+        }
+        // every edge leads to the start of a block
+        for (unsigned e = 0; e < blocks[i].n_edges; ++e) {
+            ASSERT_TRUE(cfg.block_at(blocks[i].edges[e].target) != NULL);
+        }
+    }
+}
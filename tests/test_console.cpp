@@ -0,0 +1,63 @@
+#include <cstring>
+#include <sstream>
+#include "gtest/gtest.h"
+#include "console.h"
+#include "cpu.h"
+
+TEST(Console, ProgramReadsAndPrints) {
+    static const uint8_t code[] = {
+        0xa9, 0x00,         // 0600: LDA #$00
+        0x0d, 0x01, 0xf0,   // 0602: ORA $f001
+        0xc9, 0x79,         // 0605: CMP #'y'
+        0xd0, 0x05,         // 0607: BNE $060e
+        0xa2, 0x59,         // 0609: LDX #'Y'
+        0x8e, 0x00, 0xf0,   // 060b: STX $f000
+        0xa2, 0x21,         // 060e: LDX #'!'
+        0x8e, 0x00, 0xf0,   // 0610: STX $f000
+        0x00, 0x00,         // 0613: BRK
+    };
+    const char* inputs[] = { "yes", "no" };
+    const char* outputs[] = { "Y!", "!" };
+    for (int i = 0; i < 2; ++i) {
+        std::ostringstream out;
+        std::istringstream in(inputs[i]);
+        {
+            Cpu cpu;
+            Console console(out);
+            console.map_output(cpu.mem, 0xf000);
+            console.map_input(cpu.mem, 0xf001);
+            console.read_input(in);
+            cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+            ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+            ASSERT_EQ(strlen(inputs[i]) - 1, console.input_left());
+            ASSERT_EQ("", out.str());
+        }
+        ASSERT_EQ(outputs[i], out.str());
+    }
+}
+
+TEST(Console, Buffers) {
+    std::ostringstream out;
+    Mem mem;
+    Console console(out, 3);
+    console.map_output(mem, 0xf000);
+    console.map_input(mem, 0xf001);
+    console.add_input("hi");
+
+    ASSERT_EQ('h', mem.read_8(0xf001));
+    ASSERT_EQ(0, mem.read_8(0xf002));
+    ASSERT_EQ('i', mem.read_8(0xf001));
+    ASSERT_EQ(0, mem.read_8(0xf001));
+    ASSERT_EQ(0u, console.input_left());
+
+    // the output is written when the buffer fills
+    mem.write_8(0xf000, 'a');
+    mem.write_8(0xf002, 'x');
+    mem.write_8(0xf000, 'b');
+    ASSERT_EQ("", out.str());
+    mem.write_8(0xf000, 'c');
+    ASSERT_EQ("abc", out.str());
+    mem.write_8(0xf000, 'd');
+    console.flush();
+    ASSERT_EQ("abcd", out.str());
+}
@@ -0,0 +1,75 @@
+#include <sstream>
+#include "gtest/gtest.h"
+#include "coverage.h"
+#include "assembler_fixtures.h"
+
+TEST(Coverage, MergeAndData) {
+    Coverage a, b;
+    a.mark_executed(0x0600);
+    a.mark_branch(0x0602, true);
+    b.mark_executed(0xffff);
+    b.mark_branch(0x0602, false);
+    a.merge(b);
+    ASSERT_EQ(2u, a.n_executed());
+    ASSERT_TRUE(a.was_executed(0xffff));
+    ASSERT_FALSE(a.was_executed(0x0601));
+    ASSERT_TRUE(a.was_taken(0x0602));
+    ASSERT_TRUE(a.was_not_taken(0x0602));
+
+    Coverage loaded;
+    const std::string data = a.data();
+    ASSERT_TRUE(loaded.load(data));
+    ASSERT_EQ(a.data(), loaded.data());
+    ASSERT_FALSE(loaded.load(data.substr(0, data.size() - 1)));
+    ASSERT_EQ(0u, loaded.n_executed());
+}
+
+#ifdef MOS6502_COVERAGE
+
+TEST_F(AssemblyCodeWithLabel, CoverageOfRunsMerges) {
+    Assembler assembler(codetext);
+    Coverage whole, first, rest;
+    Cpu cpu;
+    cpu.load_program(assembler);
+    cpu.set_coverage(&whole);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    ASSERT_EQ(7u, whole.n_executed());
+    ASSERT_TRUE(whole.was_taken(0x0608));
+    ASSERT_TRUE(whole.was_not_taken(0x0608));
+
+    // the first pass round the loop doesn't fall through the BNE
+    cpu.reset(RESET_REGISTERS);
+    cpu.PC.write(0x0600);
+    cpu.set_coverage(&first);
+    cpu.emu_loop(0, 5);
+    ASSERT_EQ(5u, first.n_executed());
+    ASSERT_FALSE(first.was_not_taken(0x0608));
+    cpu.set_coverage(&rest);
+    cpu.emu_loop();
+    cpu.set_coverage(NULL);
+    first.merge(rest);
+    ASSERT_EQ(whole.data(), first.data());
+}
+
+TEST_F(AssemblyWithForwardDeclaredLabel, CoverageReport) {
+    Assembler assembler(codetext);
+    Coverage coverage;
+    Cpu cpu;
+    cpu.load_program(assembler);
+    cpu.set_coverage(&coverage);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+
+    std::ostringstream out;
+    write_coverage_report(out, coverage, assembler, codetext.str(), 0x600);
+    ASSERT_EQ("line  addr  exec  branch  source\n"
+              "   1  0600     *          LDA #$01\n"
+              "   2  0602     *          CMP #$02\n"
+              "   3  0604     *   T -    BNE notequal\n"
+              "   4  0606  ####          STA $22\n"
+              "   5                      notequal:\n"
+              "   6  0608     *          BRK\n"
+              "4 of 5 instructions executed, 1 of 2 branch directions taken\n",
+              out.str());
+}
+
+#endif // MOS6502_COVERAGE
@@ -1,5 +1,9 @@
+#include <cstring>
+#include <sstream>
 #include "gtest/gtest.h"
 #include "cpu.h"
+#include "cpu_pool.h"
+#include "memo.h"
 
 TEST(Cpu, MemReadWrite8) {
     Cpu cpu;
@@ -19,6 +23,885 @@ TEST(Cpu, MemReadWrite16) {
     ASSERT_EQ(0x1234, cpu.mem.read_16(0x5555));
 }
 
+TEST(Mem, ReadWrite16WrapsAround) {
+    Mem mem;
+    mem.write_16(0xffff, 0x1234);
+    ASSERT_EQ(0x34, mem.read_8(0xffff));
+    ASSERT_EQ(0x12, mem.read_8(0x0000));
+    ASSERT_EQ(0x1234, mem.read_16(0xffff));
+}
+
+TEST(Mem, SparseAllocatesOnWrite) {
+    PageArena arena;
+    {
+        Mem mem(MEM_SPARSE, arena);
+        ASSERT_EQ(MEM_SPARSE, mem.model());
+        ASSERT_EQ(0u, mem.n_pages());
+        // reads of untouched pages don't allocate
+        ASSERT_EQ(0, mem.read_8(0x1234));
+        ASSERT_EQ(0, mem.read_16(0xfffe));
+        ASSERT_EQ(0u, mem.n_pages());
+
+        mem.write_8(0x1234, 0xab);
+        mem.write_8(0x12ff, 0xcd);
+        ASSERT_EQ(1u, mem.n_pages());
+        ASSERT_EQ(0xab, mem.read_8(0x1234));
+        ASSERT_EQ(0xcd, mem.read_8(0x12ff));
+        ASSERT_EQ(0, mem.read_8(0x1300));
+
+        // crosses into a second page
+        mem.write_16(0x12ff, 0x5678);
+        ASSERT_EQ(2u, mem.n_pages());
+        ASSERT_EQ(0x5678, mem.read_16(0x12ff));
+        ASSERT_EQ(2u, arena.size());
+        ASSERT_TRUE(mem.dense_data() == NULL);
+    }
+    ASSERT_EQ(0u, arena.size());
+}
+
+TEST(Mem, SparseWriteBlockAndCopy) {
+    PageArena arena;
+    std::vector<uint8_t> bytes(600);
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] = i * 7;
+    }
+    Mem mem(MEM_SPARSE, arena);
+    mem.write_block(0x01f0, bytes.data(), bytes.size());
+    // 0x01f0 to 0x0447
+    ASSERT_EQ(4u, mem.n_pages());
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        ASSERT_EQ(bytes[i], mem.read_8(0x01f0 + i));
+    }
+
+    Mem copy(mem);
+    ASSERT_EQ(8u, arena.size());
+    copy.write_8(0x0200, 0xff);
+    ASSERT_EQ(bytes[0x10], mem.read_8(0x0200));
+    ASSERT_EQ(0xff, copy.read_8(0x0200));
+
+    copy = Mem(MEM_SPARSE, arena);
+    ASSERT_EQ(4u, arena.size());
+    ASSERT_EQ(0, copy.read_8(0x0200));
+}
+
+TEST(Mem, SharedImageCoversWholePages) {
+    const uint8_t code[] = { 1, 2, 3, 4 };
+    std::shared_ptr<const SharedImage> image = SharedImage::create(0x06fe, code, 4);
+    ASSERT_EQ(0x06fe, image->start());
+    ASSERT_EQ(4u, image->size());
+    ASSERT_EQ(6u, image->first_page());
+    ASSERT_EQ(2u, image->n_pages());
+    ASSERT_EQ(0, image->page(0)[0xfd]);
+    ASSERT_EQ(1, image->page(0)[0xfe]);
+    ASSERT_EQ(4, image->page(1)[0x01]);
+    ASSERT_EQ(0, image->page(1)[0x02]);
+}
+
+TEST(Mem, SharedPagesCopyOnWrite) {
+    PageArena arena;
+    const uint8_t code[] = { 0xa9, 0x01, 0x00 };
+    std::shared_ptr<const SharedImage> image = SharedImage::create(0x0600, code, 3);
+    {
+        Mem a(MEM_SPARSE, arena);
+        Mem b(MEM_SPARSE, arena);
+        a.map_image(image);
+        b.map_image(image);
+        ASSERT_EQ(3, image.use_count());
+        // mapping doesn't allocate
+        ASSERT_EQ(0u, arena.size());
+        ASSERT_EQ(0xa9, a.read_8(0x0600));
+        ASSERT_EQ(0x01, b.read_8(0x0601));
+
+        a.write_8(0x0601, 0x02);
+        ASSERT_EQ(1u, a.n_pages());
+        ASSERT_EQ(0x02, a.read_8(0x0601));
+        ASSERT_EQ(0xa9, a.read_8(0x0600));
+        ASSERT_EQ(0x01, b.read_8(0x0601));
+        ASSERT_EQ(0x01, image->page(0)[1]);
+
+        // a copy keeps sharing the pages that are still shared
+        Mem c(b);
+        ASSERT_EQ(4, image.use_count());
+        ASSERT_EQ(0u, c.n_pages());
+
+        // dense Mems share too, and copy into their own buffer on write
+        Mem d;
+        d.map_image(image);
+        ASSERT_TRUE(d.dense_data() == NULL);
+        d.write_8(0x0602, 0xea);
+        ASSERT_EQ(0xa9, d.read_8(0x0600));
+        ASSERT_EQ(0xea, d.read_8(0x0602));
+        ASSERT_EQ(0x00, image->page(0)[2]);
+    }
+    ASSERT_EQ(1, image.use_count());
+    ASSERT_EQ(0u, arena.size());
+}
+
+TEST(Mem, SharedPagesTrap) {
+    const uint8_t code[] = { 0xa9, 0x01, 0x00 };
+    Mem mem(MEM_SPARSE);
+    mem.map_image(SharedImage::create(0x0600, code, 3));
+    mem.set_shared_writes(SHARED_TRAP);
+    // pages that aren't shared can still be written
+    mem.write_8(0x0200, 0x01);
+    try {
+        mem.write_8(0x06ff, 0x02);
+        FAIL() << "expected WriteProtectError";
+    } catch (WriteProtectError& error) {
+        ASSERT_EQ(0x06ff, error.addr);
+    }
+    ASSERT_EQ(0, mem.read_8(0x06ff));
+}
+
+static const uint8_t COUNT_DOWN[] = {
+    0xa2, 0x08,         // LDX #$08
+    0xca,               // DEX
+    0x8e, 0x00, 0x02,   // STX $0200
+    0xe0, 0x03,         // CPX #$03
+    0xd0, 0xf8,         // BNE -8
+    0x8e, 0x01, 0x02,   // STX $0201
+    0x00, 0x00,         // BRK
+};
+
+TEST(Cpu, ResetPowerOn) {
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(COUNT_DOWN, COUNT_DOWN + sizeof(COUNT_DOWN)));
+    cpu.A.write(0x12);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+
+    cpu.reset(RESET_POWER_ON);
+    Cpu fresh;
+    ASSERT_EQ(fresh.A.read(), cpu.A.read());
+    ASSERT_EQ(fresh.X.read(), cpu.X.read());
+    ASSERT_EQ(fresh.S.read(), cpu.S.read());
+    ASSERT_EQ(fresh.P.read(), cpu.P.read());
+    ASSERT_EQ(fresh.PC.read(), cpu.PC.read());
+    ASSERT_EQ(0u, cpu.cycles);
+    ASSERT_EQ(0u, cpu.instructions);
+    for (size_t addr = 0; addr < Mem::MEM_SIZE; ++addr) {
+        ASSERT_EQ(0, cpu.mem.read_8(addr));
+    }
+
+    // and it runs the same as a new Cpu
+    std::vector<uint8_t> code(COUNT_DOWN, COUNT_DOWN + sizeof(COUNT_DOWN));
+    cpu.load_code(code);
+    fresh.load_code(code);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    ASSERT_EQ(STOP_BRK, fresh.emu_loop());
+    ASSERT_EQ(fresh.cycles, cpu.cycles);
+    ASSERT_EQ(fresh.mem.read_16(0x200), cpu.mem.read_16(0x200));
+}
+
+TEST(Cpu, ResetWarmAndRegisters) {
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(COUNT_DOWN, COUNT_DOWN + sizeof(COUNT_DOWN)));
+    cpu.mem.write_16(Cpu::RESET_VECTOR, 0x0600);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    const uint64_t cycles = cpu.cycles;
+    const uint8_t s = cpu.S.read();
+
+    cpu.A.write(0x12);
+    cpu.reset(RESET_WARM);
+    ASSERT_EQ(0x600, cpu.PC.read());
+    ASSERT_EQ(0x12, cpu.A.read());
+    ASSERT_EQ((uint8_t) (s - 3), cpu.S.read());
+    ASSERT_TRUE(cpu.P.has_interrupt());
+    ASSERT_FALSE(cpu.P.has_breakpoint());
+    ASSERT_EQ(cycles + 7, cpu.cycles);
+    ASSERT_EQ(0x03, cpu.mem.read_8(0x0201));
+
+    cpu.reset(RESET_REGISTERS);
+    ASSERT_EQ(0, cpu.A.read());
+    ASSERT_EQ(0xff, cpu.S.read());
+    ASSERT_EQ(0, cpu.P.read());
+    ASSERT_EQ(0u, cpu.cycles);
+    ASSERT_EQ(0xa2, cpu.mem.read_8(0x0600));
+    ASSERT_EQ(0x03, cpu.mem.read_8(0x0201));
+}
+
+TEST(Cpu, SetOutput) {
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(COUNT_DOWN, COUNT_DOWN + 2));
+    std::ostringstream out;
+    cpu.set_output(out);
+    cpu.emu_step();
+    ASSERT_NE(std::string::npos, out.str().find("Instruction: LDX"));
+
+    cpu.clear_output();
+    const std::string traced = out.str();
+    cpu.PC.write(0x600);
+    cpu.emu_step();
+    ASSERT_EQ(traced, out.str());
+}
+
+/* Counts what it sees from each of the hooks a Cpu can have */
+class CountingHooks : public HostCall, public InterruptTap, public DeviceTap {
+public:
+    CountingHooks() : n_calls(0), n_taps(0) { }
+
+    int call(Cpu&, uint8_t) {
+        ++this->n_calls;
+        return 0;
+    }
+
+    Interrupt tap_interrupt(Interrupt pending) {
+        ++this->n_taps;
+        return pending;
+    }
+
+    uint8_t tap_read(MemDevice* device, address_t addr) {
+        ++this->n_taps;
+        return device->read(addr);
+    }
+
+    void tap_write(MemDevice* device, address_t addr, uint8_t value) {
+        ++this->n_taps;
+        device->write(addr, value);
+    }
+
+    uint64_t n_calls, n_taps;
+};
+
+TEST(CpuPool, ReusesResetCpus) {
+    static const uint8_t hooked[] = {
+        0x22, 0x05,         // 0600: HCL #$05
+        0x20, 0x07, 0x06,   // 0602: JSR $0607
+        0x00, 0x00,         // 0605: BRK
+        0x60,               // 0607: RTS
+    };
+    CountingHooks hooks;
+    SubroutineMemo memo;
+    memo.declare_pure(0x0607);
+
+    CpuPool pool(MEM_SPARSE, 1);
+    Cpu* first = pool.acquire();
+    ASSERT_EQ(MEM_SPARSE, first->mem.model());
+    first->load_code(std::vector<uint8_t>(COUNT_DOWN, COUNT_DOWN + sizeof(COUNT_DOWN)));
+    ASSERT_EQ(STOP_BRK, first->emu_loop());
+    first->set_host_call(5, &hooks);
+    first->set_interrupt_tap(&hooks);
+    first->mem.set_device_tap(&hooks);
+    first->set_memo(&memo);
+    first->set_fusion(false);
+    first->set_idle_skip(false);
+    first->P.clear_breakpoint();
+    first->load_code(std::vector<uint8_t>(hooked, hooked + sizeof(hooked)));
+    ASSERT_EQ(STOP_BRK, first->emu_loop());
+    ASSERT_EQ(1u, hooks.n_calls);
+    ASSERT_EQ(1u, memo.misses());
+    const uint64_t n_taps = hooks.n_taps;
+    pool.release(first);
+    ASSERT_EQ(1u, pool.idle());
+
+    {
+        CpuPool::Lease lease(pool);
+        ASSERT_EQ(first, &*lease);
+        ASSERT_EQ(0u, pool.idle());
+        ASSERT_EQ(0u, lease->instructions);
+        ASSERT_EQ(0u, lease->mem.n_pages());
+        ASSERT_EQ(0, lease->mem.read_8(0x0201));
+        ASSERT_TRUE(lease->fusion_enabled());
+        ASSERT_TRUE(lease->idle_skip_enabled());
+
+        // none of the first user's hooks are still attached
+        lease->load_code(std::vector<uint8_t>(hooked, hooked + sizeof(hooked)));
+        ASSERT_EQ(STOP_INVALID_OPCODE, lease->emu_loop());
+        lease->PC.write(0x0602);
+        ASSERT_EQ(STOP_BRK, lease->emu_loop());
+        ASSERT_EQ(1u, hooks.n_calls);
+        ASSERT_EQ(n_taps, hooks.n_taps);
+        ASSERT_EQ(1u, memo.misses());
+
+        pool.release(pool.acquire());
+        ASSERT_EQ(1u, pool.idle());
+    }
+    // the lease's Cpu would be over max_idle, so it was deleted
+    ASSERT_EQ(1u, pool.idle());
+}
+
+/* Registers at $xx00 - $xx0f that remember what was written and count reads */
+class RegisterDevice : public MemDevice {
+public:
+    RegisterDevice() : n_reads(0) { std::memset(this->regs, 0, sizeof(this->regs)); }
+
+    uint8_t read(address_t addr) {
+        ++this->n_reads;
+        return this->regs[addr & 0x0f];
+    }
+
+    void write(address_t addr, uint8_t value) { this->regs[addr & 0x0f] = value; }
+
+    uint8_t regs[16];
+    int n_reads;
+};
+
+TEST(Mem, MapDevice) {
+    for (int model = MEM_DENSE; model <= MEM_SPARSE; ++model) {
+        Mem mem((MemModel) model);
+        mem.write_8(0xd005, 0x11);
+        RegisterDevice device;
+        mem.map_device(0xd0, 1, &device);
+        ASSERT_EQ(0, mem.read_8(0xd005));
+        mem.write_8(0xd005, 0x22);
+        ASSERT_EQ(0x22, device.regs[5]);
+        ASSERT_EQ(0x22, mem.read_8(0xd005));
+        ASSERT_EQ(2, device.n_reads);
+
+        const uint8_t block[] = { 1, 2, 3, 4 };
+        mem.write_block(0xcffe, block, sizeof(block));
+        ASSERT_EQ(0x02, mem.read_8(0xcfff));
+        ASSERT_EQ(0x04, device.regs[1]);
+
+        // copies share the device, clear unmaps it
+        Mem copy(mem);
+        ASSERT_EQ(0x22, copy.read_8(0xd005));
+        mem.clear();
+        ASSERT_EQ(0, mem.read_8(0xd005));
+        mem.write_8(0xd005, 0x33);
+        ASSERT_EQ(0x22, device.regs[5]);
+    }
+}
+
+TEST(Mem, PeekLeavesDevicesAlone) {
+    for (int model = MEM_DENSE; model <= MEM_SPARSE; ++model) {
+        Mem mem((MemModel) model);
+        RegisterDevice device;
+        CountingHooks hooks;
+        mem.map_device(0xd0, 1, &device);
+        mem.set_device_tap(&hooks);
+        mem.write_8(0xd003, 0x44);
+        const uint64_t n_taps = hooks.n_taps;
+
+        ASSERT_EQ(0, mem.peek_8(0xd003));
+        ASSERT_EQ(0, device.n_reads);
+        ASSERT_EQ(n_taps, hooks.n_taps);
+        ASSERT_EQ(0x44, mem.read_8(0xd003));
+        ASSERT_EQ(1, device.n_reads);
+    }
+}
+
+TEST(Mem, SharePages) {
+    PageArena arena;
+    Mem mem(MEM_SPARSE, arena);
+    mem.write_8(0x1010, 1);
+    mem.write_8(0x1110, 2);
+    mem.write_8(0x4010, 3);
+    ASSERT_EQ(3u, mem.n_pages());
+    mem.share_pages();
+    ASSERT_EQ(0u, mem.n_pages());
+    ASSERT_EQ(0u, arena.size());
+    ASSERT_EQ(1, mem.read_8(0x1010));
+    ASSERT_EQ(2, mem.read_8(0x1110));
+    ASSERT_EQ(3, mem.read_8(0x4010));
+
+    // copies only copy the pages they write
+    Mem copy(mem);
+    ASSERT_EQ(0u, copy.n_pages());
+    copy.write_8(0x4011, 4);
+    ASSERT_EQ(1u, copy.n_pages());
+    ASSERT_EQ(3, copy.read_8(0x4010));
+    ASSERT_EQ(0, mem.read_8(0x4011));
+
+    copy.write_8(0x1010, 5);
+    copy.share_pages();
+    ASSERT_EQ(0u, copy.n_pages());
+    ASSERT_EQ(5, copy.read_8(0x1010));
+    ASSERT_EQ(4, copy.read_8(0x4011));
+    ASSERT_EQ(1, mem.read_8(0x1010));
+
+    Mem trapping(MEM_SPARSE, arena);
+    trapping.write_8(0x1010, 1);
+    trapping.set_shared_writes(SHARED_TRAP);
+    trapping.share_pages();
+    ASSERT_EQ(1u, trapping.n_pages());
+}
+
+TEST(Mem, MapDeviceReplacesCoveredDevices) {
+    Mem mem;
+    RegisterDevice first, second, third;
+    mem.map_device(0xd0, 2, &first);
+    mem.map_device(0xd1, 1, &second);
+    ASSERT_EQ(2u, mem.n_devices());
+
+    // mapping the same page again replaces the device there, rather than
+    // piling up mappings nothing can reach
+    for (int i = 0; i < 3; ++i) {
+        mem.map_device(0xd1, 1, &third);
+    }
+    ASSERT_EQ(2u, mem.n_devices());
+    mem.write_8(0xd000, 1);
+    mem.write_8(0xd101, 2);
+    ASSERT_EQ(1, first.regs[0]);
+    ASSERT_EQ(0, second.regs[1]);
+    ASSERT_EQ(2, third.regs[1]);
+
+    mem.map_device(0xd0, 2, &second);
+    ASSERT_EQ(1u, mem.n_devices());
+    mem.write_8(0xd000, 3);
+    ASSERT_EQ(3, second.regs[0]);
+}
+
+/* A device whose reads stall until it is given a value */
+class StallingDevice : public MemDevice {
+public:
+    StallingDevice() : ready(false) { }
+
+    uint8_t read(address_t) {
+        if (!this->ready) {
+            throw DeviceStall();
+        }
+        return 0x42;
+    }
+
+    void write(address_t, uint8_t) { }
+
+    bool ready;
+};
+
+TEST(Cpu, DeviceStallRestartsInstruction) {
+    const uint8_t code[] = {
+        0xa9, 0x01,         // LDA #$01
+        0x0d, 0x00, 0xd0,   // ORA $d000
+        0x00, 0x00,         // BRK
+    };
+    Cpu cpu;
+    StallingDevice device;
+    cpu.mem.map_device(0xd0, 1, &device);
+    cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    ASSERT_EQ(STOP_DEVICE_STALL, cpu.emu_loop());
+    ASSERT_EQ(0x0602, cpu.PC.read());
+    ASSERT_EQ(1u, cpu.instructions);
+    ASSERT_EQ(2u, cpu.cycles);
+
+    device.ready = true;
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    ASSERT_EQ(0x43, cpu.A.read());
+    ASSERT_EQ(3u, cpu.instructions);
+}
+
+TEST(Cpu, TakesInterrupts) {
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(COUNT_DOWN, COUNT_DOWN + sizeof(COUNT_DOWN)));
+    cpu.mem.write_16(Cpu::IRQ_VECTOR, 0x0700);
+    cpu.mem.write_16(Cpu::NMI_VECTOR, 0x0800);
+    cpu.mem.write_8(0x0700, 0x40);  // RTI
+    cpu.mem.write_8(0x0800, 0x40);
+
+    // IRQ waits for the I flag to clear, and is taken while the line is held
+    cpu.P.set_interrupt();
+    cpu.set_irq(true);
+    cpu.emu_step();
+    ASSERT_EQ(0x0602, cpu.PC.read());
+    cpu.P.clear_interrupt();
+    const uint64_t cycles = cpu.cycles;
+    ASSERT_EQ(7 + 6, cpu.emu_step());
+    ASSERT_EQ(cycles + 7 + 6, cpu.cycles);
+    ASSERT_EQ(0x0602, cpu.PC.read());
+    ASSERT_EQ(0x0602, cpu.mem.read_16(0x01fe));
+    ASSERT_FALSE(cpu.P.has_interrupt());
+    cpu.emu_step();
+    ASSERT_EQ(0x0602, cpu.PC.read());
+    cpu.set_irq(false);
+    cpu.emu_step();
+    ASSERT_EQ(0x0603, cpu.PC.read());
+
+    // NMI is taken once, even with I set
+    cpu.P.set_interrupt();
+    cpu.nmi();
+    cpu.emu_step();
+    ASSERT_EQ(0x0603, cpu.PC.read());
+    ASSERT_TRUE(cpu.P.has_interrupt());
+    cpu.emu_step();
+    ASSERT_EQ(0x0606, cpu.PC.read());
+}
+
+TEST(Cpu, PageCrossingCycles) {
+    const uint8_t code[] = {
+        0xa2, 0x01,         // 06fa: LDX #$01
+        0x1d, 0xff, 0x02,   // 06fc: ORA $02ff,X    crosses into page 3
+        0x1d, 0x00, 0x02,   // 06ff: ORA $0200,X
+        0xd0, 0x00,         // 0702: BNE $0704      not taken
+        0xf0, 0x00,         // 0704: BEQ $0706      taken
+        0xf0, 0xf2,         // 0706: BEQ $06fa      taken, to page 6
+    };
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)), 0x06fa);
+    const int expected[] = { 2, 5, 4, 2, 3, 4 };
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+        ASSERT_EQ(expected[i], cpu.emu_step()) << "instruction " << i;
+    }
+    ASSERT_EQ(0x06fa, cpu.PC.read());
+}
+
+/* Loops over every idiom the Cpu fuses */
+static const uint8_t FUSABLE[] = {
+    0xa2, 0x05,         // 0600: LDX #$05
+    0xa9, 0x10,         // 0602: LDA #$10
+    0x85, 0x20,         // 0604: STA $20
+    0x18,               // 0606: CLC
+    0x69, 0x77,         // 0607: ADC #$77
+    0x85, 0x21,         // 0609: STA $21
+    0xca,               // 060b: DEX
+    0xd0, 0xf4,         // 060c: BNE $0602
+    0xc8,               // 060e: INY
+    0xd0, 0xfd,         // 060f: BNE $060e
+    0x18,               // 0611: CLC
+    0x69, 0x01,         // 0612: ADC #$01
+    0xe0, 0x00,         // 0614: CPX #$00
+    0xd0, 0x00,         // 0616: BNE $0618
+    0x00, 0x00,         // 0618: BRK
+};
+
+TEST(Cpu, FusionMatchesUnfused) {
+    // run in slices, so that limits fall inside every idiom
+    const uint64_t limits[] = { 0, 1, 2, 3, 5, 7 };
+    const size_t n_limits = sizeof(limits) / sizeof(limits[0]);
+    for (size_t i = 0; i < n_limits; ++i) {
+        for (size_t j = 0; j < n_limits; ++j) {
+            Cpu fused, plain;
+            plain.set_fusion(false);
+            const std::vector<uint8_t> code(FUSABLE, FUSABLE + sizeof(FUSABLE));
+            fused.load_code(code);
+            plain.load_code(code);
+
+            StopReason reason;
+            do {
+                reason = plain.emu_loop(limits[i], limits[j]);
+                ASSERT_EQ(reason, fused.emu_loop(limits[i], limits[j]));
+                ASSERT_EQ(plain.cycles, fused.cycles);
+                ASSERT_EQ(plain.instructions, fused.instructions);
+                ASSERT_EQ(plain.PC.read(), fused.PC.read());
+                ASSERT_EQ(plain.A.read(), fused.A.read());
+                ASSERT_EQ(plain.X.read(), fused.X.read());
+                ASSERT_EQ(plain.Y.read(), fused.Y.read());
+                ASSERT_EQ(plain.P.read(), fused.P.read());
+                ASSERT_EQ(plain.mem.read_16(0x20), fused.mem.read_16(0x20));
+            } while (reason != STOP_BRK);
+            ASSERT_EQ(0x8710, fused.mem.read_16(0x20));
+        }
+    }
+
+    // while the IRQ line is held nothing is fused, and the IRQ is taken
+    // before the next instruction as usual
+    Cpu fused, plain;
+    plain.set_fusion(false);
+    Cpu* cpus[] = { &fused, &plain };
+    for (size_t i = 0; i < 2; ++i) {
+        cpus[i]->load_code(std::vector<uint8_t>(FUSABLE, FUSABLE + sizeof(FUSABLE)));
+        cpus[i]->mem.write_16(Cpu::IRQ_VECTOR, 0x0700);
+        cpus[i]->mem.write_8(0x0700, 0x40);   // RTI
+        cpus[i]->emu_loop(0, 6);              // up to the DEX
+        cpus[i]->set_irq(true);
+        cpus[i]->emu_loop(0, 2);
+        cpus[i]->set_irq(false);
+    }
+    ASSERT_EQ(plain.cycles, fused.cycles);
+    ASSERT_EQ(plain.PC.read(), fused.PC.read());
+}
+
+/* Writes value to addr when it fires, and remembers when that was */
+class PokeEvent : public CycleEvent {
+public:
+    PokeEvent(Cpu& cpu, address_t addr, uint8_t value)
+        : cpu(cpu), addr(addr), value(value), fired_at(0) { }
+
+    void on_cycle(uint64_t) {
+        this->cpu.mem.write_8(this->addr, this->value);
+        this->fired_at = this->cpu.cycles;
+    }
+
+    Cpu& cpu;
+    address_t addr;
+    uint8_t value;
+    uint64_t fired_at;
+};
+
+static const uint8_t POLL[] = {
+    0xa9, 0x00,         // LDA #$00
+    0x05, 0x10,         // ORA $10
+    0xf0, 0xfc,         // BEQ $0602
+    0x85, 0x11,         // STA $11
+    0x00, 0x00,         // BRK
+};
+
+TEST(Cpu, IdleSkipMatchesSpinning) {
+    const uint64_t limits[] = { 0, 1, 7, 1000 };
+    const size_t n_limits = sizeof(limits) / sizeof(limits[0]);
+    for (size_t i = 0; i < n_limits; ++i) {
+        for (size_t j = 0; j < n_limits; ++j) {
+            Cpu skipping, spinning;
+            spinning.set_idle_skip(false);
+            PokeEvent skipping_poke(skipping, 0x10, 0x42);
+            PokeEvent spinning_poke(spinning, 0x10, 0x42);
+            const std::vector<uint8_t> code(POLL, POLL + sizeof(POLL));
+            skipping.load_code(code);
+            spinning.load_code(code);
+            skipping.schedule(&skipping_poke, 100003);
+            spinning.schedule(&spinning_poke, 100003);
+
+            StopReason reason;
+            do {
+                reason = spinning.emu_loop(limits[i], limits[j]);
+                ASSERT_EQ(reason, skipping.emu_loop(limits[i], limits[j]));
+                ASSERT_EQ(spinning.cycles, skipping.cycles);
+                ASSERT_EQ(spinning.instructions, skipping.instructions);
+                ASSERT_EQ(spinning.PC.read(), skipping.PC.read());
+                ASSERT_EQ(spinning.A.read(), skipping.A.read());
+                ASSERT_EQ(spinning.P.read(), skipping.P.read());
+            } while (reason != STOP_BRK);
+            ASSERT_EQ(spinning_poke.fired_at, skipping_poke.fired_at);
+            ASSERT_EQ(0x42, skipping.mem.read_8(0x11));
+        }
+    }
+}
+
+/* Counts its calls, and takes no cycles of its own */
+class CountingCall : public HostCall {
+public:
+    CountingCall() : n_calls(0) { }
+
+    int call(Cpu&, uint8_t) {
+        ++this->n_calls;
+        return 0;
+    }
+
+    uint64_t n_calls;
+};
+
+TEST(Cpu, IdleSkipFollowsTheTakenBranch) {
+    // the BEQ back to the start isn't taken, so the loop closes through the
+    // BNE and takes in the host call
+    static const uint8_t code[] = {
+        0x05, 0x10,         // 0600: ORA $10
+        0xf0, 0xfc,         // 0602: BEQ $0600
+        0x22, 0x00,         // 0604: HCL #$00
+        0xd0, 0xf8,         // 0606: BNE $0600
+    };
+    Cpu skipping, spinning;
+    spinning.set_idle_skip(false);
+    CountingCall skipping_call, spinning_call;
+    skipping.set_host_call(0, &skipping_call);
+    spinning.set_host_call(0, &spinning_call);
+    skipping.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    spinning.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    skipping.mem.write_8(0x10, 1);
+    spinning.mem.write_8(0x10, 1);
+
+    ASSERT_EQ(STOP_CYCLE_LIMIT, spinning.emu_loop(100000));
+    ASSERT_EQ(STOP_CYCLE_LIMIT, skipping.emu_loop(100000));
+    ASSERT_EQ(10000u, spinning_call.n_calls);
+    ASSERT_EQ(spinning_call.n_calls, skipping_call.n_calls);
+    ASSERT_EQ(spinning.cycles, skipping.cycles);
+}
+
+TEST(Cpu, IdleSkipPollsWithLoad) {
+    static const uint8_t code[] = {
+        0xa5, 0x10,         // 0600: LDA $10
+        0xf0, 0xfc,         // 0602: BEQ $0600
+        0xad, 0x00, 0x03,   // 0604: LDA $0300
+        0x85, 0x11,         // 0607: STA $11
+        0x00, 0x00,         // 0609: BRK
+    };
+    Cpu skipping, spinning;
+    spinning.set_idle_skip(false);
+    PokeEvent skipping_poke(skipping, 0x10, 0x42);
+    PokeEvent spinning_poke(spinning, 0x10, 0x42);
+    skipping.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    spinning.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    skipping.mem.write_8(0x0300, 0x17);
+    spinning.mem.write_8(0x0300, 0x17);
+    skipping.schedule(&skipping_poke, 50001);
+    spinning.schedule(&spinning_poke, 50001);
+
+    ASSERT_EQ(STOP_BRK, spinning.emu_loop());
+    ASSERT_EQ(STOP_BRK, skipping.emu_loop());
+    ASSERT_EQ(spinning.cycles, skipping.cycles);
+    ASSERT_EQ(spinning.instructions, skipping.instructions);
+    ASSERT_EQ(spinning_poke.fired_at, skipping_poke.fired_at);
+    ASSERT_EQ(0x17, skipping.mem.read_8(0x11));
+}
+
+TEST(Cpu, IdleSkipLeavesDevicesAlone) {
+    // polling a device can't be skipped, since each read may change it
+    static const uint8_t code[] = {
+        0xa9, 0x00,         // LDA #$00
+        0x0d, 0x05, 0xd0,   // ORA $d005
+        0xf0, 0xfb,         // BEQ $0602
+        0x00, 0x00,         // BRK
+    };
+    Cpu skipping, spinning;
+    spinning.set_idle_skip(false);
+    RegisterDevice skipping_device, spinning_device;
+    skipping.mem.map_device(0xd0, 1, &skipping_device);
+    spinning.mem.map_device(0xd0, 1, &spinning_device);
+    PokeEvent skipping_poke(skipping, 0xd005, 1);
+    PokeEvent spinning_poke(spinning, 0xd005, 1);
+    skipping.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    spinning.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    skipping.schedule(&skipping_poke, 5000);
+    spinning.schedule(&spinning_poke, 5000);
+    ASSERT_EQ(STOP_BRK, spinning.emu_loop());
+    ASSERT_EQ(STOP_BRK, skipping.emu_loop());
+    ASSERT_EQ(spinning.cycles, skipping.cycles);
+    ASSERT_EQ(spinning_device.n_reads, skipping_device.n_reads);
+}
+
+/* Appends its id to order, and reschedules itself again times */
+class OrderEvent : public CycleEvent {
+public:
+    OrderEvent(Cpu& cpu, std::vector<int>& order, int id, int again)
+        : cpu(cpu), order(order), id(id), again(again) { }
+
+    void on_cycle(uint64_t cycle) {
+        this->order.push_back(this->id);
+        if (this->again-- > 0) {
+            this->cpu.schedule(this, cycle + 10);
+        }
+    }
+
+    Cpu& cpu;
+    std::vector<int>& order;
+    int id;
+    int again;
+};
+
+TEST(Cpu, ScheduledEvents) {
+    Cpu cpu;
+    std::vector<int> order;
+    OrderEvent first(cpu, order, 1, 2), second(cpu, order, 2, 0), third(cpu, order, 3, 0);
+    cpu.load_code(std::vector<uint8_t>(POLL, POLL + sizeof(POLL)));
+    ASSERT_EQ(Cpu::NO_EVENT, cpu.next_event());
+    cpu.schedule(&second, 15);
+    cpu.schedule(&first, 100);
+    cpu.schedule(&third, 40);
+    cpu.schedule(&first, 5);    // replaces 100
+    ASSERT_EQ(5u, cpu.next_event());
+    cpu.cancel(&third);
+
+    cpu.emu_loop(100, 0);
+    // first at 5, 15 and 25; at 15, second was scheduled before first was
+    static const int expected[] = { 1, 2, 1, 1 };
+    ASSERT_EQ(std::vector<int>(expected, expected + 4), order);
+    ASSERT_EQ(Cpu::NO_EVENT, cpu.next_event());
+
+    cpu.schedule(&second, 1000);
+    cpu.reset(RESET_POWER_ON);
+    ASSERT_EQ(Cpu::NO_EVENT, cpu.next_event());
+}
+
+/* Multiplies A by X into A (low byte) and Y (high byte), charging what a
+ * shift and add loop would take */
+class MultiplyCall : public HostCall {
+public:
+    int call(Cpu& cpu, uint8_t) {
+        const unsigned product = cpu.A.read() * cpu.X.read();
+        cpu.A.write(product & 0xff);
+        cpu.Y.write(product >> 8);
+        return 150;
+    }
+};
+
+TEST(Cpu, HostCall) {
+    const uint8_t code[] = {
+        0xa9, 0x34,         // LDA #$34
+        0xa2, 0x12,         // LDX #$12
+        0x22, 0x05,         // HCL #$05
+        0x85, 0x10,         // STA $10
+        0x00, 0x00,         // BRK
+    };
+    Cpu cpu;
+    MultiplyCall multiply;
+    cpu.set_host_call(5, &multiply);
+    cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    ASSERT_EQ(0xa8, cpu.mem.read_8(0x10));
+    ASSERT_EQ(0x03, cpu.Y.read());
+    ASSERT_EQ(2u + 2 + 2 + 150 + 3 + 7, cpu.cycles);
+    ASSERT_EQ(5u, cpu.instructions);
+
+    // an unhandled call stops like an invalid opcode
+    cpu.set_host_call(5, NULL);
+    cpu.reset(RESET_REGISTERS);
+    cpu.PC.write(0x0600);
+    ASSERT_EQ(STOP_INVALID_OPCODE, cpu.emu_loop());
+    ASSERT_EQ(2u, cpu.instructions);
+}
+
+TEST(Cpu, LoadSharedStopsOnCodeWrite) {
+    const uint8_t code[] = {
+        0xa2, 0x08,         // LDX #$08
+        0x8e, 0x00, 0x02,   // STX $0200
+        0x8e, 0x10, 0x06,   // STX $0610
+        0x00, 0x00,         // BRK
+    };
+    std::shared_ptr<const SharedImage> image = SharedImage::create(0x0600, code,
+                                                                   sizeof(code));
+    Cpu cow(MEM_SPARSE);
+    cow.load_shared(image);
+    ASSERT_EQ(0x600, cow.PC.read());
+    ASSERT_EQ(STOP_BRK, cow.emu_loop());
+    ASSERT_EQ(0x08, cow.mem.read_8(0x0610));
+
+    Cpu trap(MEM_SPARSE);
+    trap.load_shared(image);
+    trap.mem.set_shared_writes(SHARED_TRAP);
+    ASSERT_EQ(STOP_WRITE_PROTECT, trap.emu_loop());
+    ASSERT_EQ(0x08, trap.mem.read_8(0x0200));
+    ASSERT_EQ(0x00, trap.mem.read_8(0x0610));
+    ASSERT_EQ(2u, trap.instructions);
+}
+
+TEST(Mem, ClearIsLazy) {
+    Mem mem;
+    mem.write_8(0x1234, 0xab);
+    mem.write_8(0x4321, 0xcd);
+    ASSERT_TRUE(mem.dense_data() != NULL);
+
+    mem.clear();
+    ASSERT_EQ(0, mem.read_8(0x1234));
+    ASSERT_EQ(0, mem.read_8(0x4321));
+    ASSERT_TRUE(mem.dense_data() == NULL);
+
+    // the first write to a cleared page zeroes the rest of it
+    mem.write_8(0x1200, 0x01);
+    ASSERT_EQ(0x01, mem.read_8(0x1200));
+    ASSERT_EQ(0, mem.read_8(0x1234));
+    ASSERT_EQ(MEM_DENSE, mem.model());
+
+    PageArena arena;
+    Mem sparse(MEM_SPARSE, arena);
+    sparse.write_8(0x1234, 0xab);
+    sparse.clear();
+    ASSERT_EQ(0u, arena.size());
+    ASSERT_EQ(0, sparse.read_8(0x1234));
+}
+
+TEST(Mem, SparseCpuMatchesDense) {
+    const uint8_t code[] = {
+        0xa2, 0x08,         // LDX #$08
+        0xca,               // DEX
+        0x8e, 0x00, 0x02,   // STX $0200
+        0xe0, 0x03,         // CPX #$03
+        0xd0, 0xf8,         // BNE -8
+        0x8e, 0x01, 0x02,   // STX $0201
+        0x00, 0x00,         // BRK
+    };
+    std::vector<uint8_t> program(code, code + sizeof(code));
+    Cpu dense;
+    Cpu sparse(MEM_SPARSE);
+    dense.load_code(program);
+    sparse.load_code(program);
+    ASSERT_EQ(STOP_BRK, dense.emu_loop());
+    ASSERT_EQ(STOP_BRK, sparse.emu_loop());
+
+    ASSERT_EQ(dense.cycles, sparse.cycles);
+    for (size_t addr = 0; addr < Mem::MEM_SIZE; ++addr) {
+        ASSERT_EQ(dense.mem.read_8(addr), sparse.mem.read_8(addr));
+    }
+    // the code page, the results and the stack
+    ASSERT_EQ(3u, sparse.mem.n_pages());
+}
+
 
 
 TEST(Cpu, SBC_Underflow) {
@@ -151,6 +1034,75 @@ TEST(Cpu, SBC_OverflowFlag_Negative) {
     ASSERT_FALSE(cpu.P.has_carry());
 }
 
+TEST(Cpu, ADC_Decimal) {
+    Cpu cpu;
+    cpu.P.set_bcd();
+    cpu.A.write(0x15);
+    cpu.i_adc(0x27);
+    ASSERT_EQ(0x42, cpu.A.read());
+    ASSERT_FALSE(cpu.P.has_carry());
+
+    // 58 + 46 + 1 = 105
+    cpu.i_sec();
+    cpu.A.write(0x58);
+    cpu.i_adc(0x46);
+    ASSERT_EQ(0x05, cpu.A.read());
+    ASSERT_TRUE(cpu.P.has_carry());
+    ASSERT_FALSE(cpu.P.has_zero());
+
+    // 99 + 1 = 100, but Z comes from the binary sum $9a
+    cpu.i_clc();
+    cpu.A.write(0x99);
+    cpu.i_adc(0x01);
+    ASSERT_EQ(0x00, cpu.A.read());
+    ASSERT_TRUE(cpu.P.has_carry());
+    ASSERT_FALSE(cpu.P.has_zero());
+}
+
+TEST(Cpu, SBC_Decimal) {
+    Cpu cpu;
+    cpu.P.set_bcd();
+    cpu.i_sec();
+    cpu.A.write(0x42);
+    cpu.i_sbc(0x15);
+    ASSERT_EQ(0x27, cpu.A.read());
+    ASSERT_TRUE(cpu.P.has_carry());
+
+    // 15 - 27 borrows, giving 88
+    cpu.i_sec();
+    cpu.A.write(0x15);
+    cpu.i_sbc(0x27);
+    ASSERT_EQ(0x88, cpu.A.read());
+    ASSERT_FALSE(cpu.P.has_carry());
+
+    // and without the carry one more is taken
+    cpu.A.write(0x10);
+    cpu.i_sbc(0x00);
+    ASSERT_EQ(0x09, cpu.A.read());
+    ASSERT_TRUE(cpu.P.has_carry());
+}
+
+TEST(Cpu, DecimalModeRuns) {
+    static const uint8_t code[] = {
+        0xa9, 0x19,         // LDA #$19
+        0x18,               // CLC
+        0x69, 0x01,         // ADC #$01
+        0x85, 0x10,         // STA $10
+        0x69, 0x09,         // ADC #$09
+        0xe9, 0x10,         // SBC #$10
+        0x00, 0x00,         // BRK
+    };
+    for (int fusion = 0; fusion < 2; ++fusion) {
+        Cpu cpu;
+        cpu.set_fusion(fusion);
+        cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+        cpu.P.set_bcd();
+        ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+        ASSERT_EQ(0x20, cpu.mem.read_8(0x10));
+        ASSERT_EQ(0x18, cpu.A.read());
+    }
+}
+
 /* Don't use this for the TXS instruction, since changing the stack pointer
  * doesn't set any flags */
 #define TEST_TRANSFER_INSTRUCTION(tag, instruction, src, dst, val, flags) \
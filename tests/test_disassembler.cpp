@@ -0,0 +1,63 @@
+#include <sstream>
+#include "gtest/gtest.h"
+#include "assembler.h"
+#include "disassembler.h"
+#include "assembler_fixtures.h"
+
+TEST_F(AssemblyCodeWithLabel, Disassemble) {
+    Assembler assembler(codetext);
+    std::vector<uint8_t> mem(0x10000, 0);
+    assembler.link_into(0x600, &mem[0], 0xfffa);
+
+    Disassembler disassembler;
+    std::string out;
+    size_t n = disassembler.disassemble(&mem[0], 0x600,
+                                        0x600 + assembler.code.size(), out);
+    ASSERT_EQ(7u, n);
+    ASSERT_EQ("0600  a2 08     LDX #$08\n"
+              "0602  ca        DEX\n"
+              "0603  8e 00 02  STX $0200\n"
+              "0606  e0 03     CPX #$03\n"
+              "0608  d0 f8     BNE $0602\n"
+              "060a  8e 01 02  STX $0201\n"
+              "060d  00 00     BRK\n", out);
+}
+
+TEST_F(AssemblyWithForwardDeclaredLabel, DisassembleWithLabels) {
+    Assembler assembler(codetext);
+    std::vector<uint8_t> mem(0x10000, 0);
+    assembler.link_into(0x600, &mem[0], 0xfffa);
+
+    Disassembler disassembler;
+    disassembler.set_labels(assembler.labels, 0x600);
+    std::string out;
+    disassembler.disassemble(&mem[0], 0x600, 0x600 + assembler.code.size(), out);
+    ASSERT_EQ("0600  a9 01     LDA #$01\n"
+              "0602  c9 02     CMP #$02\n"
+              "0604  d0 02     BNE notequal\n"
+              "0606  85 22     STA $22\n"
+              "notequal:\n"
+              "0608  00 00     BRK\n", out);
+}
+
+TEST(Disassembler, AddressModes) {
+    const uint8_t code[] = {
+        0x0a,               // ASL A
+        0x15, 0x10,         // ORA $10,X
+        0xb6, 0x20,         // LDX $20,Y
+        0x1d, 0x34, 0x12,   // ORA $1234,X
+        0x6c, 0xfe, 0xff,   // JMP ($fffe)
+        0x01, 0x40,         // ORA ($40,X)
+        0x11, 0x41,         // ORA ($41),Y
+        0x02,               // not an instruction
+        0xad, 0x00,         // LDA abs, cut off by the end of the range
+    };
+    Disassembler disassembler;
+    std::string out;
+    for (size_t addr = 0; addr < sizeof(code); ) {
+        addr += disassembler.disassemble_one(code, addr, sizeof(code), out);
+        out.push_back(';');
+    }
+    ASSERT_EQ("ASL A;ORA $10,X;LDX $20,Y;ORA $1234,X;JMP ($fffe);"
+              "ORA ($40,X);ORA ($41),Y;.byte $02;.byte $ad;.byte $00;", out);
+}
@@ -0,0 +1,68 @@
+#include "gtest/gtest.h"
+#include "coverage.h"
+#include "explore.h"
+
+TEST(Explore, FindsInputsReachingTarget) {
+    static const uint8_t code[] = {
+        0xa9, 0x00,         // 0600: LDA #$00
+        0x0d, 0x00, 0xd0,   // 0602: ORA $d000
+        0xc9, 0x03,         // 0605: CMP #$03
+        0xd0, 0x0b,         // 0607: BNE $0614
+        0xa9, 0x00,         // 0609: LDA #$00
+        0x0d, 0x00, 0xd0,   // 060b: ORA $d000
+        0xc9, 0x05,         // 060e: CMP #$05
+        0xd0, 0x02,         // 0610: BNE $0614
+        0x00, 0x00,         // 0612: BRK
+        0x00, 0x00,         // 0614: BRK
+    };
+    if (!Coverage::ENABLED) {
+        return;
+    }
+    Cpu start(MEM_SPARSE);
+    start.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+
+    ExploreOptions options;
+    for (int value = 0; value < 8; ++value) {
+        options.alphabet.push_back(value);
+    }
+    options.n_threads = 4;
+    options.has_target = true;
+    options.target = 0x0612;
+    ExploreResult result = explore(start, options);
+
+    ASSERT_EQ(1u, result.reached.size());
+    static const uint8_t expected[] = { 3, 5 };
+    ASSERT_EQ(std::vector<uint8_t>(expected, expected + 2), result.reached[0]);
+    ASSERT_EQ(2u, result.n_forks);
+    ASSERT_EQ(1u + 8 + 8, result.n_runs);
+    ASSERT_EQ(7u + 7, result.n_ended);
+    ASSERT_EQ(0u, result.n_pruned);
+    // the start is untouched
+    ASSERT_EQ(0x0600, start.PC.read());
+}
+
+TEST(Explore, PrunesRepeatedStates) {
+    // every input is thrown away, so each read is in the same state
+    static const uint8_t code[] = {
+        0x0d, 0x00, 0xd0,   // 0600: ORA $d000
+        0xa9, 0x00,         // 0603: LDA #$00
+        0xf0, 0xf9,         // 0605: BEQ $0600
+    };
+    Cpu start(MEM_SPARSE);
+    start.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+
+    ExploreOptions options;
+    for (int value = 0; value < 4; ++value) {
+        options.alphabet.push_back(value);
+    }
+    options.max_inputs = 3;
+    ExploreResult result = explore(start, options);
+
+    ASSERT_TRUE(result.reached.empty());
+    // one fork per number of inputs, and the other three values pruned
+    ASSERT_EQ(3u, result.n_forks);
+    ASSERT_EQ(2u * 3, result.n_pruned);
+    ASSERT_EQ(4u, result.n_cut_off);
+    ASSERT_EQ(1u + 3 * 4, result.n_runs);
+    ASSERT_EQ(0u, result.n_ended);
+}
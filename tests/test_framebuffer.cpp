@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <fstream>
+#include "gtest/gtest.h"
+#include "framebuffer.h"
+
+TEST(Framebuffer, TakesNewestFrame) {
+    Cpu cpu;
+    Framebuffer framebuffer(cpu, 0);
+    ASSERT_EQ(NULL, framebuffer.take_frame());
+
+    cpu.mem.write_8(0x0200, 1);
+    ASSERT_TRUE(framebuffer.publish());
+    ASSERT_FALSE(framebuffer.publish());    // nothing has changed
+    const Frame* frame = framebuffer.take_frame();
+    ASSERT_TRUE(frame != NULL);
+    ASSERT_EQ(0u, frame->number);
+    ASSERT_EQ(32u, frame->width);
+    ASSERT_EQ(1024u, frame->pixels.size());
+    ASSERT_EQ(1, frame->pixels[0]);
+    ASSERT_EQ(NULL, framebuffer.take_frame());
+
+    // frames the reader doesn't take in time are skipped, and every slot
+    // picks up the pages written while it was elsewhere
+    cpu.mem.write_8(0x0600, 7);     // outside the framebuffer
+    ASSERT_FALSE(framebuffer.publish());
+    cpu.mem.write_8(0x0300, 2);
+    ASSERT_TRUE(framebuffer.publish());
+    cpu.mem.write_8(0x05ff, 3);
+    ASSERT_TRUE(framebuffer.publish());
+    cpu.mem.write_8(0x0201, 4);
+    ASSERT_TRUE(framebuffer.publish());
+    frame = framebuffer.take_frame();
+    ASSERT_EQ(3u, frame->number);
+    ASSERT_EQ(1, frame->pixels[0]);
+    ASSERT_EQ(4, frame->pixels[1]);
+    ASSERT_EQ(2, frame->pixels[0x100]);
+    ASSERT_EQ(3, frame->pixels[0x3ff]);
+    ASSERT_EQ(4u, framebuffer.frames_published());
+}
+
+TEST(Framebuffer, PublishesEveryInterval) {
+    static const uint8_t code[] = {
+        0xa2, 0x01,         // 0600: LDX #$01
+        0x8e, 0x00, 0x02,   // 0602: STX $0200
+        0xa2, 0x20,         // 0605: LDX #$20
+        0xca,               // 0607: DEX
+        0xd0, 0xfd,         // 0608: BNE $0607
+        0xa2, 0x05,         // 060a: LDX #$05
+        0x8e, 0xff, 0x05,   // 060c: STX $05ff
+        0x00, 0x00,         // 060f: BRK
+    };
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    Framebuffer framebuffer(cpu, 10);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+
+    // a frame at cycle 10, then none while the loop runs, and one for the
+    // last store
+    ASSERT_EQ(2u, framebuffer.frames_published());
+    const Frame* frame = framebuffer.take_frame();
+    ASSERT_EQ(1u, frame->number);
+    ASSERT_GT(frame->cycle, 160u);
+    ASSERT_EQ(1, frame->pixels[0]);
+    ASSERT_EQ(5, frame->pixels[0x3ff]);
+    ASSERT_FALSE(framebuffer.publish());
+}
+
+TEST(Framebuffer, DumpsFrames) {
+    Cpu cpu;
+    Framebuffer framebuffer(cpu, 0, 0x0200, 2, 2);
+    const std::string prefix = testing::TempDir() + "framebuffer_test_";
+    {
+        FrameDumper dumper(framebuffer, prefix);
+        cpu.mem.write_8(0x0201, 1);
+        cpu.mem.write_8(0x0203, 0x12);
+        framebuffer.publish();
+        dumper.stop();
+        ASSERT_EQ(1u, dumper.frames_written());
+        ASSERT_EQ(0u, dumper.frames_failed());
+    }
+
+    const std::string path = prefix + "000000.ppm";
+    std::ifstream f(path.c_str(), std::ios::binary);
+    std::string ppm((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(std::string("P6\n2 2\n255\n"
+                          "\x00\x00\x00" "\xff\xff\xff" "\x00\x00\x00" "\x88\x00\x00",
+                          11 + 12), ppm);
+    std::remove(path.c_str());
+}
@@ -0,0 +1,165 @@
+#include <random>
+#include "gtest/gtest.h"
+#include "input_log.h"
+
+/* An input port at $D000 that reads as noise, and raises IRQ on every fifth
+ * read until $D001 is read */
+class NoiseDevice : public MemDevice {
+public:
+    NoiseDevice(unsigned seed, Cpu& cpu) : rng(seed), cpu(cpu), n_reads(0) { }
+
+    uint8_t read(address_t addr) {
+        if (addr == 0xd001) {
+            this->cpu.set_irq(false);
+            return 0x80;
+        }
+        if (++this->n_reads % 5 == 0) {
+            this->cpu.set_irq(true);
+        }
+        return (uint8_t) this->rng();
+    }
+
+    void write(address_t, uint8_t) { }
+
+    std::minstd_rand rng;
+    Cpu& cpu;
+    int n_reads;
+};
+
+/* Reads the port n times, storing each value, with an IRQ handler that
+ * acknowledges the interrupt */
+static void load_reader(Cpu& cpu, MemDevice& device, uint8_t n = 0x20) {
+    const uint8_t code[] = {
+        0xa2, n,            // 0600: LDX #n
+        0xa9, 0x00,         // 0602: LDA #$00
+        0x0d, 0x00, 0xd0,   // 0604: ORA $D000
+        0x85, 0x00,         // 0607: STA $00
+        0xca,               // 0609: DEX
+        0xd0, 0xf6,         // 060A: BNE $0602
+        0x00, 0x00,         // 060C: BRK
+    };
+    const uint8_t handler[] = {
+        0x0d, 0x01, 0xd0,   // 0700: ORA $D001
+        0x85, 0x01,         // 0703: STA $01
+        0x40,               // 0705: RTI
+    };
+    cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    cpu.mem.write_block(0x0700, handler, sizeof(handler));
+    cpu.mem.write_16(Cpu::IRQ_VECTOR, 0x0700);
+    cpu.mem.map_device(0xd0, 1, &device);
+}
+
+/* The registers after every instruction of a run */
+static std::vector<Cpu::Registers> run_trace(Cpu& cpu) {
+    std::vector<Cpu::Registers> trace;
+    while (cpu.emu_loop(0, 1) == STOP_INSTRUCTION_LIMIT) {
+        trace.push_back(cpu.save_registers());
+    }
+    trace.push_back(cpu.save_registers());
+    return trace;
+}
+
+static void assert_same_run(const std::vector<Cpu::Registers>& expected,
+                            const std::vector<Cpu::Registers>& actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQ(expected[i].A, actual[i].A) << "instruction " << i;
+        ASSERT_EQ(expected[i].P, actual[i].P) << "instruction " << i;
+        ASSERT_EQ(expected[i].PC, actual[i].PC) << "instruction " << i;
+        ASSERT_EQ(expected[i].cycles, actual[i].cycles) << "instruction " << i;
+    }
+}
+
+TEST(InputLog, ReplayIsExact) {
+    InputLog log;
+    Cpu recorded;
+    NoiseDevice noise(1, recorded);
+    load_reader(recorded, noise);
+    std::vector<Cpu::Registers> expected;
+    {
+        InputRecorder recorder(recorded, log);
+        expected = run_trace(recorded);
+    }
+
+    size_t n_irqs = 0;
+    for (size_t i = 0; i < log.events.size(); ++i) {
+        n_irqs += log.events[i].kind == INPUT_IRQ;
+    }
+    ASSERT_EQ(6u, n_irqs);
+    ASSERT_EQ(0x20 + 2 * n_irqs, log.events.size());
+
+    // the replay's own device would give different values, but isn't used
+    Cpu replayed;
+    NoiseDevice other(2, replayed);
+    load_reader(replayed, other);
+    InputReplayer replayer(replayed, log);
+    assert_same_run(expected, run_trace(replayed));
+    ASSERT_TRUE(replayer.finished());
+    ASSERT_EQ(0, other.n_reads);
+    ASSERT_EQ(recorded.mem.read_8(0x00), replayed.mem.read_8(0x00));
+
+    Cpu live;
+    NoiseDevice live_noise(2, live);
+    load_reader(live, live_noise);
+    run_trace(live);
+    ASSERT_NE(recorded.mem.read_8(0x00), live.mem.read_8(0x00));
+}
+
+TEST(InputLog, DataRoundTrips) {
+    InputLog log;
+    Cpu cpu;
+    NoiseDevice noise(3, cpu);
+    load_reader(cpu, noise);
+    {
+        InputRecorder recorder(cpu, log);
+        ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+        ASSERT_EQ(0x42, recorder.host_call(7, 0x42));
+    }
+
+    const std::string data = log.data();
+    ASSERT_LT(data.size(), 12 + 6 * log.events.size());
+    InputLog loaded;
+    ASSERT_TRUE(loaded.load(data));
+    ASSERT_EQ(log.events.size(), loaded.events.size());
+    for (size_t i = 0; i < log.events.size(); ++i) {
+        ASSERT_EQ(log.events[i].kind, loaded.events[i].kind);
+        ASSERT_EQ(log.events[i].instructions, loaded.events[i].instructions);
+        ASSERT_EQ(log.events[i].cycles, loaded.events[i].cycles);
+        ASSERT_EQ(log.events[i].addr, loaded.events[i].addr);
+        ASSERT_EQ(log.events[i].value, loaded.events[i].value);
+    }
+    ASSERT_EQ(INPUT_HOST_CALL, loaded.events.back().kind);
+
+    ASSERT_FALSE(loaded.load(data.substr(0, data.size() - 1)));
+    ASSERT_TRUE(loaded.events.empty());
+    ASSERT_FALSE(loaded.load(data + "x"));
+    ASSERT_FALSE(loaded.load("M65C"));
+}
+
+TEST(InputLog, ReplayDetectsDivergence) {
+    InputLog log;
+    Cpu recorded;
+    NoiseDevice noise(4, recorded);
+    load_reader(recorded, noise);
+    {
+        InputRecorder recorder(recorded, log);
+        ASSERT_EQ(STOP_BRK, recorded.emu_loop());
+        recorder.host_call(7, 0x42);
+    }
+
+    // the same run, then host calls that do and don't match
+    Cpu same;
+    load_reader(same, noise);
+    InputReplayer replayer(same, log);
+    ASSERT_EQ(STOP_BRK, same.emu_loop());
+    ASSERT_FALSE(replayer.finished());
+    ASSERT_THROW(replayer.host_call(8, 0), ReplayError);
+    ASSERT_EQ(0x42, replayer.host_call(7, 0));
+    ASSERT_TRUE(replayer.finished());
+
+    // a program that reads the port once more runs off the end of the log
+    Cpu longer;
+    load_reader(longer, noise, 0x21);
+    InputReplayer longer_replayer(longer, log);
+    ASSERT_THROW(longer.emu_loop(), ReplayError);
+}
@@ -89,6 +89,23 @@ TEST_F(AssemblyCodeWithLabel, ExecutionOutput) {
     ASSERT_EQ(0x03, cpu.mem.read_8(0x0201));
 }
 
+TEST_F(AssemblyCodeWithLabel, LoadProgram) {
+    Assembler assembler(codetext);
+    Cpu cpu;
+    cpu.load_program(assembler, 0x700);
+    this->assert_cpu_equal(cpu, 0, 0, 0, 0xff, 0x700, 0);
+
+    std::vector<uint8_t> code;
+    assembler.relocate_code(0x700, code);
+    for (size_t i = 0; i < code.size(); ++i) {
+        ASSERT_EQ(code[i], cpu.mem.read_8(0x700 + i));
+    }
+
+    cpu.mem.write_16(0xfffe, 0x1234);
+    cpu.emu_loop();
+    this->assert_cpu_equal(cpu, 0, 3, 0, 0xfc, 0x1234, 0x13);
+}
+
 TEST_F(AssemblyWithForwardDeclaredLabel, ExecutionOutput) {
     Assembler assembler(codetext);
     Cpu cpu;
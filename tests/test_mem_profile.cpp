@@ -0,0 +1,113 @@
+#include <sstream>
+#include "gtest/gtest.h"
+#include "assembler_fixtures.h"
+#include "cpu.h"
+#include "mem_profile.h"
+
+TEST(MemProfile, CountsPagesAndWatchedAddresses) {
+    for (int model = MEM_DENSE; model <= MEM_SPARSE; ++model) {
+        Cpu cpu((MemModel) model);
+        load_store_loop(cpu);
+        MemProfile profile;
+        profile.watch_page(0x02);
+        profile.watch_page(0x06);
+        cpu.mem.set_profile(&profile);
+        ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+
+        // LDX, then 256 times round STX, DEX and BNE, then BRK's opcode
+        ASSERT_EQ(2u + 256 * 6 + 1, profile.page_count(0x06, ACCESS_EXECUTE));
+        ASSERT_EQ(256u, profile.address_count(0x0602, ACCESS_EXECUTE));
+        ASSERT_EQ(0u, profile.page_count(0x06, ACCESS_WRITE));
+        ASSERT_EQ(256u, profile.page_count(0x02, ACCESS_WRITE));
+        ASSERT_EQ(256u, profile.address_count(0x0200, ACCESS_ANY));
+        ASSERT_EQ(0u, profile.address_count(0x0201, ACCESS_ANY));
+        // BRK pushes three bytes and reads the IRQ vector
+        ASSERT_EQ(3u, profile.page_count(0x01, ACCESS_WRITE));
+        ASSERT_EQ(2u, profile.page_count(0xff, ACCESS_READ));
+        ASSERT_EQ(0u, profile.address_count(0x01fd, ACCESS_ANY));  // not watched
+
+        // memory is just as it would be without the profile
+        cpu.mem.set_profile(NULL);
+        Cpu plain((MemModel) model);
+        load_store_loop(plain);
+        plain.emu_loop();
+        ASSERT_EQ(plain.cycles, cpu.cycles);
+        for (size_t addr = 0; addr < Mem::MEM_SIZE; ++addr) {
+            ASSERT_EQ(plain.mem.read_8(addr), cpu.mem.read_8(addr));
+        }
+        ASSERT_EQ(plain.mem.n_pages(), cpu.mem.n_pages());
+        ASSERT_EQ(2u + 256 * 6 + 1, profile.page_count(0x06, ACCESS_EXECUTE));
+    }
+}
+
+TEST(MemProfile, DetachesWhenDestroyed) {
+    Cpu cpu(MEM_SPARSE);
+    load_store_loop(cpu);
+    {
+        MemProfile profile;
+        cpu.mem.set_profile(&profile);
+        cpu.emu_loop(0, 10);
+    }
+    cpu.mem.write_8(0x0300, 0x12);
+    ASSERT_EQ(0x12, cpu.mem.read_8(0x0300));
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    ASSERT_EQ(0x01, cpu.mem.read_8(0x0200));
+}
+
+TEST(MemProfile, WorkingSet) {
+    Cpu cpu;
+    load_store_loop(cpu);
+    MemProfile profile(100, &cpu.cycles);
+    cpu.mem.set_profile(&profile);
+    cpu.emu_loop();
+
+    std::vector<MemProfile::WorkingSetSample> samples = profile.working_set();
+    ASSERT_GT(samples.size(), cpu.cycles / 100 - 2);
+    for (size_t i = 0; i < samples.size(); ++i) {
+        ASSERT_EQ(0u, samples[i].start % 100);
+        if (i > 0) {
+            ASSERT_GT(samples[i].start, samples[i - 1].start);
+        }
+        // the loop runs on its code page and page 2. The last window has
+        // the end of the loop, after the final store, and BRK adds two.
+        ASSERT_EQ(i + 1 < samples.size() ? 2u : 3u, samples[i].n_pages);
+    }
+
+    std::ostringstream csv;
+    profile.write_working_set_csv(csv);
+    ASSERT_EQ(0u, csv.str().find("start,pages\n0,2\n100,2\n"));
+}
+
+TEST(MemProfile, Heatmaps) {
+    Cpu cpu;
+    load_store_loop(cpu);
+    MemProfile profile;
+    profile.watch_page(0x06);
+    cpu.mem.set_profile(&profile);
+    cpu.emu_loop();
+
+    std::ostringstream pgm;
+    profile.write_heatmap_pgm(pgm, ACCESS_ANY);
+    const std::string header = "P5\n256 256\n255\n";
+    ASSERT_EQ(header.size() + 256 * 256, pgm.str().size());
+    ASSERT_EQ(header, pgm.str().substr(0, header.size()));
+    const std::string pixels = pgm.str().substr(header.size());
+    ASSERT_EQ(255, (uint8_t) pixels[0x0602]);   // the busiest address
+    ASSERT_EQ(0, (uint8_t) pixels[0x0609]);     // BRK's unread operand
+    ASSERT_GT((uint8_t) pixels[0x0200], 0);     // page 2's average
+    ASSERT_EQ((uint8_t) pixels[0x0200], (uint8_t) pixels[0x02ff]);
+    ASSERT_EQ(0, (uint8_t) pixels[0x0300]);
+
+    std::ostringstream csv;
+    profile.write_heatmap_csv(csv, ACCESS_WRITE);
+    std::istringstream lines(csv.str());
+    std::string line;
+    int n_lines = 0;
+    while (std::getline(lines, line)) {
+        if (n_lines == 2) {
+            ASSERT_EQ(0u, line.find("1,1,1,"));     // 256 writes over 256 addresses
+        }
+        ++n_lines;
+    }
+    ASSERT_EQ(256, n_lines);
+}
@@ -0,0 +1,101 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "memo.h"
+
+/* Calls a routine that reads $0300 five times with the same inputs */
+static const uint8_t CALLS[] = {
+    0xa9, 0x00,         // 0600: LDA #$00
+    0x20, 0x1d, 0x06,   // 0602: JSR $061d
+    0xa9, 0x00,         // 0605: LDA #$00
+    0x20, 0x1d, 0x06,   // 0607: JSR $061d
+    0xa9, 0x00,         // 060a: LDA #$00
+    0x20, 0x1d, 0x06,   // 060c: JSR $061d
+    0xa9, 0x00,         // 060f: LDA #$00
+    0x20, 0x1d, 0x06,   // 0611: JSR $061d
+    0xa9, 0x00,         // 0614: LDA #$00
+    0x20, 0x1d, 0x06,   // 0616: JSR $061d
+    0x85, 0x11,         // 0619: STA $11
+    0x00, 0x00,         // 061b: BRK
+    0x0d, 0x00, 0x03,   // 061d: ORA $0300
+    0x85, 0x10,         // 0620: STA $10
+    0x69, 0x01,         // 0622: ADC #$01
+    0x60,               // 0624: RTS
+};
+
+static void load_calls(Cpu& cpu) {
+    cpu.load_code(std::vector<uint8_t>(CALLS, CALLS + sizeof(CALLS)));
+    cpu.mem.write_8(0x0300, 0x40);
+    cpu.mem.write_16(Cpu::NMI_VECTOR, 0x0700);
+    cpu.mem.write_8(0x0700, 0x40);     // RTI
+}
+
+static void expect_same(const Cpu& plain, const Cpu& memoized) {
+    ASSERT_EQ(plain.cycles, memoized.cycles);
+    ASSERT_EQ(plain.instructions, memoized.instructions);
+    ASSERT_EQ(plain.PC.read(), memoized.PC.read());
+    ASSERT_EQ(plain.A.read(), memoized.A.read());
+    ASSERT_EQ(plain.X.read(), memoized.X.read());
+    ASSERT_EQ(plain.Y.read(), memoized.Y.read());
+    ASSERT_EQ(plain.S.read(), memoized.S.read());
+    ASSERT_EQ(plain.P.read(), memoized.P.read());
+    for (address_t addr = 0x0100; addr < 0x0200; ++addr) {
+        ASSERT_EQ(plain.mem.read_8(addr), memoized.mem.read_8(addr));
+    }
+    ASSERT_EQ(plain.mem.read_16(0x10), memoized.mem.read_16(0x10));
+}
+
+TEST(SubroutineMemo, HitsMatchRunning) {
+    Cpu plain, memoized;
+    SubroutineMemo memo;
+    memo.declare_pure(0x061d, 0x0300, 8);
+    memoized.set_memo(&memo);
+    load_calls(plain);
+    load_calls(memoized);
+
+    ASSERT_EQ(STOP_BRK, plain.emu_loop());
+    ASSERT_EQ(STOP_BRK, memoized.emu_loop());
+    expect_same(plain, memoized);
+    ASSERT_EQ(0x41, memoized.mem.read_8(0x11));
+    ASSERT_EQ(1u, memo.misses());
+    ASSERT_EQ(4u, memo.hits());
+    ASSERT_EQ(0.8, memo.hit_rate());
+    // ORA, STA, ADC and RTS
+    ASSERT_EQ(4u * (4 + 3 + 2 + 6), memo.cycles_saved());
+    ASSERT_EQ(4u * 4, memo.instructions_saved());
+
+    // a change to the input window is a new key
+    Cpu* cpus[] = { &plain, &memoized };
+    for (size_t i = 0; i < 2; ++i) {
+        cpus[i]->mem.write_8(0x0300, 0x01);
+        cpus[i]->reset(RESET_REGISTERS);
+        cpus[i]->PC.write(0x0600);
+        ASSERT_EQ(STOP_BRK, cpus[i]->emu_loop());
+    }
+    expect_same(plain, memoized);
+    ASSERT_EQ(0x02, memoized.mem.read_8(0x11));
+    ASSERT_EQ(2u, memo.misses());
+    ASSERT_EQ(8u, memo.hits());
+    ASSERT_EQ(2u, memo.size());
+    memoized.set_memo(NULL);
+}
+
+TEST(SubroutineMemo, InterruptedCallsAreNotKept) {
+    Cpu plain, memoized;
+    SubroutineMemo memo;
+    memo.declare_pure(0x061d, 0x0300, 8);
+    memoized.set_memo(&memo);
+    load_calls(plain);
+    load_calls(memoized);
+
+    // an NMI in the middle of the first call
+    Cpu* cpus[] = { &plain, &memoized };
+    for (size_t i = 0; i < 2; ++i) {
+        cpus[i]->emu_loop(0, 4);
+        cpus[i]->nmi();
+        ASSERT_EQ(STOP_BRK, cpus[i]->emu_loop());
+    }
+    expect_same(plain, memoized);
+    ASSERT_EQ(2u, memo.misses());
+    ASSERT_EQ(3u, memo.hits());
+    memoized.set_memo(NULL);
+}
@@ -0,0 +1,103 @@
+#include <sstream>
+#include "gtest/gtest.h"
+#include "runner.h"
+#include "assembler.h"
+#include "assembler_fixtures.h"
+
+TEST(Runner, ParseNumber) {
+    uint64_t value;
+    ASSERT_TRUE(parse_number("$1f", 0xff, value));
+    ASSERT_EQ(0x1fu, value);
+    ASSERT_TRUE(parse_number("0x600", 0xffff, value));
+    ASSERT_EQ(0x600u, value);
+    ASSERT_TRUE(parse_number("1000", 0xffff, value));
+    ASSERT_EQ(1000u, value);
+
+    ASSERT_FALSE(parse_number("", 0xff, value));
+    ASSERT_FALSE(parse_number("$", 0xff, value));
+    ASSERT_FALSE(parse_number("-1", 0xff, value));
+    ASSERT_FALSE(parse_number("12ab", 0xffff, value));
+    ASSERT_FALSE(parse_number("$100", 0xff, value));
+}
+
+TEST(Runner, ParseAddressRange) {
+    uint16_t start, end;
+    ASSERT_TRUE(parse_address_range("$200:0x20f", start, end));
+    ASSERT_EQ(0x200, start);
+    ASSERT_EQ(0x20f, end);
+    ASSERT_TRUE(parse_address_range("0:0", start, end));
+
+    ASSERT_FALSE(parse_address_range("$200", start, end));
+    ASSERT_FALSE(parse_address_range("$20f:$200", start, end));
+    ASSERT_FALSE(parse_address_range("$200:$10000", start, end));
+}
+
+TEST(Runner, SetRegister) {
+    Cpu cpu;
+    ASSERT_TRUE(set_register(cpu, "A=$10"));
+    ASSERT_TRUE(set_register(cpu, "x=2"));
+    ASSERT_TRUE(set_register(cpu, "Y=0x30"));
+    ASSERT_TRUE(set_register(cpu, "S=$f0"));
+    ASSERT_TRUE(set_register(cpu, "P=$01"));
+    ASSERT_TRUE(set_register(cpu, "PC=$0700"));
+    ASSERT_EQ(0x10, cpu.A.read());
+    ASSERT_EQ(2, cpu.X.read());
+    ASSERT_EQ(0x30, cpu.Y.read());
+    ASSERT_EQ(0xf0, cpu.S.read());
+    ASSERT_EQ(1, cpu.P.read());
+    ASSERT_EQ(0x700, cpu.PC.read());
+
+    ASSERT_FALSE(set_register(cpu, "A"));
+    ASSERT_FALSE(set_register(cpu, "A=$100"));
+    ASSERT_FALSE(set_register(cpu, "Q=1"));
+}
+
+TEST_F(AssemblyCodeWithLabel, RunLimits) {
+    Assembler assembler(codetext);
+    Cpu cpu;
+    cpu.load_program(assembler, 0x600);
+
+    RunStats stats = run_cpu(cpu, 0, 4);
+    ASSERT_EQ(STOP_INSTRUCTION_LIMIT, stats.stop_reason);
+    ASSERT_EQ(4u, stats.instructions);
+    // LDX #, DEX, STX abs, CPX #
+    ASSERT_EQ(2u + 2 + 4 + 2, stats.cycles);
+
+    // limits are relative to the start of each run, and a run stops at the
+    // first instruction boundary at or past the cycle limit
+    stats = run_cpu(cpu, 1, 0);
+    ASSERT_EQ(STOP_CYCLE_LIMIT, stats.stop_reason);
+    ASSERT_EQ(1u, stats.instructions);
+    ASSERT_GE(stats.cycles, 1u);
+
+    stats = run_cpu(cpu, 0, 0);
+    ASSERT_EQ(STOP_BRK, stats.stop_reason);
+    ASSERT_EQ(0x03, cpu.mem.read_8(0x0201));
+    ASSERT_EQ(cpu.instructions, 4 + 1 + stats.instructions);
+}
+
+TEST(Runner, JsonStats) {
+    RunStats stats;
+    stats.stop_reason = STOP_CYCLE_LIMIT;
+    stats.cycles = 2000000;
+    stats.instructions = 500000;
+    stats.wall_seconds = 0.5;
+
+    std::ostringstream out;
+    write_json_stats(out, stats);
+    ASSERT_EQ("{\"cycles\":2000000,\"instructions\":500000,"
+              "\"wall_time_s\":0.500000,\"emulated_mhz\":4.000,"
+              "\"stop_reason\":\"cycle_limit\"}", out.str());
+}
+
+TEST(Runner, MemoryDump) {
+    Mem mem;
+    mem.write_8(0x201, 0xab);
+    mem.write_8(0x210, 0x01);
+
+    std::ostringstream out;
+    write_memory_dump(out, mem, 0x201, 0x210);
+    ASSERT_EQ("0200:    ab 00 00 00 00 00 00 00 00 00 00 00 00 00 00\n"
+              "0210: 01                                             \n",
+              out.str());
+}
@@ -0,0 +1,128 @@
+#include <atomic>
+#include <sstream>
+#include "gtest/gtest.h"
+#include "assembler.h"
+#include "batch.h"
+#include "console.h"
+#include "runner.h"
+#include "state_hash.h"
+#include "assembler_fixtures.h"
+
+TEST_F(AssemblyCodeWithLabel, StateHashFollowsWrites) {
+    Assembler assembler(codetext);
+    Cpu cpu, other;
+    cpu.load_program(assembler, 0x600);
+    other.load_program(assembler, 0x600);
+    StateHash hash(cpu);
+    const uint64_t start = hash.state();
+    ASSERT_EQ(start, StateHash(other).state());
+
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    const uint64_t memory = hash.memory();
+    const uint64_t page = hash.page(0x02);
+    ASSERT_NE(start, hash.state());
+    ASSERT_EQ(hash.page(0x06), StateHash(other).page(0x06));
+    hash.rehash();
+    ASSERT_EQ(memory, hash.memory());
+    ASSERT_EQ(page, hash.page(0x02));
+
+    // writing the old values back gets the old page hash back
+    const uint8_t zeros[2] = { 0, 0 };
+    cpu.mem.write_block(0x0200, zeros, sizeof(zeros));
+    ASSERT_EQ(StateHash(other).page(0x02), hash.page(0x02));
+    ASSERT_NE(StateHash(other).memory(), hash.memory());  // BRK pushed
+    cpu.mem.write_block(0x01fd, other.mem.dense_data() + 0x01fd, 3);
+    ASSERT_EQ(StateHash(other).memory(), hash.memory());
+
+    // registers count, but the cycle and instruction counts don't
+    other.restore_registers(cpu.save_registers());
+    ASSERT_EQ(StateHash(other).state(), hash.state());
+    other.cycles = 0;
+    ASSERT_EQ(StateHash(other).state(), hash.state());
+    other.X.write(other.X.read() + 1);
+    ASSERT_NE(StateHash(other).state(), hash.state());
+}
+
+TEST_F(AssemblyCodeWithLabel, DetectLoops) {
+    // a program that ends runs as it would without detection
+    Assembler assembler(codetext);
+    Cpu plain, detecting;
+    plain.load_program(assembler, 0x600);
+    detecting.load_program(assembler, 0x600);
+    RunStats stats = run_cpu(detecting, 0, 0, true);
+    ASSERT_EQ(STOP_BRK, stats.stop_reason);
+    ASSERT_EQ(run_cpu(plain, 0, 0).cycles, stats.cycles);
+
+    // a counter in A and $10 that comes round every 256 passes
+    static const uint8_t forever[] = {
+        0x69, 0x01,         // 0600: ADC #$01
+        0x85, 0x10,         // 0602: STA $10
+        0x18,               // 0604: CLC
+        0x90, 0xf9,         // 0605: BCC $0600
+    };
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(forever, forever + sizeof(forever)));
+    stats = run_cpu(cpu, 0, 0, true);
+    ASSERT_EQ(STOP_REPEATED_STATE, stats.stop_reason);
+    ASSERT_GE(stats.instructions, 256u * 4);
+    ASSERT_LE(stats.instructions, 3 * 256u * 4);
+    ASSERT_EQ(std::string("repeated_state"), stop_reason_to_string(stats.stop_reason));
+
+    cpu.load_code(std::vector<uint8_t>(forever, forever + sizeof(forever)));
+    ASSERT_EQ(STOP_CYCLE_LIMIT, run_cpu(cpu, 100, 0, true).stop_reason);
+    ASSERT_EQ(STOP_INSTRUCTION_LIMIT, run_cpu(cpu, 0, 100, true).stop_reason);
+
+    std::vector<std::string> args(1, "--detect-loops");
+    JobOptions options;
+    size_t i = 0;
+    ASSERT_EQ(OPTION_OK, parse_job_option(args, i, options));
+    ASSERT_TRUE(options.detect_loops);
+}
+
+TEST(RunCpu, DetectLoopsIgnoresWaitsOnDevices) {
+    static const uint8_t wait_for_newline[] = {
+        0xad, 0x00, 0xd0,   // 0600: LDA $d000
+        0xc9, 0x0a,         // 0603: CMP #$0a
+        0xd0, 0xf9,         // 0605: BNE $0600
+        0x00, 0x00,         // 0607: BRK
+    };
+    std::ostringstream out;
+    Console console(out);
+    Cpu cpu;
+    console.map_input(cpu.mem, 0xd000);
+    console.add_input("aaaaaaaa\n");
+    cpu.load_code(std::vector<uint8_t>(wait_for_newline,
+                                       wait_for_newline + sizeof(wait_for_newline)));
+    ASSERT_FALSE(cpu.is_closed());
+
+    // the registers and memory repeat while the input is read
+    RunStats stats = run_cpu(cpu, 0, 0, true);
+    ASSERT_EQ(STOP_BRK, stats.stop_reason);
+    ASSERT_EQ(28u, stats.instructions);
+}
+
+/* Each index inserts the hashes of i / 2 and i / 2 + 1000, so every hash is
+ * inserted twice and only one of the two insertions is new */
+struct InsertHashes {
+    InsertHashes(StateSet& set) : set(set), n_new(0) { }
+
+    void operator()(size_t i) {
+        n_new += this->set.insert(StateHash::byte_key(i / 2, 1));
+        n_new += this->set.insert(StateHash::byte_key(i / 2 + 1000, 2));
+    }
+
+    StateSet& set;
+    std::atomic<size_t> n_new;
+};
+
+TEST(StateSet, SharedBetweenThreads) {
+    StateSet set;
+    InsertHashes insert(set);
+    parallel_for(20000, 8, insert);
+    ASSERT_EQ(20000u, insert.n_new.load());
+    ASSERT_EQ(20000u, set.size());
+    ASSERT_TRUE(set.contains(StateHash::byte_key(5, 1)));
+    ASSERT_FALSE(set.contains(StateHash::byte_key(5, 2)));
+    set.clear();
+    ASSERT_EQ(0u, set.size());
+}
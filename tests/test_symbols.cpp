@@ -0,0 +1,79 @@
+#include <sstream>
+#include "gtest/gtest.h"
+#include "symbols.h"
+#include "assembler_fixtures.h"
+
+TEST_F(AssemblyCodeWithLabel, SourceLines) {
+    Assembler assembler(codetext);
+    // the label on line 2 doesn't produce code
+    const size_t offsets[] = { 0x00, 0x02, 0x03, 0x06, 0x08, 0x0a, 0x0d };
+    const int lines[] = { 1, 3, 4, 5, 6, 7, 8 };
+    ASSERT_EQ(7u, assembler.source_lines.size());
+    for (size_t i = 0; i < assembler.source_lines.size(); ++i) {
+        ASSERT_EQ(offsets[i], assembler.source_lines[i].offset);
+        ASSERT_EQ(lines[i], assembler.source_lines[i].line);
+    }
+}
+
+TEST_F(AssemblyCodeWithLabel, SymbolIndexLookup) {
+    Assembler assembler(codetext);
+    SymbolIndex index(assembler, 0x600);
+    ASSERT_EQ(7u, index.size());
+
+    ASSERT_EQ(-1, index.line_for(0x5ff));
+    ASSERT_EQ(1, index.line_for(0x600));
+    ASSERT_EQ(1, index.line_for(0x601));
+    ASSERT_EQ(3, index.line_for(0x602));
+    ASSERT_EQ(4, index.line_for(0x605));
+    ASSERT_EQ(8, index.line_for(0x60e));
+    ASSERT_EQ(-1, index.line_for(0x60f));
+
+    std::string name;
+    uint16_t offset;
+    ASSERT_FALSE(index.symbol_for(0x601, name, offset));
+    ASSERT_TRUE(index.symbol_for(0x602, name, offset));
+    ASSERT_EQ("decrement", name);
+    ASSERT_EQ(0, offset);
+    ASSERT_TRUE(index.symbol_for(0x608, name, offset));
+    ASSERT_EQ("decrement", name);
+    ASSERT_EQ(6, offset);
+}
+
+TEST_F(AssemblyWithForwardDeclaredLabel, SymbolIndexRoundTrip) {
+    Assembler assembler(codetext);
+    SymbolIndex written(assembler, 0x600);
+
+    SymbolIndex loaded;
+    ASSERT_TRUE(loaded.load(written.data()));
+    ASSERT_EQ(written.data(), loaded.data());
+    ASSERT_EQ(6, loaded.line_for(0x608));
+    std::string name;
+    uint16_t offset;
+    ASSERT_TRUE(loaded.symbol_for(0x609, name, offset));
+    ASSERT_EQ("notequal", name);
+    ASSERT_EQ(1, offset);
+
+    // truncated indexes are rejected
+    SymbolIndex bad;
+    ASSERT_FALSE(bad.load(written.data().substr(0, written.data().size() - 1)));
+    ASSERT_EQ(-1, bad.line_for(0x608));
+}
+
+TEST_F(AssemblyWithForwardDeclaredLabel, ListingAndMap) {
+    const std::string source = codetext.str();
+    Assembler assembler(codetext);
+
+    std::stringstream listing;
+    write_listing(listing, assembler, source, 0x600);
+    ASSERT_EQ("line  addr  bytes     source\n"
+              "   1  0600  a9 01     LDA #$01\n"
+              "   2  0602  c9 02     CMP #$02\n"
+              "   3  0604  d0 02     BNE notequal\n"
+              "   4  0606  85 22     STA $22\n"
+              "   5                  notequal:\n"
+              "   6  0608  00 00     BRK\n", listing.str());
+
+    std::stringstream map;
+    write_symbol_map(map, assembler, 0x600);
+    ASSERT_EQ("0608 notequal\n", map.str());
+}
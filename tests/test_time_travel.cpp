@@ -0,0 +1,186 @@
+#include "gtest/gtest.h"
+#include "assembler_fixtures.h"
+#include "time_travel.h"
+#include "via6522.h"
+
+/* A Cpu that ran the first n instructions without recording */
+static void assert_matches_run_of(const Cpu& cpu, uint64_t n) {
+    Cpu reference;
+    load_store_loop(reference);
+    if (n > 0) {
+        reference.emu_loop(0, n);
+    }
+    ASSERT_EQ(reference.instructions, cpu.instructions);
+    ASSERT_EQ(reference.cycles, cpu.cycles);
+    ASSERT_EQ(reference.PC.read(), cpu.PC.read());
+    ASSERT_EQ(reference.X.read(), cpu.X.read());
+    ASSERT_EQ(reference.P.read(), cpu.P.read());
+    ASSERT_EQ(reference.S.read(), cpu.S.read());
+    ASSERT_EQ(reference.mem.read_8(0x0200), cpu.mem.read_8(0x0200));
+    ASSERT_EQ(reference.mem.read_16(0x01fe), cpu.mem.read_16(0x01fe));
+}
+
+TEST(TimeTravel, SeekToInstruction) {
+    Cpu cpu;
+    load_store_loop(cpu);
+    TimeTravel tt(cpu, 100);
+    ASSERT_EQ(STOP_BRK, tt.run());
+    const uint64_t end = cpu.instructions;
+    ASSERT_GT(tt.checkpoints().size(), 10u);
+    ASSERT_EQ(256u, tt.journal_size() - 3);   // 256 stores and BRK's pushes
+
+    const uint64_t targets[] = { 500, 0, 1, 767, 100, end };
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i) {
+        ASSERT_TRUE(tt.seek_to_instruction(targets[i]));
+        assert_matches_run_of(cpu, targets[i]);
+    }
+}
+
+TEST(TimeTravel, ReverseStepAndSeekToCycle) {
+    Cpu cpu;
+    load_store_loop(cpu);
+    TimeTravel tt(cpu, 64);
+    tt.run(0, 300);
+
+    ASSERT_TRUE(tt.reverse_step());
+    assert_matches_run_of(cpu, 299);
+    ASSERT_TRUE(tt.reverse_step());
+    assert_matches_run_of(cpu, 298);
+
+    ASSERT_TRUE(tt.seek_to_cycle(1000));
+    ASSERT_GE(cpu.cycles, 1000u);
+    const uint64_t n = cpu.instructions;
+    ASSERT_TRUE(tt.reverse_step());
+    ASSERT_LT(cpu.cycles, 1000u);
+    assert_matches_run_of(cpu, n - 1);
+
+    ASSERT_TRUE(tt.seek_to_instruction(0));
+    ASSERT_FALSE(tt.reverse_step());
+}
+
+TEST(TimeTravel, ReverseContinue) {
+    Cpu cpu;
+    load_store_loop(cpu);
+    TimeTravel tt(cpu, 50);
+    tt.run(0, 400);
+
+    std::set<address_t> breakpoints;
+    breakpoints.insert(0x0605);
+    // the DEX before instruction 400 (every third one, from 2)
+    ASSERT_TRUE(tt.reverse_continue(breakpoints));
+    ASSERT_EQ(0x0605, cpu.PC.read());
+    assert_matches_run_of(cpu, 398);
+    ASSERT_TRUE(tt.reverse_continue(breakpoints));
+    assert_matches_run_of(cpu, 395);
+
+    breakpoints.clear();
+    breakpoints.insert(0x0600);
+    ASSERT_TRUE(tt.reverse_continue(breakpoints));
+    assert_matches_run_of(cpu, 0);
+    ASSERT_FALSE(tt.reverse_continue(breakpoints));
+    ASSERT_EQ(0u, cpu.instructions);
+}
+
+TEST(TimeTravel, JournalIsBounded) {
+    Cpu cpu;
+    load_store_loop(cpu);
+    TimeTravel tt(cpu, 90, 20);
+    ASSERT_EQ(STOP_BRK, tt.run());
+    // each interval has 10 stores
+    ASSERT_LE(tt.journal_size(), 20u + 10u);
+
+    const uint64_t oldest = tt.checkpoints().front().registers.instructions;
+    ASSERT_GT(oldest, 0u);
+    ASSERT_FALSE(tt.seek_to_instruction(oldest - 1));
+    ASSERT_TRUE(tt.seek_to_instruction(oldest));
+    assert_matches_run_of(cpu, oldest);
+}
+
+TEST(TimeTravel, StopsObservingWhenDone) {
+    Cpu cpu;
+    load_store_loop(cpu);
+    {
+        TimeTravel tt(cpu);
+        tt.run(0, 10);
+    }
+    ASSERT_TRUE(cpu.mem.dense_data() != NULL);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+}
+
+/* Writes 1 to addr when it fires */
+class StoreEvent : public CycleEvent {
+public:
+    StoreEvent(Cpu& cpu, address_t addr) : cpu(cpu), addr(addr) { }
+
+    void on_cycle(uint64_t) { this->cpu.mem.write_8(this->addr, 1); }
+
+    Cpu& cpu;
+    address_t addr;
+};
+
+TEST(TimeTravel, RestoresScheduledEvents) {
+    static const uint8_t code[] = {
+        0x90, 0xfe,         // 0600: BCC $0600
+    };
+    Cpu cpu;
+    cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    StoreEvent event(cpu, 0x40);
+    cpu.schedule(&event, 500);
+    TimeTravel tt(cpu, 100);
+    ASSERT_EQ(STOP_CYCLE_LIMIT, tt.run(1000));
+    ASSERT_EQ(Cpu::NO_EVENT, cpu.next_event());
+
+    // going back before the event puts it back, so replaying fires it again
+    ASSERT_TRUE(tt.seek_to_cycle(100));
+    ASSERT_EQ(500u, cpu.next_event());
+    ASSERT_EQ(0, cpu.mem.read_8(0x40));
+    ASSERT_TRUE(tt.seek_to_cycle(900));
+    ASSERT_EQ(1, cpu.mem.read_8(0x40));
+}
+
+/* Spins on BCC while a free running VIA timer interrupts every 102 cycles,
+ * with a handler that counts the interrupts down in X and $30 */
+static void load_timer_loop(Cpu& cpu, Via6522& via) {
+    static const uint8_t code[] = {
+        0x90, 0xfe,         // 0600: BCC $0600
+    };
+    static const uint8_t handler[] = {
+        0x0d, 0x04, 0xd0,   // 0700: ORA $d004
+        0xca,               // 0703: DEX
+        0x8e, 0x30, 0x00,   // 0704: STX $0030
+        0x40,               // 0707: RTI
+    };
+    cpu.mem.map_device(0xd0, 1, &via);
+    cpu.load_code(std::vector<uint8_t>(handler, handler + sizeof(handler)), 0x0700);
+    cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+    cpu.mem.write_16(Cpu::IRQ_VECTOR, 0x0700);
+    cpu.mem.write_8(0xd00b, Via6522::ACR_T1_FREE_RUN);
+    cpu.mem.write_8(0xd004, 100);
+    cpu.mem.write_8(0xd005, 0);
+    cpu.mem.write_8(0xd00e, 0x80 | Via6522::IRQ_T1);
+}
+
+TEST(TimeTravel, RestoresEventsAndDevices) {
+    Cpu cpu;
+    Via6522 via(cpu);
+    load_timer_loop(cpu, via);
+    TimeTravel tt(cpu, 100);
+    tt.add_state(&via);
+    ASSERT_EQ(STOP_CYCLE_LIMIT, tt.run(2000));
+
+    const uint64_t stops[] = { 5, 495, 17, 300 };
+    for (size_t i = 0; i < sizeof(stops) / sizeof(stops[0]); ++i) {
+        Cpu reference;
+        Via6522 reference_via(reference);
+        load_timer_loop(reference, reference_via);
+        reference.emu_loop(0, stops[i]);
+
+        ASSERT_TRUE(tt.seek_to_instruction(stops[i]));
+        ASSERT_EQ(reference.cycles, cpu.cycles);
+        ASSERT_EQ(reference.PC.read(), cpu.PC.read());
+        ASSERT_EQ(reference.X.read(), cpu.X.read());
+        ASSERT_EQ(reference.mem.read_8(0x30), cpu.mem.read_8(0x30));
+        ASSERT_EQ(reference_via.timer1(), via.timer1());
+        ASSERT_EQ(reference.next_event(), cpu.next_event());
+    }
+}
@@ -0,0 +1,138 @@
+#include "gtest/gtest.h"
+#include "via6522.h"
+
+TEST(Via6522, TimersCountFromCycles) {
+    Cpu cpu;
+    Via6522 via(cpu);
+    cpu.mem.map_device(0xd0, 1, &via);
+
+    cpu.cycles = 100;
+    cpu.mem.write_8(0xd004, 0xe8);
+    cpu.mem.write_8(0xd005, 0x03);
+    ASSERT_EQ(100u + 1000 + 1, cpu.next_event());
+    cpu.cycles = 400;
+    ASSERT_EQ(700, via.timer1());
+    ASSERT_EQ(0x02, cpu.mem.read_8(0xd005));
+    ASSERT_EQ(0xbc, cpu.mem.read_8(0xd014));    // registers repeat every 16
+
+    // one shot: interrupts once, then keeps counting down from $ffff
+    cpu.cycles = 1101;
+    cpu.emu_step();
+    ASSERT_EQ(Via6522::IRQ_T1, cpu.mem.read_8(0xd00d));
+    ASSERT_EQ(Cpu::NO_EVENT, cpu.next_event());
+    cpu.cycles = 1110;
+    ASSERT_EQ(0xffff - 9, via.timer1());
+    cpu.mem.read_8(0xd004);
+    ASSERT_EQ(0, cpu.mem.read_8(0xd00d));
+
+    // free run: reloads from the latches every latch + 2 cycles
+    cpu.cycles = 2000;
+    cpu.mem.write_8(0xd00b, Via6522::ACR_T1_FREE_RUN);
+    cpu.mem.write_8(0xd004, 10);
+    cpu.mem.write_8(0xd005, 0);
+    cpu.cycles = 2010;
+    ASSERT_EQ(0, via.timer1());
+    cpu.cycles = 2011;
+    ASSERT_EQ(0xffff, via.timer1());
+    cpu.cycles = 2012;
+    ASSERT_EQ(10, via.timer1());
+    cpu.cycles = 2011 + 12 * 5 + 3;
+    ASSERT_EQ(8, via.timer1());
+
+    // timer 2 counts from its own start
+    cpu.mem.write_8(0xd008, 0x34);
+    cpu.mem.write_8(0xd009, 0x12);
+    cpu.cycles += 0x34;
+    ASSERT_EQ(0x1200, via.timer2());
+    ASSERT_EQ(0x00, cpu.mem.read_8(0xd008));
+    ASSERT_EQ(0x12, cpu.mem.read_8(0xd009));
+}
+
+TEST(Via6522, InterruptRegisters) {
+    Cpu cpu;
+    Via6522 via(cpu);
+    cpu.mem.map_device(0xd0, 1, &via);
+    cpu.mem.write_16(Cpu::IRQ_VECTOR, 0x0700);
+    cpu.mem.write_8(0x0700, 0x40);  // RTI
+
+    // a flag only interrupts once it is enabled
+    cpu.mem.write_8(0xd008, 5);
+    cpu.mem.write_8(0xd009, 0);
+    cpu.cycles += 6;
+    cpu.emu_step();
+    ASSERT_EQ(Via6522::IRQ_T2, cpu.mem.read_8(0xd00d));
+    ASSERT_FALSE(via.irq());
+    cpu.mem.write_8(0xd00e, 0x80 | Via6522::IRQ_T2 | Via6522::IRQ_T1);
+    ASSERT_EQ(0x80 | Via6522::IRQ_T2 | Via6522::IRQ_T1, cpu.mem.read_8(0xd00e));
+    ASSERT_TRUE(via.irq());
+    ASSERT_EQ(0x80 | Via6522::IRQ_T2, cpu.mem.read_8(0xd00d));
+
+    // writing ones to IER with bit 7 clear disables, and to IFR clears
+    cpu.mem.write_8(0xd00e, Via6522::IRQ_T1);
+    ASSERT_EQ(0x80 | Via6522::IRQ_T2, cpu.mem.read_8(0xd00e));
+    cpu.mem.write_8(0xd00d, Via6522::IRQ_T2);
+    ASSERT_EQ(0, cpu.mem.read_8(0xd00d));
+    ASSERT_FALSE(via.irq());
+}
+
+TEST(Via6522, Ports) {
+    Cpu cpu;
+    Via6522 via(cpu);
+    cpu.mem.map_device(0xd0, 1, &via);
+
+    via.set_port_a_pins(0x5a);
+    ASSERT_EQ(0x5a, cpu.mem.read_8(0xd001));
+    cpu.mem.write_8(0xd003, 0xf0);
+    cpu.mem.write_8(0xd001, 0x33);
+    ASSERT_EQ(0x3a, via.port_a());
+    ASSERT_EQ(0x3a, cpu.mem.read_8(0xd00f));
+
+    cpu.mem.write_8(0xd002, 0xff);
+    cpu.mem.write_8(0xd000, 0x81);
+    ASSERT_EQ(0x81, via.port_b());
+}
+
+TEST(Via6522, TimerInterruptsWaitLoop) {
+    static const uint8_t code[] = {
+        0xa2, 0xe8,         // 0600: LDX #$e8
+        0x8e, 0x04, 0xd0,   // 0602: STX $d004
+        0xa2, 0x03,         // 0605: LDX #$03
+        0x8e, 0x05, 0xd0,   // 0607: STX $d005    1000 cycles
+        0xa2, 0xc0,         // 060a: LDX #$c0
+        0x8e, 0x0e, 0xd0,   // 060c: STX $d00e    enable T1
+        0xa9, 0x00,         // 060f: LDA #$00
+        0x05, 0x10,         // 0611: ORA $10
+        0xf0, 0xfc,         // 0613: BEQ $0611
+        0x00, 0x00,         // 0615: BRK
+    };
+    static const uint8_t handler[] = {
+        0xa9, 0x01,         // 0700: LDA #$01
+        0x85, 0x10,         // 0702: STA $10
+        0x0d, 0x04, 0xd0,   // 0704: ORA $d004    clears the flag
+        0x40,               // 0707: RTI
+    };
+
+    uint64_t cycles[2], instructions[2];
+    for (int skip = 0; skip < 2; ++skip) {
+        Cpu cpu;
+        Via6522 via(cpu);
+        cpu.set_idle_skip(skip);
+        cpu.mem.map_device(0xd0, 1, &via);
+        cpu.load_code(std::vector<uint8_t>(handler, handler + sizeof(handler)), 0x0700);
+        cpu.load_code(std::vector<uint8_t>(code, code + sizeof(code)));
+        cpu.mem.write_16(Cpu::IRQ_VECTOR, 0x0700);
+
+        ASSERT_EQ(STOP_BRK, cpu.emu_loop(100000));
+        ASSERT_EQ(1, cpu.mem.read_8(0x10));
+        ASSERT_FALSE(via.irq());
+        cycles[skip] = cpu.cycles;
+        instructions[skip] = cpu.instructions;
+        // STX $d005 started at cycle 6, so the IRQ is taken at the end of
+        // the wait loop iteration (6 cycles) that cycle 1007 falls in, and
+        // then the handler and the way out take 34 cycles
+        ASSERT_GE(cpu.cycles, 1007u + 34);
+        ASSERT_LE(cpu.cycles, 1007u + 6 + 34);
+    }
+    ASSERT_EQ(cycles[0], cycles[1]);
+    ASSERT_EQ(instructions[0], instructions[1]);
+}
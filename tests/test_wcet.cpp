@@ -0,0 +1,111 @@
+#include <sstream>
+#include "gtest/gtest.h"
+#include "assembler.h"
+#include "wcet.h"
+#include "assembler_fixtures.h"
+
+static void build_cfg(ControlFlowGraph& cfg, std::vector<uint8_t>& mem,
+                      const uint8_t* code, size_t size, address_t addr) {
+    mem.assign(Mem::MEM_SIZE, 0);
+    std::copy(code, code + size, mem.begin() + addr);
+    cfg.build(mem.data(), addr, addr + size, std::vector<address_t>(1, addr));
+}
+
+TEST_F(AssemblyCodeWithLabel, WcetMatchesEmulator) {
+    Assembler assembler(codetext);
+    std::vector<uint8_t> mem(Mem::MEM_SIZE, 0);
+    assembler.link_into(0x0600, mem.data(), mem.size());
+    ControlFlowGraph cfg;
+    cfg.build(mem.data(), 0x0600, 0x0600 + assembler.code.size(),
+              ControlFlowGraph::entry_points(assembler.labels, 0x0600));
+
+    WcetAnalyzer analyzer(cfg);
+    ASSERT_THROW(analyzer.analyze(0x0600), WcetError);
+
+    // X counts down from 7 to 3
+    analyzer.set_loop_bound(0x0602, 5);
+    WcetResult result = analyzer.analyze(0x0600);
+    Cpu cpu;
+    cpu.load_program(assembler);
+    ASSERT_EQ(STOP_BRK, cpu.emu_loop());
+    ASSERT_EQ(cpu.cycles, result.worst);
+    ASSERT_EQ(2u + 10 + 4 + 7, result.best);
+    ASSERT_TRUE(result.page_crossings.empty());
+
+    ASSERT_EQ(3u, result.critical_path.size());
+    ASSERT_EQ(0x0602, result.critical_path[1].block);
+    ASSERT_EQ(5u, result.critical_path[1].count);
+
+    analyzer.set_loop_bound(0x0602, 5, 5);
+    ASSERT_EQ(cpu.cycles, analyzer.analyze(0x0600).best);
+}
+
+TEST(Wcet, NestedLoopsAndCalls) {
+    static const uint8_t CODE[] = {
+        0xa0, 0x03,         // 0600: LDY #$03
+        0xa2, 0x04,         // 0602: LDX #$04
+        0xbd, 0x10, 0x02,   // 0604: LDA $0210,X
+        0xca,               // 0607: DEX
+        0xd0, 0xfa,         // 0608: BNE $0604
+        0x20, 0x12, 0x06,   // 060a: JSR $0612
+        0x88,               // 060d: DEY
+        0xd0, 0xf2,         // 060e: BNE $0602
+        0x00, 0x00,         // 0610: BRK
+        0xb9, 0x00, 0x03,   // 0612: LDA $0300,Y
+        0x60,               // 0615: RTS
+    };
+    ControlFlowGraph cfg;
+    std::vector<uint8_t> mem;
+    build_cfg(cfg, mem, CODE, sizeof(CODE), 0x0600);
+
+    WcetAnalyzer analyzer(cfg);
+    analyzer.set_loop_bound(0x0602, 3);
+    analyzer.set_loop_bound(0x0604, 4);
+    WcetResult result = analyzer.analyze(0x0600);
+
+    // each pass of the outer loop is LDX, four inner passes with a page
+    // crossing and three taken branches, the call, and DEY and BNE
+    const uint64_t outer_pass = 2 + 4 * (5 + 2 + 2) + 3 + (6 + 4 + 6) + 2 + 2;
+    ASSERT_EQ(2 + 3 * outer_pass + 2 + 7, result.worst);
+    ASSERT_EQ(2u + 2 + 4 + 2 + 2 + 16 + 2 + 2 + 7, result.best);
+    ASSERT_EQ(std::vector<address_t>(1, 0x0604), result.page_crossings);
+
+    static const WcetStep PATH[] = {
+        { 0x0600, 1 }, { 0x0602, 3 }, { 0x0604, 12 }, { 0x060a, 3 },
+        { 0x0612, 3 }, { 0x060d, 3 }, { 0x0610, 1 },
+    };
+    ASSERT_EQ(sizeof(PATH) / sizeof(PATH[0]), result.critical_path.size());
+    for (size_t i = 0; i < result.critical_path.size(); ++i) {
+        ASSERT_EQ(PATH[i].block, result.critical_path[i].block);
+        ASSERT_EQ(PATH[i].count, result.critical_path[i].count);
+    }
+
+    // the subroutine on its own
+    result = analyzer.analyze(0x0612);
+    ASSERT_EQ(10u, result.worst);
+
+    std::ostringstream out;
+    write_wcet_report(out, result);
+    ASSERT_EQ("best 10 cycles, worst 10 cycles\n"
+              "critical path:\n"
+              "  0612  x1\n", out.str());
+}
+
+TEST(Wcet, Unbounded) {
+    static const uint8_t INDIRECT[] = { 0x6c, 0x00, 0x02 };
+    static const uint8_t RECURSIVE[] = { 0x20, 0x00, 0x06, 0x60 };
+    static const uint8_t FOREVER[] = { 0x4c, 0x00, 0x06 };
+    ControlFlowGraph cfg;
+    std::vector<uint8_t> mem;
+
+    build_cfg(cfg, mem, INDIRECT, sizeof(INDIRECT), 0x0600);
+    ASSERT_THROW(WcetAnalyzer(cfg).analyze(0x0600), WcetError);
+    build_cfg(cfg, mem, RECURSIVE, sizeof(RECURSIVE), 0x0600);
+    ASSERT_THROW(WcetAnalyzer(cfg).analyze(0x0600), WcetError);
+
+    build_cfg(cfg, mem, FOREVER, sizeof(FOREVER), 0x0600);
+    WcetAnalyzer analyzer(cfg);
+    analyzer.set_loop_bound(0x0600, 10);
+    ASSERT_THROW(analyzer.analyze(0x0600), WcetError);
+    ASSERT_THROW(analyzer.set_loop_bound(0x0600, 0), std::invalid_argument);
+}